@@ -0,0 +1,222 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <assert.h>
+
+/* A simple region allocator.  Memory is carved from large blocks by
+   advancing a pointer and is released all at once when the arena is
+   destroyed.  Individual allocations cannot be freed, except that the
+   most recent one may be returned, which suits strings that are
+   repeatedly replaced such as the text of the latest server response.
+
+   Blocks are obtained from the caller's allocation function, if any,
+   otherwise from malloc().  */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "arena.h"
+
+#define ALIGN		_Alignof (max_align_t)
+#define ROUNDUP(n)	(((n) + ALIGN - 1) & ~(ALIGN - 1))
+
+struct block
+  {
+    struct block *next;
+    size_t size;			/* Size including this header */
+  };
+#define BLOCK_HDR	ROUNDUP (sizeof (struct block))
+
+struct arena
+  {
+    struct block *blocks;		/* Current block first */
+    char *top;				/* Free space in current block */
+    char *end;
+    void *last;				/* Most recent allocation */
+    size_t block_size;
+    size_t usage;			/* Total size of blocks */
+    arena_alloc_t alloc;
+    void *arg;
+  };
+
+#define MINIMUM_BLOCK	1024
+
+static void *
+block_alloc (struct arena *arena, size_t size)
+{
+  if (arena->alloc != NULL)
+    return (*arena->alloc) (NULL, size, arena->arg);
+  return malloc (size);
+}
+
+static void
+block_free (struct arena *arena, void *ptr)
+{
+  if (arena->alloc != NULL)
+    (*arena->alloc) (ptr, 0, arena->arg);
+  else
+    free (ptr);
+}
+
+/* Create an arena which allocates memory in blocks of block_size octets.
+   If alloc is not NULL it is called to obtain and release the blocks and
+   the arena itself.  */
+struct arena *
+arena_create (size_t block_size, arena_alloc_t alloc, void *arg)
+{
+  struct arena *arena;
+
+  arena = (alloc != NULL) ? (*alloc) (NULL, sizeof (struct arena), arg)
+			  : malloc (sizeof (struct arena));
+  if (arena == NULL)
+    return NULL;
+  memset (arena, 0, sizeof (struct arena));
+  if (block_size < MINIMUM_BLOCK)
+    block_size = MINIMUM_BLOCK;
+  arena->block_size = ROUNDUP (block_size);
+  arena->alloc = alloc;
+  arena->arg = arg;
+  return arena;
+}
+
+/* Release every block and the arena.  */
+void
+arena_destroy (struct arena *arena)
+{
+  struct block *block, *next;
+
+  if (arena == NULL)
+    return;
+  for (block = arena->blocks; block != NULL; block = next)
+    {
+      next = block->next;
+      block_free (arena, block);
+    }
+  block_free (arena, arena);
+}
+
+/* Allocate size octets aligned to align.  A request too large to share a
+   block is given a block of its own, placed behind the current block so
+   that the remainder of the latter is not wasted.  */
+static void *
+arena_bump (struct arena *arena, size_t size, size_t align)
+{
+  struct block *block;
+  char *p;
+
+  assert (arena != NULL);
+
+  p = arena->top;
+  if (p != NULL)
+    p += -(uintptr_t) p & (align - 1);
+  if (p != NULL && size <= (size_t) (arena->end - p))
+    {
+      arena->top = p + size;
+      return arena->last = p;
+    }
+
+  if (size > (arena->block_size - BLOCK_HDR) / 4)
+    {
+      if ((block = block_alloc (arena, BLOCK_HDR + size)) == NULL)
+	return NULL;
+      block->size = BLOCK_HDR + size;
+      arena->usage += block->size;
+      if (arena->blocks == NULL)
+	{
+	  block->next = NULL;
+	  arena->blocks = block;
+	}
+      else
+	{
+	  block->next = arena->blocks->next;
+	  arena->blocks->next = block;
+	}
+      return (char *) block + BLOCK_HDR;
+    }
+
+  if ((block = block_alloc (arena, arena->block_size)) == NULL)
+    return NULL;
+  block->size = arena->block_size;
+  arena->usage += block->size;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  p = (char *) block + BLOCK_HDR;
+  arena->end = (char *) block + block->size;
+  arena->top = p + size;
+  return arena->last = p;
+}
+
+/* Allocate memory suitably aligned for any object.  */
+void *
+arena_alloc (struct arena *arena, size_t size)
+{
+  return arena_bump (arena, ROUNDUP (size), ALIGN);
+}
+
+/* Memory is only reclaimed if ptr is the most recent allocation,
+   otherwise it remains in use until the arena is destroyed.  */
+void
+arena_free (struct arena *arena, void *ptr)
+{
+  assert (arena != NULL);
+
+  if (ptr != NULL && ptr == arena->last)
+    {
+      arena->top = ptr;
+      arena->last = NULL;
+    }
+}
+
+/* Copy len octets of string and terminate the copy.  Strings are not
+   aligned.  */
+char *
+arena_strndup (struct arena *arena, const char *string, size_t len)
+{
+  char *p;
+
+  if ((p = arena_bump (arena, len + 1, 1)) == NULL)
+    return NULL;
+  memcpy (p, string, len);
+  p[len] = '\0';
+  return p;
+}
+
+size_t
+arena_block_size (struct arena *arena)
+{
+  return arena->block_size;
+}
+
+/* Memory held by the arena.  */
+size_t
+arena_memory_usage (struct arena *arena)
+{
+  if (arena == NULL)
+    return 0;
+  return sizeof (struct arena) + arena->usage;
+}
@@ -0,0 +1,40 @@
+#ifndef _arena_h
+#define _arena_h
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Allocation and release of an arena's blocks.  Called with ptr NULL to
+   allocate size bytes and with size zero to release ptr.  */
+typedef void *(*arena_alloc_t) (void *ptr, size_t size, void *arg);
+
+struct arena;
+
+struct arena *arena_create (size_t block_size,
+			    arena_alloc_t alloc, void *arg);
+void arena_destroy (struct arena *arena);
+void *arena_alloc (struct arena *arena, size_t size);
+void arena_free (struct arena *arena, void *ptr);
+char *arena_strndup (struct arena *arena, const char *string, size_t len);
+size_t arena_block_size (struct arena *arena);
+size_t arena_memory_usage (struct arena *arena);
+
+#endif
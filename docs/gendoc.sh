@@ -4,8 +4,10 @@ SRC=..
 DST=_kdoc
 
 SOURCES="libesmtp.h message-callbacks.c
-smtp-api.c  smtp-auth.c  smtp-etrn.c  smtp-tls.c errors.c
-auth-client.c headers.c
+smtp-api.c  smtp-auth.c  smtp-etrn.c  smtp-tls.c smtp-tlscache.c
+smtp-pool.c smtp-connpool.c smtp-capcache.c
+errors.c
+auth-client.c headers.c resolver.c
 "
 
 mkdir -p $DST
@@ -516,6 +516,12 @@ void event_cb (smtp_session_t session unused, int event_no, void *arg,...)
   }
   case SMTP_EV_STARTTLS_OK:
     puts("SMTP_EV_STARTTLS_OK - TLS started here."); break;
+  case SMTP_EV_TLS_OFFLOAD: {
+    int send, recv;
+    send = va_arg(alist, int); recv = va_arg(alist, int);
+    printf("SMTP_EV_TLS_OFFLOAD, send=%d recv=%d\n", send, recv);
+    break;
+  }
   case SMTP_EV_INVALID_PEER_CERTIFICATE: {
     long vfy_result;
     vfy_result = va_arg(alist, long); ok = va_arg(alist, int*);
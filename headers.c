@@ -52,7 +52,7 @@ struct rfc2822_header
     void *value;			/* Header value */
   };
 
-typedef int (*hdrset_t) (struct rfc2822_header *, va_list);
+typedef int (*hdrset_t) (smtp_session_t, struct rfc2822_header *, va_list);
 typedef void (*hdrprint_t) (smtp_message_t, struct rfc2822_header *);
 typedef void (*hdrdestroy_t) (struct rfc2822_header *);
 
@@ -100,7 +100,8 @@ struct header_info *insert_header (smtp_message_t message, const char *name);
  ****************************************************************************/
 
 static int
-set_string (struct rfc2822_header *header, va_list alist)
+set_string (smtp_session_t session, struct rfc2822_header *header,
+	    va_list alist)
 {
   const char *value;
 
@@ -112,12 +113,13 @@ set_string (struct rfc2822_header *header, va_list alist)
   value = va_arg (alist, const char *);
   if (value == NULL)
     return 0;
-  header->value = strdup (value);
+  header->value = session_strdup (session, value);
   return header->value != NULL;
 }
 
 static int
-set_string_null (struct rfc2822_header *header, va_list alist)
+set_string_null (smtp_session_t session, struct rfc2822_header *header,
+	         va_list alist)
 {
   const char *value;
 
@@ -129,7 +131,7 @@ set_string_null (struct rfc2822_header *header, va_list alist)
   value = va_arg (alist, const char *);
   if (value == NULL)
     return 1;
-  header->value = strdup (value);
+  header->value = session_strdup (session, value);
   return header->value != NULL;
 }
 
@@ -187,7 +189,8 @@ print_message_id (smtp_message_t message, struct rfc2822_header *header)
 /****/
 
 static int
-set_date (struct rfc2822_header *header, va_list alist)
+set_date (smtp_session_t session __attribute__ ((unused)),
+	  struct rfc2822_header *header, va_list alist)
 {
   const time_t *value;
 
@@ -246,8 +249,21 @@ destroy_mbox_list (struct rfc2822_header *header)
     }
 }
 
+static struct mbox *
+create_mbox (smtp_session_t session, const char *phrase, const char *mailbox)
+{
+  struct mbox *mbox;
+
+  if ((mbox = session_alloc (session, sizeof (struct mbox))) == NULL)
+    return NULL;
+  mbox->phrase = (phrase != NULL) ? session_strdup (session, phrase) : NULL;
+  mbox->mailbox = session_strdup (session, mailbox);
+  return mbox;
+}
+
 static int
-set_from (struct rfc2822_header *header, va_list alist)
+set_from (smtp_session_t session, struct rfc2822_header *header,
+	  va_list alist)
 {
   struct mbox *mbox;
   const char *mailbox;
@@ -264,11 +280,8 @@ set_from (struct rfc2822_header *header, va_list alist)
   if (phrase == NULL && mailbox == NULL)
     return header->value == NULL;
 
-  mbox = malloc (sizeof (struct mbox));
-  if (mbox == NULL)
+  if ((mbox = create_mbox (session, phrase, mailbox)) == NULL)
     return 0;
-  mbox->phrase = (phrase != NULL) ? strdup (phrase) : NULL;
-  mbox->mailbox = strdup (mailbox);
 
   mbox->next = header->value;
   header->value = mbox;
@@ -313,7 +326,8 @@ print_from (smtp_message_t message, struct rfc2822_header *header)
 /* Same arguments and syntax as from: except that only one value is
    allowed.  */
 static int
-set_sender (struct rfc2822_header *header, va_list alist)
+set_sender (smtp_session_t session, struct rfc2822_header *header,
+	    va_list alist)
 {
   struct mbox *mbox;
   const char *mailbox;
@@ -329,11 +343,8 @@ set_sender (struct rfc2822_header *header, va_list alist)
   if (phrase == NULL && mailbox == NULL)
     return 0;
 
-  mbox = malloc (sizeof (struct mbox));
-  if (mbox == NULL)
+  if ((mbox = create_mbox (session, phrase, mailbox)) == NULL)
     return 0;
-  mbox->phrase = (phrase != NULL) ? strdup (phrase) : NULL;
-  mbox->mailbox = strdup (mailbox);
   mbox->next = NULL;
 
   header->value = mbox;
@@ -366,7 +377,8 @@ print_sender (smtp_message_t message, struct rfc2822_header *header)
 }
 
 static int
-set_to (struct rfc2822_header *header, va_list alist)
+set_to (smtp_session_t session, struct rfc2822_header *header,
+	va_list alist)
 {
   struct mbox *mbox;
   const char *mailbox;
@@ -380,11 +392,8 @@ set_to (struct rfc2822_header *header, va_list alist)
     mbox = NULL;
   else
     {
-      mbox = malloc (sizeof (struct mbox));
-      if (mbox == NULL)
+      if ((mbox = create_mbox (session, phrase, mailbox)) == NULL)
 	return 0;
-      mbox->phrase = (phrase != NULL) ? strdup (phrase) : NULL;
-      mbox->mailbox = strdup (mailbox);
 
       mbox->next = header->value;
     }
@@ -393,7 +402,8 @@ set_to (struct rfc2822_header *header, va_list alist)
 }
 
 static int
-set_cc (struct rfc2822_header *header, va_list alist)
+set_cc (smtp_session_t session, struct rfc2822_header *header,
+	va_list alist)
 {
   struct mbox *mbox;
   const char *mailbox;
@@ -405,11 +415,8 @@ set_cc (struct rfc2822_header *header, va_list alist)
   mailbox = va_arg (alist, const char *);
   if (mailbox == NULL)
     return 0;
-  mbox = malloc (sizeof (struct mbox));
-  if (mbox == NULL)
+  if ((mbox = create_mbox (session, phrase, mailbox)) == NULL)
     return 0;
-  mbox->phrase = (phrase != NULL) ? strdup (phrase) : NULL;
-  mbox->mailbox = strdup (mailbox);
 
   mbox->next = header->value;
   header->value = mbox;
@@ -455,6 +462,14 @@ print_to (smtp_message_t message, struct rfc2822_header *header)
       return;
     }
 
+  /* Recipients obtained from a callback are not known in advance.  */
+  if (message->rcpt_cb != NULL)
+    {
+      vconcatenate (&message->hdr_buffer, header->header,
+		    ": undisclosed-recipients:;\r\n", NULL);
+      return;
+    }
+
   /* TODO: implement line folding at white spaces */
   vconcatenate (&message->hdr_buffer, header->header, ": ", NULL);
   for (recipient = message->recipients;
@@ -537,20 +552,30 @@ init_header_table (smtp_message_t message)
 {
   int i;
   struct header_info *hi;
+  struct arena *arena;
 
   assert (message != NULL);
 
   if (message->hdr_action != NULL)
     return -1;
 
-  message->hdr_action = h_create ();
+  arena = message->session->arena;
+  if (arena != NULL)
+    message->hdr_action = h_create_arena (arena);
+  else
+    message->hdr_action = h_create ();
   if (message->hdr_action == NULL)
     return 0;
   for (i = 0; i < NELT (header_actions); i++)
     if (header_actions[i].name != NULL)
       {
-	hi = h_insert (message->hdr_action, header_actions[i].name, -1,
-		       sizeof (struct header_info));
+	if (arena != NULL)
+	  hi = h_insert_arena (message->hdr_action, arena,
+			       header_actions[i].name, -1,
+			       sizeof (struct header_info));
+	else
+	  hi = h_insert (message->hdr_action, header_actions[i].name, -1,
+			 sizeof (struct header_info));
 	if (hi == NULL)
 	  return 0;
 	hi->action = &header_actions[i];
@@ -622,7 +647,12 @@ insert_header (smtp_message_t message, const char *name)
 
   assert (message != NULL && name != NULL);
 
-  info = h_insert (message->hdr_action, name, -1, sizeof (struct header_info));
+  if (message->session->arena != NULL)
+    info = h_insert_arena (message->hdr_action, message->session->arena,
+			   name, -1, sizeof (struct header_info));
+  else
+    info = h_insert (message->hdr_action, name, -1,
+		     sizeof (struct header_info));
   if (info == NULL)
     return NULL;
   info->action = &header_actions[0];
@@ -637,11 +667,12 @@ create_header (smtp_message_t message, const char *header,
 
   assert (message != NULL && header != NULL && info != NULL);
 
-  if ((hdr = malloc (sizeof (struct rfc2822_header))) == NULL)
+  if ((hdr = session_alloc (message->session,
+			    sizeof (struct rfc2822_header))) == NULL)
     return NULL;
 
   memset (hdr, 0, sizeof (struct rfc2822_header));
-  hdr->header = strdup (header);
+  hdr->header = session_strdup (message->session, header);
   hdr->info = info;
   info->hdr = hdr;
   APPEND_LIST (message->headers, message->end_headers, hdr);
@@ -952,7 +983,7 @@ smtp_set_header (smtp_message_t message, const char *header, ...)
 
   /* Set its value */
   va_start (alist, header);
-  (*set) (hdr, alist);
+  (*set) (message->session, hdr, alist);
   va_end (alist);
 
   return 1;
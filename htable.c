@@ -40,6 +40,7 @@
 #include <missing.h> /* declarations for missing library functions */
 
 #include "htable.h"
+#include "arena.h"
 
 struct h_node
   {
@@ -101,6 +102,24 @@ hashi (const char *string, int length)
   return h1;
 }
 
+/* Initialise a node allocated with room for its data and name and link
+   it into the table.  */
+static void *
+h_link (struct h_node **table, struct h_node *node,
+	const char *name, int namelen, size_t size)
+{
+  unsigned int hv;
+
+  memset (node, 0, sizeof (struct h_node) + size);
+  node->name = (char *) (node + 1) + size;
+  memcpy (node->name, name, namelen);
+  node->name[namelen] = '\0';
+  hv = hashi (node->name, namelen);
+  node->next = table[hv];
+  table[hv] = node;
+  return node + 1;
+}
+
 /* Insert a new node into the table.  It is not an error for an entry with
    the same name to be already present in the table.  The new entry will
    be found when searching the table.  When removed, the former entry
@@ -108,7 +127,6 @@ hashi (const char *string, int length)
 void *
 h_insert (struct h_node **table, const char *name, int namelen, size_t size)
 {
-  unsigned int hv;
   struct h_node *node;
 
   assert (table != NULL && name != NULL);
@@ -117,20 +135,9 @@ h_insert (struct h_node **table, const char *name, int namelen, size_t size)
     namelen = strlen (name);
   if (namelen == 0)
     return NULL;
-  size += sizeof (struct h_node);
-  if ((node = malloc (size)) == NULL)
+  if ((node = malloc (sizeof (struct h_node) + size + namelen + 1)) == NULL)
     return NULL;
-  memset (node, 0, size);
-  if ((node->name = malloc (namelen)) == NULL)
-    {
-      free (node);
-      return NULL;
-    }
-  memcpy (node->name, name, namelen);
-  hv = hashi (node->name, namelen);
-  node->next = table[hv];
-  table[hv] = node;
-  return node + 1;
+  return h_link (table, node, name, namelen, size);
 }
 
 /* Remove the node from the table.
@@ -155,7 +162,6 @@ h_remove (struct h_node **table, void *data)
 	  node->next = NULL;
 	  break;
 	}
-  free (node->name);
   free (node);
 }
 
@@ -171,7 +177,7 @@ h_search (struct h_node **table, const char *name, int namelen)
   if (namelen < 0)
     namelen = strlen (name);
   for (p = table[hashi (name, namelen)]; p != NULL; p = p->next)
-    if (strncasecmp (name, p->name, namelen) == 0)
+    if (strncasecmp (name, p->name, namelen) == 0 && p->name[namelen] == '\0')
       return p + 1;
   return NULL;
 }
@@ -219,9 +225,38 @@ h_destroy (struct h_node **table,
 	next = p->next;
 	if (cb != NULL)
 	  (*cb) (p->name, p + 1, arg);
-	free (p->name);
 	free (p);
       }
   free (table);
 }
 
+
+/* A table allocated from an arena.  Its nodes are released with the arena,
+   it must not be passed to h_remove() or h_destroy().  */
+struct h_node **
+h_create_arena (struct arena *arena)
+{
+  struct h_node **table;
+
+  if ((table = arena_alloc (arena, HASHSIZE * sizeof (struct h_node *))) != NULL)
+    memset (table, 0, HASHSIZE * sizeof (struct h_node *));
+  return table;
+}
+
+void *
+h_insert_arena (struct h_node **table, struct arena *arena,
+		const char *name, int namelen, size_t size)
+{
+  struct h_node *node;
+
+  assert (table != NULL && name != NULL);
+
+  if (namelen < 0)
+    namelen = strlen (name);
+  if (namelen == 0)
+    return NULL;
+  if ((node = arena_alloc (arena, sizeof (struct h_node) + size
+				  + namelen + 1)) == NULL)
+    return NULL;
+  return h_link (table, node, name, namelen, size);
+}
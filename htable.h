@@ -23,6 +23,7 @@
  */
 
 struct h_node;
+struct arena;
 
 void *h_insert (struct h_node **table,
 		const char *name, int namelen, size_t size);
@@ -36,4 +37,8 @@ void h_destroy (struct h_node **table,
 		void (*cb) (const char *name, void *data, void *arg),
 		void *arg);
 
+struct h_node **h_create_arena (struct arena *arena);
+void *h_insert_arena (struct h_node **table, struct arena *arena,
+		      const char *name, int namelen, size_t size);
+
 #endif
@@ -23,6 +23,7 @@
  */
 
 #include <stddef.h>		/* for size_t */
+#include <sys/types.h>		/* for off_t */
 
 #ifdef USE_TLS
 #include <openssl/ssl.h>
@@ -49,6 +50,8 @@
 #define EXT_ETRN		_BIT(10)/* RFC 1985 */
 #define EXT_XUSR		_BIT(11)/* sendmail */
 #define EXT_XEXCH50		_BIT(12)/* exchange */
+#define EXT_LIMITS		_BIT(13)/* RFC 9422 */
+#define EXT_PIPECONNECT		_BIT(14)/* Exim */
 
 struct smtp_session
   {
@@ -79,9 +82,16 @@ struct smtp_session
 
   /* Variables used by the protocol state engine */
     int cmd_state, rsp_state;
+    int pipeconnect_state;		/* Command sent ahead of EHLO response */
     struct smtp_message *current_message;
+    struct smtp_message *cmd_message;	/* MAIL pipelined behind the data */
     struct smtp_recipient *cmd_recipient;
     struct smtp_recipient *rsp_recipient;
+    struct smtp_recipient *rcpt_end;	/* First RCPT beyond server limits */
+    struct smtp_recipient *rcpt_deferred; /* First RCPT refused with 452 */
+    int rcpt_count, rcpt_domains;	/* RCPTs and domains in transaction */
+    struct catbuf rcpt_domain_list;	/* Domains in transaction */
+    int mail_count;			/* Transactions on this connection */
     msg_source_t msg_source;
 
   /* SMTP timeouts */
@@ -90,6 +100,16 @@ struct smtp_session
     long data_timeout;			/* default 2 minutes */
     long transfer_timeout;		/* default 3 minutes */
     long data2_timeout;			/* default 10 minutes */
+    long connect_timeout;		/* default 30 seconds */
+    long resolve_timeout;		/* default none */
+    long connect_time;			/* Time taken to connect or -1 */
+
+  /* Connection tuning, zero for the defaults */
+    int read_buffer_size;		/* siobuf read buffer */
+    int write_buffer_size;		/* siobuf write buffer for commands */
+    int data_buffer_size;		/* write buffer for the message */
+    int sndbuf;				/* SO_SNDBUF */
+    int rcvbuf;				/* SO_RCVBUF */
 
   /* Status */
     smtp_status_t mta_status;		/* Status from MTA greeting */
@@ -99,6 +119,9 @@ struct smtp_session
     unsigned long required_extensions;
     unsigned long size_limit;		/* RFC 1870 */
     long min_by_time;			/* RFC 2852 */
+    int rcpt_max;			/* RFC 9422 LIMITS */
+    int mail_max;
+    int rcptdomain_max;
 
   /* Interface to RFC 4954 AUTH and SASL */
     auth_context_t auth_context;
@@ -121,18 +144,56 @@ struct smtp_session
 
 #ifdef USE_CHUNKING
     int bdat_pipelined;
+    off_t bdat_offset;			/* Next octet to send from file */
+    off_t bdat_remaining;		/* Octets remaining in file */
 #endif
 
+  /* Non-blocking protocol engine, see smtp_session_step() */
+    struct siobuf *conn;		/* Buffered connection to MTA */
+    int sd;				/* Socket or -1 */
+    int nresp;				/* Number of responses expected */
+    int events;				/* SMTP_IO_READ, SMTP_IO_WRITE */
+    long long deadline;			/* Monotonic time in ms or -1 */
+    struct addrinfo *addrs;		/* MTA addresses */
+    struct addrinfo **addr_order;	/* Addresses in connection order */
+    int naddrs;
+    int addr_next;			/* Next address to try */
+    long long connect_start;		/* Time connect started */
+    struct resolve_job *resolve_job;	/* Lookup running on another thread */
+
+  /* Connection reuse, see smtp_set_connpool() */
+    struct smtp_connpool *connpool;
+    char *connpool_identity;		/* Credentials of auth_context */
+
+  /* Session memory, see smtp_set_arena() */
+    struct arena *arena;		/* Messages, recipients and headers */
+
   /* Miscellaneous options and flags */
     unsigned int try_fallback_server : 1;
     unsigned int require_all_recipients : 1;
     unsigned int authenticated : 1;
+    unsigned int nonblocking : 1;	/* Session driven by the application */
+    unsigned int cmd_partial : 1;	/* Command handler must be resumed */
+    unsigned int reuse_probe : 1;	/* Reused connection not yet verified */
+    unsigned int mail_pipelined : 1;	/* MAIL follows the end of data */
+    unsigned int mail_limited : 1;	/* MAILMAX reached, must reconnect */
+    unsigned int pipeconnect : 1;	/* EHLO sent ahead of the greeting */
+    unsigned int pipeconnect_retry : 1;	/* Cached capabilities were wrong */
+    unsigned int pipeconnect_failed : 1; /* No early pipelining this session */
+    unsigned int low_memory : 1;	/* Release idle connection buffers */
+    unsigned int tcp_nodelay : 1;	/* TCP_NODELAY with corking */
+    unsigned int io_uring : 1;		/* Use the io_uring I/O backend */
+    unsigned int recipient_release : 1;	/* A recipient has a release cb */
 #ifdef USE_CHUNKING
     unsigned int bdat_abort_pipeline : 1;
     unsigned int bdat_last_issued : 1;
+    unsigned int bdat_sendfile : 1;	/* Copy body from file to socket */
 #endif
 #ifdef USE_TLS
     unsigned int using_tls : 1;
+    unsigned int tls_handshake : 1;	/* Non-blocking handshake running */
+    unsigned int tcp_fastopen : 1;	/* ClientHello in the SYN */
+    unsigned int tls_verify_cached : 1;	/* Certificate accepted from cache */
 #endif
   };
 
@@ -155,6 +216,15 @@ struct smtp_message
   /* Recipients */
     struct smtp_recipient *recipients;	/* List of recipients */
     struct smtp_recipient *end_recipients;
+    struct recipient_block *recipient_blocks; /* See smtp_add_recipients() */
+    smtp_recipientcb_t rcpt_cb;		/* See smtp_set_recipientcb() */
+    void *rcpt_cb_arg;
+    struct smtp_recipient *rcpt_free;	/* Streamed recipients for reuse */
+    int rcpt_cb_done;			/* No more recipients from rcpt_cb */
+    struct smtp_recipient *pending;	/* Recipients not yet complete */
+    struct smtp_recipient *end_pending;
+    struct smtp_recipient *pending_kept; /* Hint for drop_recipient() */
+    int pending_rebuild;		/* Recipient reset, see rebuild_pending() */
     int valid_recipients;		/* Valid recipients in this session */
     int failed_recipients;		/* Failed recipients in this session */
 
@@ -168,6 +238,7 @@ struct smtp_message
   /* Message */
     smtp_messagecb_t cb;		/* Transfer message from app. */
     void *cb_arg;			/* Argument for above */
+    int fd;				/* See smtp_set_message_fd() */
 
   /* DSN  (RFC 3461) */
     char *dsn_envid;			/* envelope identifier */
@@ -185,25 +256,43 @@ struct smtp_message
     enum e8bitmime_body e8bitmime;
   };
 
-struct smtp_recipient
+/* Per recipient data which is seldom used, allocated when first set.  */
+struct recipient_extra
   {
-    struct smtp_recipient *next;
-    struct smtp_message *message;	/* Back reference */
-
   /* Application data */
     void *application_data;		/* Pointer to data maintained by app */
     void (*release) (void *);		/* function to free/unref data */
 
+  /* DSN  - (RFC 3461) */
+    char *dsn_addrtype;			/* original recipient address type */
+    char *dsn_orcpt;			/* original recipient */
+  };
+
+struct smtp_recipient
+  {
+    struct smtp_recipient *next;
+    struct smtp_recipient *next_pending; /* See APPEND_PENDING() */
+    struct smtp_message *message;	/* Back reference */
+
   /* Recipient Info */
     char *mailbox;			/* Envelope address */
     smtp_status_t status;		/* Recipient status from RCPT */
-    unsigned complete : 1;		/* Sent OK or permanent failure */
+    struct recipient_extra *extra;	/* Application data and ORCPT */
+
+    unsigned int complete : 1;		/* Sent OK or permanent failure */
+    unsigned int in_block : 1;		/* Allocated by smtp_add_recipients() */
+    unsigned int streamed : 1;		/* Obtained from the message's rcpt_cb */
+    unsigned int pending : 1;		/* On the message's pending list */
+    signed int dsn_notify : 4;		/* DSN enum notify_flags */
     /* more per recipient stuff */
+  };
 
-  /* DSN  - (RFC 3461) */
-    char *dsn_addrtype;			/* original recipient address type */
-    char *dsn_orcpt;			/* original recipient */
-    enum notify_flags dsn_notify;	/* notification options */
+/* Recipients added together share a single allocation, their mailboxes
+   follow the array.  */
+struct recipient_block
+  {
+    struct recipient_block *next;
+    struct smtp_recipient recipients[];
   };
 
 #define APPEND_LIST(start,end,item)	do {				\
@@ -215,6 +304,21 @@ struct smtp_recipient
 					  (item)->next = NULL;		\
 					} while (0)
 
+/* Each message also links its recipients which are not yet complete in
+   the order they are to be sent, so that recipients accepted by an
+   earlier transaction or session need not be passed over.  Streamed
+   recipients are only on this list.  Completed recipients are unlinked
+   at the end of each transaction by complete_recipients().  */
+#define APPEND_PENDING(msg,item)	do {				\
+					  if ((msg)->pending == NULL)	\
+					    (msg)->pending = (item);	\
+					  else				\
+					    (msg)->end_pending->next_pending = (item); \
+					  (msg)->end_pending = (item);	\
+					  (item)->next_pending = NULL;	\
+					  (item)->pending = 1;		\
+					} while (0)
+
 /* RFC 5321 minimum timeouts */
 
 #define GREETING_DEFAULT	( 5 * 60l * 1000l)
@@ -223,10 +327,23 @@ struct smtp_recipient
 #define TRANSFER_DEFAULT	( 3 * 60l * 1000l)
 #define DATA2_DEFAULT		(10 * 60l * 1000l)
 
+/* Not specified by RFC 5321 */
+
+#define CONNECT_DEFAULT		(30l * 1000l)
+
 /* protocol.c */
 
 int initial_transaction_state (smtp_session_t session);
 int next_message (smtp_session_t session);
+int pipeline_next_message (smtp_session_t session, int state);
+smtp_recipient_t resume_recipient (smtp_session_t session);
+void complete_recipients (smtp_session_t session, int code);
+void rebuild_pending (smtp_message_t message);
+int begin_session (smtp_session_t session);
+int step_session (smtp_session_t session, int events);
+int session_timeout (smtp_session_t session);
+int session_fd (smtp_session_t session);
+void abort_session (smtp_session_t session);
 
 /* errors.c */
 
@@ -234,21 +351,53 @@ void set_error (int code);
 void set_errno(int code);
 void set_herror (int code);
 int do_session (smtp_session_t session);
-void reset_status (struct smtp_status *status);
+void reset_status (smtp_session_t session, struct smtp_status *status);
+void reset_recipient_status (smtp_recipient_t recipient);
+
+/* smtp-api.c */
+
+void *session_alloc (smtp_session_t session, size_t size);
+char *session_strdup (smtp_session_t session, const char *string);
+char *session_strndup (smtp_session_t session, const char *string,
+		       size_t len);
+void session_free (smtp_session_t session, void *ptr);
 
 /* smtp-auth.c */
 
 void set_auth_mechanisms (smtp_session_t session, const char *mechanisms);
 void destroy_auth_mechanisms (smtp_session_t session);
 int select_auth_mechanism (smtp_session_t session);
+int resume_auth_mechanism (smtp_session_t session);
+char *auth_mechanism_list (smtp_session_t session);
 
 #ifdef USE_TLS
 /* smtp-tls.c */
 
 int select_starttls (smtp_session_t session);
 void destroy_starttls_context (smtp_session_t session);
+int handshake_starttls (struct siobuf *conn, smtp_session_t session);
+int start_implicit_tls (struct siobuf *conn, smtp_session_t session);
+
+/* smtp-tlscache.c */
+
+void tls_session_cache_get (smtp_session_t session, SSL *ssl);
+void tls_session_cache_put (smtp_session_t session, SSL *ssl);
+void tls_verify_cache_install (SSL_CTX *ctx, const char *trust);
+void tls_verify_cache_attach (smtp_session_t session, SSL *ssl);
+void tls_verify_cache_put (smtp_session_t session, SSL *ssl, X509 *cert);
 #endif
 
+/* smtp-capcache.c */
+
+int capability_cache_get (smtp_session_t session);
+int capability_cache_put (smtp_session_t session);
+void capability_cache_remove (smtp_session_t session);
+
+/* smtp-connpool.c */
+
+struct siobuf *connpool_checkout (smtp_session_t session, int *sd);
+int connpool_checkin (smtp_session_t session, struct siobuf *conn, int sd);
+
 #ifdef USE_ETRN
 /* smtp-etrn.c */
 
@@ -82,12 +82,50 @@ int smtp_enumerate_messages (smtp_session_t session,
 			     smtp_enumerate_messagecb_t cb, void *arg);
 int smtp_set_server (smtp_session_t session, const char *hostport);
 const char *smtp_get_server_name (smtp_session_t session);
+long smtp_get_connect_time (smtp_session_t session);
+int smtp_set_low_memory (smtp_session_t session, int onoff);
+int smtp_set_buffer_size (smtp_session_t session, int read_size,
+			  int write_size, int data_size);
+int smtp_set_socket_options (smtp_session_t session, int sndbuf, int rcvbuf,
+			     int nodelay);
+int smtp_set_io_uring (smtp_session_t session, int onoff);
+size_t smtp_get_memory_usage (smtp_session_t session);
+
+/**
+ * typedef smtp_alloc_t - Memory allocator.
+ * @ptr: Memory to release or %NULL.
+ * @size: Octets to allocate or zero.
+ * @arg: User data passed to smtp_set_allocator().
+ *
+ * Called with @ptr %NULL to allocate @size octets, returning %NULL on
+ * failure, or with @size zero to release @ptr.
+ */
+typedef void *(*smtp_alloc_t) (void *ptr, size_t size, void *arg);
+int smtp_set_arena (smtp_session_t session, size_t block_size);
+int smtp_set_allocator (smtp_session_t session, smtp_alloc_t alloc, void *arg);
 int smtp_set_hostname (smtp_session_t session, const char *hostname);
 int smtp_set_reverse_path (smtp_message_t message, const char *mailbox);
 smtp_recipient_t smtp_add_recipient (smtp_message_t message,
                                      const char *mailbox);
 int smtp_enumerate_recipients (smtp_message_t message,
 			       smtp_enumerate_recipientcb_t cb, void *arg);
+int smtp_enumerate_deferred_recipients (smtp_message_t message,
+					smtp_enumerate_recipientcb_t cb,
+					void *arg);
+
+/**
+ * typedef smtp_recipientcb_t - Recipient source callback.
+ * @message: The message.
+ * @arg: User data passed to smtp_set_recipientcb().
+ *
+ * Supply the next recipient mailbox for the message.
+ *
+ * Return: The mailbox or %NULL if there are no more recipients.
+ */
+typedef const char *(*smtp_recipientcb_t) (smtp_message_t message, void *arg);
+int smtp_set_recipientcb (smtp_message_t message,
+			  smtp_recipientcb_t cb, void *arg);
+
 int smtp_set_header (smtp_message_t message, const char *header, ...);
 enum header_option
   {
@@ -134,7 +172,8 @@ enum
     SMTP_EV_WRONG_PEER_CERTIFICATE,
     SMTP_EV_NO_CLIENT_CERTIFICATE,
     SMTP_EV_UNUSABLE_CLIENT_CERTIFICATE,
-    SMTP_EV_UNUSABLE_CA_LIST
+    SMTP_EV_UNUSABLE_CA_LIST,
+    SMTP_EV_TLS_OFFLOAD
   };
 typedef void (*smtp_eventcb_t) (smtp_session_t session, int event_no,
 				void *arg, ...);
@@ -146,6 +185,28 @@ int smtp_set_monitorcb (smtp_session_t session, smtp_monitorcb_t cb, void *arg,
 int smtp_start_session (smtp_session_t session);
 int smtp_destroy_session (smtp_session_t session);
 
+/**
+ * enum step_status - Non-blocking session progress.
+ * @Step_FAILED: The session failed, see smtp_errno().
+ * @Step_DONE: The session completed.
+ * @Step_WANT_IO: Call smtp_session_step() again when the socket is ready.
+ *
+ * Values returned by smtp_session_step().
+ */
+enum step_status
+  {
+    Step_FAILED,
+    Step_DONE,
+    Step_WANT_IO
+  };
+#define SMTP_IO_READ	1
+#define SMTP_IO_WRITE	2
+int smtp_session_begin (smtp_session_t session);
+int smtp_session_step (smtp_session_t session, int events);
+int smtp_session_get_fd (smtp_session_t session);
+int smtp_session_get_events (smtp_session_t session);
+int smtp_session_get_timeout (smtp_session_t session);
+
 struct smtp_status
   {
     int code;			/* SMTP protocol status code */
@@ -206,6 +267,9 @@ const char *_smtp_message_str_cb (void **ctx, int *len, void *arg);
 #define smtp_set_message_str(message,str)	\
 		smtp_set_messagecb ((message), _smtp_message_str_cb, (str))
 
+const char *_smtp_message_fd_cb (void **ctx, int *len, void *arg);
+int smtp_set_message_fd (smtp_message_t message, int fd);
+
 /* Protocol timeouts */
 
 /**
@@ -215,9 +279,13 @@ const char *_smtp_message_str_cb (void **ctx, int *len, void *arg);
  * @Timeout_DATA: Timeout waiting for data transfer to begin.
  * @Timeout_TRANSFER: Timeout for data transfer phase.
  * @Timeout_DATA2: Timeout for data transfer phase.
+ * @Timeout_CONNECT: Timeout for establishing the connection to the server.
+ * @Timeout_RESOLVE: Timeout for resolving the server's address.
  *
  * Timeout flags. In addition %Timeout_OVERRIDE_RFC2822_MINIMUM may
  * be bitwise-ORed with above to override recommended minimum timeouts.
+ * RFC 5321 does not recommend a connect timeout, the default is 30 seconds.
+ * By default the server's address is resolved without a timeout.
  */
 enum rfc2822_timeouts
   {
@@ -225,7 +293,9 @@ enum rfc2822_timeouts
     Timeout_ENVELOPE,
     Timeout_DATA,
     Timeout_TRANSFER,
-    Timeout_DATA2
+    Timeout_DATA2,
+    Timeout_CONNECT,
+    Timeout_RESOLVE
   };
 #define Timeout_OVERRIDE_RFC2822_MINIMUM	0x1000
 long smtp_set_timeout (smtp_session_t session, int which, long value);
@@ -272,6 +342,9 @@ enum notify_flags
 int smtp_dsn_set_notify (smtp_recipient_t recipient, enum notify_flags flags);
 int smtp_dsn_set_orcpt (smtp_recipient_t recipient,
 			const char *address_type, const char *address);
+int smtp_add_recipients (smtp_message_t message,
+			 const char *const *mailboxes, int n,
+			 enum notify_flags notify);
 
 /*
     	RFC 1870.  SMTP Size extension.
@@ -330,14 +403,17 @@ int smtp_deliverby_set_mode (smtp_message_t message,
  * @Starttls_DISABLED: Do not use TLS, even if offered by the MTA.
  * @Starttls_ENABLED: Use TLS if offered by the MTA.
  * @Starttls_REQUIRED: Exit session if TLS is not offered by the MTA.
+ * @Starttls_IMPLICIT: Start TLS as soon as connected (RFC 8314), port 465.
  */
 enum starttls_option
   {
     Starttls_DISABLED,
     Starttls_ENABLED,
-    Starttls_REQUIRED
+    Starttls_REQUIRED,
+    Starttls_IMPLICIT
   };
 int smtp_starttls_enable (smtp_session_t session, enum starttls_option how);
+int smtp_set_tcp_fastopen (smtp_session_t session, int onoff);
 
 /* Only delare this if the app has incuded <openssl/ssl.h> which
    defines the symbol tested. */
@@ -361,6 +437,7 @@ SSL_CTX *smtp_starttls_get_ctx (smtp_session_t session);
 typedef int (*smtp_starttls_passwordcb_t) (char *buf, int buflen,
                                            int rwflag, void *arg);
 int smtp_starttls_set_password_cb (smtp_starttls_passwordcb_t cb, void *arg);
+int smtp_starttls_ctx_cache_enable (int onoff);
 
 /*
     	RFC 1985.  Remote Message Queue Starting (ETRN)
@@ -383,6 +460,67 @@ void smtp_etrn_set_application_data_release (smtp_etrn_node_t node, void *data,
                                              void (*release) (void *));
 void *smtp_etrn_get_application_data (smtp_etrn_node_t node);
 
+/*
+	Delivery pool.
+ */
+
+typedef struct smtp_pool *smtp_pool_t;
+
+/**
+ * typedef smtp_pool_donecb_t - Pool session completion callback.
+ * @session: The session which completed.
+ * @status: Value returned by smtp_start_session().
+ * @arg: User data passed to smtp_pool_set_donecb().
+ *
+ * Called on the worker thread when a session submitted to a delivery
+ * pool completes.
+ */
+typedef void (*smtp_pool_donecb_t) (smtp_session_t session, int status,
+				    void *arg);
+smtp_pool_t smtp_pool_create (int nworkers, int max_per_host);
+int smtp_pool_set_donecb (smtp_pool_t pool, smtp_pool_donecb_t cb, void *arg);
+int smtp_pool_submit (smtp_pool_t pool, smtp_session_t session);
+int smtp_pool_wait (smtp_pool_t pool);
+void smtp_pool_destroy (smtp_pool_t pool);
+
+/*
+	Connection pool.
+ */
+
+typedef struct smtp_connpool *smtp_connpool_t;
+smtp_connpool_t smtp_connpool_create (int max_idle, long idle_timeout);
+int smtp_connpool_set_keepalive (smtp_connpool_t pool, long interval);
+int smtp_connpool_maintain (smtp_connpool_t pool);
+void smtp_connpool_destroy (smtp_connpool_t pool);
+int smtp_set_connpool (smtp_session_t session, smtp_connpool_t pool);
+int smtp_set_connpool_identity (smtp_session_t session, const char *identity);
+
+/*
+	Resolver cache.
+ */
+
+int smtp_resolver_set_ttl (long ttl, long negative_ttl);
+void smtp_resolver_flush (void);
+int smtp_resolver_load_hosts (const char *path);
+
+/*
+	TLS session cache.
+ */
+
+int smtp_tls_session_cache_set_size (int size);
+void smtp_tls_session_cache_flush (void);
+int smtp_tls_session_cache_save (const char *path);
+int smtp_tls_session_cache_load (const char *path);
+int smtp_tls_verify_cache_set_lifetime (long seconds);
+void smtp_tls_verify_cache_flush (void);
+
+/*
+	Server capability cache and PIPECONNECT.
+ */
+
+int smtp_capability_cache_set_size (int size);
+void smtp_capability_cache_flush (void);
+
 #ifdef __cplusplus
 };
 #endif
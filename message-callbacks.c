@@ -28,6 +28,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "libesmtp.h"
 
 #define BUFLEN	8192
@@ -38,8 +40,9 @@
  * Message Callbacks
  * -----------------
  *
- * libESMTP provides basic message callbacks to handle two common cases,
- * reading from a file and reading from a string.  In both cases the message
+ * libESMTP provides basic message callbacks to handle three common cases,
+ * reading from a stdio stream, from a file descriptor and from a string.
+ * In all cases the message
  * *must* be formatted according to RFC 5322 and lines *must* be terminated
  * with the canonical CRLF sequence.  Furthermore, RFC 5321 line length
  * limitations must be observed (1000 octets maximum).
@@ -71,6 +74,39 @@ _smtp_message_fp_cb (void **ctx, int *len, void *arg)
   return *ctx;
 }
 
+/**
+ * _smtp_message_fd_cb() - Read message from a file descriptor.
+ * @ctx: context data for the message.
+ * @len: length of message data returned to the application.
+ * @arg: pointer to the file descriptor.
+ *
+ * Callback function to read the message from a file descriptor.  The
+ * message is read from the start of the file.  This is installed by
+ * smtp_set_message_fd().
+ *
+ * Return: A pointer to message data which remains valid until the next call.
+ */
+const char *
+_smtp_message_fd_cb (void **ctx, int *len, void *arg)
+{
+  int fd = *(int *) arg;
+  ssize_t n;
+
+  if (*ctx == NULL)
+    *ctx = malloc (BUFLEN);
+
+  if (len == NULL)
+    {
+      lseek (fd, 0, SEEK_SET);
+      return NULL;
+    }
+
+  while ((n = read (fd, *ctx, BUFLEN)) < 0 && errno == EINTR)
+    ;
+  *len = (n > 0) ? n : 0;
+  return *ctx;
+}
+
 struct state
   {
     int state;
@@ -31,6 +31,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#if defined (__AVX2__) || defined (__SSE2__)
+# include <immintrin.h>
+#elif defined (__ARM_NEON)
+# include <arm_neon.h>
+#endif
 #include "message-source.h"
 
 /* This is similar to code in siobuf.c */
@@ -49,6 +54,10 @@ struct msg_source
     /* Output buffer (used by msg_gets()) */
     char *buf;
     size_t nalloc;
+
+    /* Line state (used by msg_getb_stuffed()) */
+    int lastc;			/* last octet returned */
+    int bol;			/* next octet starts a line */
   };
 
 msg_source_t
@@ -106,6 +115,9 @@ msg_rewind (msg_source_t source)
   assert (source != NULL && source->cb != NULL);
 
   (*source->cb) (&source->ctx, NULL, source->arg);
+  source->rn = 0;
+  source->lastc = '\n';
+  source->bol = 1;
 }
 
 /* Line oriented reader.  An output buffer is allocated as required.
@@ -167,6 +179,8 @@ msg_gets (msg_source_t source, int *len, int concatenate)
       buflen--;
       if (c == '\n' && lastc == '\r')
 	{
+	  source->lastc = '\n';
+	  source->bol = 1;
 	  *len = p - source->buf;
 	  return source->buf;
 	}
@@ -179,6 +193,8 @@ msg_gets (msg_source_t source, int *len, int concatenate)
   if (lastc != '\r')
     *p++ = '\r';
   *p++ = '\n';
+  source->lastc = '\n';
+  source->bol = 1;
   *len = p - source->buf;
   return source->buf;
 }
@@ -214,3 +230,142 @@ msg_getb (msg_source_t source, int *len)
   source->rn = 0;
   return source->rp;
 }
+
+/* Discard input read from the callback but not yet returned.  Returns the
+   number of octets discarded.  This allows the caller to find the position
+   in the message source reached by msg_gets().
+ */
+int
+msg_discard (msg_source_t source)
+{
+  int n;
+
+  assert (source != NULL);
+
+  n = source->rn > 0 ? source->rn : 0;
+  source->rn = 0;
+  return n;
+}
+
+/* Find the first occurrence of "\n." between p and end.  Returns a
+   pointer to the '.' or NULL.  Body text rarely contains lines starting
+   with a dot so the vector loops check 16 or 32 line breaks at a time
+   for a following dot, rather than stopping at every line.  */
+static const char *
+find_dot_line (const char *p, const char *end)
+{
+#if defined (__AVX2__)
+  const __m256i nl = _mm256_set1_epi8 ('\n');
+  const __m256i dot = _mm256_set1_epi8 ('.');
+  __m256i a, b;
+  unsigned int mask;
+
+  while (end - p > 32)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) p);
+      b = _mm256_loadu_si256 ((const __m256i *) (p + 1));
+      mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpeq_epi8 (a, nl),
+						     _mm256_cmpeq_epi8 (b, dot)));
+      if (mask != 0)
+	return p + __builtin_ctz (mask) + 1;
+      p += 32;
+    }
+#elif defined (__SSE2__)
+  const __m128i nl = _mm_set1_epi8 ('\n');
+  const __m128i dot = _mm_set1_epi8 ('.');
+  __m128i a, b;
+  unsigned int mask;
+
+  while (end - p > 16)
+    {
+      a = _mm_loadu_si128 ((const __m128i *) p);
+      b = _mm_loadu_si128 ((const __m128i *) (p + 1));
+      mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, nl),
+					       _mm_cmpeq_epi8 (b, dot)));
+      if (mask != 0)
+	return p + __builtin_ctz (mask) + 1;
+      p += 16;
+    }
+#elif defined (__ARM_NEON)
+  const uint8x16_t nl = vdupq_n_u8 ('\n');
+  const uint8x16_t dot = vdupq_n_u8 ('.');
+  uint8x16_t match;
+  uint64_t mask;
+
+  while (end - p > 16)
+    {
+      match = vandq_u8 (vceqq_u8 (vld1q_u8 ((const uint8_t *) p), nl),
+			vceqq_u8 (vld1q_u8 ((const uint8_t *) (p + 1)), dot));
+      /* Narrow each byte of the comparison to 4 bits of a 64 bit mask. */
+      mask = vget_lane_u64 (vreinterpret_u64_u8 (
+		vshrn_n_u16 (vreinterpretq_u16_u8 (match), 4)), 0);
+      if (mask != 0)
+	return p + (__builtin_ctzll (mask) >> 2) + 1;
+      p += 16;
+    }
+#endif
+
+  while (end - p > 1 && (p = memchr (p, '\n', end - p - 1)) != NULL)
+    {
+      if (*++p == '.')
+	return p;
+    }
+  return NULL;
+}
+
+/* Block oriented reader for the message body which implements SMTP dot
+   stuffing (RFC 5321 section 4.5.2).  Returns the next span of at most
+   maxlen octets which may be copied to the server unchanged.  If *stuff is
+   set on return, the span starts a line with a dot and an extra dot must
+   be written first.  Spans are taken directly from the application's
+   buffers and are never copied.  As with msg_gets(), a line starts after
+   a \r\n and if the message is not terminated with \r\n, it is
+   supplied.  Returns NULL at the end of the message.
+ */
+const char *
+msg_getb_stuffed (msg_source_t source, int *len, int maxlen, int *stuff)
+{
+  const char *p, *end, *dot;
+  int n;
+
+  assert (source != NULL && len != NULL && stuff != NULL && maxlen > 1);
+
+  *stuff = 0;
+  if (source->rn <= 0 && !msg_fill (source))
+    {
+      if (source->bol)
+	return NULL;
+      source->bol = 1;
+      *len = (source->lastc == '\r') ? 1 : 2;
+      return (source->lastc == '\r') ? "\n" : "\r\n";
+    }
+
+  p = source->rp;
+  end = p + (source->rn < maxlen ? source->rn : maxlen);
+  if (source->bol && *p == '.')
+    {
+      *stuff = 1;
+      p++;
+    }
+
+  /* Find the next line starting with a dot.  The \n must be preceded
+     by \r which may have been the last octet of the previous span.  */
+  for (; (dot = find_dot_line (p, end)) != NULL; p = dot)
+    if (dot - 2 >= source->rp ? dot[-2] == '\r' : source->lastc == '\r')
+      {
+	end = dot;
+	break;
+      }
+
+  n = end - source->rp;
+  if (end[-1] == '\n')
+    source->bol = (n > 1) ? end[-2] == '\r' : source->lastc == '\r';
+  else
+    source->bol = 0;
+  source->lastc = (unsigned char) end[-1];
+  *len = n;
+  p = source->rp;
+  source->rp += n;
+  source->rn -= n;
+  return p;
+}
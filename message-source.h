@@ -38,5 +38,8 @@ void msg_rewind (msg_source_t source);
 const char *msg_gets (msg_source_t source, int *len, int concatenate);
 int msg_nextc (msg_source_t source);
 const char *msg_getb (msg_source_t source, int *len);
+int msg_discard (msg_source_t source);
+const char *msg_getb_stuffed (msg_source_t source, int *len, int maxlen,
+			      int *stuff);
 
 #endif
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+#
+#  This file is part of libESMTP, a library for submission of RFC 2822
+#  formatted electronic mail messages using the SMTP protocol described
+#  in RFC 2821.
+#
+#  This library is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU Lesser General Public
+#  License as published by the Free Software Foundation; either
+#  version 2.1 of the License, or (at your option) any later version.
+#
+#  This library is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  Lesser General Public License for more details.
+
+"""Generate case insensitive perfect hash tables for keywords.
+
+usage: mkkeywords.py keywords.in keywords.c keywords.h
+
+For each table in keywords.in, find a seed for keyword_hash() in tokens.c
+which maps every keyword to a distinct slot of the smallest power of two
+sized table possible.  A lookup then costs one hash and one comparison.
+"""
+
+import sys
+
+MAX_SEED = 1 << 20
+
+
+def keyword_hash(seed, name):
+    """Must agree with keyword_hash() in tokens.c."""
+    h = seed
+    for c in name.encode('ascii'):
+        h = ((h ^ (c | 0x20)) * 16777619) & 0xffffffff
+    return h ^ (h >> 15)
+
+
+def find_seed(names):
+    size = 1
+    while size < len(names):
+        size *= 2
+    while True:
+        for seed in range(MAX_SEED):
+            slots = {keyword_hash(seed, name) & (size - 1) for name in names}
+            if len(slots) == len(names):
+                return seed, size
+        size *= 2
+
+
+def read_tables(path):
+    tables = {}
+    with open(path) as f:
+        for line in f:
+            line = line.split('#', 1)[0].split()
+            if not line:
+                continue
+            table, name = line
+            names = tables.setdefault(table, [])
+            if name.upper() in (n.upper() for n in names):
+                sys.exit('%s: duplicate keyword %s' % (path, name))
+            names.append(name)
+    return tables
+
+
+def constant(table, name):
+    return '%s_%s' % (table.upper(), name.upper().replace('-', '_'))
+
+
+def main(argv):
+    if len(argv) != 4:
+        sys.exit(__doc__.strip().splitlines()[2])
+    tables = read_tables(argv[1])
+    header = ['/* Generated by mkkeywords.py from keywords.in.  Do not edit. */',
+              '#ifndef _keywords_h',
+              '#define _keywords_h',
+              '']
+    source = ['/* Generated by mkkeywords.py from keywords.in.  Do not edit. */',
+              '#include <config.h>',
+              '',
+              '#include <string.h>',
+              '#include <strings.h>',
+              '',
+              '#include "tokens.h"',
+              '#include "keywords.h"']
+    for table, names in tables.items():
+        seed, size = find_seed(names)
+        slots = [-1] * size
+        for i, name in enumerate(names):
+            slots[keyword_hash(seed, name) & (size - 1)] = i
+
+        header.append('enum %s_keyword' % table)
+        header.append('  {')
+        header.append('    %s_UNKNOWN = -1,' % table.upper())
+        for name in names:
+            header.append('    %s,' % constant(table, name))
+        header.append('    %s_NKEYWORDS' % table.upper())
+        header.append('  };')
+        header.append('')
+        header.append('int %s_keyword (const char *name, int len);' % table)
+        header.append('const char *%s_keyword_name (int keyword);' % table)
+        header.append('')
+
+        source.append('')
+        source.append('static const char *const %s_names[] =' % table)
+        source.append('  {')
+        for name in names:
+            source.append('    "%s",' % name)
+        source.append('  };')
+        source.append('')
+        source.append('static const signed char %s_slots[%d] =' % (table, size))
+        source.append('  {')
+        for i in range(0, size, 16):
+            source.append('    ' + ' '.join('%d,' % s for s in slots[i:i + 16]))
+        source.append('  };')
+        source.append('')
+        source.append('int')
+        source.append('%s_keyword (const char *name, int len)' % table)
+        source.append('{')
+        source.append('  int keyword;')
+        source.append('')
+        source.append('  keyword = %s_slots[keyword_hash (%#xu, name, len) & %d];'
+                      % (table, seed, size - 1))
+        source.append('  if (keyword >= 0')
+        source.append('      && strncasecmp (name, %s_names[keyword], len) == 0'
+                      % table)
+        source.append("      && %s_names[keyword][len] == '\\0')" % table)
+        source.append('    return keyword;')
+        source.append('  return -1;')
+        source.append('}')
+        source.append('')
+        source.append('const char *')
+        source.append('%s_keyword_name (int keyword)' % table)
+        source.append('{')
+        source.append('  return %s_names[keyword];' % table)
+        source.append('}')
+    header.append('#endif')
+
+    with open(argv[2], 'w') as f:
+        f.write('\n'.join(source) + '\n')
+    with open(argv[3], 'w') as f:
+        f.write('\n'.join(header) + '\n')
+
+
+if __name__ == '__main__':
+    main(sys.argv)
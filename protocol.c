@@ -32,11 +32,17 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <missing.h> /* declarations for missing library functions */
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #if HAVE_LWRES_NETDB_H
 # include <lwres/netdb.h>
 #else
@@ -51,8 +57,11 @@
 #include "message-source.h"
 #include "siobuf.h"
 #include "tokens.h"
+#include "keywords.h"
 #include "headers.h"
 #include "protocol.h"
+#include "resolver.h"
+#include "arena.h"
 
 struct protocol_states
   {
@@ -67,6 +76,178 @@ struct protocol_states protocol_states[] =
 #include "protocol-states.h"
   };
 
+/* Mailboxes no longer than this are copied into the same allocation as
+   a streamed recipient, longer ones are allocated separately.  */
+#define RCPT_INLINE	64
+
+/* Maximum number of streamed recipients awaiting the server's response.  */
+#define RCPT_WINDOW	1024
+
+/* Obtain another recipient from the message's recipient callback, if it
+   has one, and append it to the message's pending recipients.  Records
+   discarded by release_recipient() are reused.  */
+static smtp_recipient_t
+pull_recipient (smtp_message_t message)
+{
+  smtp_session_t session = message->session;
+  smtp_recipient_t recipient;
+  const char *mailbox;
+  size_t len;
+
+  if (message->rcpt_cb == NULL || message->rcpt_cb_done)
+    return NULL;
+
+  if ((recipient = message->rcpt_free) != NULL)
+    message->rcpt_free = recipient->next;
+  else if ((recipient = session_alloc (session, sizeof (struct smtp_recipient)
+					       + RCPT_INLINE + 1)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+
+  mailbox = (*message->rcpt_cb) (message, message->rcpt_cb_arg);
+  if (mailbox == NULL)
+    {
+      message->rcpt_cb_done = 1;
+      recipient->next = message->rcpt_free;
+      message->rcpt_free = recipient;
+      return NULL;
+    }
+
+  memset (recipient, 0, sizeof (struct smtp_recipient));
+  recipient->message = message;
+  recipient->streamed = 1;
+  recipient->dsn_notify = Notify_NOTSET;
+  if ((len = strlen (mailbox)) <= RCPT_INLINE)
+    recipient->mailbox = memcpy (recipient + 1, mailbox, len + 1);
+  else if ((recipient->mailbox = strdup (mailbox)) == NULL)
+    {
+      set_errno (ENOMEM);
+      recipient->next = message->rcpt_free;
+      message->rcpt_free = recipient;
+      return NULL;
+    }
+  APPEND_PENDING (message, recipient);
+  return recipient;
+}
+
+/* Free a streamed recipient which is no longer on the pending list.
+   Its allocations are made with malloc() whether or not the session has
+   an arena.  Memory allocated from an arena is not released, so the
+   record itself is then kept for reuse by pull_recipient().  */
+static void
+release_recipient (smtp_recipient_t recipient)
+{
+  smtp_message_t message = recipient->message;
+  smtp_session_t session = message->session;
+  struct recipient_extra *extra;
+
+  reset_recipient_status (recipient);
+  if (recipient->mailbox != (char *) (recipient + 1))
+    free (recipient->mailbox);
+  if ((extra = recipient->extra) != NULL)
+    {
+      if (extra->application_data != NULL && extra->release != NULL)
+	(*extra->release) (extra->application_data);
+      free (extra->dsn_addrtype);
+      free (extra->dsn_orcpt);
+      free (extra);
+      recipient->extra = NULL;
+    }
+  if (session->arena == NULL)
+    free (recipient);
+  else
+    {
+      recipient->next = message->rcpt_free;
+      message->rcpt_free = recipient;
+    }
+}
+
+/* Discard a streamed recipient once its status has been reported.
+   Responses are read in order so the recipient usually follows the one
+   kept by the previous call.  */
+static void
+drop_recipient (smtp_recipient_t recipient)
+{
+  smtp_message_t message = recipient->message;
+  smtp_recipient_t prev;
+
+  if (message->pending_kept == recipient)
+    message->pending_kept = NULL;
+  for (prev = message->pending_kept; prev != NULL; prev = prev->next_pending)
+    if (prev->next_pending == recipient)
+      break;
+  if (prev == NULL && message->pending != recipient)
+    for (prev = message->pending; prev != NULL; prev = prev->next_pending)
+      if (prev->next_pending == recipient)
+	break;
+
+  if (prev == NULL)
+    message->pending = recipient->next_pending;
+  else
+    prev->next_pending = recipient->next_pending;
+  if (message->end_pending == recipient)
+    message->end_pending = prev;
+  message->pending_kept = prev;
+  release_recipient (recipient);
+}
+
+/* smtp_recipient_reset_status() cannot insert the recipient into the
+   pending list without searching for its position, instead the list is
+   rebuilt before the message is next sent.  Streamed recipients follow
+   the others.  */
+void
+rebuild_pending (smtp_message_t message)
+{
+  smtp_recipient_t recipient, next, streamed, end_streamed;
+
+  streamed = end_streamed = NULL;
+  for (recipient = message->pending; recipient != NULL; recipient = next)
+    {
+      next = recipient->next_pending;
+      recipient->pending = 0;
+      if (recipient->streamed)
+	{
+	  if (streamed == NULL)
+	    streamed = recipient;
+	  else
+	    end_streamed->next_pending = recipient;
+	  end_streamed = recipient;
+	}
+    }
+
+  message->pending = message->end_pending = message->pending_kept = NULL;
+  for (recipient = message->recipients;
+       recipient != NULL;
+       recipient = recipient->next)
+    if (!recipient->complete)
+      APPEND_PENDING (message, recipient);
+  for (recipient = streamed; recipient != NULL; recipient = next)
+    {
+      next = recipient == end_streamed ? NULL : recipient->next_pending;
+      APPEND_PENDING (message, recipient);
+    }
+  message->pending_rebuild = 0;
+}
+
+/* Return the message's first unsent recipient, asking the recipient
+   callback for one if necessary.  */
+static smtp_recipient_t
+first_recipient (smtp_message_t message)
+{
+  smtp_recipient_t recipient;
+
+  if (message->pending_rebuild)
+    rebuild_pending (message);
+  for (recipient = message->pending;
+       recipient != NULL;
+       recipient = recipient->next_pending)
+    if (!recipient->complete)
+      return recipient;
+  return pull_recipient (message);
+}
+
 static int
 set_first_recipient (smtp_session_t session)
 {
@@ -75,12 +256,9 @@ set_first_recipient (smtp_session_t session)
   if (session->current_message == NULL)
     return 0;
   
-  for (recipient = session->current_message->recipients;
-       recipient != NULL;
-       recipient = recipient->next)
-    if (!recipient->complete)
-      break;
+  recipient = first_recipient (session->current_message);
   session->cmd_recipient = session->rsp_recipient = recipient;
+  session->rcpt_end = session->rcpt_deferred = NULL;
   return recipient != NULL;
 }
 
@@ -91,23 +269,134 @@ set_first_recipient (smtp_session_t session)
 static smtp_recipient_t
 next_recipient (smtp_recipient_t recipient)
 {
-  while ((recipient = recipient->next) != NULL)
+  while ((recipient = recipient->next_pending) != NULL)
     if (!recipient->complete)
       break;
   return recipient;
 }
 
-/* Set the session's current message to the next unsent message.
+/* When a message's recipients exceed the server's limits they are split
+   between several transactions.  Return the first recipient for the next
+   transaction or NULL if the current transaction has all of them.  */
+smtp_recipient_t
+resume_recipient (smtp_session_t session)
+{
+  if (session->rcpt_deferred != NULL)
+    return session->rcpt_deferred;
+  return session->rcpt_end;
+}
+
+/* Update the current message's recipients once the server has responded
+   to the message data with the status class in code.  When the message
+   is accepted, so are the recipients which the server accepted.  When it
+   is refused, no recipient in this transaction can be sent the message.
+   Completed recipients are removed from the pending list, which need not
+   be searched beyond the recipients in this transaction.  */
+void
+complete_recipients (smtp_session_t session, int code)
+{
+  smtp_message_t message = session->current_message;
+  smtp_recipient_t recipient, next, prev, end;
+
+  end = code == 2 ? session->rcpt_end : resume_recipient (session);
+  prev = NULL;
+  for (recipient = message->pending;
+       recipient != NULL && recipient != end;
+       recipient = next)
+    {
+      next = recipient->next_pending;
+      if (code == 5
+	  || (code == 2 && recipient->status.code >= 200
+			&& recipient->status.code <= 299))
+	recipient->complete = 1;
+      if (!recipient->complete)
+	{
+	  prev = recipient;
+	  continue;
+	}
+      if (prev == NULL)
+	message->pending = next;
+      else
+	prev->next_pending = next;
+      recipient->pending = 0;
+      if (recipient->streamed)
+	release_recipient (recipient);
+    }
+  if (recipient == NULL)
+    message->end_pending = prev;
+  message->pending_kept = NULL;
+}
+
+/* Set the session's current message to the next unsent message.  If the
+   recipients of the current message were split, it remains current with
+   the remaining recipients.
  */
 int
 next_message (smtp_session_t session)
 {
+  smtp_recipient_t recipient;
+
+  if ((recipient = resume_recipient (session)) != NULL)
+    {
+      session->cmd_recipient = session->rsp_recipient = recipient;
+      session->rcpt_end = session->rcpt_deferred = NULL;
+      return 1;
+    }
   while ((session->current_message = session->current_message->next) != NULL)
     if (set_first_recipient (session))
       return 1;
   return 0;
 }
 
+/* Check whether the number of transactions on this connection has reached
+   the server's MAILMAX (RFC 9422).  */
+static int
+mail_limit_reached (smtp_session_t session)
+{
+  return session->mail_max > 0 && session->mail_count >= session->mail_max;
+}
+
+/* RFC 2920 allows the next transaction's MAIL command to be sent behind
+   the end of the previous message's data.  If this is possible, arrange
+   for the MAIL command to be issued for the message that next_message()
+   will select once the response to the data has been read.  State is the
+   command which starts the next transaction, S_mail or S_rset if RSET
+   must precede MAIL.  Returns the next command state.
+
+   BDAT LAST may follow the RCPT commands before their responses are read.
+   Until then it is not known whether the server deferred some recipients
+   to another transaction of the current message, so the next MAIL cannot
+   be chosen.  */
+int
+pipeline_next_message (smtp_session_t session, int state)
+{
+  smtp_message_t message;
+
+  if (!(session->extensions & EXT_PIPELINING)
+      || session->rsp_state == S_rcpt
+      || mail_limit_reached (session)
+      || initial_transaction_state (session) != S_mail)
+    return -1;
+
+  if (resume_recipient (session) != NULL)
+    {
+      session->cmd_message = session->current_message;
+      session->mail_pipelined = 1;
+      return state;
+    }
+
+  for (message = session->current_message->next;
+       message != NULL;
+       message = message->next)
+    if (first_recipient (message) != NULL)
+      {
+	session->cmd_message = message;
+	session->mail_pipelined = 1;
+	return state;
+      }
+  return -1;
+}
+
 /* Set the current message to the first unsent message in the
    session.  */
 static int
@@ -125,16 +414,23 @@ set_first_message (smtp_session_t session)
  * The main protocol engine.
  *****************************************************************************/
 
-int
-do_session (smtp_session_t session)
+/* Delay between starting connection attempts, RFC 8305 section 5 */
+#define CONNECT_ATTEMPT_DELAY	250
+
+static long long
+monotonic_ms (void)
 {
-  struct addrinfo hints, *res, *addrs;
-  int err;
-  int sd;
-  siobuf_t conn;
-  int nresp, status, want_flush, fast;
-  char *nodename;
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
 
+/* Set up the session before connecting to the MTA.  Returns zero if
+   there is nothing to do or on error. */
+static int
+prepare_session (smtp_session_t session)
+{
 #if HAVE_UNAME
   if (session->localhost == NULL)
     {
@@ -183,6 +479,10 @@ do_session (smtp_session_t session)
       return 0;
     }
 
+  /* Early pipelining is permitted until the cached capabilities for the
+     server turn out to be wrong.  */
+  session->pipeconnect_failed = 0;
+
   /* Create a message source only if it is needed.
    */
   if (session->msg_source == NULL && session->current_message != NULL)
@@ -194,222 +494,1001 @@ do_session (smtp_session_t session)
 	  return 0;
         }
     }
+  return 1;
+}
+
+/* Check the result of looking up the addresses of the MTA and note its
+   canonical name.  */
+static struct addrinfo *
+server_addresses (smtp_session_t session, int err, struct addrinfo *res)
+{
+  if (err != 0)
+    {
+      set_herror (err);
+      return NULL;
+    }
+
+  if (session->canon != NULL)
+    free (session->canon);
+  session->canon = res->ai_canonname != NULL ? strdup (res->ai_canonname) : NULL;
+  return res;
+}
+
+/* Look up the addresses of the MTA.  The result must be released with
+   resolver_free(). */
+static struct addrinfo *
+resolve_server (smtp_session_t session)
+{
+  struct addrinfo *res;
+  int err;
+
+  errno = 0;
+  err = resolver_lookup (session->host, session->port,
+			 session->resolve_timeout, &res);
+  return server_addresses (session, err, res);
+}
+
+/* Order the MTA's addresses for connection attempts as recommended by
+   RFC 8305, alternating between address families starting with the
+   family of the first address returned by the resolver.  */
+static struct addrinfo **
+order_addresses (struct addrinfo *res, int *naddrs)
+{
+  struct addrinfo **order, *ai, *first, *other;
+  int n;
+
+  n = 1;
+  for (ai = res->ai_next; ai != NULL; ai = ai->ai_next)
+    n++;
+  if ((order = malloc (n * sizeof (struct addrinfo *))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+
+  /* Take the next address of the preferred family followed by the next
+     of any other family until both lists are exhausted.  */
+  n = 0;
+  first = other = res;
+  while (first != NULL || other != NULL)
+    {
+      while (first != NULL && first->ai_family != res->ai_family)
+	first = first->ai_next;
+      if (first != NULL)
+	{
+	  order[n++] = first;
+	  first = first->ai_next;
+	}
+      while (other != NULL && other->ai_family == res->ai_family)
+	other = other->ai_next;
+      if (other != NULL)
+	{
+	  order[n++] = other;
+	  other = other->ai_next;
+	}
+    }
+  *naddrs = n;
+  return order;
+}
+
+/* Start a non-blocking connect.  Returns the socket or -1 on failure, in
+   which case the error is set.  *done is set if the connection completed
+   immediately.  */
+static int
+start_connect (smtp_session_t session, struct addrinfo *addr, int *done)
+{
+  int sd;
+
+  sd = socket (addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (sd < 0)
+    {
+      set_errno (errno);
+      return -1;
+    }
+  fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) | O_NONBLOCK);
+  if (session->sndbuf > 0)
+    setsockopt (sd, SOL_SOCKET, SO_SNDBUF,
+		&session->sndbuf, sizeof session->sndbuf);
+  if (session->rcvbuf > 0)
+    setsockopt (sd, SOL_SOCKET, SO_RCVBUF,
+		&session->rcvbuf, sizeof session->rcvbuf);
+  if (session->tcp_nodelay)
+    {
+      int on = 1;
+
+      setsockopt (sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    }
+#if defined USE_TLS && defined TCP_FASTOPEN_CONNECT
+  /* With TCP Fast Open, connect() completes at once and the SYN is sent
+     with the ClientHello when the handshake starts.  */
+  if (session->tcp_fastopen && session->starttls_enabled == Starttls_IMPLICIT)
+    {
+      int on = 1;
+
+      setsockopt (sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof on);
+    }
+#endif
+  *done = connect (sd, addr->ai_addr, addr->ai_addrlen) == 0;
+  if (!*done && errno != EINPROGRESS)
+    {
+      set_errno (errno);
+      close (sd);
+      return -1;
+    }
+  return sd;
+}
+
+/* Race connections to the MTA's addresses as described in RFC 8305
+   ("Happy Eyeballs").  A new attempt starts every CONNECT_ATTEMPT_DELAY
+   milliseconds, or as soon as the previous attempt fails, while earlier
+   attempts continue; the first connection established wins.  Addresses
+   which fail, or which succeed, are removed from the array so that a
+   subsequent call for a fallback server tries only the remainder.  The
+   race is abandoned when the connect timeout expires.  Returns a blocking
+   socket or -1.  */
+static int
+race_connect (smtp_session_t session, struct addrinfo **addrs, int naddrs)
+{
+  struct pollfd *pfd;
+  int *which;
+  int npending, next, sd, done, err, timeout, i;
+  socklen_t len;
+  long long start, now, deadline, next_attempt, remaining;
+
+  pfd = malloc (naddrs * sizeof (struct pollfd));
+  which = malloc (naddrs * sizeof (int));
+  if (pfd == NULL || which == NULL)
+    {
+      free (pfd);
+      free (which);
+      set_errno (ENOMEM);
+      return -1;
+    }
+
+  npending = next = 0;
+  sd = -1;
+  start = next_attempt = monotonic_ms ();
+  deadline = start + session->connect_timeout;
+  for (;;)
+    {
+      now = monotonic_ms ();
+      if (now >= deadline)
+	{
+	  set_errno (ETIMEDOUT);
+	  break;
+	}
+
+      /* Start another attempt if one is due.  */
+      while (next < naddrs && addrs[next] == NULL)
+	next++;
+      if (next < naddrs && (npending == 0 || now >= next_attempt))
+	{
+	  i = next++;
+	  if ((pfd[npending].fd = start_connect (session, addrs[i], &done)) < 0)
+	    {
+	      addrs[i] = NULL;
+	      continue;
+	    }
+	  pfd[npending].events = POLLOUT;
+	  which[npending++] = i;
+	  if (done)
+	    {
+	      sd = npending - 1;
+	      break;
+	    }
+	  next_attempt = now + CONNECT_ATTEMPT_DELAY;
+	  continue;
+	}
+      if (npending == 0)
+	break;
+
+      /* Wait for an attempt to complete or until the next is due.  */
+      remaining = deadline - now;
+      if (next < naddrs && next_attempt - now < remaining)
+	remaining = next_attempt - now;
+      timeout = remaining < INT_MAX ? (int) remaining : INT_MAX;
+      if (poll (pfd, npending, timeout) < 0 && errno != EINTR)
+	{
+	  set_errno (errno);
+	  break;
+	}
+      for (i = 0; i < npending; i++)
+	{
+	  if (pfd[i].revents == 0)
+	    continue;
+	  len = sizeof err;
+	  if (getsockopt (pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	    err = errno;
+	  if (err == 0)
+	    {
+	      sd = i;
+	      break;
+	    }
+	  set_errno (err);
+	  close (pfd[i].fd);
+	  addrs[which[i]] = NULL;
+	  npending--;
+	  /* Try the next address now rather than after the delay.  */
+	  next_attempt = now;
+	  pfd[i] = pfd[npending];
+	  which[i] = which[npending];
+	  i--;
+	}
+      if (sd >= 0)
+	break;
+    }
+
+  /* Abandon the losers.  Their addresses remain available as fallbacks.  */
+  for (i = 0; i < npending; i++)
+    if (i != sd)
+      close (pfd[i].fd);
+  if (sd >= 0)
+    {
+      addrs[which[sd]] = NULL;
+      sd = pfd[sd].fd;
+      fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) & ~O_NONBLOCK);
+      session->connect_time = monotonic_ms () - start;
+    }
+  free (pfd);
+  free (which);
+  return sd;
+}
+
+/* Apply the session's buffering options to the connection.  */
+static void
+tune_connection (smtp_session_t session, siobuf_t conn)
+{
+  sio_set_buffer_size (conn, session->read_buffer_size > 0
+			     ? session->read_buffer_size : SIO_BUFSIZE,
+		       session->write_buffer_size > 0
+		       ? session->write_buffer_size : SIO_BUFSIZE);
+  sio_set_cork (conn, session->tcp_nodelay);
+  sio_set_lowmem (conn, session->low_memory);
+  sio_set_uring (conn, session->io_uring && !session->nonblocking);
+}
+
+/* Message transfer may use a larger write buffer than commands.  Switch
+   to the size for the message body if data is set, otherwise back to the
+   size for commands.  A buffer holding output is resized once flushed. */
+void
+set_data_buffering (siobuf_t conn, smtp_session_t session, int data)
+{
+  if (session->data_buffer_size <= 0)
+    return;
+  if (data)
+    sio_set_buffer_size (conn, 0, session->data_buffer_size);
+  else
+    sio_set_buffer_size (conn, 0, session->write_buffer_size > 0
+				  ? session->write_buffer_size : SIO_BUFSIZE);
+}
+
+/* Add buffering to a newly connected socket and reset the session
+   variables to their initial state before entering the protocol. */
+static siobuf_t
+start_protocol (smtp_session_t session, int sd)
+{
+  siobuf_t conn;
+
+  conn = sio_attach (sd, sd, SIO_BUFSIZE);
+  if (conn == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+
+  /* If monitoring the protocol, pass the callback on to the sio_
+     package. */
+  if (session->monitor_cb != NULL)
+    sio_set_monitorcb (conn, session->monitor_cb, session->monitor_cb_arg);
+  tune_connection (session, conn);
+
+  if (session->event_cb != NULL)
+    (*session->event_cb) (session, SMTP_EV_CONNECT, session->event_cb_arg);
+
+  session->extensions = 0;
+  session->try_fallback_server = 0;
+  reset_status (session, &session->mta_status);
+  destroy_auth_mechanisms (session);
+  session->authenticated = 0;
+#ifdef USE_TLS
+  session->using_tls = 0;
+  session->tls_handshake = 0;
+#endif
+  session->cmd_partial = 0;
+  session->nresp = 0;
+  session->cmd_message = NULL;
+  session->mail_pipelined = 0;
+  session->mail_count = 0;
+  session->mail_limited = 0;
+  session->cmd_state = session->rsp_state = 0;
+
+  /* If the server's capabilities are known, EHLO need not wait for the
+     greeting.  See smtp-capcache.c.  */
+  session->pipeconnect_state = -1;
+  session->pipeconnect_retry = 0;
+  session->pipeconnect = !session->pipeconnect_failed
+			 && capability_cache_get (session);
+  return conn;
+}
+
+/* Close the connection to the MTA. */
+static void
+end_protocol (smtp_session_t session, siobuf_t conn, int sd)
+{
+  sio_detach (conn);
+  close (sd);
+
+  if (session->event_cb != NULL)
+    (*session->event_cb) (session, SMTP_EV_DISCONNECT,
+			  session->event_cb_arg);
+}
+
+/* Prepare to reuse a parked connection.  connpool_checkout() restores the
+   server state recorded when the connection was parked.  The protocol
+   restarts with RSET, which also checks the connection is still alive. */
+static void
+resume_protocol (smtp_session_t session, siobuf_t conn)
+{
+  if (session->monitor_cb != NULL)
+    sio_set_monitorcb (conn, session->monitor_cb, session->monitor_cb_arg);
+  tune_connection (session, conn);
+
+  if (session->event_cb != NULL)
+    (*session->event_cb) (session, SMTP_EV_CONNECT, session->event_cb_arg);
+
+  session->try_fallback_server = 0;
+  reset_status (session, &session->mta_status);
+  session->cmd_partial = 0;
+  session->nresp = 0;
+  session->cmd_message = NULL;
+  session->mail_pipelined = 0;
+  session->mail_limited = 0;
+  session->pipeconnect = session->pipeconnect_retry = 0;
+  session->pipeconnect_state = -1;
+  session->reuse_probe = 1;
+  session->cmd_state = session->rsp_state = S_rset;
+}
+
+/* Run the protocol on a connected socket until the session ends.  Returns
+   non-zero if the connection was parked in the connection pool, otherwise
+   the caller must close it. */
+static int
+protocol_loop (smtp_session_t session, siobuf_t conn, int sd)
+{
+  int status, want_flush, fast;
+
+  /* Make the connection visible to smtp_get_memory_usage().  */
+  session->conn = conn;
+
+  /* Outer loop of the protocol.  This is trickier than superficial
+     examination of RFC 821 would suggest, however the complexity is
+     required to handle batched commands and responses.  RFC 821 makes
+     no comment on the underlying transport so it cannot be assumed that
+     each command and its response is transported in a single packet on
+     the network or that the network preserves packet boundaries (or,
+     for that matter, that the underlying transport is even a network,
+     e.g. it might be a pipe or a AF_UNIX socket).  Multiple commands
+     may be sent in a single packet and similarly multiple responses
+     may be returned in a single packet. RFC 2920 which describes the
+     PIPELINING SMTP extension clarifies this for the case where the
+     underlying transport is TCP/IP.
+
+     In this implementation the outer loop will batch together as many
+     commands as possible until the remote server sends a response (this
+     will normally happen after the local transmit buffer is flushed)
+     or a command has been sent which requires a response before the
+     client can proceed.
+
+     In order not to break certain SMTP server implementations, flushing
+     is done after every command unless the PIPELINING keyword is received
+     in response to the EHLO command.  Even when PIPELINING is in force
+     certain commands *always* flush the transmit buffer.
+
+     One good reason for wanting PIPELINING is that when submitting mail
+     to an ISP's sluggish server, there will be a big performance boost
+     since many round trips are eliminated.
+
+     As the protocol engine advances through its states, it will walk
+     through the messages and recipients within the session.
+
+     The protocol functions set a few timeouts as they progress.  The
+     values set are those recommended in RFC 5321.
+
+     [is it just me, or does everybody find that it's easier to implement
+      protocols on the server side?]
+   */
+  while (session->rsp_state >= 0)
+    {
+      if (session->cmd_state == -1)
+	session->cmd_state = session->rsp_state;
+
+      /* Rather than QUIT, park a connection which completed cleanly so
+	 that the next session for the same server can reuse it.  */
+      if (session->cmd_state == S_quit && session->rsp_state == S_quit
+	  && session->connpool != NULL && connpool_checkin (session, conn, sd))
+	{
+	  session->conn = NULL;
+	  if (session->event_cb != NULL)
+	    (*session->event_cb) (session, SMTP_EV_DISCONNECT,
+				  session->event_cb_arg);
+	  return 1;
+	}
+      (*protocol_states[session->cmd_state].cmd) (conn, session);
+      sio_mark (conn);
+      if (!(session->extensions & EXT_PIPELINING))
+	session->cmd_state = -1;
+      session->nresp++;
+
+      if (session->rsp_state < 0)
+	break;
+
+      /* With PIPECONNECT, send EHLO before reading anything.  The socket
+	 may already be readable without the greeting having arrived,
+	 e.g. TLS 1.3 session tickets follow an implicit TLS handshake,
+	 and the greeting handler would block waiting for it.  */
+      if (session->pipeconnect && session->cmd_state == S_ehlo)
+	continue;
+
+      /* The following loop polls the server and reads or writes
+	 to it as required.
+
+	 When the command state is set to -1, this signals that no
+	 more commands can be issued until the response to the most
+	 recent command has been processed, therefore the write
+	 buffer must be explicitly flushed.  If the command state is
+	 not -1, more commands may be issued however, pending
+	 responses from the server should be processed.  When this
+	 is the case, sio_poll should return immediately if there is
+	 nothing to read.  `fast' requests this non-blocking poll.
+
+	 `want_flush' indicates that the write buffer should be
+	 sent to the server.  This flag remains set until the buffer
+	 has been written.
+
+	 After explicitly flushing the buffer, sio_poll blocks
+	 waiting to read data from the server since the server may
+	 take some time to complete the pending commands.
+       */
+      want_flush = (session->cmd_state == -1);
+      fast = (session->cmd_state != -1);
+      while ((status = sio_poll (conn, session->nresp > 0,
+				 want_flush, fast)) > 0)
+	{
+	  /* XXX - Here I assume that once the write fd becomes
+		   available for writing, it stays that way until
+		   it is written to.  I.e. a blocking read() or a
+		   subsequent poll() will not revoke the writable
+		   status.	Could somebody confirm that this is the
+		   case?
+
+	     Flush before reading, including commands pipelined ahead
+	     of the response, since the response handlers block until a
+	     complete response arrives.  The socket may become readable
+	     before the command is sent, e.g. TLS 1.3 session tickets
+	     arrive after the handshake.  */
+	  if ((status & (SIO_READ | SIO_WRITE)) || want_flush)
+	    {
+	      sio_flush (conn);
+	      want_flush = 0;
+	    }
+	  if (status & SIO_READ)
+	    {
+	      session->nresp--;
+
+	      /* TODO: change so that the response line is parsed
+		       here.  This means that the server 421
+		       response which can be issued at any time may
+		       be checked for here. */
+
+	      /* When reading from the server in the response state
+		 handlers the read call blocks.  Complete responses
+		 must be read from the server before processing and
+		 an individual response may be larger than the read
+		 buffer.  */
+	      (*protocol_states[session->rsp_state].rsp) (conn, session);
+
+	      /* The connection is being dropped, responses to any
+		 commands sent ahead are of no interest.  */
+	      if (session->rsp_state < 0)
+		break;
+	    }
+	}
+      if (status < 0)
+	{
+	  set_error (SMTP_ERR_DROPPED_CONNECTION);
+	  break;
+	}
+    }
+  session->conn = NULL;
+  return 0;
+}
+
+int
+do_session (smtp_session_t session)
+{
+  struct addrinfo *res, **addrs;
+  int sd, naddrs;
+  siobuf_t conn;
+
+  if (!prepare_session (session))
+    return 0;
+
+  /* Reuse a parked connection to the server if there is one.  A stale
+     connection is discarded and the next tried, finally falling back to
+     a new connection. */
+  session->connect_time = -1;
+  while (session->connpool != NULL
+	 && (conn = connpool_checkout (session, &sd)) != NULL)
+    {
+      session->connect_time = 0;
+      resume_protocol (session, conn);
+      if (protocol_loop (session, conn, sd))
+	return 1;
+      end_protocol (session, conn, sd);
+
+      /* Once the connection proved usable, continue as for a new
+	 connection below if the server sent the client away or its
+	 MAILMAX was reached.  */
+      if (!session->reuse_probe)
+	{
+	  if (!session->try_fallback_server
+	      && !(session->mail_limited && session->current_message != NULL))
+	    return 1;
+	  break;
+	}
+      session->reuse_probe = 0;
+      set_first_message (session);
+    }
 
   /* Connect to the SMTP server. */
+  if ((res = resolve_server (session)) == NULL)
+    return 0;
+  if ((addrs = order_addresses (res, &naddrs)) == NULL)
+    {
+      resolver_free (res);
+      return 0;
+    }
+
+  /* Try to establish an SMTP session with each host in turn until one
+     succeeds.  */
+  while ((sd = race_connect (session, addrs, naddrs)) >= 0)
+    {
+      /* Add buffering to the socket */
+      conn = start_protocol (session, sd);
+      if (conn == NULL)
+	{
+	  free (addrs);
+	  resolver_free (res);
+	  close (sd);
+	  return 0;
+	}
+
+#ifdef USE_TLS
+      /* With implicit TLS the handshake precedes the greeting.  If it
+	 fails try the next address.  */
+      if (session->starttls_enabled == Starttls_IMPLICIT
+	  && !start_implicit_tls (conn, session))
+	{
+	  end_protocol (session, conn, sd);
+	  continue;
+	}
+#endif
+
+      if (!protocol_loop (session, conn, sd))
+	end_protocol (session, conn, sd);
+
+      /* The server's MAILMAX was reached or commands were pipelined
+	 using out of date capabilities.  Continue with the remaining
+	 messages on a new connection.  */
+      if ((session->mail_limited && session->current_message != NULL)
+	  || session->pipeconnect_retry)
+	{
+	  free (addrs);
+	  if ((addrs = order_addresses (res, &naddrs)) == NULL)
+	    break;
+	  continue;
+	}
+
+      /* This flag will be set if the server was reached OK but was the
+         wrong kind of server or the client is told to go away.  So if
+         not set the protocol must have concluded sucessfully. */
+      if (!session->try_fallback_server)
+	{
+	  free (addrs);
+	  resolver_free (res);
+	  return 1;
+        }
+    }
+
+  /* If the loop terminated, couldn't work with any servers. */
+  if (addrs != NULL)
+    free (addrs);
+  resolver_free (res);
+  return 0;
+}
+
+/*****************************************************************************
+ * The non-blocking protocol engine.
+ *
+ * This drives the same state handlers as do_session() from an application's
+ * event loop.  A response handler is called only once its complete response
+ * is buffered, so the handlers never wait for the server.  Output is queued
+ * in the siobuf when the socket is not ready and command generation pauses
+ * while the queue is above SIO_HIGHWATER.
+ *****************************************************************************/
+
+/* Check if a complete response is waiting in the read buffer.  The
+   final line of a response has a space, not a hyphen, after the status
+   code. */
+static int
+response_available (siobuf_t conn)
+{
+  const char *p, *end, *nl;
+  int len;
 
+  p = sio_peek (conn, &len);
+  for (end = p + len; (nl = memchr (p, '\n', end - p)) != NULL; p = nl + 1)
+    if (nl - p < 4 || p[3] != '-')
+      return 1;
+  return 0;
+}
+
+/* Start a non-blocking connect to the next untried address.  Only one
+   descriptor can be presented to the application so attempts are made in
+   turn rather than raced.  The remainder of the connect timeout is shared
+   between the untried addresses so that an unresponsive address cannot
+   prevent the others from being tried.  */
+static int
+connect_next (smtp_session_t session)
+{
+  long long now, remaining;
+  int sd, done;
+
+  while (session->addr_next < session->naddrs)
+    {
+      now = monotonic_ms ();
+      remaining = session->connect_start + session->connect_timeout - now;
+      if (remaining <= 0)
+	{
+	  set_errno (ETIMEDOUT);
+	  return 0;
+	}
+      sd = start_connect (session,
+			  session->addr_order[session->addr_next], &done);
+      remaining /= session->naddrs - session->addr_next++;
+      if (sd < 0)
+	continue;
+      session->sd = sd;
+      session->deadline = now + remaining;
+      return 1;
+    }
+  return 0;
+}
+
+/* Release the resources used by a non-blocking session. */
+void
+abort_session (smtp_session_t session)
+{
+  if (session->conn != NULL)
+    {
+      sio_detach (session->conn);
+      session->conn = NULL;
+    }
+  if (session->sd >= 0)
+    {
+      close (session->sd);
+      session->sd = -1;
+    }
+  if (session->addr_order != NULL)
+    {
+      free (session->addr_order);
+      session->addr_order = NULL;
+    }
+  if (session->addrs != NULL)
+    {
+      resolver_free (session->addrs);
+      session->addrs = NULL;
+    }
+  if (session->resolve_job != NULL)
+    {
+      resolver_job_cancel (session->resolve_job);
+      session->resolve_job = NULL;
+    }
+  session->events = 0;
+  session->nonblocking = 0;
+}
+
+/* Start connecting to the MTA once its addresses are known.  */
+static int
+connect_server (smtp_session_t session, int err, struct addrinfo *res)
+{
+  if ((session->addrs = server_addresses (session, err, res)) == NULL)
+    return 0;
+  session->addr_order = order_addresses (session->addrs, &session->naddrs);
+  session->addr_next = 0;
+  session->connect_start = monotonic_ms ();
+  if (session->addr_order == NULL || !connect_next (session))
+    return 0;
+  session->events = SMTP_IO_WRITE;
+  return 1;
+}
+
+/* Unless the MTA's addresses are already known, the lookup runs on another
+   thread.  The application then waits for the descriptor returned by
+   session_fd() to become readable before the first step.  */
+int
+begin_session (smtp_session_t session)
+{
+  struct addrinfo *res;
+  int err;
+
+  if (!prepare_session (session))
+    return 0;
+  session->nonblocking = 1;
+  session->connect_time = -1;
   errno = 0;
-  nodename = (session->host == NULL || *session->host == '\0') ? NULL
-							       : session->host;
-  /* Use the RFC 3493/Posix resolver interface.  This allows for much
-     cleaner code, protocol independence and thread safety. */
-  memset (&hints, 0, sizeof hints);
-  hints.ai_flags = AI_CANONNAME;
-  hints.ai_family = PF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  err = getaddrinfo (nodename, session->port, &hints, &res);
-  if (err != 0)
+  err = resolver_start (session->host, session->port,
+			&session->resolve_job, &res);
+  if (session->resolve_job != NULL)
+    {
+      session->events = SMTP_IO_READ;
+      if (session->resolve_timeout > 0)
+	session->deadline = monotonic_ms () + session->resolve_timeout;
+      else
+	session->deadline = -1;
+      return 1;
+    }
+  if (!connect_server (session, err, res))
     {
-      set_herror (err);
+      abort_session (session);
       return 0;
     }
+  return 1;
+}
 
-  session->canon = res->ai_canonname != NULL ? strdup (res->ai_canonname) : NULL;
+/* Run the protocol as far as possible without waiting.  Return non-zero
+   if anything was read, written or processed. */
+static int
+run_protocol (siobuf_t conn, smtp_session_t session)
+{
+  int progress = 0;
+  int n, pending;
 
-  /* Try to establish an SMTP session with each host in turn until one
-     succeeds.  */
-  for (addrs = res; addrs != NULL; addrs = addrs->ai_next)
+  for (;;)
     {
-      sd = socket (addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
-      if (sd < 0)
-	{
-	  set_errno (errno);
-	  continue;
-	}
-      if (connect (sd, addrs->ai_addr, addrs->ai_addrlen) < 0)
+      n = 0;
+
+#ifdef USE_TLS
+      if (session->tls_handshake)
 	{
-	  /* Failed to connect.  Close the socket and try again.  */
-	  set_errno (errno);
-	  close (sd);
-	  continue;
+	  if (!handshake_starttls (conn, session))
+	    break;
+	  n = 1;
 	}
+#endif
 
-      /* Add buffering to the socket */
-      conn = sio_attach (sd, sd, SIO_BUFSIZE);
-      if (conn == NULL)
+      /* Write queued output and read as much as is available. */
+      if ((pending = sio_write_pending (conn)) > 0
+	  && sio_drain (conn) != pending)
+	n = 1;
+      if (session->nresp > 0 && sio_read_ahead (conn) != 0)
+	n = 1;
+
+      /* Process complete responses.  After the connection is closed
+	 let the handlers run anyway so that failures are handled as in
+	 the blocking case. */
+      while (session->nresp > 0 && session->rsp_state >= 0
+	     && (response_available (conn) || sio_read_ahead (conn) < 0))
 	{
-	  set_errno (ENOMEM);
-	  freeaddrinfo (res);
-	  close (sd);
-	  return 0;
+	  session->nresp--;
+	  (*protocol_states[session->rsp_state].rsp) (conn, session);
+	  n = 1;
+#ifdef USE_TLS
+	  if (session->tls_handshake)
+	    break;
+#endif
 	}
+      if (session->rsp_state < 0)
+	return 1;
 
-      /* If monitoring the protocol, pass the callback on to the sio_
-	 package. */
-      if (session->monitor_cb != NULL)
-	sio_set_monitorcb (conn, session->monitor_cb, session->monitor_cb_arg);
-
-      if (session->event_cb != NULL)
-	(*session->event_cb) (session, SMTP_EV_CONNECT, session->event_cb_arg);
-
-      /* Outer loop of the protocol.  This is trickier than superficial
-	 examination of RFC 821 would suggest, however the complexity is
-	 required to handle batched commands and responses.  RFC 821 makes
-	 no comment on the underlying transport so it cannot be assumed that
-	 each command and its response is transported in a single packet on
-	 the network or that the network preserves packet boundaries (or,
-	 for that matter, that the underlying transport is even a network,
-	 e.g. it might be a pipe or a AF_UNIX socket).  Multiple commands
-	 may be sent in a single packet and similarly multiple responses
-	 may be returned in a single packet. RFC 2920 which describes the
-	 PIPELINING SMTP extension clarifies this for the case where the
-	 underlying transport is TCP/IP.
-
-	 In this implementation the outer loop will batch together as many
-	 commands as possible until the remote server sends a response (this
-	 will normally happen after the local transmit buffer is flushed)
-	 or a command has been sent which requires a response before the
-	 client can proceed.
-
-	 In order not to break certain SMTP server implementations, flushing
-	 is done after every command unless the PIPELINING keyword is received
-	 in response to the EHLO command.  Even when PIPELINING is in force
-	 certain commands *always* flush the transmit buffer.
-
-	 One good reason for wanting PIPELINING is that when submitting mail
-	 to an ISP's sluggish server, there will be a big performance boost
-	 since many round trips are eliminated.
-
-	 As the protocol engine advances through its states, it will walk
-	 through the messages and recipients within the session.
-
-	 The protocol functions set a few timeouts as they progress.  The
-	 values set are those recommended in RFC 5321.
-
-	 [is it just me, or does everybody find that it's easier to implement
-	  protocols on the server side?]
-       */
-
-      /* Reset variables to their initial state before entering the protocol
-	 main loop. */
-      session->extensions = 0;
-      session->try_fallback_server = 0;
-      reset_status (&session->mta_status);
-      destroy_auth_mechanisms (session);
-      session->authenticated = 0;
+      /* Issue commands until one requires a response before
+	 proceeding or the output queue fills. */
+      while (sio_write_pending (conn) < SIO_HIGHWATER
+	     && (session->cmd_state != -1 || session->nresp == 0)
 #ifdef USE_TLS
-      session->using_tls = 0;
+	     && !session->tls_handshake
 #endif
-
-      nresp = 0;
-      session->cmd_state = session->rsp_state = 0;
-      while (session->rsp_state >= 0)
+	     )
 	{
 	  if (session->cmd_state == -1)
 	    session->cmd_state = session->rsp_state;
 	  (*protocol_states[session->cmd_state].cmd) (conn, session);
+	  n = 1;
+	  if (session->rsp_state < 0)
+	    return 1;
+	  if (session->cmd_partial)
+	    continue;
 	  sio_mark (conn);
 	  if (!(session->extensions & EXT_PIPELINING))
 	    session->cmd_state = -1;
-	  nresp++;
+	  session->nresp++;
+	}
+      sio_flush (conn);
 
-	  if (session->rsp_state < 0)
-	    break;
+      if (!n)
+	break;
+      progress = 1;
+    }
+  return progress;
+}
+
+int
+step_session (smtp_session_t session, int events)
+{
+  struct addrinfo *res;
+  int err;
+  socklen_t len;
+  long long now;
+
+  for (;;)
+    {
+      now = monotonic_ms ();
 
-	  /* The following loop polls the server and reads or writes
-	     to it as required.
-
-	     When the command state is set to -1, this signals that no
-	     more commands can be issued until the response to the most
-	     recent command has been processed, therefore the write
-	     buffer must be explicitly flushed.  If the command state is
-	     not -1, more commands may be issued however, pending
-	     responses from the server should be processed.  When this
-	     is the case, sio_poll should return immediately if there is
-	     nothing to read.  `fast' requests this non-blocking poll.
-
-	     `want_flush' indicates that the write buffer should be
-	     sent to the server.  This flag remains set until the buffer
-	     has been written.
-
-	     After explicitly flushing the buffer, sio_poll blocks
-	     waiting to read data from the server since the server may
-	     take some time to complete the pending commands.
-           */
-	  want_flush = (session->cmd_state == -1);
-	  fast = (session->cmd_state != -1);
-	  while ((status = sio_poll (conn, nresp > 0, want_flush, fast)) > 0)
+      if (session->resolve_job != NULL)
+	{
+	  /* Wait for the lookup of the MTA's addresses.  As in the
+	     blocking case, Timeout_RESOLVE fails the session with
+	     EAI_AGAIN and the lookup continues in the background.  */
+	  res = NULL;
+	  if (!resolver_job_finish (session->resolve_job, &res, &err))
 	    {
-	      if (status & SIO_READ)
-		{
-		  nresp--;
-
-		  /* TODO: change so that the response line is parsed
-		           here.  This means that the server 421
-		           response which can be issued at any time may
-			   be checked for here. */
-
-		  /* When reading from the server in the response state
-		     handlers the read call blocks.  Complete responses
-	             must be read from the server before processing and
-	             an individual response may be larger than the read
-	             buffer.  */
-		  (*protocol_states[session->rsp_state].rsp) (conn, session);
-		}
-	      /* XXX - Here I assume that once the write fd becomes
-		       available for writing, it stays that way until
-		       it is written to.  I.e. a blocking read() or a
-		       subsequent poll() will not revoke the writable
-		       status.	Could somebody confirm that this is the
-		       case? */
-	      if (status & SIO_WRITE)
-		{
-		  sio_flush (conn);
-		  want_flush = 0;
-		}
+	      if (session->deadline < 0 || now < session->deadline)
+		return Step_WANT_IO;
+	      resolver_job_cancel (session->resolve_job);
+	      err = EAI_AGAIN;
 	    }
-	  if (status < 0)
+	  session->resolve_job = NULL;
+	  session->deadline = -1;
+	  if (!connect_server (session, err, res))
+	    break;
+	  return Step_WANT_IO;
+	}
+
+      if (session->conn == NULL)
+	{
+	  /* Wait for the connection to be established. */
+	  if (!(events & SMTP_IO_WRITE) && now < session->deadline)
+	    return Step_WANT_IO;
+	  len = sizeof err;
+	  if (!(events & SMTP_IO_WRITE))
+	    err = ETIMEDOUT;
+	  else if (getsockopt (session->sd, SOL_SOCKET, SO_ERROR,
+			       &err, &len) < 0)
+	    err = errno;
+	  if (err != 0)
 	    {
-	      set_error (SMTP_ERR_DROPPED_CONNECTION);
-	      break;
+	      set_errno (err);
+	      close (session->sd);
+	      session->sd = -1;
+	      if (!connect_next (session))
+		break;
+	      return Step_WANT_IO;
 	    }
+	  session->connect_time = now - session->connect_start;
+	  session->conn = start_protocol (session, session->sd);
+	  if (session->conn == NULL)
+	    break;
+	  sio_set_nonblocking (session->conn, 1);
+	  session->deadline = -1;
+#ifdef USE_TLS
+	  if (session->starttls_enabled == Starttls_IMPLICIT
+	      && !start_implicit_tls (session->conn, session))
+	    break;
+#endif
 	}
 
-      sio_detach (conn);
-      close (sd);
+      if (run_protocol (session->conn, session))
+	{
+	  if (sio_get_timeout (session->conn) >= 0)
+	    session->deadline = now + sio_get_timeout (session->conn);
+	  else
+	    session->deadline = -1;
+	}
+      else if (session->deadline >= 0 && now >= session->deadline)
+	{
+	  set_error (SMTP_ERR_DROPPED_CONNECTION);
+	  session->rsp_state = -1;
+	}
 
-      if (session->event_cb != NULL)
-	(*session->event_cb) (session, SMTP_EV_DISCONNECT,
-	                      session->event_cb_arg);
+      if (session->rsp_state >= 0)
+	{
+	  session->events = sio_events (session->conn);
+	  if (session->nresp > 0)
+	    session->events |= SMTP_IO_READ;
+	  return Step_WANT_IO;
+	}
 
-      /* This flag will be set if the server was reached OK but was the
-         wrong kind of server or the client is told to go away.  So if
-         not set the protocol must have concluded sucessfully. */
+      end_protocol (session, session->conn, session->sd);
+      session->conn = NULL;
+      session->sd = -1;
+
+      /* See do_session() */
+      if ((session->mail_limited && session->current_message != NULL)
+	  || session->pipeconnect_retry)
+	{
+	  session->addr_next = 0;
+	  session->connect_start = now;
+	  if (!connect_next (session))
+	    break;
+	  session->events = SMTP_IO_WRITE;
+	  return Step_WANT_IO;
+	}
       if (!session->try_fallback_server)
 	{
-	  freeaddrinfo (res);
-	  return 1;
-        }
+	  abort_session (session);
+	  return Step_DONE;
+	}
+      if (!connect_next (session))
+	break;
+      session->events = SMTP_IO_WRITE;
+      return Step_WANT_IO;
     }
 
-  /* If the loop terminated, couldn't work with any servers. */
-  freeaddrinfo (res);
-  return 0;
+  abort_session (session);
+  return Step_FAILED;
+}
+
+/* The descriptor the application waits for, the resolver's while the
+   MTA's addresses are being looked up, otherwise the socket.  */
+int
+session_fd (smtp_session_t session)
+{
+  if (session->resolve_job != NULL)
+    return resolver_job_fd (session->resolve_job);
+  return session->sd;
+}
+
+int
+session_timeout (smtp_session_t session)
+{
+  long long remaining;
+
+  if (session->deadline < 0)
+    return -1;
+  remaining = session->deadline - monotonic_ms ();
+  return remaining > 0 ? (int) remaining : 0;
 }
 
 /*****************************************************************************
  * Response parser.
  *****************************************************************************/
 
+/* Parse a decimal number without reading past END.  */
+static char *
+parse_number (char *p, const char *end, int *value)
+{
+  int n;
+
+  for (n = 0; p < end && *p >= '0' && *p <= '9'; p++)
+    if (n < 100000000)
+      n = n * 10 + *p - '0';
+  *value = n;
+  return p;
+}
+
 static int
-parse_status_triplet (char *p, char **ep, struct smtp_status *triplet)
+parse_status_triplet (char *p, const char *end, char **ep,
+		      struct smtp_status *triplet)
 {
-  triplet->enh_class = strtol (p, &p, 10);
-  if (*p++ != '.')
+  while (p < end && *p == ' ')
+    p++;
+  p = parse_number (p, end, &triplet->enh_class);
+  if (p >= end || *p++ != '.')
     return 0;
-  triplet->enh_subject = strtol (p, &p, 10);
-  if (*p++ != '.')
+  p = parse_number (p, end, &triplet->enh_subject);
+  if (p >= end || *p++ != '.')
     return 0;
-  triplet->enh_detail = strtol (p, &p, 10);
+  p = parse_number (p, end, &triplet->enh_detail);
   *ep = p;
   return 1;
 }
@@ -425,13 +1504,27 @@ compare_status_triplet (struct smtp_status *a, struct smtp_status *b)
 /* Free memory allocated in read_smtp_response()
    and clear the status structure */
 void
-reset_status (struct smtp_status *status)
+reset_status (smtp_session_t session, struct smtp_status *status)
 {
   if (status->text != NULL)
-    free ((void *) status->text);
+    session_free (session, (void *) status->text);
   memset (status, 0, sizeof (struct smtp_status));
 }
 
+/* As reset_status() for a recipient.  A streamed recipient's status text
+   is always allocated with malloc(), see rsp_rcpt().  */
+void
+reset_recipient_status (smtp_recipient_t recipient)
+{
+  if (recipient->streamed)
+    {
+      free ((void *) recipient->status.text);
+      memset (&recipient->status, 0, sizeof (struct smtp_status));
+    }
+  else
+    reset_status (recipient->message->session, &recipient->status);
+}
+
 /* All SMTP responses have standard syntax.  This function could be
    called by the protocol engine above and the results from the parsed
    response passed to the response handler functions.  However certain
@@ -441,31 +1534,35 @@ reset_status (struct smtp_status *status)
 int
 read_smtp_response (siobuf_t conn, smtp_session_t session,
                     struct smtp_status *status,
-                    int (*cb) (smtp_session_t, char *))
+                    int (*cb) (smtp_session_t, char *, int))
 {
   struct catbuf text;
-  char buf[1024];
-  char *p, *nul;
-  int code, more, want_enhanced, textlen, quit_now;
+  char *line, *end, *p, *s;
+  int len, code, more, want_enhanced, textlen, quit_now;
   struct smtp_status triplet;
 
-  /* First line of an SMTP response is the normal one.  Put it in a buffer.
-     Save the status code and the enhanced status triplet if ENHSTATUSCODES
-     is set.  The remainder of the line is the message from the server.
-     If there are any continuation lines, get the status code and enhanced
-     status triplet and check that they are the same as the first response
+  /* First line of an SMTP response is the normal one.  Save the status
+     code and the enhanced status triplet if ENHSTATUSCODES is set.  The
+     remainder of the line is the message from the server.  If there are
+     any continuation lines, get the status code and enhanced status
+     triplet and check that they are the same as the first response
      line.  If not there is a protocol error.  Process the extra lines
      by calling a callback.  If not supplied, concatenate the lines
-     (excluding the status info) with the first line. */
+     (excluding the status info) with the first line.
+
+     Lines are parsed in place in the connection's read buffer.  With
+     pipelining there is a response per recipient so this avoids copying
+     each one before it is looked at.  */
 
-  reset_status (status);
-  if ((p = sio_gets (conn, buf, sizeof buf)) == NULL)
+  reset_status (session, status);
+  if ((line = sio_getline (conn, &len)) == NULL)
     {
       set_error (SMTP_ERR_DROPPED_CONNECTION);
       return -1;
     }
-  status->code = strtol (p, &p, 10);
-  if (!(*p == ' ' || *p == '-'))
+  end = line + len;
+  p = parse_number (line, end, &status->code);
+  if (p >= end || !(*p == ' ' || *p == '-'))
     {
       set_error (SMTP_ERR_INVALID_RESPONSE_SYNTAX);
       return -1;
@@ -479,7 +1576,7 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
   if (code != 2 && code != 4 && code != 5)
     want_enhanced = 0;
 
-  if (want_enhanced && !parse_status_triplet (p, &p, status))
+  if (want_enhanced && !parse_status_triplet (p, end, &p, status))
     {
       quit_now = 0;	/* Be tolerant by default */
       if (session->event_cb != NULL)
@@ -492,30 +1589,43 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
 	}
       want_enhanced = 0;
     }
-  while (isspace (*p))
+  while (p < end && isspace (*p))
     p++;
 
   /* p points to the remainder of the line.  This is the text of the
-     server message */
+     server message.  The usual single line response is copied once.  */
+  if (!more)
+    {
+      if ((s = session_strndup (session, p, end - p)) == NULL)
+	{
+	  set_errno (ENOMEM);
+	  return -1;
+	}
+      status->text = s;
+      sio_release (conn);
+      return status->code / 100;
+    }
+
   cat_init (&text, 128);
-  concatenate (&text, p, -1);
+  concatenate (&text, p, end - p);
 
   while (more)
     {
-      if ((p = sio_gets (conn, buf, sizeof buf)) == NULL)
+      if ((line = sio_getline (conn, &len)) == NULL)
 	{
 	  cat_free (&text);
 	  set_error (SMTP_ERR_DROPPED_CONNECTION);
 	  return -1;
 	}
-      code = strtol (p, &p, 10);
+      end = line + len;
+      p = parse_number (line, end, &code);
       if (code != status->code)
 	{
 	  cat_free (&text);
 	  set_error (SMTP_ERR_STATUS_MISMATCH);
 	  return -1;
 	}
-      if (!(*p == ' ' || *p == '-'))
+      if (p >= end || !(*p == ' ' || *p == '-'))
 	{
 	  cat_free (&text);
 	  set_error (SMTP_ERR_INVALID_RESPONSE_SYNTAX);
@@ -524,7 +1634,7 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
       more = *p++ == '-';
       if (want_enhanced)
 	{
-	  if (!parse_status_triplet (p, &p, &triplet))
+	  if (!parse_status_triplet (p, end, &p, &triplet))
 	    {
 	      cat_free (&text);
 	      set_error (SMTP_ERR_INVALID_RESPONSE_SYNTAX);
@@ -539,12 +1649,11 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
 	}
 
       /* Skip whitespace but don't wander over the CRLF */
-      while (isspace (*p) && isprint (*p))
+      while (p < end && isspace (*p) && isprint (*p))
 	p++;
 
       /* Check that the line is correctly terminated. */
-      nul = strchr (p, '\0');
-      if (nul == NULL || nul == p || nul[-1] != '\n')
+      if (p == end || end[-1] != '\n')
         {
 	  cat_free (&text);
 	  set_error (SMTP_ERR_UNTERMINATED_RESPONSE);
@@ -552,11 +1661,18 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
         }
 
       /* `p' points to the remainder of the line.  Either process with the
-         callback or concatenate with the first line. */
+         callback or concatenate with the first line.  The callback is
+         passed the line without its CRLF, NUL terminated in place.  */
       if (cb != NULL)
-        (*cb) (session, p);
+	{
+	  len = end - p - 1;
+	  if (len > 0 && p[len - 1] == '\r')
+	    len--;
+	  p[len] = '\0';
+	  (*cb) (session, p, len);
+	}
       else
-	concatenate (&text, p, nul - p);
+	concatenate (&text, p, end - p);
 
       /* Check if the total text returned in a multiline response
          exceeds 4k.  Abort if this happens, this might be a DoS attack
@@ -570,10 +1686,20 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
 	  return -1;
         }
     }
+  sio_release (conn);
 
   /* Terminate and save the response text */
-  concatenate (&text, "", 1);
-  status->text = cat_shrink (&text, NULL);
+  if (session->arena != NULL)
+    {
+      s = cat_buffer (&text, &textlen);
+      status->text = arena_strndup (session->arena, s, textlen);
+      cat_free (&text);
+    }
+  else
+    {
+      concatenate (&text, "", 1);
+      status->text = cat_shrink (&text, NULL);
+    }
 
   return status->code / 100;
 }
@@ -589,13 +1715,14 @@ read_smtp_response (siobuf_t conn, smtp_session_t session,
  *****************************************************************************/
 
 /* If the response to the server greeting is not a 2xx status code,
-   issue the QUIT command and terminate the session.  */
+   issue the QUIT command and terminate the session.  With PIPECONNECT,
+   EHLO is sent without waiting for the greeting.  */
 void
 cmd_greeting (siobuf_t conn, smtp_session_t session)
 {
   /* Set a five minute timeout. */
   sio_set_timeout (conn, session->greeting_timeout);
-  session->cmd_state = -1;
+  session->cmd_state = session->pipeconnect ? S_ehlo : -1;
 }
 
 void
@@ -606,6 +1733,16 @@ rsp_greeting (siobuf_t conn, smtp_session_t session)
   code = read_smtp_response (conn, session, &session->mta_status, NULL);
   if (code == 2 && session->mta_status.code == 220)
     session->rsp_state = S_ehlo;
+  else if (session->pipeconnect)
+    {
+      /* The server may be refusing the commands sent ahead of the
+         greeting.  Drop the connection and try again without early
+         pipelining.  See rsp_ehlo().  */
+      capability_cache_remove (session);
+      session->pipeconnect_failed = 1;
+      session->pipeconnect_retry = 1;
+      session->rsp_state = -1;
+    }
   else if (code == 4 || code == 5)
     {
       session->rsp_state = S_quit;	/* Graceful exit using QUIT */
@@ -630,6 +1767,33 @@ rsp_greeting (siobuf_t conn, smtp_session_t session)
  * EHLO 
  *****************************************************************************/
 
+/* Choose the command following an EHLO sent ahead of the greeting.  This
+   makes the same choices as rsp_ehlo() for an unchanged response, except
+   that it waits for the response whenever rsp_ehlo() might report a
+   missing extension.  */
+static int
+pipeconnect_next_state (smtp_session_t session)
+{
+#ifdef USE_TLS
+  if (!session->using_tls && session->starttls_enabled != Starttls_DISABLED)
+    {
+      if (select_starttls (session))
+	return S_starttls;
+      if (session->starttls_enabled == Starttls_REQUIRED)
+	return -1;
+    }
+#endif
+  if ((session->extensions & EXT_AUTH) && select_auth_mechanism (session))
+    return S_auth;
+  if (session->required_extensions & ~session->extensions & ~EXT_STARTTLS)
+    return -1;
+#ifdef USE_ETRN
+  if (check_etrn (session))
+    return -1;
+#endif
+  return initial_transaction_state (session);
+}
+
 /* EHLO is the preferred client greeting to the server.  The parameter is
    the FQDN of the client host.  The server response is the greeting line
    followed by extra lines listing the server capabilities.  The additional
@@ -639,12 +1803,19 @@ rsp_greeting (siobuf_t conn, smtp_session_t session)
    must be flushed.
 
    Next state is one of Auth, Helo, Mail.
+
+   With PIPECONNECT, the capabilities cached from an earlier connection
+   select the next command without waiting for the response.
  */
 void
 cmd_ehlo (siobuf_t conn, smtp_session_t session)
 {
   sio_printf (conn, "EHLO %s\r\n", session->localhost);
-  session->cmd_state = -1;
+  if (session->pipeconnect)
+    session->cmd_state = session->pipeconnect_state
+		       = pipeconnect_next_state (session);
+  else
+    session->cmd_state = -1;
 }
 
 #define no_required_extension(s,e)	\
@@ -706,67 +1877,106 @@ report_extensions (smtp_session_t session)
   return !exts;
 }
 
+/* Parse the RFC 9422 LIMITS keyword's parameters.  Unknown limits are
+   ignored.  */
+static void
+parse_limits (smtp_session_t session, const char *p)
+{
+  char token[64], *value;
+  long limit;
+
+  while (read_atom (skipblank (p), &p, token, sizeof token))
+    {
+      if ((value = strchr (token, '=')) == NULL)
+	continue;
+      *value++ = '\0';
+      limit = strtol (value, NULL, 10);
+      if (limit <= 0 || limit > INT_MAX)
+	continue;
+      if (strcasecmp (token, "RCPTMAX") == 0)
+	session->rcpt_max = limit;
+      else if (strcasecmp (token, "MAILMAX") == 0)
+	session->mail_max = limit;
+      else if (strcasecmp (token, "RCPTDOMAINMAX") == 0)
+	session->rcptdomain_max = limit;
+    }
+}
+
+static void
+parse_size (smtp_session_t session, const char *p)
+{
+  session->size_limit = strtol (p, NULL, 10);
+}
+
+static void
+parse_deliverby (smtp_session_t session, const char *p)
+{
+  session->min_by_time = strtol (p, NULL, 10);
+}
+
+/* Extensions recognised in the EHLO response, indexed by the keyword
+   constants generated from keywords.in, with the session flag for each
+   and the parser for its parameters.
+
+   Since the session structure mostly just carries a bit for each of
+   the extensions, there is no point #ifdefing out the extension
+   keywords for omitted features.  */
+static const struct ehlo_extension
+  {
+    unsigned long flag;
+    void (*parse) (smtp_session_t session, const char *params);
+  }
+ehlo_extensions[EHLO_NKEYWORDS] =
+  {
+    [EHLO_ENHANCEDSTATUSCODES] =
+			{ EXT_ENHANCEDSTATUSCODES, NULL }, /* RFC 3463, RFC 2034 */
+    [EHLO_PIPELINING] =	{ EXT_PIPELINING, NULL },	/* RFC 2920 */
+    [EHLO_DSN] =	{ EXT_DSN, NULL },		/* RFC 3461 */
+    [EHLO_AUTH] =	{ EXT_AUTH, set_auth_mechanisms }, /* RFC 4954 */
+    [EHLO_STARTTLS] =	{ EXT_STARTTLS, NULL },		/* RFC 3207 */
+    [EHLO_SIZE] =	{ EXT_SIZE, parse_size },	/* RFC 1870 */
+    [EHLO_CHUNKING] =	{ EXT_CHUNKING, NULL },		/* RFC 3030 */
+    [EHLO_BINARYMIME] =	{ EXT_BINARYMIME, NULL },	/* RFC 3030 */
+    [EHLO_8BITMIME] =	{ EXT_8BITMIME, NULL },		/* RFC 6152 */
+    [EHLO_DELIVERBY] =	{ EXT_DELIVERBY, parse_deliverby }, /* RFC 2852 */
+    [EHLO_ETRN] =	{ EXT_ETRN, NULL },		/* RFC 1985 */
+    [EHLO_XUSR] =	{ EXT_XUSR, NULL },	/* sendmail (I feel ill) */
+    [EHLO_XEXCH50] =	{ EXT_XEXCH50, NULL },	/* exchange (I feel worse) */
+    [EHLO_LIMITS] =	{ EXT_LIMITS, parse_limits },	/* RFC 9422 */
+    [EHLO_PIPECONNECT] = { EXT_PIPECONNECT, NULL },	/* Exim */
+  };
+
+/* The keyword is looked up in place in the response line.  Extensions
+   may be added in the future so it is not an error to have an
+   unrecognised extension keyword, it costs a hash and nothing more.  */
 static int
-cb_ehlo (smtp_session_t session, char *buf)
+cb_ehlo (smtp_session_t session, char *buf, int len __attribute__ ((unused)))
 {
-  const char *p;
-  char token[32];
+  const struct ehlo_extension *ext;
+  const char *name, *p;
+  int keyword;
 
-  if (!read_atom (skipblank (buf), &p, token, sizeof token))
+  name = skipblank (buf);
+  if ((p = skipatom (name)) == name)
     {
       /* expecting an atom - do nothing */
       return 0;
     }
 
-  /* Since the session structure mostly just carries a bit for each of
-     the extensions, there is no point #ifdefing out the extension
-     keywords for omitted features.  Also extensions may be added
-     in the future so it is not an error to have an unrecognised
-     extension keyword. */
-
-  if (strcasecmp (token, "ENHANCEDSTATUSCODES") == 0)	/* RFC 3463, RFC 2034 */
-    session->extensions |= EXT_ENHANCEDSTATUSCODES;
-  else if (strcasecmp (token, "PIPELINING") == 0)	/* RFC 2920 */
-    session->extensions |= EXT_PIPELINING;
-  else if (strcasecmp (token, "DSN") == 0)		/* RFC 3461 */
-    session->extensions |= EXT_DSN;
-  else if (strcasecmp (token, "AUTH") == 0)		/* RFC 4954 */
+  if ((keyword = ehlo_keyword (name, p - name)) >= 0)
     {
-      session->extensions |= EXT_AUTH;
-      set_auth_mechanisms (session, p);
+      ext = &ehlo_extensions[keyword];
+      session->extensions |= ext->flag;
+      if (ext->parse != NULL)
+	(*ext->parse) (session, p);
     }
 #ifdef AUTH_ID_HACK
-  else if (strncasecmp (token, "AUTH=", 5) == 0) /* non-standard syntax */
+  else if (strncasecmp (name, "AUTH=", 5) == 0) /* non-standard syntax */
     {
       session->extensions |= EXT_AUTH;
-      set_auth_mechanisms (session, token + 5);
-      set_auth_mechanisms (session, p);
+      set_auth_mechanisms (session, name + 5);
     }
 #endif
-  else if (strcasecmp (token, "STARTTLS") == 0)		/* RFC 3207 */
-    session->extensions |= EXT_STARTTLS;
-  else if (strcasecmp (token, "SIZE") == 0)		/* RFC 1870 */
-    {
-      session->extensions |= EXT_SIZE;
-      session->size_limit = strtol (p, NULL, 10);
-    }
-  else if (strcasecmp (token, "CHUNKING") == 0)		/* RFC 3030 */
-    session->extensions |= EXT_CHUNKING;
-  else if (strcasecmp (token, "BINARYMIME") == 0)	/* RFC 3030 */
-    session->extensions |= EXT_BINARYMIME;
-  else if (strcasecmp (token, "8BITMIME") == 0)		/* RFC 6152 */
-    session->extensions |= EXT_8BITMIME;
-  else if (strcasecmp (token, "DELIVERBY") == 0)	/* RFC 2852 */
-    {
-      session->extensions |= EXT_DELIVERBY;
-      session->min_by_time = strtol (p, NULL, 10);
-    }
-  else if (strcasecmp (token, "ETRN") == 0)		/* RFC 1985 */
-    session->extensions |= EXT_ETRN;
-  else if (strcasecmp (token, "XUSR") == 0)	/* sendmail (I feel ill) */
-    session->extensions |= EXT_XUSR;
-  else if (strcasecmp (token, "XEXCH50") == 0)	/* exchange (I feel worse) */
-    session->extensions |= EXT_XEXCH50;
   return 1;
 }
 
@@ -774,11 +1984,45 @@ cb_ehlo (smtp_session_t session, char *buf)
 void
 rsp_ehlo (siobuf_t conn, smtp_session_t session)
 {
-  int code;
+  int code, early;
 
   session->extensions = 0;
+  session->rcpt_max = session->mail_max = session->rcptdomain_max = 0;
   destroy_auth_mechanisms (session);
   code = read_smtp_response (conn, session, &session->mta_status, cb_ehlo);
+
+  /* Remember the capabilities of servers offering PIPECONNECT.  The
+     response to EHLO after STARTTLS is not cached since the next
+     connection's EHLO will be sent before the TLS handshake.
+
+     If the server refused EHLO sent ahead of the greeting, or a command
+     was sent ahead of this response and the server's capabilities have
+     changed, the server and client may disagree on what has happened.
+     Drop the connection and start over without early pipelining.  */
+  early = session->pipeconnect_state;
+  session->pipeconnect_state = -1;
+  if (session->pipeconnect)
+    {
+      session->pipeconnect = 0;
+      if (code != 2)
+	capability_cache_remove (session);
+      if (code != 2 || (capability_cache_put (session) && early >= 0))
+	{
+	  session->pipeconnect_failed = 1;
+	  session->pipeconnect_retry = 1;
+	  session->rsp_state = -1;
+	  return;
+	}
+    }
+#ifdef USE_TLS
+  else if (code == 2 && !session->authenticated
+	   && (!session->using_tls
+	       || session->starttls_enabled == Starttls_IMPLICIT))
+#else
+  else if (code == 2 && !session->authenticated)
+#endif
+    capability_cache_put (session);
+
   if (code < 0)
     {
       session->rsp_state = S_quit;
@@ -818,6 +2062,11 @@ rsp_ehlo (siobuf_t conn, smtp_session_t session)
     }
 
 #ifdef USE_TLS
+  /* Session tickets sent after the TLS handshake have been read along with
+     the response, the TLS session may now be cached for resumption.  */
+  if (session->using_tls)
+    tls_session_cache_put (session, sio_get_ssl (conn));
+
   /* Totally ignore the TLS stuff if it's already in use */
   if (!session->using_tls && session->starttls_enabled != Starttls_DISABLED)
     {
@@ -840,7 +2089,9 @@ rsp_ehlo (siobuf_t conn, smtp_session_t session)
   /* If AUTH is enabled but no mechanisms can be selected, move on to the
      MAIL command since the MTA is required to accept mail for its own
      domain. */
-  if ((session->extensions & EXT_AUTH) && select_auth_mechanism (session))
+  if ((session->extensions & EXT_AUTH)
+      && (early == S_auth ? resume_auth_mechanism (session)
+			  : select_auth_mechanism (session)))
     {
       session->rsp_state = S_auth;
       return;
@@ -869,6 +2120,13 @@ rsp_ehlo (siobuf_t conn, smtp_session_t session)
 int
 initial_transaction_state (smtp_session_t session)
 {
+  /* No more transactions are permitted on this connection, the session
+     continues on a new one.  */
+  if (mail_limit_reached (session))
+    {
+      session->mail_limited = 1;
+      return S_quit;
+    }
 #ifdef USE_XUSR
   if (session->extensions & EXT_XUSR)
     return S_xusr;
@@ -903,6 +2161,7 @@ rsp_helo (siobuf_t conn, smtp_session_t session)
 #endif
 
   session->extensions = 0;
+  session->rcpt_max = session->mail_max = session->rcptdomain_max = 0;
   destroy_auth_mechanisms (session);
   code = read_smtp_response (conn, session, &session->mta_status, NULL);
   if (code < 0)
@@ -966,10 +2225,19 @@ cmd_mail (siobuf_t conn, smtp_session_t session)
   char xtext[256];
 
   /* Set a five minute timeout.  This stays in force until the DATA
-     command. */
-  sio_set_timeout (conn, session->envelope_timeout);
-
-  message = session->current_message;
+     command.  When MAIL is pipelined behind the previous message, the
+     response to the data is still awaited, the envelope timeout is set
+     once it has been read. */
+  if (session->cmd_message != NULL)
+    {
+      message = session->cmd_message;
+      session->cmd_message = NULL;
+    }
+  else
+    {
+      sio_set_timeout (conn, session->envelope_timeout);
+      message = session->current_message;
+    }
   mailbox = message->reverse_path_mailbox;
   sio_printf (conn, "MAIL FROM:<%s>", (mailbox != NULL) ? mailbox : "");
 
@@ -1035,6 +2303,8 @@ cmd_mail (siobuf_t conn, smtp_session_t session)
     }
 
   sio_write (conn, "\r\n", 2);
+  session->mail_count += 1;
+  session->rcpt_count = 0;
   /* TODO: until code to prevent issuing of further RCPT commands and to
            discard RCPT responses cascading from an error response to
            MAIL is in place, flush the mail command even when pipelining. */
@@ -1083,6 +2353,44 @@ rsp_mail (siobuf_t conn, smtp_session_t session)
  * RCPT TO:
  *****************************************************************************/
 
+static const char *
+mailbox_domain (const char *mailbox)
+{
+  const char *domain;
+
+  domain = strrchr (mailbox, '@');
+  return domain != NULL ? domain + 1 : "";
+}
+
+/* Check if no earlier recipient in the current transaction has the same
+   domain as this one.  The domains are kept in the session since
+   streamed recipients are discarded once their status is known.  */
+static int
+new_rcpt_domain (smtp_session_t session, smtp_recipient_t recipient)
+{
+  const char *domain, *p, *end;
+  int len;
+
+  domain = mailbox_domain (recipient->mailbox);
+  p = cat_buffer (&session->rcpt_domain_list, &len);
+  for (end = p + len; p < end; p += strlen (p) + 1)
+    if (strcasecmp (p, domain) == 0)
+      return 0;
+  return 1;
+}
+
+/* Check if the recipient would exceed the server's RCPTMAX or
+   RCPTDOMAINMAX for the current transaction (RFC 9422).  */
+static int
+rcpt_limit_reached (smtp_session_t session, smtp_recipient_t recipient)
+{
+  if (session->rcpt_max > 0 && session->rcpt_count >= session->rcpt_max)
+    return 1;
+  return session->rcptdomain_max > 0
+	 && session->rcpt_domains >= session->rcptdomain_max
+	 && new_rcpt_domain (session, recipient);
+}
+
 /* Specify one message recipient.  This is taken from the recipient
    parameters.  Many parameters are possible depending on the extensions
    enabled.  For errors such as unknown recipient, or cannot relay,
@@ -1104,10 +2412,22 @@ cmd_rcpt (siobuf_t conn, smtp_session_t session)
     };
   smtp_recipient_t recipient;
   enum notify_flags notify;
+  const char *domain;
   char xtext[256];
   int i;
 
   recipient = session->cmd_recipient;
+  if (session->rcpt_count++ == 0)
+    {
+      cat_reset (&session->rcpt_domain_list, 0);
+      session->rcpt_domains = 0;
+    }
+  if (session->rcptdomain_max > 0 && new_rcpt_domain (session, recipient))
+    {
+      session->rcpt_domains += 1;
+      domain = mailbox_domain (recipient->mailbox);
+      concatenate (&session->rcpt_domain_list, domain, strlen (domain) + 1);
+    }
   sio_printf (conn, "RCPT TO:<%s>", recipient->mailbox);
 
   if (session->extensions & EXT_DSN)
@@ -1131,15 +2451,34 @@ cmd_rcpt (siobuf_t conn, smtp_session_t session)
 	}
 
       /* DSN: ORCPT=type;address */
-      if (recipient->dsn_orcpt != NULL)
-	sio_printf (conn, " ORCPT=%s;%s", recipient->dsn_addrtype,
-		    encode_xtext (xtext, sizeof xtext, recipient->dsn_orcpt));
+      if (recipient->extra != NULL && recipient->extra->dsn_orcpt != NULL)
+	sio_printf (conn, " ORCPT=%s;%s", recipient->extra->dsn_addrtype,
+		    encode_xtext (xtext, sizeof xtext,
+				  recipient->extra->dsn_orcpt));
     }
   sio_write (conn, "\r\n", 2);
 
-  session->cmd_recipient = next_recipient (session->cmd_recipient);
+  /* Leave recipients beyond the server's limits for another
+     transaction.  */
+  if ((session->cmd_recipient = next_recipient (recipient)) == NULL)
+    session->cmd_recipient = pull_recipient (recipient->message);
+  if (session->cmd_recipient != NULL
+      && rcpt_limit_reached (session, session->cmd_recipient))
+    {
+      session->rcpt_end = session->cmd_recipient;
+      session->cmd_recipient = NULL;
+    }
   if (session->cmd_recipient != NULL)
-    session->cmd_state = S_rcpt;
+    {
+      /* Streamed recipients are held until their responses are read.
+	 Wait for these periodically so that they do not accumulate
+	 while the server lags behind.  */
+      if (session->cmd_recipient->streamed
+	  && session->rcpt_count % RCPT_WINDOW == 0)
+	session->cmd_state = -1;
+      else
+	session->cmd_state = S_rcpt;
+    }
   else if (session->require_all_recipients)
     /* can't pipeline the DATA command when require_all_recpients is set. */
     session->cmd_state = -1;
@@ -1154,10 +2493,29 @@ cmd_rcpt (siobuf_t conn, smtp_session_t session)
 void
 rsp_rcpt (siobuf_t conn, smtp_session_t session)
 {
+  smtp_recipient_t recipient;
+  char *text;
   int code;
 
-  code = read_smtp_response (conn, session,
-  			     &session->rsp_recipient->status, NULL);
+  recipient = session->rsp_recipient;
+  reset_recipient_status (recipient);
+  code = read_smtp_response (conn, session, &recipient->status, NULL);
+
+  /* A streamed recipient is freed as soon as its status is reported but
+     an arena only reclaims its most recent allocation.  The status text
+     just read is that allocation, so move it out of the arena.  */
+  if (recipient->streamed && session->arena != NULL
+      && recipient->status.text != NULL)
+    {
+      text = strdup (recipient->status.text);
+      arena_free (session->arena, (void *) recipient->status.text);
+      recipient->status.text = text;
+      if (text == NULL)
+	{
+	  set_errno (ENOMEM);
+	  code = -1;
+	}
+    }
   if (code < 0)
     {
       session->rsp_state = S_quit;
@@ -1166,6 +2524,14 @@ rsp_rcpt (siobuf_t conn, smtp_session_t session)
 
   if (code == 2)
     session->current_message->valid_recipients += 1;
+  else if (session->rsp_recipient->status.code == 452
+	   && session->current_message->valid_recipients > 0)
+    {
+      /* RFC 5321 section 4.5.3.1.10 - too many recipients.  This and any
+	 following recipients are sent in another transaction.  */
+      if (session->rcpt_deferred == NULL)
+	session->rcpt_deferred = session->rsp_recipient;
+    }
   else
     session->current_message->failed_recipients += 1;
 
@@ -1180,13 +2546,22 @@ rsp_rcpt (siobuf_t conn, smtp_session_t session)
   			  session->rsp_recipient->mailbox,
   			  session->rsp_recipient);
 
-  session->rsp_recipient = next_recipient (session->rsp_recipient);
-  if (session->rsp_recipient != NULL)
+  recipient = session->rsp_recipient;
+  session->rsp_recipient = next_recipient (recipient);
+
+  /* Once reported, a streamed recipient is no longer needed unless it
+     is to be sent again in another transaction.  */
+  if (recipient->streamed && session->rcpt_deferred == NULL)
+    drop_recipient (recipient);
+
+  if (session->rsp_recipient != NULL
+      && session->rsp_recipient != session->rcpt_end)
     session->rsp_state = S_rcpt;
   else if (session->require_all_recipients
            && session->current_message->failed_recipients > 0)
     {
-      reset_status (&session->current_message->message_status);
+      session->rcpt_end = session->rcpt_deferred = NULL;
+      reset_status (session, &session->current_message->message_status);
       session->rsp_state = next_message (session) ? S_rset : S_quit;
     }
   else
@@ -1259,7 +2634,15 @@ void
 cmd_data2 (siobuf_t conn, smtp_session_t session)
 {
   const char *line, *header, *pline, *p;
-  int c, len;
+  int c, len, stuff;
+
+  /* In non-blocking mode, the transfer is suspended when the output
+     queue is full (see below).  Resume with the message body. */
+  if (session->cmd_partial)
+    {
+      session->cmd_partial = 0;
+      goto body;
+    }
 
   /* RFC 2920 - some servers may return a 354 response to DATA even
      if there are no valid recipients.  If this happens just send a
@@ -1268,11 +2651,12 @@ cmd_data2 (siobuf_t conn, smtp_session_t session)
   if (session->current_message->valid_recipients == 0)
     {
       sio_write (conn, ".\r\n", 3);
-      session->cmd_state = -1;
+      session->cmd_state = pipeline_next_message (session, S_mail);
       return;
     }
 
   sio_set_timeout (conn, session->transfer_timeout);
+  set_data_buffering (conn, session, 1);
 
   /* Arrange to read the current message from the application. */
   msg_source_set_cb (session->msg_source,
@@ -1409,10 +2793,13 @@ break_2:
   /* ... and finally terminate the message headers */
   sio_write (conn, "\r\n", 2);
 
-  /* Read message body lines from the application and write them
-     to the remote MTA using dot stuffing. */
+  /* Read the message body from the application and write it to the
+     remote MTA using dot stuffing.  The body is copied in spans between
+     lines starting with a dot rather than line by line. */
+body:
   errno = 0;
-  while ((line = msg_gets (session->msg_source, &len, 0)) != NULL)
+  while ((line = msg_getb_stuffed (session->msg_source, &len,
+				   SIO_HIGHWATER, &stuff)) != NULL)
     {
       /* Notify byte count to the application. */
       if (session->event_cb != NULL)
@@ -1420,10 +2807,20 @@ break_2:
 	                      session->event_cb_arg,
 	                      session->current_message, len);
 
-      if (line[0] == '.')
+      if (stuff)
 	sio_write (conn, ".", 1);
       sio_write (conn, line, len);
       errno = 0;
+
+      /* Output is only queued in non-blocking mode.  Suspend the
+         transfer when the queue is full, the protocol engine calls
+         this again when the socket is ready. */
+      if (sio_write_pending (conn) > SIO_HIGHWATER)
+	{
+	  session->cmd_partial = 1;
+	  session->cmd_state = S_data2;
+	  return;
+	}
     }
   if (errno != 0)
     {
@@ -1432,21 +2829,23 @@ break_2:
       return;
     }
 
-  /* Terminate the DATA command.  Explicitly flush the buffer here.
-     This would have happened in the protocol loop anyway but doing it
-     here makes the output of strace more intuitive. */
+  /* Terminate the DATA command.  Unless the next MAIL command follows,
+     explicitly flush the buffer here.  This would have happened in the
+     protocol loop anyway but doing it here makes the output of strace
+     more intuitive. */
   sio_write (conn, ".\r\n", 3);
-  sio_flush (conn);
+  session->cmd_state = pipeline_next_message (session, S_mail);
+  if (session->cmd_state == -1)
+    sio_flush (conn);
+  set_data_buffering (conn, session, 0);
 
   sio_set_timeout (conn, session->data2_timeout);
-  session->cmd_state = -1;
 }
 
 void
 rsp_data2 (siobuf_t conn, smtp_session_t session)
 {
   int code;
-  smtp_recipient_t recipient;
 
   /* Reinstate the protocol monitor. */
   if (session->monitor_cb != NULL)
@@ -1461,33 +2860,26 @@ rsp_data2 (siobuf_t conn, smtp_session_t session)
       return;
     }
 
-  if (code == 2)
-    {
-      /* Mark all the recipients complete for which the MTA has accepted
-         responsibility for delivery.  */
-      for (recipient = session->current_message->recipients;
-	   recipient != NULL;
-	   recipient = recipient->next)
-	if (!recipient->complete
-	    && recipient->status.code >= 200 && recipient->status.code <= 299)
-	  recipient->complete = 1;
-    }
-  else if (code == 5)
-    {
-      /* Mark all the recipients complete.  This message cannot be
-         accepted for any recipients.  */
-      for (recipient = session->current_message->recipients;
-	   recipient != NULL;
-	   recipient = recipient->next)
-	recipient->complete = 1;
-    }
-
+  /* Mark the recipients complete for which the MTA has accepted
+     responsibility for delivery or, if the message is refused, all
+     except those left for another transaction.  */
+  complete_recipients (session, code);
 
   if (session->event_cb != NULL)
     (*session->event_cb) (session, SMTP_EV_MESSAGESENT,
                           session->event_cb_arg, session->current_message);
 
-  if (next_message (session))
+  /* If the next MAIL command was pipelined, its response follows.  The
+     response to the data ends the transaction whatever its code, so RSET
+     is not needed.  */
+  if (session->mail_pipelined)
+    {
+      session->mail_pipelined = 0;
+      next_message (session);
+      sio_set_timeout (conn, session->envelope_timeout);
+      session->rsp_state = S_mail;
+    }
+  else if (next_message (session))
     session->rsp_state = (code == 2) ? initial_transaction_state (session)
                                      : S_rset;
   else
@@ -1502,7 +2894,15 @@ void
 cmd_rset (siobuf_t conn, smtp_session_t session)
 {
   sio_write (conn, "RSET\r\n", 6);
-  if (session->current_message != NULL)
+
+  /* Don't pipeline commands after RSET on a reused connection until the
+     server has been heard from.  */
+  if (session->reuse_probe)
+    {
+      sio_set_timeout (conn, session->envelope_timeout);
+      session->cmd_state = -1;
+    }
+  else if (session->current_message != NULL)
     session->cmd_state = initial_transaction_state (session);
   else
     session->cmd_state = S_quit;
@@ -1512,13 +2912,34 @@ void
 rsp_rset (siobuf_t conn, smtp_session_t session)
 {
   struct smtp_status status;
+  int code;
 
   /* The RSET command should always succeed, since this client never
      attempts to sent trailing whitespace or parameters to the command */
   memset (&status, 0, sizeof status);
-  read_smtp_response (conn, session, &status, NULL);
-  reset_status (&status);
-  if (session->current_message != NULL)
+  code = read_smtp_response (conn, session, &status, NULL);
+  reset_status (session, &status);
+
+  /* If a reused connection has been closed or the server is otherwise
+     unwilling to proceed, drop it.  The caller will try again with a
+     new connection.  */
+  if (session->reuse_probe)
+    {
+      if (code != 2)
+	{
+	  session->rsp_state = -1;
+	  return;
+	}
+      session->reuse_probe = 0;
+    }
+
+  /* The response to the MAIL command pipelined behind RSET follows.  */
+  if (session->mail_pipelined)
+    {
+      session->mail_pipelined = 0;
+      session->rsp_state = S_mail;
+    }
+  else if (session->current_message != NULL)
     session->rsp_state = initial_transaction_state (session);
   else
     session->rsp_state = S_quit;
@@ -1544,7 +2965,7 @@ rsp_quit (siobuf_t conn, smtp_session_t session)
    */
   memset (&status, 0, sizeof status);
   read_smtp_response (conn, session, &status, NULL);
-  reset_status (&status);
+  reset_status (session, &status);
   session->rsp_state = -1;
 }
 
@@ -1568,7 +2989,7 @@ rsp_xusr (siobuf_t conn, smtp_session_t session)
   /* The XUSR command should always succeed?  */
   memset (&status, 0, sizeof status);
   read_smtp_response (conn, session, &status, NULL);
-  reset_status (&status);
+  reset_status (session, &status);
   session->rsp_state = S_mail;
 }
 #endif
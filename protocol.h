@@ -37,6 +37,7 @@ enum states
 
 int read_smtp_response (siobuf_t conn, smtp_session_t session,
 			struct smtp_status *status,
-			int (*cb) (smtp_session_t, char *));
+			int (*cb) (smtp_session_t, char *, int));
+void set_data_buffering (siobuf_t conn, smtp_session_t session, int data);
 
 #endif
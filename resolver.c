@@ -0,0 +1,748 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#if HAVE_LWRES_NETDB_H
+# include <lwres/netdb.h>
+#else
+# include <netdb.h>
+#endif
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "htable.h"
+#include "resolver.h"
+#include "api.h"
+
+/**
+ * DOC: Resolver
+ *
+ * Resolver
+ * --------
+ *
+ * libESMTP resolves the host set with smtp_set_server() each time a session
+ * connects.  An application which submits many sessions to the same relay
+ * may enable a process wide cache of resolver results, shared by all
+ * sessions and threads, with smtp_resolver_set_ttl().  Both successful
+ * lookups and names which do not exist are cached.  Temporary failures are
+ * never cached.
+ *
+ * By default the lookup runs on the thread calling smtp_start_session().
+ * If %Timeout_RESOLVE is set with smtp_set_timeout() the lookup runs on a
+ * separate thread and the session fails with %SMTP_ERR_EAI_AGAIN if it
+ * does not complete in time.  The lookup continues in the background and
+ * its result is cached for subsequent sessions.
+ *
+ * A session started with smtp_session_begin() always looks up its server on
+ * a separate thread, unless the address is cached, so that the application's
+ * event loop is not held up.  %Timeout_RESOLVE applies in the same way.
+ *
+ * For testing, smtp_resolver_load_hosts() reads a file in the format of
+ * ``/etc/hosts``.  Names listed there are resolved from the file, bypassing
+ * the system resolver and the cache.
+ */
+
+struct cache_entry
+  {
+    struct addrinfo *res;		/* Private copy or NULL */
+    int error;				/* getaddrinfo() error code */
+    long long expires;			/* Monotonic time in ms */
+  };
+
+struct hosts_entry
+  {
+    struct hosts_entry *next;
+    char *name;				/* Host name or alias */
+    char *canon;			/* First name listed for address */
+    char *addr;				/* Numeric address */
+  };
+
+static struct h_node **cache;
+static long ttl_positive;
+static long ttl_negative;
+static struct hosts_entry *hosts;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+# define RESOLVER_LOCK()	pthread_mutex_lock (&resolver_lock)
+# define RESOLVER_UNLOCK()	pthread_mutex_unlock (&resolver_lock)
+#else
+# define RESOLVER_LOCK()	((void) 0)
+# define RESOLVER_UNLOCK()	((void) 0)
+#endif
+
+static long long
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+/* Free an address list returned by resolver_lookup().  These are private
+   copies so must not be passed to freeaddrinfo().  */
+void
+resolver_free (struct addrinfo *res)
+{
+  struct addrinfo *next;
+
+  for (; res != NULL; res = next)
+    {
+      next = res->ai_next;
+      free (res->ai_canonname);
+      free (res);
+    }
+}
+
+/* Make a private copy of an address list.  Each element is allocated with
+   its socket address in a single block.  */
+static struct addrinfo *
+copy_addrinfo (const struct addrinfo *src)
+{
+  struct addrinfo *head, **tail, *ai;
+
+  head = NULL;
+  tail = &head;
+  for (; src != NULL; src = src->ai_next)
+    {
+      if ((ai = malloc (sizeof (struct addrinfo) + src->ai_addrlen)) == NULL)
+	goto nomem;
+      *ai = *src;
+      ai->ai_next = NULL;
+      ai->ai_addr = (struct sockaddr *) (ai + 1);
+      memcpy (ai->ai_addr, src->ai_addr, src->ai_addrlen);
+      ai->ai_canonname = NULL;
+      *tail = ai;
+      tail = &ai->ai_next;
+      if (src->ai_canonname != NULL
+	  && (ai->ai_canonname = strdup (src->ai_canonname)) == NULL)
+	goto nomem;
+    }
+  return head;
+
+nomem:
+  resolver_free (head);
+  return NULL;
+}
+
+static char *
+cache_key (const char *host, const char *port)
+{
+  char *key;
+  size_t len;
+
+  len = strlen (host) + strlen (port) + 2;
+  if ((key = malloc (len)) != NULL)
+    snprintf (key, len, "%s/%s", host, port);
+  return key;
+}
+
+static void
+cache_entry_free (const char *name __attribute__ ((unused)), void *data,
+		  void *arg __attribute__ ((unused)))
+{
+  struct cache_entry *entry = data;
+
+  resolver_free (entry->res);
+}
+
+/* Record the result of a lookup.  Only positive results and definite
+   negative results are cached.  Called with the lock held.  */
+static void
+cache_store (const char *key, int error, const struct addrinfo *res)
+{
+  struct cache_entry *entry;
+  long ttl;
+
+  if (error == 0)
+    ttl = ttl_positive;
+  else if (error == EAI_NONAME
+#ifdef EAI_NODATA
+	   || error == EAI_NODATA
+#endif
+	   )
+    ttl = ttl_negative;
+  else
+    ttl = 0;
+  if (ttl <= 0)
+    return;
+
+  if (cache == NULL && (cache = h_create ()) == NULL)
+    return;
+  if ((entry = h_search (cache, key, -1)) != NULL)
+    {
+      resolver_free (entry->res);
+      h_remove (cache, entry);
+    }
+  if ((entry = h_insert (cache, key, -1, sizeof (struct cache_entry))) == NULL)
+    return;
+  entry->error = error;
+  entry->expires = now_ms () + ttl;
+  if (error == 0 && (entry->res = copy_addrinfo (res)) == NULL)
+    {
+      h_remove (cache, entry);
+      return;
+    }
+}
+
+/* Look up the key in the cache.  Returns zero if not cached, otherwise
+   sets *error to the cached error code and, if zero, *res to a copy of the
+   cached addresses.  Getaddrinfo() error codes may be negative so cannot
+   be distinguished from a sentinel value.  Called with the lock held.  */
+static int
+cache_search (const char *key, struct addrinfo **res, int *error)
+{
+  struct cache_entry *entry;
+
+  if (cache == NULL || (entry = h_search (cache, key, -1)) == NULL)
+    return 0;
+  if (now_ms () >= entry->expires)
+    {
+      resolver_free (entry->res);
+      h_remove (cache, entry);
+      return 0;
+    }
+  if (entry->error != 0)
+    *error = entry->error;
+  else if ((*res = copy_addrinfo (entry->res)) == NULL)
+    *error = EAI_MEMORY;
+  else
+    *error = 0;
+  return 1;
+}
+
+/* Resolve from the hosts file stand-in.  Returns zero if the host is not
+   listed, otherwise sets *error as for cache_search().  Called with the
+   lock held.  */
+static int
+hosts_search (const char *host, const char *port, struct addrinfo **res,
+	      int *error)
+{
+  struct addrinfo hints, *ai, *copy, **tail;
+  struct hosts_entry *entry;
+  int found, err;
+
+  memset (&hints, 0, sizeof hints);
+  hints.ai_flags = AI_NUMERICHOST;
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  *res = NULL;
+  tail = res;
+  found = 0;
+  for (entry = hosts; entry != NULL; entry = entry->next)
+    {
+      if (strcasecmp (entry->name, host) != 0)
+	continue;
+      found = 1;
+      if ((err = getaddrinfo (entry->addr, port, &hints, &ai)) != 0)
+	continue;
+      copy = copy_addrinfo (ai);
+      freeaddrinfo (ai);
+      if (copy == NULL)
+	{
+	  resolver_free (*res);
+	  *res = NULL;
+	  *error = EAI_MEMORY;
+	  return 1;
+	}
+      if (*res == NULL && (copy->ai_canonname = strdup (entry->canon)) == NULL)
+	{
+	  resolver_free (copy);
+	  *error = EAI_MEMORY;
+	  return 1;
+	}
+      *tail = copy;
+      while (*tail != NULL)
+	tail = &(*tail)->ai_next;
+    }
+  if (found)
+    *error = *res != NULL ? 0 : EAI_NONAME;
+  return found;
+}
+
+/* Resolve the host with the system resolver and cache the result.  */
+static int
+resolve (const char *host, const char *port, const char *key,
+	 struct addrinfo **res)
+{
+  struct addrinfo hints, *ai;
+  int err;
+
+  /* Use the RFC 3493/Posix resolver interface.  This allows for much
+     cleaner code, protocol independence and thread safety. */
+  memset (&hints, 0, sizeof hints);
+  hints.ai_flags = AI_CANONNAME;
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  *res = NULL;
+  err = getaddrinfo (*host != '\0' ? host : NULL, port, &hints, &ai);
+  if (err == 0)
+    {
+      *res = copy_addrinfo (ai);
+      freeaddrinfo (ai);
+      if (*res == NULL)
+	err = EAI_MEMORY;
+    }
+  if (err == EAI_SYSTEM)
+    return err;
+
+  RESOLVER_LOCK ();
+  cache_store (key, err, *res);
+  RESOLVER_UNLOCK ();
+  return err;
+}
+
+/* Look up host and port in the hosts file stand-in and then the cache.
+   Returns zero if neither knows the name, otherwise sets *error and *res
+   as for resolver_lookup().  */
+static int
+lookup_known (const char *host, const char *port, const char *key,
+	      struct addrinfo **res, int *error)
+{
+  int found;
+
+  RESOLVER_LOCK ();
+  found = hosts_search (host, port, res, error)
+	  || cache_search (key, res, error);
+  RESOLVER_UNLOCK ();
+  return found;
+}
+
+#ifdef USE_PTHREADS
+
+/* A lookup running on its own thread.  The job is shared between the
+   resolver thread and the session waiting for it; whichever finishes with
+   it last frees it.  A non-blocking session waits for the pipe to become
+   readable.  */
+struct resolve_job
+  {
+    char *host;
+    char *port;
+    char *key;
+    struct addrinfo *res;
+    int error;
+    int done;
+    int refs;
+    int notify[2];			/* Written when done, or -1 */
+    pthread_cond_t cond;
+  };
+
+static void
+release_job (struct resolve_job *job)
+{
+  if (--job->refs > 0)
+    return;
+  pthread_cond_destroy (&job->cond);
+  if (job->notify[0] >= 0)
+    {
+      close (job->notify[0]);
+      close (job->notify[1]);
+    }
+  resolver_free (job->res);
+  free (job->host);
+  free (job->port);
+  free (job->key);
+  free (job);
+}
+
+static void *
+resolve_thread (void *arg)
+{
+  struct resolve_job *job = arg;
+  struct addrinfo *res;
+  int err;
+
+  err = resolve (job->host, job->port, job->key, &res);
+
+  RESOLVER_LOCK ();
+  job->res = res;
+  job->error = err;
+  job->done = 1;
+  pthread_cond_broadcast (&job->cond);
+  if (job->notify[1] >= 0)
+    while (write (job->notify[1], "", 1) < 0 && errno == EINTR)
+      ;
+  release_job (job);
+  RESOLVER_UNLOCK ();
+  return NULL;
+}
+
+/* Start a lookup on a separate thread.  If notify is set, the job's pipe
+   becomes readable when the lookup completes.  Returns NULL if the thread
+   could not be started.  */
+static struct resolve_job *
+start_job (const char *host, const char *port, const char *key, int notify)
+{
+  struct resolve_job *job;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int started;
+
+  if ((job = malloc (sizeof (struct resolve_job))) == NULL)
+    return NULL;
+  memset (job, 0, sizeof (struct resolve_job));
+  job->notify[0] = job->notify[1] = -1;
+  job->host = strdup (host);
+  job->port = strdup (port);
+  job->key = strdup (key);
+  job->refs = 2;
+  pthread_cond_init (&job->cond, NULL);
+  if (job->host == NULL || job->port == NULL || job->key == NULL
+      || (notify && pipe (job->notify) < 0))
+    {
+      job->notify[0] = job->notify[1] = -1;
+      job->refs = 1;
+      release_job (job);
+      return NULL;
+    }
+  if (notify)
+    {
+      fcntl (job->notify[0], F_SETFD, FD_CLOEXEC);
+      fcntl (job->notify[1], F_SETFD, FD_CLOEXEC);
+    }
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  started = pthread_create (&thread, &attr, resolve_thread, job) == 0;
+  pthread_attr_destroy (&attr);
+  if (!started)
+    {
+      job->refs = 1;
+      release_job (job);
+      return NULL;
+    }
+  return job;
+}
+
+/* Resolve on a separate thread, waiting at most timeout milliseconds.
+   Returns zero if the thread could not be started, otherwise sets *error
+   to the getaddrinfo() error code or EAI_AGAIN if the timeout expired.  */
+static int
+resolve_async (const char *host, const char *port, const char *key,
+	       long timeout, struct addrinfo **res, int *error)
+{
+  struct resolve_job *job;
+  struct timespec abstime;
+
+  if ((job = start_job (host, port, key, 0)) == NULL)
+    return 0;
+
+  clock_gettime (CLOCK_REALTIME, &abstime);
+  abstime.tv_sec += timeout / 1000;
+  abstime.tv_nsec += (timeout % 1000) * 1000000L;
+  if (abstime.tv_nsec >= 1000000000L)
+    {
+      abstime.tv_sec++;
+      abstime.tv_nsec -= 1000000000L;
+    }
+
+  RESOLVER_LOCK ();
+  while (!job->done)
+    if (pthread_cond_timedwait (&job->cond, &resolver_lock, &abstime)
+        == ETIMEDOUT)
+      break;
+  if (job->done)
+    {
+      *res = job->res;
+      job->res = NULL;
+      *error = job->error;
+    }
+  else
+    *error = EAI_AGAIN;
+  release_job (job);
+  RESOLVER_UNLOCK ();
+  return 1;
+}
+
+/* Descriptor which becomes readable when the job completes.  */
+int
+resolver_job_fd (struct resolve_job *job)
+{
+  return job->notify[0];
+}
+
+/* If the job has completed, release it and set *error and *res as for
+   resolver_lookup().  Returns zero if the lookup is still running.  */
+int
+resolver_job_finish (struct resolve_job *job, struct addrinfo **res,
+		     int *error)
+{
+  int done;
+
+  RESOLVER_LOCK ();
+  if ((done = job->done))
+    {
+      *res = job->res;
+      job->res = NULL;
+      *error = job->error;
+      release_job (job);
+    }
+  RESOLVER_UNLOCK ();
+  return done;
+}
+
+/* Abandon a job.  The lookup continues and its result is cached.  */
+void
+resolver_job_cancel (struct resolve_job *job)
+{
+  RESOLVER_LOCK ();
+  release_job (job);
+  RESOLVER_UNLOCK ();
+}
+
+#else
+
+/* Without threads resolver_start() never returns a job.  */
+
+int
+resolver_job_fd (struct resolve_job *job __attribute__ ((unused)))
+{
+  return -1;
+}
+
+int
+resolver_job_finish (struct resolve_job *job __attribute__ ((unused)),
+		     struct addrinfo **res, int *error)
+{
+  *res = NULL;
+  *error = EAI_FAIL;
+  return 1;
+}
+
+void
+resolver_job_cancel (struct resolve_job *job __attribute__ ((unused)))
+{
+}
+
+#endif
+
+/* Resolve host and port, consulting the hosts file stand-in, then the
+   cache and finally the system resolver.  If timeout is positive and
+   threads are available the system resolver is called on another thread.
+   Returns a getaddrinfo() error code, on success *res must be released
+   with resolver_free().  */
+int
+resolver_lookup (const char *host, const char *port,
+		 long timeout __attribute__ ((unused)), struct addrinfo **res)
+{
+  char *key;
+  int err;
+
+  if (host == NULL)
+    host = "";
+  *res = NULL;
+
+  if ((key = cache_key (host, port)) == NULL)
+    return EAI_MEMORY;
+
+  if (!lookup_known (host, port, key, res, &err))
+    {
+#ifdef USE_PTHREADS
+      if (timeout <= 0
+	  || !resolve_async (host, port, key, timeout, res, &err))
+#endif
+	err = resolve (host, port, key, res);
+    }
+  free (key);
+  return err;
+}
+
+/* Start resolving host and port without waiting for the system resolver.
+   If the lookup continues on another thread, *job is set and zero is
+   returned, the caller must wait until the job completes, see
+   resolver_job_fd(), and collect its result with resolver_job_finish() or
+   abandon it with resolver_job_cancel().  Otherwise *job is NULL and the
+   result is returned as for resolver_lookup().  */
+int
+resolver_start (const char *host, const char *port, struct resolve_job **job,
+		struct addrinfo **res)
+{
+  char *key;
+  int err;
+
+  if (host == NULL)
+    host = "";
+  *job = NULL;
+  *res = NULL;
+
+  if ((key = cache_key (host, port)) == NULL)
+    return EAI_MEMORY;
+
+  err = 0;
+  if (!lookup_known (host, port, key, res, &err))
+    {
+#ifdef USE_PTHREADS
+      if ((*job = start_job (host, port, key, 1)) == NULL)
+#endif
+	err = resolve (host, port, key, res);
+    }
+  free (key);
+  return err;
+}
+
+/**
+ * smtp_resolver_set_ttl() - Enable the resolver cache.
+ * @ttl: Time in milliseconds to cache resolved addresses, zero to disable.
+ * @negative_ttl: Time in milliseconds to cache non-existent names.
+ *
+ * Set how long the results of looking up the addresses of MTAs are cached.
+ * The cache is shared by all sessions in the process.  Setting both times
+ * to zero disables the cache and discards its contents.  The new times
+ * apply to results cached subsequently.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_resolver_set_ttl (long ttl, long negative_ttl)
+{
+  SMTPAPI_CHECK_ARGS (ttl >= 0 && negative_ttl >= 0, 0);
+
+  RESOLVER_LOCK ();
+  ttl_positive = ttl;
+  ttl_negative = negative_ttl;
+  RESOLVER_UNLOCK ();
+  if (ttl == 0 && negative_ttl == 0)
+    smtp_resolver_flush ();
+  return 1;
+}
+
+/**
+ * smtp_resolver_flush() - Discard cached resolver results.
+ *
+ * Empty the resolver cache.  Subsequent sessions will look up their MTA's
+ * addresses afresh.
+ */
+void
+smtp_resolver_flush (void)
+{
+  struct h_node **table;
+
+  RESOLVER_LOCK ();
+  table = cache;
+  cache = NULL;
+  RESOLVER_UNLOCK ();
+  if (table != NULL)
+    h_destroy (table, cache_entry_free, NULL);
+}
+
+static void
+free_hosts (struct hosts_entry *entry)
+{
+  struct hosts_entry *next;
+
+  for (; entry != NULL; entry = next)
+    {
+      next = entry->next;
+      free (entry->name);
+      free (entry->canon);
+      free (entry->addr);
+      free (entry);
+    }
+}
+
+/**
+ * smtp_resolver_load_hosts() - Resolve names from a hosts file.
+ * @path: File in ``/etc/hosts`` format or %NULL.
+ *
+ * Read a list of addresses and host names from a file formatted in the
+ * same way as ``/etc/hosts``.  Subsequently, names listed in the file are
+ * resolved from it without consulting the system resolver or the cache.
+ * A name listed with several addresses resolves to all of them in the
+ * order they appear.  This is intended to let tests direct sessions to
+ * local servers.  If @path is %NULL, previously loaded names are forgotten.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_resolver_load_hosts (const char *path)
+{
+  struct hosts_entry *list, **tail, *entry;
+  char buf[1024], *p, *addr, *name, *canon, *save;
+  FILE *fp;
+
+  list = NULL;
+  if (path != NULL)
+    {
+      if ((fp = fopen (path, "r")) == NULL)
+	{
+	  set_errno (errno);
+	  return 0;
+	}
+      tail = &list;
+      while (fgets (buf, sizeof buf, fp) != NULL)
+	{
+	  if ((p = strchr (buf, '#')) != NULL)
+	    *p = '\0';
+	  if ((addr = strtok_r (buf, " \t\r\n", &save)) == NULL)
+	    continue;
+	  canon = NULL;
+	  while ((name = strtok_r (NULL, " \t\r\n", &save)) != NULL)
+	    {
+	      if (canon == NULL)
+		canon = name;
+	      if ((entry = malloc (sizeof (struct hosts_entry))) == NULL)
+		goto nomem;
+	      entry->next = NULL;
+	      entry->name = strdup (name);
+	      entry->canon = strdup (canon);
+	      entry->addr = strdup (addr);
+	      *tail = entry;
+	      tail = &entry->next;
+	      if (entry->name == NULL || entry->canon == NULL
+		  || entry->addr == NULL)
+		goto nomem;
+	    }
+	}
+      fclose (fp);
+    }
+
+  RESOLVER_LOCK ();
+  entry = hosts;
+  hosts = list;
+  RESOLVER_UNLOCK ();
+  free_hosts (entry);
+  return 1;
+
+nomem:
+  fclose (fp);
+  free_hosts (list);
+  set_errno (ENOMEM);
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _resolver_h
+#define _resolver_h
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+struct addrinfo;
+struct resolve_job;
+
+int resolver_lookup (const char *host, const char *port, long timeout,
+		     struct addrinfo **res);
+int resolver_start (const char *host, const char *port,
+		    struct resolve_job **job, struct addrinfo **res);
+int resolver_job_fd (struct resolve_job *job);
+int resolver_job_finish (struct resolve_job *job, struct addrinfo **res,
+			 int *error);
+void resolver_job_cancel (struct resolve_job *job);
+void resolver_free (struct addrinfo *res);
+
+#endif
@@ -25,6 +25,7 @@
 #include <assert.h>
 
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -37,16 +38,41 @@
 
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#if HAVE_SENDFILE
+# include <sys/sendfile.h>
+#endif
 
 #ifdef USE_TLS
 # include <openssl/ssl.h>
 #endif
+#ifdef USE_PTHREADS
+# include <pthread.h>
+#endif
+#ifdef USE_IO_URING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
 
 #include "siobuf.h"
 
+static void flush_buffer (struct siobuf *sio, int more);
+static void set_corked (struct siobuf *sio, int state);
+static void raw_write (struct siobuf *sio, const char *buf, int len);
+static void raw_writev (struct siobuf *sio, struct iovec *iov, int iovcnt);
+static void queue_write (struct siobuf *sio, const char *buf, int len);
+#ifdef USE_IO_URING
+struct sio_uring;
+static void uring_destroy (struct sio_uring *ring);
+#endif
 #ifdef USE_TLS
 static int sio_sslpoll (struct siobuf *sio, int ret);
+static void set_ssl_lowmem (struct siobuf *sio);
 #endif
 
 /* Socket I/O buffering */
@@ -55,7 +81,9 @@ struct siobuf
     int sdr;			/* Socket descriptor being buffered. */
     int sdw;			/* Socket descriptor being buffered. */
 
-    size_t buffer_size;		/* size of buffers */
+    size_t buffer_size;		/* preferred size of the read buffer */
+    int write_size;		/* preferred size of the write buffer */
+    int write_alloc;		/* allocated size of the write buffer */
     int milliseconds;		/* Timeout in ms */
 
     char *read_buffer;		/* client read buffer */
@@ -63,6 +91,7 @@ struct siobuf
     int read_unread;		/* number of bytes unread in buffer */
 
     char *write_buffer;		/* client write buffer */
+    char *write_start;		/* start of data not yet flushed */
     char *write_position;	/* client write buffer pointer */
     char *flush_mark;		/* don't flush beyond this point */
     int write_available;	/* number of bytes available in buffer */
@@ -76,11 +105,561 @@ struct siobuf
 
 #ifdef USE_TLS
     SSL *ssl;			/* The SSL connection */
+    int ssl_want;		/* SIO_READ/SIO_WRITE wanted by OpenSSL */
+    int ktls;			/* SIO_READ/SIO_WRITE offloaded to kernel */
 #endif
 
     void *user_data;
+
+    /* Non-blocking mode */
+    int nonblocking;		/* never wait in poll() */
+    int read_size;		/* size of the read buffer */
+    int eof;			/* read failed or connection closed */
+    int write_error;		/* write failed, discard output */
+    char *out_buffer;		/* output not yet accepted by the socket */
+    int out_length;		/* number of bytes in out_buffer */
+    int out_size;		/* allocated size of out_buffer */
+
+    int lowmem;			/* release buffers while they are empty */
+    int cork;			/* cork the socket for partial flushes */
+    int corked;			/* TCP_CORK is set */
+
+#ifdef USE_IO_URING
+    struct sio_uring *uring;	/* io_uring backend, NULL for poll() */
+#endif
+  };
+
+/* Limit on the read buffer growth in non-blocking mode.  A complete
+   response must fit into the read buffer before it can be processed. */
+#define SIO_READ_MAX	(64 * 1024)
+
+/* Buffers of SIO_BUFSIZE octets are recycled through a process-wide slab
+   of free buffers instead of being returned to malloc().  Connections in
+   low memory mode give up their buffers whenever they are empty, so with
+   many connections open only those actually transferring data hold any.
+   The slab keeps at most SIO_SLAB_MAX buffers.  */
+#define SIO_SLAB_MAX	256
+
+struct slab_buffer
+  {
+    struct slab_buffer *next;
+  };
+
+static struct slab_buffer *slab;
+static int slab_count;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+# define SLAB_LOCK()	pthread_mutex_lock (&slab_lock)
+# define SLAB_UNLOCK()	pthread_mutex_unlock (&slab_lock)
+#else
+# define SLAB_LOCK()	((void) 0)
+# define SLAB_UNLOCK()	((void) 0)
+#endif
+
+static char *
+slab_alloc (size_t size)
+{
+  struct slab_buffer *buf = NULL;
+
+  if (size == SIO_BUFSIZE)
+    {
+      SLAB_LOCK ();
+      if ((buf = slab) != NULL)
+	{
+	  slab = buf->next;
+	  slab_count--;
+	}
+      SLAB_UNLOCK ();
+    }
+  return buf != NULL ? (char *) buf : malloc (size);
+}
+
+static void
+slab_free (char *ptr, size_t size)
+{
+  struct slab_buffer *buf = (struct slab_buffer *) (void *) ptr;
+
+  if (ptr == NULL)
+    return;
+  if (size == SIO_BUFSIZE)
+    {
+      SLAB_LOCK ();
+      if (slab_count < SIO_SLAB_MAX)
+	{
+	  buf->next = slab;
+	  slab = buf;
+	  slab_count++;
+	  buf = NULL;
+	}
+      SLAB_UNLOCK ();
+      if (buf == NULL)
+	return;
+    }
+  free (ptr);
+}
+
+/* Allocate the read or write buffer if it was released.  Returns zero if
+   memory is exhausted.  */
+static int
+want_read_buffer (struct siobuf *sio)
+{
+  if (sio->read_buffer == NULL)
+    {
+      if ((sio->read_buffer = slab_alloc (sio->buffer_size)) == NULL)
+	return 0;
+      sio->read_position = sio->read_buffer;
+      sio->read_unread = 0;
+      sio->read_size = sio->buffer_size;
+    }
+  return 1;
+}
+
+static int
+want_write_buffer (struct siobuf *sio)
+{
+  if (sio->write_buffer == NULL)
+    {
+      if ((sio->write_buffer = slab_alloc (sio->write_size)) == NULL)
+	return 0;
+      sio->write_start = sio->write_position = sio->write_buffer;
+      sio->write_available = sio->write_alloc = sio->write_size;
+    }
+  return 1;
+}
+
+/* Release buffers which are empty, in low memory mode or if they are not
+   the preferred size.  They are reallocated at the preferred size when
+   next used.  A read buffer which grew in non-blocking mode thus shrinks
+   to its original size.  */
+static void
+release_read_buffer (struct siobuf *sio)
+{
+  if (sio->read_buffer != NULL && sio->read_unread <= 0
+      && (sio->lowmem || sio->read_size != (int) sio->buffer_size))
+    {
+      slab_free (sio->read_buffer, sio->read_size);
+      sio->read_position = sio->read_buffer = NULL;
+      sio->read_unread = 0;
+      sio->read_size = 0;
+    }
+}
+
+static void
+release_write_buffer (struct siobuf *sio)
+{
+  if (sio->write_buffer != NULL && sio->write_position == sio->write_buffer
+      && (sio->lowmem || sio->write_alloc != sio->write_size))
+    {
+      slab_free (sio->write_buffer, sio->write_alloc);
+      sio->write_start = sio->write_position = sio->write_buffer = NULL;
+      sio->write_available = 0;
+      sio->flush_mark = NULL;
+    }
+  if (sio->lowmem && sio->out_buffer != NULL && sio->out_length == 0)
+    {
+      free (sio->out_buffer);
+      sio->out_buffer = NULL;
+      sio->out_size = 0;
+    }
+}
+
+#ifdef USE_IO_URING
+/* The io_uring backend performs reads and writes on a plain connection in
+   blocking mode, that is, when neither TLS nor the non-blocking engine are
+   in use.  Each read or write is submitted together with a linked timeout
+   in place of the poll() timeout and waited for in the same system call.
+   The read and write buffers are registered with the ring so that the
+   kernel does not map them for each operation.  A multishot poll on the
+   socket reports input as it arrives, so the fast poll in the protocol
+   loop, which checks for responses to pipelined commands, costs a system
+   call only when a response is waiting.  */
+#define URING_ENTRIES	8
+
+#define URING_IO	1	/* user_data for the read or write */
+#define URING_TIMEOUT	2	/* user_data for its linked timeout */
+#define URING_POLL	3	/* user_data for the multishot poll */
+
+struct sio_uring
+  {
+    int fd;			/* ring file descriptor */
+    void *sq_ring;		/* mapped submission queue ring */
+    size_t sq_ring_size;
+    void *cq_ring;		/* mapped completion queue ring */
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;	/* mapped submission queue entries */
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct iovec buffers[2];	/* registered read and write buffers */
+    int registered;		/* buffers are registered */
+    int no_register;		/* registration failed, don't retry */
+
+    int poll_armed;		/* multishot poll is active */
+    int readable;		/* input reported and not yet read */
+    int io_done;		/* read or write completed */
+    int io_res;			/* its result */
   };
 
+static int
+uring_setup (unsigned entries, struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter (struct sio_uring *ring, unsigned to_submit, unsigned min_complete)
+{
+  return syscall (__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+		  min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int
+uring_register (struct sio_uring *ring, unsigned opcode, void *arg,
+		unsigned nargs)
+{
+  return syscall (__NR_io_uring_register, ring->fd, opcode, arg, nargs);
+}
+
+static struct sio_uring *
+uring_create (void)
+{
+  struct sio_uring *ring;
+  struct io_uring_params params;
+  char *sq, *cq;
+
+  if ((ring = malloc (sizeof (struct sio_uring))) == NULL)
+    return NULL;
+  memset (ring, 0, sizeof (struct sio_uring));
+  ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+
+  memset (&params, 0, sizeof params);
+  if ((ring->fd = uring_setup (URING_ENTRIES, &params)) < 0)
+    {
+      free (ring);
+      return NULL;
+    }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries
+		       * sizeof (unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries
+		       * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+	ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = 0;
+    }
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail;
+  if (ring->cq_ring_size == 0)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+	goto fail;
+    }
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned *) (void *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (void *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (void *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (void *) (sq + params.sq_off.array);
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned *) (void *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (void *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (void *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (void *) (cq + params.cq_off.cqes);
+  return ring;
+
+fail:
+  uring_destroy (ring);
+  return NULL;
+}
+
+static void
+uring_destroy (struct sio_uring *ring)
+{
+  if (ring->sqes != MAP_FAILED)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != MAP_FAILED)
+    munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+  free (ring);
+}
+
+/* Return the next free submission queue entry, cleared.  The ring never
+   holds more than a few entries so it cannot be full.  */
+static struct io_uring_sqe *
+uring_get_sqe (struct sio_uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  tail = *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+/* Number of entries not yet consumed by the kernel.  */
+static unsigned
+uring_unsubmitted (struct sio_uring *ring)
+{
+  return *ring->sq_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Process completions.  Stale completions of linked timeouts are
+   discarded.  */
+static void
+uring_reap (struct sio_uring *ring)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+
+  head = *ring->cq_head;
+  while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      if (cqe->user_data == URING_IO)
+	{
+	  ring->io_res = cqe->res;
+	  ring->io_done = 1;
+	}
+      else if (cqe->user_data == URING_POLL)
+	{
+	  if (cqe->res > 0)
+	    ring->readable = 1;
+	  if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_MORE))
+	    ring->poll_armed = 0;
+	}
+      head++;
+    }
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Arm the multishot poll for input.  */
+static void
+uring_arm_poll (struct siobuf *sio)
+{
+  struct sio_uring *ring = sio->uring;
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_get_sqe (ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = sio->sdr;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = URING_POLL;
+  if (uring_enter (ring, uring_unsubmitted (ring), 0) >= 0)
+    ring->poll_armed = 1;
+}
+
+/* Return the index of the registered buffer containing the LEN octets at
+   BUF or -1.  The registration follows the connection's buffers as they
+   are reallocated, except in low memory mode where they change too often
+   for this to be worthwhile.  */
+static int
+uring_buffer (struct siobuf *sio, const char *buf, int len)
+{
+  struct sio_uring *ring = sio->uring;
+  const char *base;
+  int i;
+
+  if (ring->no_register || sio->lowmem)
+    return -1;
+  if (ring->buffers[0].iov_base != sio->read_buffer
+      || ring->buffers[0].iov_len != (size_t) sio->read_size
+      || ring->buffers[1].iov_base != sio->write_buffer
+      || ring->buffers[1].iov_len != (size_t) sio->write_alloc)
+    {
+      if (ring->registered)
+	uring_register (ring, IORING_UNREGISTER_BUFFERS, NULL, 0);
+      ring->registered = 0;
+      memset (ring->buffers, 0, sizeof ring->buffers);
+      if (sio->read_buffer == NULL || sio->write_buffer == NULL)
+	return -1;
+      ring->buffers[0].iov_base = sio->read_buffer;
+      ring->buffers[0].iov_len = sio->read_size;
+      ring->buffers[1].iov_base = sio->write_buffer;
+      ring->buffers[1].iov_len = sio->write_alloc;
+      if (uring_register (ring, IORING_REGISTER_BUFFERS, ring->buffers, 2) < 0)
+	{
+	  ring->no_register = 1;
+	  return -1;
+	}
+      ring->registered = 1;
+    }
+  for (i = 0; i < 2; i++)
+    {
+      base = ring->buffers[i].iov_base;
+      if (buf >= base && buf + len <= base + ring->buffers[i].iov_len)
+	return i;
+    }
+  return -1;
+}
+
+/* Submit a read or write prepared in TEMPLATE with a linked timeout and
+   wait for it.  Returns the result of the operation or -1 with errno set,
+   ETIMEDOUT if the timeout expired.  */
+static int
+uring_io (struct siobuf *sio, const struct io_uring_sqe *template)
+{
+  struct sio_uring *ring = sio->uring;
+  struct io_uring_sqe *sqe, poll_sqe;
+  struct __kernel_timespec ts;
+  int res;
+
+  for (;;)
+    {
+      ring->io_done = 0;
+      sqe = uring_get_sqe (ring);
+      memcpy (sqe, template, sizeof (struct io_uring_sqe));
+      sqe->user_data = URING_IO;
+      if (sio->milliseconds >= 0)
+	{
+	  sqe->flags |= IOSQE_IO_LINK;
+	  ts.tv_sec = sio->milliseconds / 1000;
+	  ts.tv_nsec = (sio->milliseconds % 1000) * 1000000L;
+	  sqe = uring_get_sqe (ring);
+	  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	  sqe->fd = -1;
+	  sqe->addr = (uintptr_t) &ts;
+	  sqe->len = 1;
+	  sqe->user_data = URING_TIMEOUT;
+	}
+
+      /* The operation is in flight once submitted, even if the wait is
+	 interrupted, so wait until it completes.  */
+      for (;;)
+	{
+	  uring_reap (ring);
+	  if (ring->io_done)
+	    break;
+	  if (uring_enter (ring, uring_unsubmitted (ring), 1) < 0
+	      && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	    return -1;
+	}
+
+      /* Sockets are non-blocking.  In case the kernel reports this rather
+	 than waiting itself, wait for the socket with a poll operation
+	 and try again.  */
+      res = ring->io_res;
+      if (res != -EAGAIN || template->opcode == IORING_OP_POLL_ADD)
+	break;
+      memset (&poll_sqe, 0, sizeof poll_sqe);
+      poll_sqe.opcode = IORING_OP_POLL_ADD;
+      poll_sqe.fd = template->fd;
+      poll_sqe.poll32_events = template->opcode == IORING_OP_READ
+			   || template->opcode == IORING_OP_READ_FIXED
+			   ? POLLIN : POLLOUT;
+      if (uring_io (sio, &poll_sqe) < 0)
+	return -1;
+    }
+
+  if (res == -ECANCELED)
+    res = -ETIMEDOUT;
+  if (res < 0)
+    {
+      errno = -res;
+      return -1;
+    }
+  return res;
+}
+
+/* Read or write LEN octets at BUF using the registered buffers where
+   possible.  */
+static int
+uring_rw (struct siobuf *sio, int output, const char *buf, int len)
+{
+  struct io_uring_sqe sqe;
+  int index, n;
+
+  memset (&sqe, 0, sizeof sqe);
+  sqe.fd = output ? sio->sdw : sio->sdr;
+  sqe.addr = (uintptr_t) buf;
+  sqe.len = len;
+  if ((index = uring_buffer (sio, buf, len)) >= 0)
+    {
+      sqe.opcode = output ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe.buf_index = index;
+    }
+  else
+    sqe.opcode = output ? IORING_OP_WRITE : IORING_OP_READ;
+  n = uring_io (sio, &sqe);
+
+  /* A short read means the socket was drained, otherwise there may be
+     more input than was requested.  */
+  if (!output && n < len)
+    sio->uring->readable = 0;
+  return n;
+}
+
+static int
+uring_writev (struct siobuf *sio, const struct iovec *iov, int iovcnt)
+{
+  struct io_uring_sqe sqe;
+
+  memset (&sqe, 0, sizeof sqe);
+  sqe.opcode = IORING_OP_WRITEV;
+  sqe.fd = sio->sdw;
+  sqe.addr = (uintptr_t) iov;
+  sqe.len = iovcnt;
+  return uring_io (sio, &sqe);
+}
+
+/* As sio_poll().  Reads and writes wait for the socket themselves, so
+   only the fast poll, which must not block, needs to check for input.
+   This uses the multishot poll and, only if that reported input, confirms
+   that a read will not block.  */
+static int
+uring_poll (struct siobuf *sio, int want_read, int want_write, int fast)
+{
+  struct sio_uring *ring = sio->uring;
+  int rval;
+  char c;
+
+  rval = 0;
+  if (want_write)
+    rval |= SIO_WRITE;
+  if (want_read && !fast)
+    rval |= SIO_READ;
+  else if (want_read)
+    {
+      if (!ring->poll_armed)
+	uring_arm_poll (sio);
+      uring_reap (ring);
+      if (ring->readable)
+	{
+	  if (recv (sio->sdr, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+	      && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    ring->readable = 0;
+	  else
+	    rval |= SIO_READ;
+	}
+    }
+  return rval;
+}
+#endif
+
 /* Attach bi-directional buffering to the socket descriptor.
  */
 struct siobuf *
@@ -101,25 +680,19 @@ sio_attach (int sdr, int sdw, int buffer_size)
   if (sio->sdr != sio->sdw)
     fcntl (sio->sdr, F_SETFL, O_NONBLOCK);
 
-  /* Allocate the buffer for reading. */
-  sio->buffer_size = buffer_size;
-  sio->read_position = sio->read_buffer = malloc (sio->buffer_size);
-  sio->read_unread = 0;
-  if (sio->read_buffer == NULL)
+  /* Allocate the buffers for reading and writing. */
+  sio->buffer_size = sio->write_size = buffer_size;
+  if (!want_read_buffer (sio))
     {
       free (sio);
       return NULL;
     }
-
-  /* Allocate the buffer for writing. */
-  sio->write_position = sio->write_buffer = malloc (sio->buffer_size);
-  if (sio->write_buffer == NULL)
+  if (!want_write_buffer (sio))
     {
-      free (sio->read_buffer);
+      slab_free (sio->read_buffer, sio->read_size);
       free (sio);
       return NULL;
     }
-  sio->write_available = sio->buffer_size;
 
   sio->milliseconds = -1;
   return sio;
@@ -138,18 +711,132 @@ sio_detach (struct siobuf *sio)
       int ret;
 
       /* Send a close notify to the peer for a graceful shutdown.
+         Don't wait for the peer's close notify in non-blocking mode.
        */
-      while ((ret = SSL_shutdown (sio->ssl)) == 0)
-        if (sio_sslpoll (sio, ret) <= 0)
-	  break;
+      if (sio->nonblocking)
+        SSL_shutdown (sio->ssl);
+      else
+	while ((ret = SSL_shutdown (sio->ssl)) == 0)
+	  if (sio_sslpoll (sio, ret) <= 0)
+	    break;
       SSL_free (sio->ssl);
     }
 #endif
-  free (sio->read_buffer);
-  free (sio->write_buffer);
+#ifdef USE_IO_URING
+  if (sio->uring != NULL)
+    uring_destroy (sio->uring);
+#endif
+  slab_free (sio->read_buffer, sio->read_size);
+  slab_free (sio->write_buffer, sio->write_alloc);
+  free (sio->out_buffer);
   free (sio);
 }
 
+/* In low memory mode the buffers are released while they are empty and
+   reallocated when needed.  This reduces the footprint of idle
+   connections.  */
+void
+sio_set_lowmem (struct siobuf *sio, int state)
+{
+  assert (sio != NULL);
+
+  sio->lowmem = state;
+#ifdef USE_TLS
+  if (sio->ssl != NULL)
+    set_ssl_lowmem (sio);
+#endif
+  release_read_buffer (sio);
+  release_write_buffer (sio);
+}
+
+/* Set the preferred sizes of the read and write buffers, zero leaves a
+   size unchanged.  A buffer is resized immediately if it is empty,
+   otherwise once it has been emptied.  */
+void
+sio_set_buffer_size (struct siobuf *sio, int read_size, int write_size)
+{
+  assert (sio != NULL && read_size >= 0 && write_size >= 0);
+
+  if (read_size > 0)
+    sio->buffer_size = read_size;
+  if (write_size > 0)
+    sio->write_size = write_size;
+  release_read_buffer (sio);
+  release_write_buffer (sio);
+}
+
+/* When the write buffer must be flushed because it is full, more output
+   follows at once.  With cork set the socket is corked (TCP_CORK) until
+   the next explicit flush, so that the output is sent in full segments
+   even if TCP_NODELAY is set.  This has no effect if TCP_CORK is not
+   supported.  */
+void
+sio_set_cork (struct siobuf *sio, int state)
+{
+  assert (sio != NULL);
+
+  sio->cork = state;
+}
+
+/* Return the number of octets of memory held by the buffering.  This does
+   not include memory held by OpenSSL or the security layer.  */
+size_t
+sio_memory_usage (struct siobuf *sio)
+{
+  size_t total;
+
+  assert (sio != NULL);
+
+  total = sizeof (struct siobuf);
+  if (sio->read_buffer != NULL)
+    total += sio->read_size;
+  if (sio->write_buffer != NULL)
+    total += sio->write_alloc;
+  return total + sio->out_size;
+}
+
+/* In non-blocking mode, reads and writes never wait for the socket.
+   Output which cannot be written immediately is queued by sio_flush()
+   and written by sio_drain(), and input is read using sio_read_ahead().
+   The caller is responsible for polling the socket, see sio_events().  */
+void
+sio_set_nonblocking (struct siobuf *sio, int state)
+{
+  assert (sio != NULL);
+
+  sio->nonblocking = state;
+  if (state)
+    sio_set_uring (sio, 0);
+}
+
+/* Use the io_uring backend for reads and writes if state is set and it is
+   available, see above.  It applies only in blocking mode and is dropped
+   when TLS starts.  Returns non-zero if the backend is in use.  */
+int
+sio_set_uring (struct siobuf *sio, int state)
+{
+  assert (sio != NULL);
+
+#ifdef USE_IO_URING
+  if (!state || sio->nonblocking
+# ifdef USE_TLS
+      || sio->ssl != NULL
+# endif
+     )
+    {
+      if (sio->uring != NULL)
+	uring_destroy (sio->uring);
+      sio->uring = NULL;
+    }
+  else if (sio->uring == NULL)
+    sio->uring = uring_create ();
+  return sio->uring != NULL;
+#else
+  (void) state;
+  return 0;
+#endif
+}
+
 void
 sio_set_monitorcb (struct siobuf *sio, monitorcb_t cb, void *arg)
 {
@@ -179,7 +866,42 @@ sio_set_timeout (struct siobuf *sio, int milliseconds)
 #endif
 }
 
+int
+sio_get_timeout (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+  return sio->milliseconds;
+}
+
 #ifdef USE_TLS
+/* Once the handshake is complete, OpenSSL may hand the record layer to the
+   kernel (kTLS) if SSL_OP_ENABLE_KTLS is set.  Note which directions are
+   offloaded.  Writes may then bypass OpenSSL and the socket can be used
+   with sendfile().  */
+static void
+check_ktls (struct siobuf *sio)
+{
+  sio->ktls = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+  if (BIO_get_ktls_send (SSL_get_wbio (sio->ssl)))
+    sio->ktls |= SIO_WRITE;
+  if (BIO_get_ktls_recv (SSL_get_rbio (sio->ssl)))
+    sio->ktls |= SIO_READ;
+#endif
+}
+
+/* In low memory mode OpenSSL releases its record buffers while they are
+   empty.  */
+static void
+set_ssl_lowmem (struct siobuf *sio)
+{
+  if (sio->lowmem)
+    SSL_set_mode (sio->ssl, SSL_MODE_RELEASE_BUFFERS);
+  else
+    SSL_clear_mode (sio->ssl, SSL_MODE_RELEASE_BUFFERS);
+}
+
 int
 sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl)
 {
@@ -189,9 +911,11 @@ sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl)
 
   if (ssl != NULL)
     {
+      sio_set_uring (sio, 0);
       sio->ssl = ssl;
       SSL_set_rfd (sio->ssl, sio->sdr);
       SSL_set_wfd (sio->ssl, sio->sdw);
+      set_ssl_lowmem (sio);
       while ((ret = SSL_connect (sio->ssl)) <= 0)
         if (sio_sslpoll (sio, ret) <= 0)
 	  {
@@ -199,11 +923,79 @@ sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl)
 	    sio->ssl = NULL;
 	    break;
 	  }
+      if (sio->ssl != NULL)
+	check_ktls (sio);
       sio_set_timeout (sio, sio->milliseconds);
     }
   return sio->ssl != NULL;
 }
 
+/* Attach the SSL connection without performing the handshake.  This is
+   for non-blocking mode, sio_tls_handshake() must be called until the
+   handshake completes. */
+void
+sio_start_tlsclient_ssl (struct siobuf *sio, SSL *ssl)
+{
+  assert (sio != NULL && ssl != NULL);
+
+  sio_set_uring (sio, 0);
+  sio->ssl = ssl;
+  SSL_set_rfd (sio->ssl, sio->sdr);
+  SSL_set_wfd (sio->ssl, sio->sdw);
+  set_ssl_lowmem (sio);
+  /* Queued output may move when out_buffer is reallocated. */
+  SSL_set_mode (sio->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_set_connect_state (sio->ssl);
+}
+
+/* Return 1 when the handshake is complete, 0 if it must be resumed when
+   the socket is ready (see sio_events()) or -1 if it failed.  */
+int
+sio_tls_handshake (struct siobuf *sio)
+{
+  int ret, err;
+
+  assert (sio != NULL && sio->ssl != NULL);
+
+  sio->ssl_want = 0;
+  if ((ret = SSL_do_handshake (sio->ssl)) == 1)
+    {
+      check_ktls (sio);
+      sio_set_timeout (sio, sio->milliseconds);
+      return 1;
+    }
+  err = SSL_get_error (sio->ssl, ret);
+  if (err == SSL_ERROR_WANT_READ)
+    sio->ssl_want = SIO_READ;
+  else if (err == SSL_ERROR_WANT_WRITE)
+    sio->ssl_want = SIO_WRITE;
+  else
+    {
+      SSL_free (sio->ssl);
+      sio->ssl = NULL;
+      return -1;
+    }
+  return 0;
+}
+
+SSL *
+sio_get_ssl (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+  return sio->ssl;
+}
+
+/* Return the directions (SIO_READ, SIO_WRITE) for which TLS records are
+   processed by the kernel.  */
+int
+sio_tls_offload (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+  return sio->ssl != NULL ? sio->ktls : 0;
+}
+
 int
 sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl)
 {
@@ -213,9 +1005,11 @@ sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl)
 
   if (ssl != NULL)
     {
+      sio_set_uring (sio, 0);
       sio->ssl = ssl;
       SSL_set_rfd (sio->ssl, sio->sdr);
       SSL_set_wfd (sio->ssl, sio->sdw);
+      set_ssl_lowmem (sio);
       while ((ret = SSL_accept (sio->ssl)) <= 0)
         if (sio_sslpoll (sio, ret) <= 0)
 	  {
@@ -223,6 +1017,8 @@ sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl)
 	    sio->ssl = NULL;
 	    break;
 	  }
+      if (sio->ssl != NULL)
+	check_ktls (sio);
       sio_set_timeout (sio, sio->milliseconds);
     }
   return sio->ssl != NULL;
@@ -263,6 +1059,10 @@ sio_poll (struct siobuf *sio, int want_read, int want_write, int fast)
   if (want_read && sio->ssl != NULL && SSL_pending (sio->ssl))
     return SIO_READ;
 #endif
+#ifdef USE_IO_URING
+  if (sio->uring != NULL)
+    return uring_poll (sio, want_read, want_write, fast);
+#endif
 
   npoll = 0;
   if (want_read)
@@ -319,112 +1119,497 @@ sio_sslpoll (struct siobuf *sio, int ret)
     return -1;
   return sio_poll (sio, want_read, want_write, 0);
 }
-#endif
+#endif
+
+/* Data which does not fit in the write buffer may be written directly from
+   the caller's buffers, together with the buffered output, instead of
+   being copied through the write buffer.  This is not possible if the
+   output must be encoded by a security layer.  */
+static int
+can_write_direct (struct siobuf *sio)
+{
+  return sio->encode_cb == NULL && !sio->write_error;
+}
+
+/* TLS records carry at most 16 KiB of data.  */
+#define SIO_TLS_RECORD	16384
+
+/* Write the buffered output followed by the data in iov.  In blocking mode
+   this is a single writev().  With TLS, the write buffer is topped up
+   from iov and written as one record, then whole records are written
+   from iov; any remainder is left in the write buffer, to be sent with
+   the next output.  In non-blocking mode the data is queued without first
+   being copied to the write buffer.  The flush mark is ignored since the
+   buffered output must precede the new data.  */
+static void
+write_direct (struct siobuf *sio, const struct iovec *iov, int iovcnt)
+{
+  struct iovec vec[SIO_IOV_MAX + 1];
+  int i, n, len;
+
+  if (sio->cork)
+    set_corked (sio, 1);
+  sio->flush_mark = NULL;
+  n = 0;
+  len = sio->write_position - sio->write_start;
+  if (len > 0)
+    {
+      if (sio->monitor_cb != NULL)
+	(*sio->monitor_cb) (sio->write_start, len, 1, sio->cbarg);
+      vec[n].iov_base = sio->write_start;
+      vec[n++].iov_len = len;
+    }
+  for (i = 0; i < iovcnt; i++)
+    if (iov[i].iov_len > 0)
+      {
+	if (sio->monitor_cb != NULL)
+	  (*sio->monitor_cb) (iov[i].iov_base, iov[i].iov_len, 1, sio->cbarg);
+	vec[n++] = iov[i];
+      }
+
+#ifdef USE_TLS
+  if (sio->ssl != NULL && !(sio->ktls & SIO_WRITE) && !sio->nonblocking)
+    {
+      char *buf;
+      int part;
+
+      /* Data from vec[0] is already in the write buffer.  */
+      for (i = len > 0; i < n; i++)
+	{
+	  buf = vec[i].iov_base;
+	  len = vec[i].iov_len;
+	  if (sio->write_position > sio->write_start)
+	    {
+	      part = len < sio->write_available ? len : sio->write_available;
+	      memcpy (sio->write_position, buf, part);
+	      sio->write_position += part;
+	      sio->write_available -= part;
+	      buf += part;
+	      len -= part;
+	      if (sio->write_available > 0)
+		continue;
+	      raw_write (sio, sio->write_start,
+			 sio->write_position - sio->write_start);
+	      sio->write_start = sio->write_position = sio->write_buffer;
+	      sio->write_available = sio->write_alloc;
+	    }
+	  part = len - len % SIO_TLS_RECORD;
+	  if (len - part > sio->write_available)
+	    part = len;
+	  if (part > 0)
+	    raw_write (sio, buf, part);
+	  if (len > part)
+	    {
+	      memcpy (sio->write_position, buf + part, len - part);
+	      sio->write_position += len - part;
+	      sio->write_available -= len - part;
+	    }
+	}
+      return;
+    }
+#endif
+
+  if (sio->nonblocking)
+    for (i = 0; i < n; i++)
+      queue_write (sio, vec[i].iov_base, vec[i].iov_len);
+  else
+    raw_writev (sio, vec, n);
+  sio->write_start = sio->write_position = sio->write_buffer;
+  sio->write_available = sio->write_alloc;
+}
+
+/* Write data from several buffers.  Data which does not fit into the
+   write buffer is written immediately without being copied, see
+   write_direct().  The buffers need not remain valid after this
+   returns.  */
+void
+sio_writev (struct siobuf *sio, const struct iovec *iov, int iovcnt)
+{
+  int i, total;
+
+  assert (sio != NULL && iov != NULL && iovcnt <= SIO_IOV_MAX);
+
+  for (total = i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  if (total == 0)
+    return;
+  if (!want_write_buffer (sio))
+    {
+      sio->write_error = 1;
+      return;
+    }
+  if (total > sio->write_available && can_write_direct (sio))
+    write_direct (sio, iov, iovcnt);
+  else
+    for (i = 0; i < iovcnt; i++)
+      if (iov[i].iov_len > 0)
+	sio_write (sio, iov[i].iov_base, iov[i].iov_len);
+}
+
+void
+sio_write (struct siobuf *sio, const void *bufp, int buflen)
+{
+  const char *buf = bufp;
+  struct iovec iov;
+
+  assert (sio != NULL && buf != NULL);
+
+  if (buflen < 0)
+    buflen = strlen (buf);
+  if (buflen == 0)
+    return;
+
+  if (!want_write_buffer (sio))
+    {
+      sio->write_error = 1;
+      return;
+    }
+  if (buflen > sio->write_available && can_write_direct (sio))
+    {
+      iov.iov_base = (void *) (uintptr_t) buf;
+      iov.iov_len = buflen;
+      write_direct (sio, &iov, 1);
+      return;
+    }
+  while (buflen > sio->write_available)
+    {
+      if (sio->write_available > 0)
+	{
+	  memcpy (sio->write_position, buf, sio->write_available);
+	  sio->write_position += sio->write_available;
+	  buf += sio->write_available;
+	  buflen -= sio->write_available;
+	}
+      flush_buffer (sio, 1);
+      if (!want_write_buffer (sio))
+	{
+	  sio->write_error = 1;
+	  return;
+	}
+      assert (sio->write_available > 0);
+    }
+  if (buflen > 0)
+    {
+      memcpy (sio->write_position, buf, buflen);
+      sio->write_position += buflen;
+      sio->write_available -= buflen;
+      /* If the buffer is exactly filled, flush it */
+      if (sio->write_available == 0)
+	flush_buffer (sio, 1);
+    }
+}
+
+static void
+raw_write (struct siobuf *sio, const char *buf, int len)
+{
+  int n, total, status;
+  struct pollfd pollfd;
+
+  assert (sio != NULL && buf != NULL);
+
+  for (total = 0; total < len; total += n)
+#ifdef USE_TLS
+    /* With kTLS the kernel encrypts data written to the socket. */
+    if (sio->ssl != NULL && !(sio->ktls & SIO_WRITE))
+      {
+	/* SSL_write() writes a record a time.	The outer loop calls
+	   it repeatedly until all the write buffer contents have
+	   been written.  The inner loop handles EAGAIN (EWOULDBLOCK)
+	   propagating up through OpenSSL. */
+	while ((n = SSL_write (sio->ssl, buf, len)) <= 0)
+	  if (sio_sslpoll (sio, n) <= 0)
+	    goto fail;
+      }
+    else
+#endif
+      {
+        /* Its conceiveable that write() actually writes less than
+           requested.  The outer loop calls this until all of the write
+           buffer has been written.  The inner loop handles blocking
+           in poll() and errors */
+#ifdef USE_IO_URING
+	if (sio->uring != NULL)
+	  {
+	    if ((n = uring_rw (sio, 1, buf + total, len - total)) < 0)
+	      goto fail;
+	    continue;
+	  }
+#endif
+	pollfd.fd = sio->sdw;
+	pollfd.events = POLLOUT;
+	errno = 0;
+	while ((n = write (sio->sdw, buf + total, len - total)) < 0)
+	  {
+	    if (errno == EINTR)
+	      continue;
+	    if (errno != EAGAIN)
+	      goto fail;
+
+	    pollfd.revents = 0;
+	    while ((status = poll (&pollfd, 1, sio->milliseconds)) < 0)
+	      if (errno != EINTR)
+		goto fail;
+	    if (status == 0)
+	      {
+	        errno = ETIMEDOUT;
+		goto fail;
+	      }
+	    if (!(pollfd.revents & POLLOUT))
+	      goto fail;
+	    errno = 0;
+	  }
+      }
+  return;
+
+fail:
+  sio->write_error = 1;
+}
+
+/* As raw_write() for several buffers, which are written with writev().
+   The iovec array is modified.  */
+static void
+raw_writev (struct siobuf *sio, struct iovec *iov, int iovcnt)
+{
+  struct pollfd pollfd;
+  ssize_t n;
+  int status;
+
+  pollfd.fd = sio->sdw;
+  pollfd.events = POLLOUT;
+  while (iovcnt > 0)
+    {
+      errno = 0;
+#ifdef USE_IO_URING
+      if (sio->uring != NULL)
+	{
+	  if ((n = uring_writev (sio, iov, iovcnt)) < 0)
+	    goto fail;
+	}
+      else
+#endif
+      while ((n = writev (sio->sdw, iov, iovcnt)) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN)
+	    goto fail;
+
+	  pollfd.revents = 0;
+	  while ((status = poll (&pollfd, 1, sio->milliseconds)) < 0)
+	    if (errno != EINTR)
+	      goto fail;
+	  if (status == 0)
+	    {
+	      errno = ETIMEDOUT;
+	      goto fail;
+	    }
+	  if (!(pollfd.revents & POLLOUT))
+	    goto fail;
+	  errno = 0;
+	}
+
+      /* Skip the buffers written, and adjust a partial write.  */
+      while (iovcnt > 0 && (size_t) n >= iov->iov_len)
+	{
+	  n -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (iovcnt > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+  return;
+
+fail:
+  sio->write_error = 1;
+}
+
+/* Write without waiting.  Return the number of bytes written which may
+   be zero if the socket is not ready, or -1 on error.  */
+static int
+nb_write (struct siobuf *sio, const char *buf, int len)
+{
+  int n;
+
+  assert (sio != NULL && buf != NULL);
+
+#ifdef USE_TLS
+  if (sio->ssl != NULL && !(sio->ktls & SIO_WRITE))
+    {
+      /* If SSL_write() cannot proceed it must be retried with the same
+	 data.  The data remains at the start of the output queue.  */
+      sio->ssl_want = 0;
+      if ((n = SSL_write (sio->ssl, buf, len)) > 0)
+	return n;
+      switch (SSL_get_error (sio->ssl, n))
+	{
+	case SSL_ERROR_WANT_READ:
+	  sio->ssl_want = SIO_READ;
+	  return 0;
+	case SSL_ERROR_WANT_WRITE:
+	  sio->ssl_want = SIO_WRITE;
+	  return 0;
+	default:
+	  return -1;
+	}
+    }
+#endif
+  while ((n = write (sio->sdw, buf, len)) < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+  return n;
+}
+
+/* Append data to the output queue, growing it as required. */
+static void
+queue_write (struct siobuf *sio, const char *buf, int len)
+{
+  int n;
+  char *nbuf;
+
+  if (sio->write_error)
+    return;
+
+  /* Write directly if nothing is queued, otherwise preserve order. */
+  if (sio->out_length == 0)
+    {
+      if ((n = nb_write (sio, buf, len)) < 0)
+	{
+	  sio->write_error = 1;
+	  return;
+	}
+      buf += n;
+      len -= n;
+      if (len == 0)
+	return;
+    }
+
+  if (sio->out_length + len > sio->out_size)
+    {
+      n = sio->out_size > 0 ? sio->out_size : sio->write_size;
+      while (n < sio->out_length + len)
+	n *= 2;
+      if ((nbuf = realloc (sio->out_buffer, n)) == NULL)
+	{
+	  sio->write_error = 1;
+	  return;
+	}
+      sio->out_buffer = nbuf;
+      sio->out_size = n;
+    }
+  memcpy (sio->out_buffer + sio->out_length, buf, len);
+  sio->out_length += len;
+}
 
-void
-sio_write (struct siobuf *sio, const void *bufp, int buflen)
+/* Write as much of the output queue as the socket will accept.  Return
+   the number of bytes remaining in the queue or -1 on error. */
+int
+sio_drain (struct siobuf *sio)
 {
-  const char *buf = bufp;
-
-  assert (sio != NULL && buf != NULL);
+  int n;
 
-  if (buflen < 0)
-    buflen = strlen (buf);
-  if (buflen == 0)
-    return;
+  assert (sio != NULL);
 
-  while (buflen > sio->write_available)
+  if (sio->write_error)
+    return -1;
+  while (sio->out_length > 0)
     {
-      if (sio->write_available > 0)
+      if ((n = nb_write (sio, sio->out_buffer, sio->out_length)) < 0)
 	{
-	  memcpy (sio->write_position, buf, sio->write_available);
-	  sio->write_position += sio->write_available;
-	  buf += sio->write_available;
-	  buflen -= sio->write_available;
+	  sio->write_error = 1;
+	  sio->out_length = 0;
+	  return -1;
 	}
-      sio_flush (sio);
-      assert (sio->write_available > 0);
-    }
-  if (buflen > 0)
-    {
-      memcpy (sio->write_position, buf, buflen);
-      sio->write_position += buflen;
-      sio->write_available -= buflen;
-      /* If the buffer is exactly filled, flush it */
-      if (sio->write_available == 0)
-	sio_flush (sio);
+      if (n == 0)
+	break;
+      sio->out_length -= n;
+      if (sio->out_length > 0)
+	memmove (sio->out_buffer, sio->out_buffer + n, sio->out_length);
     }
+  release_write_buffer (sio);
+  return sio->out_length;
 }
 
-static void
-raw_write (struct siobuf *sio, const char *buf, int len)
+/* Number of bytes flushed but not yet written to the socket.  This is
+   always zero in blocking mode. */
+int
+sio_write_pending (struct siobuf *sio)
 {
-  int n, total, status;
-  struct pollfd pollfd;
+  assert (sio != NULL);
 
-  assert (sio != NULL && buf != NULL);
+  return sio->out_length;
+}
 
-  for (total = 0; total < len; total += n)
+/* Return the events (SIO_READ, SIO_WRITE) the caller must poll for in
+   non-blocking mode, before retrying an operation that could not
+   complete.  SIO_READ is not included unless OpenSSL needs it. */
+int
+sio_events (struct siobuf *sio)
+{
+  int events = 0;
+
+  assert (sio != NULL);
+
+  if (sio->out_length > 0)
+    events |= SIO_WRITE;
 #ifdef USE_TLS
-    if (sio->ssl != NULL)
-      {
-	/* SSL_write() writes a record a time.	The outer loop calls
-	   it repeatedly until all the write buffer contents have
-	   been written.  The inner loop handles EAGAIN (EWOULDBLOCK)
-	   propagating up through OpenSSL. */
-	while ((n = SSL_write (sio->ssl, buf, len)) <= 0)
-	  if (sio_sslpoll (sio, n) <= 0)
-	    return;
-      }
-    else
+  if (sio->ssl != NULL)
+    events |= sio->ssl_want;
 #endif
-      {
-        /* Its conceiveable that write() actually writes less than
-           requested.  The outer loop calls this until all of the write
-           buffer has been written.  The inner loop handles blocking
-           in poll() and errors */
-	pollfd.fd = sio->sdw;
-	pollfd.events = POLLOUT;
-	errno = 0;
-	while ((n = write (sio->sdw, buf + total, len - total)) < 0)
-	  {
-	    if (errno == EINTR)
-	      continue;
-	    if (errno != EAGAIN)
-	      return;
+  return events;
+}
 
-	    pollfd.revents = 0;
-	    while ((status = poll (&pollfd, 1, sio->milliseconds)) < 0)
-	      if (errno != EINTR)
-		return;
-	    if (status == 0)
-	      {
-	        errno = ETIMEDOUT;
-		return;
-	      }
-	    if (!(pollfd.revents & POLLOUT))
-	      return;
-	    errno = 0;
-	  }
-      }
+static void
+set_corked (struct siobuf *sio, int state)
+{
+#ifdef TCP_CORK
+  int save_errno;
+
+  if (sio->corked != state)
+    {
+      save_errno = errno;
+      setsockopt (sio->sdw, IPPROTO_TCP, TCP_CORK, &state, sizeof state);
+      errno = save_errno;
+      sio->corked = state;
+    }
+#else
+  (void) sio;
+  (void) state;
+#endif
 }
 
-void
-sio_flush (struct siobuf *sio)
+/* Write the buffer contents.  more is set if the buffer is flushed
+   because it is full, in which case more output follows.  */
+static void
+flush_buffer (struct siobuf *sio, int more)
 {
   int length;
 
   assert (sio != NULL);
 
-  if (sio->flush_mark != NULL && sio->flush_mark > sio->write_buffer)
-    length = sio->flush_mark - sio->write_buffer;
+  if (sio->write_buffer == NULL)
+    length = 0;
+  else if (sio->flush_mark != NULL && sio->flush_mark > sio->write_start)
+    length = sio->flush_mark - sio->write_start;
   else
-    length = sio->write_position - sio->write_buffer;
+    length = sio->write_position - sio->write_start;
   if (length <= 0)
-    return;
+    {
+      if (!more)
+	set_corked (sio, 0);
+      return;
+    }
+  if (more && sio->cork)
+    set_corked (sio, 1);
 
   if (sio->monitor_cb != NULL)
-    (*sio->monitor_cb) (sio->write_buffer, length, 1, sio->cbarg);
+    (*sio->monitor_cb) (sio->write_start, length, 1, sio->cbarg);
 
   if (sio->encode_cb != NULL)
     {
@@ -439,23 +1624,43 @@ sio_flush (struct siobuf *sio)
          callback must maintain its own buffer which must persist until
          the next call in the same thread.  The secarg argument may be
          used to maintain this buffer. */
-      (*sio->encode_cb) (&buf, &len, sio->write_buffer, length, sio->secarg);
-      raw_write (sio, buf, len);
+      (*sio->encode_cb) (&buf, &len, sio->write_start, length, sio->secarg);
+      if (sio->nonblocking)
+	queue_write (sio, buf, len);
+      else
+	raw_write (sio, buf, len);
     }
+  else if (sio->nonblocking)
+    queue_write (sio, sio->write_start, length);
   else
-    raw_write (sio, sio->write_buffer, length);
+    raw_write (sio, sio->write_start, length);
 
-  if (sio->flush_mark != NULL && sio->flush_mark > sio->write_buffer)
+  /* Output beyond the flush mark stays where it is.  It is moved to the
+     start of the buffer only if room is needed for more output.  */
+  sio->write_start += length;
+  sio->flush_mark = NULL;
+  length = sio->write_position - sio->write_start;
+  if (length == 0)
     {
-      length = sio->write_position - sio->flush_mark;
-      if (length > 0)
-        memmove (sio->write_buffer, sio->flush_mark, length);
+      sio->write_start = sio->write_position = sio->write_buffer;
+      sio->write_available = sio->write_alloc;
     }
-  else
-    length = 0;
-  sio->write_available = sio->buffer_size - length;
-  sio->write_position = sio->write_buffer + length;
-  sio->flush_mark = NULL;
+  else if (more && sio->write_start > sio->write_buffer)
+    {
+      memmove (sio->write_buffer, sio->write_start, length);
+      sio->write_start = sio->write_buffer;
+      sio->write_position = sio->write_buffer + length;
+      sio->write_available = sio->write_alloc - length;
+    }
+  if (!more)
+    set_corked (sio, 0);
+  release_write_buffer (sio);
+}
+
+void
+sio_flush (struct siobuf *sio)
+{
+  flush_buffer (sio, 0);
 }
 
 void
@@ -466,6 +1671,43 @@ sio_mark (struct siobuf *sio)
   sio->flush_mark = sio->write_position;
 }
 
+/* Read without waiting.  Return the number of bytes read, zero if no
+   data is available or -1 if the connection is closed or fails. */
+static int
+nb_read (struct siobuf *sio, char *buf, int len)
+{
+  int n;
+
+  assert (sio != NULL && buf != NULL && len > 0);
+
+#ifdef USE_TLS
+  if (sio->ssl != NULL)
+    {
+      sio->ssl_want = 0;
+      if ((n = SSL_read (sio->ssl, buf, len)) > 0)
+	return n;
+      switch (SSL_get_error (sio->ssl, n))
+	{
+	case SSL_ERROR_WANT_READ:
+	  sio->ssl_want = SIO_READ;
+	  return 0;
+	case SSL_ERROR_WANT_WRITE:
+	  sio->ssl_want = SIO_WRITE;
+	  return 0;
+	default:
+	  return -1;
+	}
+    }
+#endif
+  while ((n = read (sio->sdr, buf, len)) < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+  return n > 0 ? n : -1;
+}
+
 /* N.B. raw_read() requires a non-blocking read, otherwise it would
    block indefinitely instead of timing out.  Normally the poll()
    should not be needed since the protocol level will have polled
@@ -478,6 +1720,11 @@ raw_read (struct siobuf *sio, char *buf, int len)
 
   assert (sio != NULL && buf != NULL && len > 0);
 
+  /* Never wait in non-blocking mode.  Input is normally read ahead, see
+     sio_read_ahead(), so reaching here indicates a truncated response. */
+  if (sio->nonblocking)
+    return sio->eof ? 0 : nb_read (sio, buf, len);
+
 #ifdef USE_TLS
   if (sio->ssl != NULL)
     {
@@ -492,6 +1739,14 @@ raw_read (struct siobuf *sio, char *buf, int len)
 	  break;
     }
   else
+#endif
+#ifdef USE_IO_URING
+  if (sio->uring != NULL)
+    {
+      if ((n = uring_rw (sio, 0, buf, len)) < 0)
+	return 0;
+    }
+  else
 #endif
     {
       pollfd.fd = sio->sdr;
@@ -526,7 +1781,9 @@ sio_fill (struct siobuf *sio)
 {
   assert (sio != NULL);
 
-  sio->read_unread = raw_read (sio, sio->read_buffer, sio->buffer_size);
+  if (!want_read_buffer (sio))
+    return 0;
+  sio->read_unread = raw_read (sio, sio->read_buffer, sio->read_size);
   if (sio->read_unread <= 0)
     return 0;
 
@@ -550,6 +1807,116 @@ sio_fill (struct siobuf *sio)
   return sio->read_unread > 0;
 }
 
+/* Append as much input as is available without waiting to the read
+   buffer.  This is used in non-blocking mode to accumulate complete
+   responses before they are processed, the buffer grows as required up to
+   SIO_READ_MAX bytes.  Return the number of bytes read, zero if no input is
+   available or -1 if the connection is closed, fails or the buffer limit
+   is reached. */
+int
+sio_read_ahead (struct siobuf *sio)
+{
+  char *buf, *nbuf;
+  int n, len, space, total;
+
+  assert (sio != NULL);
+
+  if (sio->eof || !want_read_buffer (sio))
+    return -1;
+
+  for (total = 0;;)
+    {
+      /* Move unread data to the start of the buffer. */
+      if (sio->read_position != sio->read_buffer)
+	{
+	  if (sio->read_unread > 0)
+	    memmove (sio->read_buffer, sio->read_position, sio->read_unread);
+	  sio->read_position = sio->read_buffer;
+	}
+      if (sio->read_unread < 0)
+	sio->read_unread = 0;
+
+      space = sio->read_size - sio->read_unread;
+      if (space == 0)
+	{
+	  if (sio->read_size >= SIO_READ_MAX)
+	    break;
+	  n = sio->read_size * 2;
+	  if ((nbuf = realloc (sio->read_buffer, n)) == NULL)
+	    {
+	      sio->eof = 1;
+	      break;
+	    }
+	  sio->read_position = sio->read_buffer = nbuf;
+	  sio->read_size = n;
+	  space = n - sio->read_unread;
+	}
+
+      buf = sio->read_buffer + sio->read_unread;
+      if ((n = nb_read (sio, buf, space)) <= 0)
+	{
+	  if (n < 0)
+	    sio->eof = 1;
+	  break;
+	}
+
+      if (sio->decode_cb != NULL)
+	{
+	  char *dst;
+
+	  /* See sio_fill() regarding the decode callback.  Decoded
+	     output is copied back to the read buffer. */
+	  (*sio->decode_cb) (&dst, &len, buf, n, sio->secarg);
+	  if (len > space)
+	    {
+	      n = sio->read_unread + len;
+	      if ((nbuf = realloc (sio->read_buffer, n)) == NULL)
+		{
+		  sio->eof = 1;
+		  break;
+		}
+	      sio->read_position = sio->read_buffer = nbuf;
+	      sio->read_size = n;
+	      buf = sio->read_buffer + sio->read_unread;
+	    }
+	  if (len > 0)
+	    memmove (buf, dst, len);
+	}
+      else
+	len = n;
+
+      if (sio->monitor_cb != NULL && len > 0)
+	(*sio->monitor_cb) (buf, len, 0, sio->cbarg);
+      sio->read_unread += len;
+      total += n;
+    }
+
+  if (total > 0)
+    return total;
+  release_read_buffer (sio);
+  if (sio->eof || sio->read_unread >= SIO_READ_MAX)
+    {
+      sio->eof = 1;
+      return -1;
+    }
+  return 0;
+}
+
+/* Return a pointer to the unread data in the read buffer.  */
+const char *
+sio_peek (struct siobuf *sio, int *len)
+{
+  assert (sio != NULL && len != NULL);
+
+  if (sio->read_unread <= 0)
+    {
+      *len = 0;
+      return "";
+    }
+  *len = sio->read_unread;
+  return sio->read_position;
+}
+
 int
 sio_read (struct siobuf *sio, void *bufp, int buflen)
 {
@@ -573,18 +1940,134 @@ sio_read (struct siobuf *sio, void *bufp, int buflen)
 
         total += count;
         if ((buflen -= count) <= 0)
-          return total;
+	  {
+	    release_read_buffer (sio);
+	    return total;
+	  }
         buf += count;
       }
   while (sio_fill (sio));
+  release_read_buffer (sio);
   return total;
 }
 
+/* Replace the read buffer with one of SIZE octets, moving the unread data
+   to its start.  */
+static int
+resize_read_buffer (struct siobuf *sio, int size)
+{
+  char *nbuf;
+
+  if ((nbuf = slab_alloc (size)) == NULL)
+    return 0;
+  if (sio->read_unread > 0)
+    memcpy (nbuf, sio->read_position, sio->read_unread);
+  slab_free (sio->read_buffer, sio->read_size);
+  sio->read_position = sio->read_buffer = nbuf;
+  sio->read_size = size;
+  return 1;
+}
+
+/* Append more input to the partial line in the read buffer.  The line
+   is first moved to the start of the buffer, which grows if the line
+   fills it, up to SIO_READ_MAX octets.  Returns zero at end of input or if
+   the line cannot be extended.  */
+static int
+append_input (struct siobuf *sio)
+{
+  char *buf, *dst;
+  int n, len, space;
+
+  if (sio->read_unread >= sio->read_size)
+    {
+      if (sio->read_unread >= SIO_READ_MAX)
+	return 0;
+      n = sio->read_unread * 2;
+      if (!resize_read_buffer (sio, n < SIO_READ_MAX ? n : SIO_READ_MAX))
+	return 0;
+    }
+  else if (sio->read_position != sio->read_buffer)
+    {
+      memmove (sio->read_buffer, sio->read_position, sio->read_unread);
+      sio->read_position = sio->read_buffer;
+    }
+
+  buf = sio->read_buffer + sio->read_unread;
+  space = sio->read_size - sio->read_unread;
+  if ((n = raw_read (sio, buf, space)) <= 0)
+    return 0;
+
+  if (sio->decode_cb != NULL)
+    {
+      /* See sio_fill() regarding the decode callback.  */
+      (*sio->decode_cb) (&dst, &len, buf, n, sio->secarg);
+      if (len > space)
+	{
+	  if (!resize_read_buffer (sio, sio->read_unread + len))
+	    return 0;
+	  buf = sio->read_buffer + sio->read_unread;
+	}
+      if (len > 0)
+	memmove (buf, dst, len);
+    }
+  else
+    len = n;
+
+  if (sio->monitor_cb != NULL && len > 0)
+    (*sio->monitor_cb) (buf, len, 0, sio->cbarg);
+  sio->read_unread += len;
+  return 1;
+}
+
+/* Return the next line of input in place in the read buffer.  The line
+   includes its terminating newline and *len is set to its length.  It is
+   not NUL terminated.  A line longer than SIO_READ_MAX octets or a final
+   line without a newline is returned unterminated.  The line may be
+   modified and remains valid until the next read or sio_release().
+   Returns NULL at end of input.  */
+char *
+sio_getline (struct siobuf *sio, int *len)
+{
+  char *line, *nl;
+  int scanned;
+
+  assert (sio != NULL && len != NULL);
+
+  if (sio->read_unread <= 0 && !sio_fill (sio))
+    return NULL;
+
+  scanned = 0;
+  while ((nl = memchr (sio->read_position + scanned, '\n',
+		       sio->read_unread - scanned)) == NULL)
+    {
+      scanned = sio->read_unread;
+      if (!append_input (sio))
+	break;
+    }
+
+  line = sio->read_position;
+  *len = nl != NULL ? nl + 1 - line : sio->read_unread;
+  sio->read_position += *len;
+  sio->read_unread -= *len;
+  return line;
+}
+
+/* Release the read buffer if it is empty, as sio_read() and sio_gets() do
+   after copying out the data.  Lines returned by sio_getline() are invalid
+   after this.  */
+void
+sio_release (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+  release_read_buffer (sio);
+}
+
 char *
 sio_gets (struct siobuf *sio, char buf[], int buflen)
 {
-  int c;
-  char *p;
+  char *p, *nl;
+  int count;
 
   assert (sio != NULL && buf != NULL && buflen > 0);
 
@@ -593,20 +2076,23 @@ sio_gets (struct siobuf *sio, char buf[], int buflen)
 
   p = buf;
   do
-    while (sio->read_unread > 0)
+    if (sio->read_unread > 0)
       {
-	c = *sio->read_position++;
-	sio->read_unread--;
-	*p++ = c;
-	buflen--;
-	if (c == '\n' || buflen <= 1)
-	  {
-	    *p = '\0';
-	    return buf;
-	  }
+	if ((count = sio->read_unread) > buflen - 1)
+	  count = buflen - 1;
+	if ((nl = memchr (sio->read_position, '\n', count)) != NULL)
+	  count = nl + 1 - sio->read_position;
+	memcpy (p, sio->read_position, count);
+	sio->read_position += count;
+	sio->read_unread -= count;
+	p += count;
+	buflen -= count;
+	if (nl != NULL || buflen <= 1)
+	  break;
       }
   while (sio_fill (sio));
   *p = '\0';
+  release_read_buffer (sio);
   return buf;
 }
 
@@ -643,3 +2129,85 @@ sio_printf (struct siobuf *sio, const char *format, ...)
     sio_write (sio, buf, len);
   return len;
 }
+
+/* Check if sio_sendfile() can be used.  The file is copied to the socket
+   without passing through the buffer so this is not possible if the data
+   must be encrypted or encoded, or if output is queued.  Encryption is
+   possible if it is offloaded to the kernel.  */
+int
+sio_can_sendfile (struct siobuf *sio)
+{
+  assert (sio != NULL);
+
+#if HAVE_SENDFILE
+# ifdef USE_TLS
+  if (sio->ssl != NULL && !(sio->ktls & SIO_WRITE))
+    return 0;
+# endif
+  return sio->encode_cb == NULL && !sio->nonblocking;
+#else
+  return 0;
+#endif
+}
+
+/* Copy count octets from the file to the socket, starting at *offset,
+   which is advanced past the data copied.  Buffered output is flushed
+   first.  The data is copied by the kernel, without passing through user
+   space.  Returns the number of octets copied, which is less than count
+   if the file is shorter, or -1 on error.  */
+int
+sio_sendfile (struct siobuf *sio, int fd, off_t *offset, int count)
+{
+#if HAVE_SENDFILE
+  struct pollfd pollfd;
+  ssize_t n;
+  int total, status;
+
+  assert (sio != NULL && offset != NULL && sio_can_sendfile (sio));
+
+  /* All buffered output must precede the file data.  If corking, the
+     buffered output is sent with the start of the file.  */
+  sio->flush_mark = NULL;
+  flush_buffer (sio, 1);
+  if (sio->write_error)
+    return -1;
+
+  pollfd.fd = sio->sdw;
+  pollfd.events = POLLOUT;
+  for (total = 0; total < count; total += n)
+    {
+      while ((n = sendfile (sio->sdw, fd, offset, count - total)) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN)
+	    return -1;
+
+	  pollfd.revents = 0;
+	  while ((status = poll (&pollfd, 1, sio->milliseconds)) < 0)
+	    if (errno != EINTR)
+	      return -1;
+	  if (status == 0)
+	    {
+	      errno = ETIMEDOUT;
+	      return -1;
+	    }
+	  if (!(pollfd.revents & POLLOUT))
+	    {
+	      errno = EPIPE;
+	      return -1;
+	    }
+	}
+      if (n == 0)
+	break;
+    }
+  return total;
+#else
+  (void) sio;
+  (void) fd;
+  (void) offset;
+  (void) count;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
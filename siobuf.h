@@ -27,6 +27,8 @@ typedef struct siobuf *siobuf_t;
 #define SIO_BUFSIZE	2048 /* arbitrary, not too short, not too long */
 #define SIO_READ	1
 #define SIO_WRITE	2
+#define SIO_HIGHWATER	(16 * SIO_BUFSIZE) /* output queue limit */
+#define SIO_IOV_MAX	16 /* buffers accepted by sio_writev() */
 
 typedef void (*recodecb_t) (char **dstbuf, int *dstlen,
 			    const char *srcbuf, int srclen, void *arg);
@@ -35,17 +37,35 @@ typedef void (*monitorcb_t) (const char *buffer, int length, int direction,
 
 struct siobuf *sio_attach(int sdr, int sdw, int buffer_size);
 void sio_detach(struct siobuf *sio);
+void sio_set_lowmem(struct siobuf *sio, int state);
+void sio_set_buffer_size(struct siobuf *sio, int read_size, int write_size);
+void sio_set_cork(struct siobuf *sio, int state);
+size_t sio_memory_usage(struct siobuf *sio);
+void sio_set_nonblocking(struct siobuf *sio, int state);
+int sio_set_uring(struct siobuf *sio, int state);
 void sio_set_monitorcb(struct siobuf *sio, monitorcb_t cb, void *arg);
 void sio_set_timeout(struct siobuf *sio, int milliseconds);
 void sio_set_securitycb(struct siobuf *sio, recodecb_t encode_cb,
 		        recodecb_t decode_cb, void *arg);
 int sio_poll(struct siobuf *sio,int want_read, int want_write, int fast);
 void sio_write(struct siobuf *sio, const void *bufp, int buflen);
+struct iovec;
+void sio_writev(struct siobuf *sio, const struct iovec *iov, int iovcnt);
 void sio_flush(struct siobuf *sio);
 void sio_mark(struct siobuf *sio);
 int sio_fill(struct siobuf *sio);
 int sio_read(struct siobuf *sio, void *bufp, int buflen);
 char *sio_gets(struct siobuf *sio, char buf[], int buflen);
+char *sio_getline(struct siobuf *sio, int *len);
+void sio_release(struct siobuf *sio);
+int sio_drain(struct siobuf *sio);
+int sio_write_pending(struct siobuf *sio);
+int sio_events(struct siobuf *sio);
+int sio_read_ahead(struct siobuf *sio);
+const char *sio_peek(struct siobuf *sio, int *len);
+int sio_get_timeout(struct siobuf *sio);
+int sio_can_sendfile(struct siobuf *sio);
+int sio_sendfile(struct siobuf *sio, int fd, off_t *offset, int count);
 int sio_printf(struct siobuf *sio, const char *format, ...)
 	       __attribute__ ((format (printf, 2, 3))) ;
 void *sio_set_userdata (struct siobuf *sio, void *user_data);
@@ -55,5 +75,9 @@ void *sio_get_userdata (struct siobuf *io);
 #ifdef USE_TLS
 int sio_set_tlsclient_ssl (struct siobuf *sio, SSL *ssl);
 int sio_set_tlsserver_ssl (struct siobuf *sio, SSL *ssl);
+void sio_start_tlsclient_ssl (struct siobuf *sio, SSL *ssl);
+int sio_tls_handshake (struct siobuf *sio);
+SSL *sio_get_ssl (struct siobuf *sio);
+int sio_tls_offload (struct siobuf *sio);
 #endif
 #endif
@@ -32,7 +32,9 @@
 #include <errno.h>
 #include "api.h"
 #include "libesmtp-private.h"
+#include "siobuf.h"
 #include "headers.h"
+#include "arena.h"
 
 /* This file contains the SMTP client library's external API.  For the
    most part, it just sanity checks function arguments and either carries
@@ -77,7 +79,10 @@ smtp_create_session (void)
   session->data_timeout = DATA_DEFAULT;
   session->transfer_timeout = TRANSFER_DEFAULT;
   session->data2_timeout = DATA2_DEFAULT;
+  session->connect_timeout = CONNECT_DEFAULT;
 
+  session->sd = -1;
+  session->connect_time = -1;
   return session;
 }
 
@@ -148,6 +153,310 @@ smtp_get_server_name (smtp_session_t session)
   return session->canon != NULL ? session->canon : session->host;
 }
 
+/**
+ * smtp_get_connect_time() - get time taken to connect to the MTA.
+ * @session: The session.
+ *
+ * Get the time taken to establish the connection to the submission MTA in
+ * the most recent call to smtp_start_session() or smtp_session_begin().
+ * This is valid from the %SMTP_EV_CONNECT event onwards.  When the MTA has
+ * several addresses, connections are attempted concurrently and this is
+ * the time until the first succeeded.  Zero is returned if a connection
+ * from a connection pool was reused.
+ *
+ * Return: Connect time in milliseconds or -1 if not connected.
+ */
+long
+smtp_get_connect_time (smtp_session_t session)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, -1);
+
+  return session->connect_time;
+}
+
+/**
+ * smtp_set_low_memory() - Minimise the memory held by the connection.
+ * @session: The session.
+ * @onoff: Non-zero to enable low memory mode.
+ *
+ * Normally a connection holds its read and write buffers, and OpenSSL its
+ * record buffers, for as long as it is open.  In low memory mode the
+ * buffers are released whenever they are empty, which is most of the time
+ * while waiting for the server, and reallocated when needed.  Buffers are
+ * recycled through a process-wide free list so this is inexpensive.  This
+ * is useful for applications with many concurrent non-blocking sessions or
+ * large connection pools.  The setting applies to a pooled connection
+ * for as long as it is used by the session.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_low_memory (smtp_session_t session, int onoff)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  session->low_memory = !!onoff;
+  return 1;
+}
+
+/* Limit on the buffer sizes accepted by smtp_set_buffer_size().  */
+#define BUFFER_SIZE_MIN		256
+#define BUFFER_SIZE_MAX		(4 * 1024 * 1024)
+#define valid_buffer_size(n)						\
+	((n) == 0 || ((n) >= BUFFER_SIZE_MIN && (n) <= BUFFER_SIZE_MAX))
+
+/**
+ * smtp_set_buffer_size() - Set the connection buffer sizes.
+ * @session: The session.
+ * @read_size: Size of the buffer for responses from the MTA.
+ * @write_size: Size of the buffer for commands.
+ * @data_size: Size of the buffer for the message.
+ *
+ * Set the sizes of the buffers used for the connection to the MTA.  Output
+ * is written to the socket, or to OpenSSL, a buffer at a time so a larger
+ * write buffer means fewer system calls and larger TLS records, which is
+ * worthwhile on links with a high bandwidth-delay product.  Commands are
+ * short, so for the message a different write buffer size may be set with
+ * @data_size.  The write buffer then grows when message transfer with
+ * DATA or BDAT starts and shrinks again once it completes.
+ *
+ * A size of zero selects the default, 2048 octets, or, for @data_size, the
+ * same size as @write_size.  Otherwise sizes must be between 256 octets
+ * and 4 MiB.  Larger buffers cost memory for each connection, see also
+ * smtp_set_low_memory().
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_buffer_size (smtp_session_t session, int read_size, int write_size,
+		      int data_size)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && valid_buffer_size (read_size)
+		      && valid_buffer_size (write_size)
+		      && valid_buffer_size (data_size), 0);
+
+  session->read_buffer_size = read_size;
+  session->write_buffer_size = write_size;
+  session->data_buffer_size = data_size;
+  return 1;
+}
+
+/**
+ * smtp_set_socket_options() - Set socket options for the connection.
+ * @session: The session.
+ * @sndbuf: Socket send buffer size (%SO_SNDBUF) or zero.
+ * @rcvbuf: Socket receive buffer size (%SO_RCVBUF) or zero.
+ * @nodelay: Non-zero to set %TCP_NODELAY.
+ *
+ * Set the kernel socket buffer sizes for new connections to the MTA.  Zero
+ * leaves the system default and its automatic tuning in effect.  The sizes
+ * are set before connecting so that a suitable TCP window scale is
+ * negotiated.
+ *
+ * If @nodelay is set, the Nagle algorithm is disabled so that each group
+ * of pipelined commands is sent without waiting for outstanding
+ * acknowledgements.  Where %TCP_CORK is available, the socket is corked
+ * while a group of commands or a message which exceeds the write buffer is
+ * written, and uncorked when the group is complete, so that data is still
+ * sent in full segments.
+ *
+ * These options apply to sockets connected by this session; a connection
+ * reused from a connection pool keeps the options it was created with.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_socket_options (smtp_session_t session, int sndbuf, int rcvbuf,
+			 int nodelay)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && sndbuf >= 0 && rcvbuf >= 0, 0);
+
+  session->sndbuf = sndbuf;
+  session->rcvbuf = rcvbuf;
+  session->tcp_nodelay = !!nodelay;
+  return 1;
+}
+
+/**
+ * smtp_set_io_uring() - Use io_uring for I/O on the connection.
+ * @session: The session.
+ * @onoff: Non-zero to use io_uring.
+ *
+ * By default the connection to the MTA waits for the socket with poll()
+ * before each read or write.  If enabled, reads and writes are instead
+ * submitted to a Linux io_uring with a linked timeout, so that each costs
+ * a single system call, and no system call is needed to check for the
+ * responses to pipelined commands until one arrives.  This reduces the
+ * system calls made for transactions with many recipients.
+ *
+ * io_uring is used only by smtp_start_session() and only until TLS is
+ * started, the poll() backend is used otherwise or if the kernel does not
+ * permit io_uring.
+ *
+ * Return: Zero on failure, non-zero on success.  Fails if libESMTP was
+ * built without io_uring support.
+ */
+int
+smtp_set_io_uring (smtp_session_t session, int onoff)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+#ifdef USE_IO_URING
+  session->io_uring = !!onoff;
+  return 1;
+#else
+  if (!onoff)
+    return 1;
+  set_errno (ENOSYS);
+  return 0;
+#endif
+}
+
+/**
+ * smtp_get_memory_usage() - Get the memory used by the session.
+ * @session: The session.
+ *
+ * Report the memory held by the session structure, by its arena, if one
+ * has been set with smtp_set_arena(), and by the buffering for its
+ * connection to the MTA, if one is open.  Messages and recipients not
+ * allocated from an arena and the memory held internally by OpenSSL are
+ * not included.  This may be called at any time, including from the event
+ * and monitor callbacks.
+ *
+ * Return: Memory in use in octets or zero on failure.
+ */
+size_t
+smtp_get_memory_usage (smtp_session_t session)
+{
+  size_t total;
+
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  total = sizeof (struct smtp_session);
+  total += arena_memory_usage (session->arena);
+  if (session->conn != NULL)
+    total += sio_memory_usage (session->conn);
+  return total;
+}
+
+/* Default arena block size and whether the arena can still be replaced,
+   which is not possible once memory has been allocated from it.  */
+#define ARENA_DEFAULT		(16 * 1024)
+#define arena_replaceable(s)	((s)->messages == NULL && (s)->mta_status.text == NULL)
+
+/**
+ * smtp_set_arena() - Allocate session memory from an arena.
+ * @session: The session.
+ * @block_size: Size of the arena's blocks or zero for the default.
+ *
+ * By default each message, recipient, header and status message from the
+ * MTA is separately allocated with malloc() and freed again by
+ * smtp_destroy_session().  When an arena is set, these are instead carved
+ * from blocks of @block_size octets, by default 16 KiB, which are released
+ * together when the session is destroyed.  This saves an allocation and a
+ * free for each of them and keeps the memory for a session compact, which
+ * is worthwhile for messages with many recipients.  Memory in the arena is
+ * not reused while the session exists, so replacing values, for example by
+ * calling smtp_set_reverse_path() repeatedly, consumes additional memory.
+ *
+ * This must be called before any messages are added to the session.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_arena (smtp_session_t session, size_t block_size)
+{
+  struct arena *arena;
+
+  SMTPAPI_CHECK_ARGS (session != NULL && arena_replaceable (session), 0);
+
+  if ((arena = arena_create (block_size != 0 ? block_size : ARENA_DEFAULT,
+			     NULL, NULL)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  arena_destroy (session->arena);
+  session->arena = arena;
+  return 1;
+}
+
+/**
+ * smtp_set_allocator() - Set the allocator for the session's arena.
+ * @session: The session.
+ * @alloc: Allocator for the arena's blocks.
+ * @arg: User data passed to @alloc.
+ *
+ * Obtain the blocks of the session's arena by calling @alloc instead of
+ * malloc().  If smtp_set_arena() has not been called, an arena with the
+ * default block size is set.  @alloc is called for each block and when the
+ * session is destroyed to release them.  Like smtp_set_arena(), this must
+ * be called before any messages are added to the session.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_allocator (smtp_session_t session, smtp_alloc_t alloc, void *arg)
+{
+  struct arena *arena;
+  size_t block_size;
+
+  SMTPAPI_CHECK_ARGS (session != NULL && alloc != NULL
+		      && arena_replaceable (session), 0);
+
+  block_size = ARENA_DEFAULT;
+  if (session->arena != NULL)
+    block_size = arena_block_size (session->arena);
+  if ((arena = arena_create (block_size, alloc, arg)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  arena_destroy (session->arena);
+  session->arena = arena;
+  return 1;
+}
+
+/* Memory for messages, recipients, headers and status text.  Taken from
+   the arena if there is one, otherwise from malloc().  */
+void *
+session_alloc (smtp_session_t session, size_t size)
+{
+  if (session->arena != NULL)
+    return arena_alloc (session->arena, size);
+  return malloc (size);
+}
+
+char *
+session_strndup (smtp_session_t session, const char *string, size_t len)
+{
+  char *p;
+
+  if (session->arena != NULL)
+    return arena_strndup (session->arena, string, len);
+  if ((p = malloc (len + 1)) != NULL)
+    {
+      memcpy (p, string, len);
+      p[len] = '\0';
+    }
+  return p;
+}
+
+char *
+session_strdup (smtp_session_t session, const char *string)
+{
+  return session_strndup (session, string, strlen (string));
+}
+
+void
+session_free (smtp_session_t session, void *ptr)
+{
+  if (session->arena != NULL)
+    arena_free (session->arena, ptr);
+  else
+    free (ptr);
+}
+
 /**
  * smtp_set_hostname() - Set the local host name.
  * @session: The session.
@@ -203,7 +512,7 @@ smtp_add_message (smtp_session_t session)
 
   SMTPAPI_CHECK_ARGS (session != NULL, NULL);
 
-  if ((message = malloc (sizeof (struct smtp_message))) == NULL)
+  if ((message = session_alloc (session, sizeof (struct smtp_message))) == NULL)
     {
       set_errno (ENOMEM);
       return 0;
@@ -290,10 +599,11 @@ smtp_set_reverse_path (smtp_message_t message, const char *mailbox)
   SMTPAPI_CHECK_ARGS (message != NULL, 0);
 
   if (message->reverse_path_mailbox != NULL)
-    free (message->reverse_path_mailbox);
+    session_free (message->session, message->reverse_path_mailbox);
   if (mailbox == NULL)
     message->reverse_path_mailbox = NULL;
-  else if ((message->reverse_path_mailbox = strdup (mailbox)) == NULL)
+  else if ((message->reverse_path_mailbox = session_strdup (message->session,
+							   mailbox)) == NULL)
     {
       set_errno (ENOMEM);
       return 0;
@@ -336,11 +646,47 @@ smtp_message_reset_status (smtp_message_t message)
 {
   SMTPAPI_CHECK_ARGS (message != NULL, 0);
 
-  reset_status (&message->reverse_path_status);
-  reset_status (&message->message_status);
+  reset_status (message->session, &message->reverse_path_status);
+  reset_status (message->session, &message->message_status);
   return 1;
 }
 
+/* Memory for a recipient's fields.  A streamed recipient is discarded
+   once its status is reported, so these are allocated with malloc() even
+   when the session has an arena.  */
+static void *
+recipient_alloc (smtp_recipient_t recipient, size_t size)
+{
+  if (recipient->streamed)
+    return malloc (size);
+  return session_alloc (recipient->message->session, size);
+}
+
+static char *
+recipient_strdup (smtp_recipient_t recipient, const char *string)
+{
+  if (recipient->streamed)
+    return strdup (string);
+  return session_strdup (recipient->message->session, string);
+}
+
+/* Allocate the recipient's seldom used fields if necessary.  */
+static struct recipient_extra *
+recipient_extra (smtp_recipient_t recipient)
+{
+  struct recipient_extra *extra;
+
+  if (recipient->extra == NULL)
+    {
+      extra = recipient_alloc (recipient, sizeof (struct recipient_extra));
+      if (extra == NULL)
+	return NULL;
+      memset (extra, 0, sizeof (struct recipient_extra));
+      recipient->extra = extra;
+    }
+  return recipient->extra;
+}
+
 /**
  * smtp_add_recipient() - Add a message recipient.
  * @message: The message.
@@ -366,11 +712,14 @@ smtp_message_reset_status (smtp_message_t message)
 smtp_recipient_t
 smtp_add_recipient (smtp_message_t message, const char *mailbox)
 {
+  smtp_session_t session;
   smtp_recipient_t recipient;
 
   SMTPAPI_CHECK_ARGS (message != NULL && mailbox != NULL, NULL);
 
-  if ((recipient = malloc (sizeof (struct smtp_recipient))) == NULL)
+  session = message->session;
+  if ((recipient = session_alloc (session,
+				  sizeof (struct smtp_recipient))) == NULL)
     {
       set_errno (ENOMEM);
       return 0;
@@ -378,18 +727,89 @@ smtp_add_recipient (smtp_message_t message, const char *mailbox)
 
   memset (recipient, 0, sizeof (struct smtp_recipient));
   recipient->message = message;
-  recipient->mailbox = strdup (mailbox);
+  recipient->mailbox = session_strdup (session, mailbox);
   if (recipient->mailbox == NULL)
     {
-      free (recipient);
+      session_free (session, recipient);
       set_errno (ENOMEM);
       return 0;
     }
 
   APPEND_LIST (message->recipients, message->end_recipients, recipient);
+  APPEND_PENDING (message, recipient);
   return recipient;
 }
 
+/**
+ * smtp_add_recipients() - Add many recipients to a message.
+ * @message: The message.
+ * @mailboxes: Array of recipient mailbox addresses.
+ * @n: Number of addresses in @mailboxes.
+ * @notify: DSN notify flags for every recipient or %Notify_NOTSET.
+ *
+ * Add @n recipients to the message as if by calling smtp_add_recipient()
+ * for each element of @mailboxes followed, unless @notify is
+ * %Notify_NOTSET, by smtp_dsn_set_notify().  The recipients and a copy of
+ * their mailboxes are stored together in a single allocation, which is
+ * considerably more compact than adding recipients individually and keeps
+ * them adjacent in memory while the protocol engine works through them.
+ * This is preferable for messages with a large number of recipients.
+ *
+ * Recipient descriptors may be obtained with smtp_enumerate_recipients()
+ * or from the event callback and are used in the same way as those
+ * returned by smtp_add_recipient().
+ *
+ * Return: Zero on failure, non-zero on success.  On failure no recipients
+ * are added.
+ */
+int
+smtp_add_recipients (smtp_message_t message, const char *const *mailboxes,
+		     int n, enum notify_flags notify)
+{
+  smtp_session_t session;
+  struct recipient_block *block;
+  smtp_recipient_t recipient;
+  size_t size, len;
+  char *p;
+  int i;
+
+  SMTPAPI_CHECK_ARGS (message != NULL && mailboxes != NULL && n > 0, 0);
+
+  size = sizeof (struct recipient_block) + n * sizeof (struct smtp_recipient);
+  for (i = 0; i < n; i++)
+    {
+      SMTPAPI_CHECK_ARGS (mailboxes[i] != NULL, 0);
+      size += strlen (mailboxes[i]) + 1;
+    }
+
+  session = message->session;
+  if ((block = session_alloc (session, size)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  memset (block, 0, (char *) &block->recipients[n] - (char *) block);
+  p = (char *) &block->recipients[n];
+  for (i = 0; i < n; i++)
+    {
+      recipient = &block->recipients[i];
+      recipient->message = message;
+      recipient->in_block = 1;
+      recipient->dsn_notify = notify;
+      len = strlen (mailboxes[i]) + 1;
+      recipient->mailbox = memcpy (p, mailboxes[i], len);
+      p += len;
+      APPEND_LIST (message->recipients, message->end_recipients, recipient);
+      APPEND_PENDING (message, recipient);
+    }
+  block->next = message->recipient_blocks;
+  message->recipient_blocks = block;
+
+  if (notify != Notify_NOTSET)
+    session->required_extensions |= EXT_DSN;
+  return 1;
+}
+
 /**
  * smtp_enumerate_recipients() - Call a function for each recipient.
  * @message: The message.
@@ -415,6 +835,94 @@ smtp_enumerate_recipients (smtp_message_t message,
   return 1;
 }
 
+/**
+ * smtp_enumerate_deferred_recipients() - Call a function for each
+ * recipient still to be sent the message.
+ * @message: The message.
+ * @cb: Callback function to process recipient.
+ * @arg: User data passed to the callback.
+ *
+ * Call the callback function once for each recipient for which processing
+ * is not complete, in the order they would be sent.  These are the
+ * recipients which the server refused temporarily or which were not
+ * reached, for example because the connection failed, and which
+ * smtp_start_session() would send the message to if called again.
+ * Recipients which have been accepted or permanently refused are not
+ * visited, so this is inexpensive even for messages with very many
+ * recipients, most of which succeeded.  Recipients obtained from the
+ * callback set by smtp_set_recipientcb() are included if they were kept
+ * to be sent in a further transaction.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_enumerate_deferred_recipients (smtp_message_t message,
+				    smtp_enumerate_recipientcb_t cb,
+				    void *arg)
+{
+  smtp_recipient_t recipient, next;
+
+  SMTPAPI_CHECK_ARGS (message != NULL && cb != NULL, 0);
+
+  if (message->pending_rebuild)
+    rebuild_pending (message);
+  for (recipient = message->pending; recipient != NULL; recipient = next)
+    {
+      next = recipient->next_pending;
+      if (!recipient->complete)
+	(*cb) (recipient, recipient->mailbox, arg);
+    }
+  return 1;
+}
+
+/**
+ * smtp_set_recipientcb() - Obtain recipients from a callback.
+ * @message: The message.
+ * @cb: Callback supplying recipient mailboxes.
+ * @arg: User data passed to the callback.
+ *
+ * Rather than adding every recipient to the message beforehand, obtain
+ * them one at a time as the RCPT commands are issued.  After any
+ * recipients added with smtp_add_recipient() or smtp_add_recipients(),
+ * @cb is called whenever the protocol engine is ready for another
+ * recipient until it returns %NULL.  The mailbox returned is copied and
+ * need only remain valid until the next call.  Since the first RCPT
+ * command can be sent as soon as the first mailbox is known, the
+ * application may produce the list while the message is being
+ * submitted.
+ *
+ * The outcome for each recipient is reported by the %SMTP_EV_RCPTSTATUS
+ * event.  The recipient descriptor passed to the event callback may be
+ * used to query its status or set application data but is discarded when
+ * the callback returns.  Thus memory use is bounded by the number of RCPT
+ * commands awaiting a response, which libESMTP limits, rather than by the
+ * number of recipients.  This holds when the session uses an arena too,
+ * the descriptors are then reused.
+ * An exception is made for recipients the server asks to be sent in a
+ * further transaction, these are kept and sent again automatically.
+ * Recipients which were accepted are then subject to the message status
+ * reported by %SMTP_EV_MESSAGESENT.  Recipients which were refused,
+ * temporarily or permanently, are not retried by libESMTP.
+ *
+ * Since the recipients are not retained, smtp_enumerate_recipients() will
+ * not find them.  Likewise a ``To:`` header requested by calling
+ * smtp_set_header() with a %NULL value cannot list them and reads
+ * ``undisclosed-recipients:;`` instead.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_recipientcb (smtp_message_t message,
+		      smtp_recipientcb_t cb, void *arg)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL, 0);
+
+  message->rcpt_cb = cb;
+  message->rcpt_cb_arg = arg;
+  message->rcpt_cb_done = 0;
+  return 1;
+}
+
 /**
  * smtp_recipient_status() - Get the recipient status.
  * @recipient: The recipient.
@@ -473,8 +981,10 @@ smtp_recipient_reset_status (smtp_recipient_t recipient)
 {
   SMTPAPI_CHECK_ARGS (recipient != NULL, 0);
 
-  reset_status (&recipient->status);
+  reset_recipient_status (recipient);
   recipient->complete = 0;
+  if (!recipient->pending)
+    recipient->message->pending_rebuild = 1;
   return 1;
 }
 
@@ -526,7 +1036,7 @@ smtp_dsn_set_envid (smtp_message_t message, const char *envid)
 {
   SMTPAPI_CHECK_ARGS (message != NULL, 0);
 
-  message->dsn_envid = strdup (envid);
+  message->dsn_envid = session_strdup (message->session, envid);
   if (message->dsn_envid == NULL)
     {
       set_errno (ENOMEM);
@@ -577,18 +1087,31 @@ int
 smtp_dsn_set_orcpt (smtp_recipient_t recipient,
 		    const char *address_type, const char *address)
 {
+  smtp_session_t session;
+  struct recipient_extra *extra;
+
   SMTPAPI_CHECK_ARGS (recipient != NULL, 0);
 
-  recipient->dsn_addrtype = strdup (address_type);
-  if (recipient->dsn_addrtype == NULL)
+  session = recipient->message->session;
+  if ((extra = recipient_extra (recipient)) == NULL)
     {
       set_errno (ENOMEM);
       return 0;
     }
-  recipient->dsn_orcpt = strdup (address);
-  if (recipient->dsn_orcpt == NULL)
+  extra->dsn_addrtype = recipient_strdup (recipient, address_type);
+  if (extra->dsn_addrtype == NULL)
     {
-      free (recipient->dsn_addrtype);
+      set_errno (ENOMEM);
+      return 0;
+    }
+  extra->dsn_orcpt = recipient_strdup (recipient, address);
+  if (extra->dsn_orcpt == NULL)
+    {
+      if (recipient->streamed)
+	free (extra->dsn_addrtype);
+      else
+	session_free (session, extra->dsn_addrtype);
+      extra->dsn_addrtype = NULL;
       set_errno (ENOMEM);
       return 0;
     }
@@ -735,6 +1258,36 @@ smtp_set_messagecb (smtp_message_t message, smtp_messagecb_t cb, void *arg)
   return 1;
 }
 
+/**
+ * smtp_set_message_fd() - Read message from a file descriptor.
+ * @message: The message.
+ * @fd: File descriptor open for reading.
+ *
+ * Read the message from a file descriptor, starting at the beginning of the
+ * file.  The descriptor must remain open until the session is destroyed
+ * and is not closed by libESMTP.
+ *
+ * If @fd refers to a regular file and the server supports CHUNKING, the
+ * message body following the headers is copied to the server by the kernel
+ * without passing through the application or libESMTP's buffers, provided
+ * the connection is not encoded by a SASL security layer, TLS encryption,
+ * if any, is offloaded to the kernel (see %SMTP_EV_TLS_OFFLOAD) and the
+ * session is run by smtp_start_session().  Otherwise the message is read
+ * into a buffer in the usual way.
+ *
+ * Return: Non zero on success, zero on failure.
+ */
+int
+smtp_set_message_fd (smtp_message_t message, int fd)
+{
+  SMTPAPI_CHECK_ARGS (message != NULL && fd >= 0, 0);
+
+  message->fd = fd;
+  message->cb = _smtp_message_fd_cb;
+  message->cb_arg = &message->fd;
+  return 1;
+}
+
 /**
  * smtp_set_eventcb() - Set event callback.
  * @session: The session.
@@ -790,6 +1343,21 @@ smtp_set_monitorcb (smtp_session_t session, smtp_monitorcb_t cb, void *arg,
  *
  */
 
+/* Check that every message has a callback set */
+static int
+check_message_callbacks (smtp_session_t session)
+{
+  smtp_message_t message;
+
+  for (message = session->messages; message != NULL; message = message->next)
+    if (message->cb == NULL)
+      {
+        set_error (SMTP_ERR_INVAL);
+        return 0;
+      }
+  return 1;
+}
+
 /**
  * smtp_start_session() - Start an SMTP session.
  * @session: The session to start.
@@ -804,6 +1372,12 @@ smtp_set_monitorcb (smtp_session_t session, smtp_monitorcb_t cb, void *arg,
  * first line containing only CR-LF is encountered.  The remainder of the
  * message is copied verbatim.
  *
+ * If a message has more recipients than the server accepts in one
+ * transaction, either as advertised by the RFC 9422 LIMITS extension or
+ * indicated by a 452 response, the message is sent in several transactions,
+ * each to a subset of the recipients.  If the server limits the number of
+ * transactions per connection, the session continues on a new connection.
+ *
  * This call is atomic in the sense that a connection to the server is made
  * only when this is called and is closed down before it returns, i.e. there is
  * no connection to the server outside this function.
@@ -813,22 +1387,162 @@ smtp_set_monitorcb (smtp_session_t session, smtp_monitorcb_t cb, void *arg,
 int
 smtp_start_session (smtp_session_t session)
 {
-  smtp_message_t message;
+  SMTPAPI_CHECK_ARGS (session != NULL && session->host != NULL, 0);
+#if !HAVE_GETHOSTNAME
+  SMTPAPI_CHECK_ARGS (session->localhost != NULL, 0);
+#endif
+  SMTPAPI_CHECK_ARGS (!session->nonblocking, 0);
+
+  if (!check_message_callbacks (session))
+    return 0;
+  return do_session (session);
+}
 
+/**
+ * DOC: Non-blocking
+ *
+ * Non-blocking Sessions
+ * ---------------------
+ *
+ * smtp_start_session() occupies the calling thread until the SMTP session
+ * completes.  Alternatively an application can drive a session from its own
+ * event loop, allowing a single thread to run many concurrent sessions.
+ * smtp_session_begin() starts connecting to the server, and
+ * smtp_session_step() advances the protocol as far as possible without
+ * waiting.  Between steps, the application waits until the socket returned by
+ * smtp_session_get_fd() is ready for the events returned by
+ * smtp_session_get_events(), or the smtp_session_get_timeout() interval
+ * expires, for example using poll() or epoll.
+ *
+ * Callbacks are made from within smtp_session_step() exactly as they are
+ * during smtp_start_session().  The message callback should not block.
+ *
+ * .. code-block:: c
+ *
+ *    if (!smtp_session_begin (session))
+ *      fail ();
+ *    events = 0;
+ *    while (smtp_session_step (session, events) == Step_WANT_IO)
+ *      {
+ *        pfd.fd = smtp_session_get_fd (session);
+ *        pfd.events = 0;
+ *        if (smtp_session_get_events (session) & SMTP_IO_READ)
+ *          pfd.events |= POLLIN;
+ *        if (smtp_session_get_events (session) & SMTP_IO_WRITE)
+ *          pfd.events |= POLLOUT;
+ *        poll (&pfd, 1, smtp_session_get_timeout (session));
+ *        events = 0;
+ *        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+ *          events |= SMTP_IO_READ;
+ *        if (pfd.revents & (POLLOUT | POLLHUP | POLLERR))
+ *          events |= SMTP_IO_WRITE;
+ *      }
+ *
+ * Note that the socket may change between steps, for example when the first
+ * address for the server cannot be reached and the next one is tried.  While
+ * the server's address is being looked up, smtp_session_get_fd() returns a
+ * descriptor which becomes readable when the lookup completes.
+ */
+
+/**
+ * smtp_session_begin() - Start a non-blocking SMTP session.
+ * @session: The session to start.
+ *
+ * Start resolving the server address without waiting for the result.  If
+ * the address is known, from smtp_resolver_load_hosts() or the resolver
+ * cache, or threads are not available, it is resolved immediately and
+ * connecting to the server starts.  Otherwise the lookup runs on another
+ * thread and the connection starts in smtp_session_step() once the lookup
+ * completes.  The session then proceeds as for smtp_start_session() each
+ * time smtp_session_step() is called.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_session_begin (smtp_session_t session)
+{
   SMTPAPI_CHECK_ARGS (session != NULL && session->host != NULL, 0);
 #if !HAVE_GETHOSTNAME
   SMTPAPI_CHECK_ARGS (session->localhost != NULL, 0);
 #endif
+  SMTPAPI_CHECK_ARGS (!session->nonblocking, 0);
 
-  /* Check that every message has a callback set */
-  for (message = session->messages; message != NULL; message = message->next)
-    if (message->cb == NULL)
-      {
-        set_error (SMTP_ERR_INVAL);
-        return 0;
-      }
+  if (!check_message_callbacks (session))
+    return 0;
+  return begin_session (session);
+}
 
-  return do_session (session);
+/**
+ * smtp_session_step() - Advance a non-blocking SMTP session.
+ * @session: A session started with smtp_session_begin().
+ * @events: The &SMTP_IO_READ and &SMTP_IO_WRITE events reported for the
+ *          socket since the previous call, or zero if the timeout expired.
+ *
+ * Read from and write to the server as much as is possible without waiting
+ * and advance the protocol accordingly.  When the return value is
+ * %Step_WANT_IO, call this again once the socket is ready or the timeout
+ * expires.  Otherwise the connection to the server has been closed.
+ *
+ * %Step_DONE and %Step_FAILED correspond to smtp_start_session() returning
+ * non-zero or zero respectively.
+ *
+ * Return: A value from &enum step_status.
+ */
+int
+smtp_session_step (smtp_session_t session, int events)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL && session->nonblocking, Step_FAILED);
+
+  return step_session (session, events);
+}
+
+/**
+ * smtp_session_get_fd() - Socket for a non-blocking session.
+ * @session: The session.
+ *
+ * Return: The descriptor to poll before the next call to
+ * smtp_session_step() or -1 if the session is not running.  This is the
+ * socket, except while the server's address is being looked up.
+ */
+int
+smtp_session_get_fd (smtp_session_t session)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, -1);
+
+  return session_fd (session);
+}
+
+/**
+ * smtp_session_get_events() - Events wanted by a non-blocking session.
+ * @session: The session.
+ *
+ * Return: A bitwise-OR of %SMTP_IO_READ and %SMTP_IO_WRITE.
+ */
+int
+smtp_session_get_events (smtp_session_t session)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  return session->nonblocking ? session->events : 0;
+}
+
+/**
+ * smtp_session_get_timeout() - Time remaining before a session times out.
+ * @session: The session.
+ *
+ * The protocol timeouts set with smtp_set_timeout() apply to non-blocking
+ * sessions.  If nothing is received from or sent to the server before the
+ * interval returned elapses, call smtp_session_step() with @events set to
+ * zero.  The value is suitable for use as the timeout argument to poll().
+ *
+ * Return: Timeout in milliseconds or -1 if no timeout applies.
+ */
+int
+smtp_session_get_timeout (smtp_session_t session)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, -1);
+
+  return session->nonblocking ? session_timeout (session) : -1;
 }
 
 /**
@@ -839,6 +1553,54 @@ smtp_start_session (smtp_session_t session)
  *
  */
 
+/* Release the recipient's application data and, unless they belong to
+   the session's arena, the recipient's allocations.  A streamed
+   recipient's fields are always allocated with malloc().  */
+static void
+destroy_recipient (smtp_session_t session, smtp_recipient_t recipient)
+{
+  struct recipient_extra *extra;
+
+  if ((extra = recipient->extra) != NULL
+      && extra->application_data != NULL && extra->release != NULL)
+    (*extra->release) (extra->application_data);
+
+  if (recipient->streamed)
+    {
+      if (extra != NULL)
+	{
+	  free (extra->dsn_addrtype);
+	  free (extra->dsn_orcpt);
+	  free (extra);
+	}
+      reset_recipient_status (recipient);
+      if (recipient->mailbox != (char *) (recipient + 1))
+	free (recipient->mailbox);
+      if (session->arena == NULL)
+	free (recipient);
+      return;
+    }
+  if (session->arena != NULL)
+    return;
+
+  if (extra != NULL)
+    {
+      if (extra->dsn_addrtype != NULL)
+	free (extra->dsn_addrtype);
+      if (extra->dsn_orcpt != NULL)
+	free (extra->dsn_orcpt);
+      free (extra);
+    }
+
+  reset_status (session, &recipient->status);
+
+  if (!recipient->in_block)
+    {
+      free (recipient->mailbox);
+      free (recipient);
+    }
+}
+
 /**
  * smtp_destroy_session() - Destroy a libESMTP session.
  * @session: The session.
@@ -860,13 +1622,17 @@ smtp_destroy_session (smtp_session_t session)
 {
   smtp_message_t message, next_message;
   smtp_recipient_t recipient, next_recipient;
+  struct recipient_block *block, *next_block;
 
   SMTPAPI_CHECK_ARGS (session != NULL, 0);
 
   if (session->application_data != NULL && session->release != NULL)
     (*session->release) (session->application_data);
 
-  reset_status (&session->mta_status);
+  /* Close the connection if a non-blocking session is abandoned */
+  abort_session (session);
+
+  reset_status (session, &session->mta_status);
   destroy_auth_mechanisms (session);
 #ifdef USE_ETRN
   destroy_etrn_nodes (session);
@@ -881,6 +1647,8 @@ smtp_destroy_session (smtp_session_t session)
     free (session->host);
   if (session->localhost != NULL)
     free (session->localhost);
+  if (session->connpool_identity != NULL)
+    free (session->connpool_identity);
 
   if (session->msg_source != NULL)
     msg_source_destroy (session->msg_source);
@@ -892,29 +1660,48 @@ smtp_destroy_session (smtp_session_t session)
       if (message->application_data != NULL && message->release != NULL)
 	(*message->release) (message->application_data);
 
-      reset_status (&message->message_status);
-      reset_status (&message->reverse_path_status);
+      /* Streamed recipients are only on the pending list.  */
+      for (recipient = message->pending;
+	   recipient != NULL;
+	   recipient = next_recipient)
+	{
+	  next_recipient = recipient->next_pending;
+	  if (recipient->streamed)
+	    destroy_recipient (session, recipient);
+	}
+
+      /* Everything else belonging to the message is released with the
+         arena, so the other recipients need only be visited to release
+         their application data.  */
+      if (session->arena == NULL || session->recipient_release)
+	{
+	  for (recipient = message->recipients;
+	       recipient != NULL;
+	       recipient = next_recipient)
+	    {
+	      next_recipient = recipient->next;
+	      destroy_recipient (session, recipient);
+	    }
+	}
+      if (session->arena != NULL)
+	continue;
+
+      reset_status (session, &message->message_status);
+      reset_status (session, &message->reverse_path_status);
       free (message->reverse_path_mailbox);
 
-      for (recipient = message->recipients;
+      for (recipient = message->rcpt_free;
            recipient != NULL;
       	   recipient = next_recipient)
-        {
+	{
 	  next_recipient = recipient->next;
-
-	  if (recipient->application_data != NULL && recipient->release != NULL)
-	    (*recipient->release) (recipient->application_data);
-
-	  reset_status (&recipient->status);
-	  free (recipient->mailbox);
-
-	  if (recipient->dsn_addrtype != NULL)
-	    free (recipient->dsn_addrtype);
-	  if (recipient->dsn_orcpt != NULL)
-	    free (recipient->dsn_orcpt);
-
 	  free (recipient);
-        }
+	}
+      for (block = message->recipient_blocks; block != NULL; block = next_block)
+	{
+	  next_block = block->next;
+	  free (block);
+	}
 
       destroy_header_table (message);
 
@@ -924,6 +1711,8 @@ smtp_destroy_session (smtp_session_t session)
       free (message);
     }
 
+  cat_free (&session->rcpt_domain_list);
+  arena_destroy (session->arena);
   free (session);
   return 1;
 }
@@ -1084,13 +1873,21 @@ smtp_message_get_application_data (smtp_message_t message)
 void *
 smtp_recipient_set_application_data (smtp_recipient_t recipient, void *data)
 {
+  struct recipient_extra *extra;
   void *old;
 
   SMTPAPI_CHECK_ARGS (recipient != NULL, NULL);
 
-  old = recipient->application_data;
-  recipient->application_data = data;
-  recipient->release = NULL;
+  if (recipient->extra == NULL && data == NULL)
+    return NULL;
+  if ((extra = recipient_extra (recipient)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  old = extra->application_data;
+  extra->application_data = data;
+  extra->release = NULL;
   return old;
 }
 
@@ -1109,13 +1906,24 @@ smtp_recipient_set_application_data_release (smtp_recipient_t recipient,
 					     void *data,
 					  void (*release) (void *))
 {
+  struct recipient_extra *extra;
+
   SMTPAPI_CHECK_ARGS (recipient != NULL, /* void */);
 
-  if (recipient->application_data != NULL && recipient->release != NULL)
-    (*recipient->release) (recipient->application_data);
+  if (recipient->extra == NULL && data == NULL)
+    return;
+  if ((extra = recipient_extra (recipient)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return;
+    }
+  if (extra->application_data != NULL && extra->release != NULL)
+    (*extra->release) (extra->application_data);
 
-  recipient->release = release;
-  recipient->application_data = data;
+  extra->release = release;
+  extra->application_data = data;
+  if (release != NULL)
+    recipient->message->session->recipient_release = 1;
 }
 
 /**
@@ -1131,7 +1939,9 @@ smtp_recipient_get_application_data (smtp_recipient_t recipient)
 {
   SMTPAPI_CHECK_ARGS (recipient != NULL, NULL);
 
-  return recipient->application_data;
+  if (recipient->extra == NULL)
+    return NULL;
+  return recipient->extra->application_data;
 }
 
 /**
@@ -1275,6 +2085,12 @@ smtp_set_timeout (smtp_session_t session, int which, long value)
     case Timeout_DATA2:
       session->data2_timeout = value;
       break;
+    case Timeout_CONNECT:
+      session->connect_timeout = value;
+      break;
+    case Timeout_RESOLVE:
+      session->resolve_timeout = value;
+      break;
     default:
       set_error (SMTP_ERR_INVAL);
       return 0L;
@@ -43,6 +43,7 @@
 #include "message-source.h"
 #include "siobuf.h"
 #include "tokens.h"
+#include "keywords.h"
 #include "base64.h"
 #include "protocol.h"
 
@@ -86,10 +87,15 @@ smtp_auth_set_context (smtp_session_t session, auth_context_t context)
   return 1;
 }
 
+/* Mechanisms advertised by the server, in the server's order of
+   preference.  Names of mechanisms in the SASL table generated from
+   keywords.in are not copied.  */
 struct mechanism
   {
     struct mechanism *next;
-    char *name;
+    const char *name;
+    int keyword;		/* SASL_xxx or SASL_UNKNOWN */
+    char buf[];			/* name of an unknown mechanism */
   };
 
 void
@@ -100,8 +106,6 @@ destroy_auth_mechanisms (smtp_session_t session)
   for (mech = session->auth_mechanisms; mech != NULL; mech = next)
     {
       next = mech->next;
-      if (mech->name != NULL)	/* or assert (mech->name != NULL); */
-	free (mech->name);
       free (mech);
     }
   session->current_mechanism = session->auth_mechanisms = NULL;
@@ -110,31 +114,46 @@ destroy_auth_mechanisms (smtp_session_t session)
 void
 set_auth_mechanisms (smtp_session_t session, const char *mechanisms)
 {
-  char buf[64];
   struct mechanism *mech;
+  const char *name;
+  int keyword, len;
 
-  while (read_atom (skipblank (mechanisms), &mechanisms, buf, sizeof buf))
+  for (;;)
     {
+      name = skipblank (mechanisms);
+      if ((mechanisms = skipatom (name)) == name)
+        break;
+      len = mechanisms - name;
+      keyword = sasl_keyword (name, len);
+
       /* scan existing list to avoid duplicates */
       for (mech = session->auth_mechanisms; mech != NULL; mech = mech->next)
-        if (strcasecmp (buf, mech->name) == 0)
+        if (mech->keyword == keyword
+            && (keyword != SASL_UNKNOWN
+                || (strncasecmp (name, mech->name, len) == 0
+                    && mech->name[len] == '\0')))
           break;
       if (mech != NULL)
         continue;
 
       /* new mechanism, so add to the list */
-      mech = malloc (sizeof (struct mechanism));
+      if (keyword != SASL_UNKNOWN)
+        mech = malloc (sizeof (struct mechanism));
+      else
+        mech = malloc (sizeof (struct mechanism) + len + 1);
       if (mech == NULL)
         {
           /* FIXME: propagate ENOMEM to app. */
           continue;
         }
-      mech->name = strdup (buf);
-      if (mech->name == NULL)
+      mech->keyword = keyword;
+      if (keyword != SASL_UNKNOWN)
+        mech->name = sasl_keyword_name (keyword);
+      else
         {
-          /* FIXME: propagate ENOMEM to app. */
-          free (mech);
-          continue;
+          memcpy (mech->buf, name, len);
+          mech->buf[len] = '\0';
+          mech->name = mech->buf;
         }
       APPEND_LIST (session->auth_mechanisms, session->current_mechanism, mech);
     }
@@ -159,6 +178,53 @@ select_auth_mechanism (smtp_session_t session)
   return 0;
 }
 
+/* AUTH was sent ahead of the EHLO response using capabilities cached from
+   an earlier connection.  Find the selected mechanism in the list just
+   read without disturbing the SASL exchange already in progress.  */
+int
+resume_auth_mechanism (smtp_session_t session)
+{
+  const char *name;
+
+  if (session->auth_context == NULL
+      || (name = auth_mechanism_name (session->auth_context)) == NULL)
+    return 0;
+  for (session->current_mechanism = session->auth_mechanisms;
+       session->current_mechanism != NULL;
+       session->current_mechanism = session->current_mechanism->next)
+    if (strcasecmp (session->current_mechanism->name, name) == 0)
+      return 1;
+  return 0;
+}
+
+/* Return the advertised mechanisms as a space separated list in the
+   server's order of preference, suitable for set_auth_mechanisms().
+   Returns NULL if there are none or memory is exhausted.  */
+char *
+auth_mechanism_list (smtp_session_t session)
+{
+  struct mechanism *mech;
+  size_t len;
+  char *list, *p;
+
+  len = 0;
+  for (mech = session->auth_mechanisms; mech != NULL; mech = mech->next)
+    len += strlen (mech->name) + 1;
+  if (len == 0 || (list = malloc (len)) == NULL)
+    return NULL;
+  p = list;
+  for (mech = session->auth_mechanisms; mech != NULL; mech = mech->next)
+    {
+      if (p > list)
+	*p++ = ' ';
+      len = strlen (mech->name);
+      memcpy (p, mech->name, len);
+      p += len;
+    }
+  *p = '\0';
+  return list;
+}
+
 static int
 next_auth_mechanism (smtp_session_t session)
 {
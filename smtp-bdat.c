@@ -34,6 +34,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <missing.h> /* declarations for missing library functions */
 
@@ -54,6 +60,7 @@ cmd_bdat (siobuf_t conn, smtp_session_t session)
   struct catbuf headers;
 
   sio_set_timeout (conn, session->transfer_timeout);
+  set_data_buffering (conn, session, 1);
 
   /* Arrange to read the current message from the application. */
   msg_source_set_cb (session->msg_source,
@@ -176,9 +183,71 @@ break_2:
   sio_printf (conn, "BDAT %d\r\n", len);
   sio_write (conn, chunk, len);
   cat_free (&headers);
+
+  /* If the message is read from a regular file and the connection is
+     neither encrypted nor encoded, the remainder of the message may be
+     copied from the file to the socket by the kernel.  The file position
+     is adjusted for data read but not yet consumed by header processing.  */
+  session->bdat_sendfile = 0;
+  if (session->current_message->cb == _smtp_message_fd_cb
+      && !session->nonblocking && sio_can_sendfile (conn))
+    {
+      int fd = session->current_message->fd;
+      struct stat st;
+      off_t offset;
+
+      if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode)
+          && (offset = lseek (fd, 0, SEEK_CUR)) >= 0)
+	{
+	  session->bdat_offset = offset - msg_discard (session->msg_source);
+	  session->bdat_remaining = st.st_size - session->bdat_offset;
+	  session->bdat_sendfile = session->bdat_remaining > 0;
+	}
+    }
   session->cmd_state = S_bdat2;
 }
 
+/* Largest chunk copied from a file in a single BDAT command.  */
+#define BDAT_FILE_CHUNK		(1024 * 1024)
+
+static void
+bdat_sendfile (siobuf_t conn, smtp_session_t session)
+{
+  int len, last;
+
+  len = session->bdat_remaining > BDAT_FILE_CHUNK
+	? BDAT_FILE_CHUNK : (int) session->bdat_remaining;
+  last = len == session->bdat_remaining;
+
+  /* Notify byte count to the application. */
+  if (session->event_cb != NULL)
+    (*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
+			  session->event_cb_arg,
+			  session->current_message, len);
+  sio_printf (conn, "BDAT %d%s\r\n", len, last ? " LAST" : "");
+  errno = 0;
+  if (sio_sendfile (conn, session->current_message->fd,
+		    &session->bdat_offset, len) != len)
+    {
+      set_errno (errno != 0 ? errno : EIO);
+      session->cmd_state = session->rsp_state = -1;
+      return;
+    }
+  session->bdat_remaining -= len;
+  session->bdat_pipelined += 1;
+
+  if (last)
+    {
+      sio_set_timeout (conn, session->data2_timeout);
+      set_data_buffering (conn, session, 0);
+      session->bdat_last_issued = 1;
+      session->cmd_state = session->bdat_abort_pipeline
+			   ? -1 : pipeline_next_message (session, S_rset);
+    }
+  else
+    session->cmd_state = session->bdat_abort_pipeline ? -1 : S_bdat2;
+}
+
 void
 rsp_bdat (siobuf_t conn, smtp_session_t session)
 {
@@ -189,8 +258,16 @@ void
 cmd_bdat2 (siobuf_t conn, smtp_session_t session)
 {
   const char *chunk;
+  char command[32];
+  struct iovec iov[2];
   int len;
 
+  if (session->bdat_sendfile)
+    {
+      bdat_sendfile (conn, session);
+      return;
+    }
+
   /* N.B. the BDAT chunk size is set by the amount of buffering
           provided by the application callback.  An application is not
           advised to read a message line by line in the callback.
@@ -205,8 +282,14 @@ cmd_bdat2 (siobuf_t conn, smtp_session_t session)
 	(*session->event_cb) (session, SMTP_EV_MESSAGEDATA,
 	                      session->event_cb_arg,
 	                      session->current_message, len);
-      sio_printf (conn, "BDAT %d\r\n", len);
-      sio_write (conn, chunk, len);
+      /* The command and the chunk are written together.  A large
+	 chunk is written from the message source's buffer without being
+	 copied through the write buffer.  */
+      iov[0].iov_base = command;
+      iov[0].iov_len = snprintf (command, sizeof command, "BDAT %d\r\n", len);
+      iov[1].iov_base = (void *) (uintptr_t) chunk;
+      iov[1].iov_len = len;
+      sio_writev (conn, iov, 2);
 
       /* BDAT commands may be pipelined.  Check if a a previous BDAT has
          failed and stop pipelining if necessary.  */
@@ -220,8 +303,14 @@ cmd_bdat2 (siobuf_t conn, smtp_session_t session)
       else
 	sio_write (conn, "BDAT 0 LAST\r\n", -1);
       sio_set_timeout (conn, session->data2_timeout);
+      set_data_buffering (conn, session, 0);
       session->bdat_last_issued = 1;
-      session->cmd_state = -1;
+
+      /* A refused chunk leaves the server's state indeterminate and
+	 RFC 3030 requires RSET.  Since the outcome is not known yet,
+	 RSET precedes a pipelined MAIL command.  */
+      session->cmd_state = session->bdat_abort_pipeline
+			   ? -1 : pipeline_next_message (session, S_rset);
     }
   session->bdat_pipelined += 1;
   if (errno != 0)
@@ -236,7 +325,6 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 {
   int code;
   smtp_message_t message;
-  smtp_recipient_t recipient;
 
   message = session->current_message;
   code = read_smtp_response (conn, session, &message->message_status, NULL);
@@ -250,13 +338,7 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
         {
 	  /* Mark all the recipients complete for which the MTA has accepted
 	     responsibility for delivery.  */
-	  for (recipient = session->current_message->recipients;
-	       recipient != NULL;
-	       recipient = recipient->next)
-	    if (!recipient->complete
-		&& recipient->status.code >= 200
-		&& recipient->status.code <= 299)
-	      recipient->complete = 1;
+	  complete_recipients (session, code);
 
 	  /* Notify `message sent' */
 	  if (session->event_cb != NULL)
@@ -264,7 +346,15 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 				  session->event_cb_arg,
 				  session->current_message);
 
-	  if (next_message (session))
+	  /* The responses to the RSET and MAIL commands pipelined
+	     behind BDAT LAST follow, rsp_rset() reads the latter.  */
+	  if (session->mail_pipelined)
+	    {
+	      next_message (session);
+	      sio_set_timeout (conn, session->envelope_timeout);
+	      session->rsp_state = S_rset;
+	    }
+	  else if (next_message (session))
 	    session->rsp_state = initial_transaction_state (session);
 	  else
 	    session->rsp_state = S_quit;
@@ -281,11 +371,7 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 	{
 	  /* Mark all the recipients complete.  This message cannot be
 	     accepted for any recipients.  */
-	  if (code == 5)
-	    for (recipient = session->current_message->recipients;
-		 recipient != NULL;
-		 recipient = recipient->next)
-	      recipient->complete = 1;
+	  complete_recipients (session, code);
 
 	  /* Notify `message sent' */
 	  if (session->event_cb != NULL)
@@ -302,6 +388,14 @@ rsp_bdat2 (siobuf_t conn, smtp_session_t session)
 	      set_error (SMTP_ERR_INVALID_RESPONSE_STATUS);
 	      session->rsp_state = S_quit;
 	    }
+	  else if (session->mail_pipelined)
+	    {
+	      /* RSET was pipelined behind BDAT LAST, ahead of the next
+	         MAIL command.  */
+	      next_message (session);
+	      sio_set_timeout (conn, session->envelope_timeout);
+	      session->rsp_state = S_rset;
+	    }
 	  else if (next_message (session))
 	    session->rsp_state = S_rset;
 	  else
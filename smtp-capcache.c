@@ -0,0 +1,326 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+/**
+ * DOC: Capability Cache
+ *
+ * Capability Cache
+ * ----------------
+ *
+ * Before anything useful can be sent, each connection waits for the
+ * server's greeting, sends EHLO and waits again for the list of
+ * capabilities.  Servers advertising the PIPECONNECT extension, first
+ * implemented by Exim, permit the client to send EHLO and the commands
+ * following it without waiting for either response, provided the client
+ * chooses those commands using capabilities it has seen before.
+ *
+ * An application may enable a process wide cache of server capabilities
+ * with smtp_capability_cache_set_size().  The cache remembers the EHLO
+ * response of each server host and port which offers PIPECONNECT.
+ * Subsequent connections to the server send EHLO together with STARTTLS,
+ * AUTH or MAIL as soon as the connection is established, saving up to
+ * two round trips.
+ *
+ * If the server refuses EHLO or its capabilities no longer match those
+ * cached, the commands already sent cannot be trusted.  The connection is
+ * dropped and the session continues on a new connection which waits for
+ * each response in the usual way and refreshes the cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "htable.h"
+#include "api.h"
+
+struct cache_entry
+  {
+    time_t time;			/* When the entry was stored */
+    unsigned long extensions;
+    unsigned long size_limit;
+    long min_by_time;
+    int rcpt_max;
+    int mail_max;
+    int rcptdomain_max;
+    char *auth;				/* AUTH mechanisms or NULL */
+  };
+
+static struct h_node **cache;
+static int cache_size;
+static int cache_count;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t capcache_lock = PTHREAD_MUTEX_INITIALIZER;
+# define CAPCACHE_LOCK()	pthread_mutex_lock (&capcache_lock)
+# define CAPCACHE_UNLOCK()	pthread_mutex_unlock (&capcache_lock)
+#else
+# define CAPCACHE_LOCK()	((void) 0)
+# define CAPCACHE_UNLOCK()	((void) 0)
+#endif
+
+/* Early pipelining requires both extensions.  */
+#define EXT_EARLY	(EXT_PIPECONNECT | EXT_PIPELINING)
+
+/* Capabilities are cached per server and port.  */
+static char *
+cache_key (smtp_session_t session)
+{
+  const char *host;
+  char *key;
+  size_t len;
+
+  host = session->canon != NULL ? session->canon : session->host;
+  if (host == NULL)
+    host = "";
+  len = strlen (host) + strlen (session->port) + 2;
+  if ((key = malloc (len)) != NULL)
+    snprintf (key, len, "%s/%s", host, session->port);
+  return key;
+}
+
+static void
+cache_entry_free (const char *name __attribute__ ((unused)), void *data,
+		  void *arg __attribute__ ((unused)))
+{
+  struct cache_entry *entry = data;
+
+  free (entry->auth);
+}
+
+static void
+cache_remove (struct cache_entry *entry)
+{
+  free (entry->auth);
+  h_remove (cache, entry);
+  cache_count--;
+}
+
+static void
+find_oldest (const char *name __attribute__ ((unused)), void *data,
+	     void *arg)
+{
+  struct cache_entry *entry = data;
+  struct cache_entry **oldest = arg;
+
+  if (*oldest == NULL || entry->time < (*oldest)->time)
+    *oldest = entry;
+}
+
+/* Discard the oldest entries until the cache has room for n.  Called with
+   the lock held.  */
+static void
+cache_trim (int n)
+{
+  struct cache_entry *oldest;
+
+  while (cache != NULL && cache_count > n)
+    {
+      oldest = NULL;
+      h_enumerate (cache, find_oldest, &oldest);
+      if (oldest == NULL)
+	break;
+      cache_remove (oldest);
+    }
+}
+
+static int
+same_string (const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp (a, b) == 0;
+}
+
+/* If the session's server offered PIPECONNECT on an earlier connection,
+   set the session's capabilities from the cache and return non-zero.
+   The caller may then send EHLO and the command following it without
+   waiting for the greeting.  */
+int
+capability_cache_get (smtp_session_t session)
+{
+  struct cache_entry *entry;
+  char *key, *auth;
+  int found;
+
+  if (cache_size <= 0 || (key = cache_key (session)) == NULL)
+    return 0;
+
+  found = 0;
+  auth = NULL;
+  CAPCACHE_LOCK ();
+  if (cache != NULL && (entry = h_search (cache, key, -1)) != NULL
+      && (entry->auth == NULL || (auth = strdup (entry->auth)) != NULL))
+    {
+      session->extensions = entry->extensions;
+      session->size_limit = entry->size_limit;
+      session->min_by_time = entry->min_by_time;
+      session->rcpt_max = entry->rcpt_max;
+      session->mail_max = entry->mail_max;
+      session->rcptdomain_max = entry->rcptdomain_max;
+      found = 1;
+    }
+  CAPCACHE_UNLOCK ();
+  free (key);
+
+  if (auth != NULL)
+    {
+      set_auth_mechanisms (session, auth);
+      free (auth);
+    }
+  return found;
+}
+
+/* Remember the capabilities just read from the server's EHLO response.
+   Only servers offering PIPECONNECT are cached, any previous entry for
+   other servers is removed.  Returns non-zero if the capabilities differ
+   from those cached, or none were cached.  */
+int
+capability_cache_put (smtp_session_t session)
+{
+  struct cache_entry *entry;
+  char *key, *auth;
+  int changed;
+
+  if (cache_size <= 0 || (key = cache_key (session)) == NULL)
+    return 1;
+  auth = auth_mechanism_list (session);
+
+  changed = 1;
+  CAPCACHE_LOCK ();
+  if (cache == NULL)
+    cache = h_create ();
+  if (cache == NULL)
+    entry = NULL;
+  else if ((entry = h_search (cache, key, -1)) != NULL)
+    {
+      changed = entry->extensions != session->extensions
+		|| entry->size_limit != session->size_limit
+		|| entry->min_by_time != session->min_by_time
+		|| entry->rcpt_max != session->rcpt_max
+		|| entry->mail_max != session->mail_max
+		|| entry->rcptdomain_max != session->rcptdomain_max
+		|| !same_string (entry->auth, auth);
+      if (changed || (session->extensions & EXT_EARLY) != EXT_EARLY)
+	{
+	  cache_remove (entry);
+	  entry = NULL;
+	}
+    }
+  if (entry == NULL && cache != NULL
+      && (session->extensions & EXT_EARLY) == EXT_EARLY)
+    {
+      cache_trim (cache_size - 1);
+      entry = h_insert (cache, key, -1, sizeof (struct cache_entry));
+      if (entry != NULL)
+	{
+	  entry->extensions = session->extensions;
+	  entry->size_limit = session->size_limit;
+	  entry->min_by_time = session->min_by_time;
+	  entry->rcpt_max = session->rcpt_max;
+	  entry->mail_max = session->mail_max;
+	  entry->rcptdomain_max = session->rcptdomain_max;
+	  entry->auth = auth;
+	  auth = NULL;
+	  cache_count++;
+	}
+    }
+  if (entry != NULL)
+    entry->time = time (NULL);
+  CAPCACHE_UNLOCK ();
+  free (auth);
+  free (key);
+  return changed;
+}
+
+/* Forget the server's capabilities, e.g. after it has refused EHLO.  */
+void
+capability_cache_remove (smtp_session_t session)
+{
+  struct cache_entry *entry;
+  char *key;
+
+  if (cache_size <= 0 || (key = cache_key (session)) == NULL)
+    return;
+
+  CAPCACHE_LOCK ();
+  if (cache != NULL && (entry = h_search (cache, key, -1)) != NULL)
+    cache_remove (entry);
+  CAPCACHE_UNLOCK ();
+  free (key);
+}
+
+/**
+ * smtp_capability_cache_set_size() - Enable the capability cache.
+ * @size: Maximum number of servers cached, zero to disable.
+ *
+ * Set the maximum number of servers whose capabilities are remembered for
+ * early pipelining.  One entry is kept for each server host and port.
+ * When the cache is full the entry least recently confirmed by the server
+ * is discarded.  Setting the size to zero disables the cache, and with it
+ * early pipelining, and discards its contents.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_capability_cache_set_size (int size)
+{
+  SMTPAPI_CHECK_ARGS (size >= 0, 0);
+
+  CAPCACHE_LOCK ();
+  cache_size = size;
+  if (size > 0)
+    cache_trim (size);
+  CAPCACHE_UNLOCK ();
+  if (size == 0)
+    smtp_capability_cache_flush ();
+  return 1;
+}
+
+/**
+ * smtp_capability_cache_flush() - Discard cached server capabilities.
+ *
+ * Empty the capability cache.  Subsequent connections wait for the
+ * server's greeting and EHLO response before sending further commands.
+ */
+void
+smtp_capability_cache_flush (void)
+{
+  struct h_node **table;
+
+  CAPCACHE_LOCK ();
+  table = cache;
+  cache = NULL;
+  cache_count = 0;
+  CAPCACHE_UNLOCK ();
+  if (table != NULL)
+    h_destroy (table, cache_entry_free, NULL);
+}
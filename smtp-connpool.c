@@ -0,0 +1,569 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "siobuf.h"
+#include "api.h"
+
+/**
+ * DOC: Connection Pool
+ *
+ * Connection Pool
+ * ---------------
+ *
+ * Normally smtp_start_session() connects to the server, reads the greeting,
+ * issues EHLO, possibly STARTTLS followed by a second EHLO and AUTH, before
+ * the first message is sent, and finally closes the connection with QUIT.
+ * When sessions to the same server follow each other closely these round
+ * trips dominate the time taken to submit a small message.
+ *
+ * A connection pool retains connections between sessions.  When a session
+ * using a pool completes cleanly, the connection is parked in the pool
+ * instead of being closed.  A later session for the same server with the
+ * same STARTTLS option and credentials takes the parked connection and
+ * proceeds directly to RSET and the mail transaction.
+ * If a parked connection is found to have been closed by the server,
+ * it is discarded and the session continues with another connection, so
+ * a stale connection never causes a submission to fail.
+ *
+ * Parked connections are closed after an idle timeout.  Servers typically
+ * drop idle clients after a few minutes, so the application should call
+ * smtp_connpool_maintain() periodically to keep parked connections alive
+ * with NOOP and to close those which have expired.
+ *
+ * An authentication context may be released and its memory reused once a
+ * session completes, so it does not identify the credentials with which a
+ * parked connection was authenticated.  Sessions which set an
+ * authentication context park their connections only when the application
+ * names the credentials with smtp_set_connpool_identity().
+ *
+ * A pool may be shared by sessions running on different threads.  Pools
+ * are used only by smtp_start_session(), sessions driven by
+ * smtp_session_step() always use a new connection.
+ */
+
+#define CONNPOOL_TIMEOUT	(30 * 1000l)	/* Timeout for NOOP/QUIT */
+
+struct parked_conn
+  {
+    struct parked_conn *next;
+
+  /* Key */
+    char *host;
+    char *port;
+    char *identity;			/* NULL without auth context */
+#ifdef USE_TLS
+    enum starttls_option starttls_enabled;
+#endif
+
+  /* Connection and server state */
+    struct siobuf *conn;
+    int sd;
+    char *canon;
+    unsigned long extensions;
+    unsigned long size_limit;
+    int rcpt_max, mail_max, rcptdomain_max;
+    int mail_count;			/* Transactions made */
+    unsigned int authenticated : 1;
+#ifdef USE_TLS
+    unsigned int using_tls : 1;
+#endif
+    long long parked;			/* Time parked */
+    long long active;			/* Time of last exchange with server */
+  };
+
+struct smtp_connpool
+  {
+#ifdef USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    struct parked_conn *conns;
+    int nconns;
+    int max_idle;			/* Maximum parked connections */
+    long idle_timeout;			/* Close after this many ms */
+    long keepalive;			/* NOOP interval in ms */
+  };
+
+#ifdef USE_PTHREADS
+# define POOL_LOCK(p)	pthread_mutex_lock (&(p)->lock)
+# define POOL_UNLOCK(p)	pthread_mutex_unlock (&(p)->lock)
+#else
+# define POOL_LOCK(p)	((void) 0)
+# define POOL_UNLOCK(p)	((void) 0)
+#endif
+
+static long long
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+static void
+free_parked (struct parked_conn *pc)
+{
+  free (pc->host);
+  free (pc->port);
+  free (pc->identity);
+  free (pc->canon);
+  free (pc);
+}
+
+/* Close a parked connection, politely if possible. */
+static void
+close_parked (struct parked_conn *pc)
+{
+  sio_set_timeout (pc->conn, CONNPOOL_TIMEOUT);
+  sio_write (pc->conn, "QUIT\r\n", 6);
+  sio_flush (pc->conn);
+  sio_detach (pc->conn);
+  close (pc->sd);
+  free_parked (pc);
+}
+
+/* Read a complete response, return the status class or -1. */
+static int
+read_status (struct siobuf *conn)
+{
+  char buf[512];
+
+  do
+    if (sio_gets (conn, buf, sizeof buf) == NULL || strlen (buf) < 4)
+      return -1;
+  while (buf[3] == '-');
+  return buf[0] - '0';
+}
+
+/* Check that the server has not closed the connection, or sent something
+   unsolicited such as a 421 response, while it was parked.  */
+static int
+is_alive (struct parked_conn *pc)
+{
+  struct pollfd pfd;
+
+  pfd.fd = pc->sd;
+  pfd.events = POLLIN;
+  return poll (&pfd, 1, 0) == 0;
+}
+
+static int
+key_matches (struct parked_conn *pc, smtp_session_t session)
+{
+  if (session->auth_context == NULL)
+    {
+      if (pc->identity != NULL)
+	return 0;
+    }
+  else if (pc->identity == NULL || session->connpool_identity == NULL
+	   || strcmp (pc->identity, session->connpool_identity) != 0)
+    return 0;
+
+  return 1
+#ifdef USE_TLS
+	 && pc->starttls_enabled == session->starttls_enabled
+#endif
+	 && strcasecmp (pc->host, session->host) == 0
+	 && strcmp (pc->port, session->port) == 0;
+}
+
+/**
+ * smtp_connpool_create() - Create a connection pool.
+ * @max_idle: Maximum number of connections held in the pool.
+ * @idle_timeout: Close parked connections after this many milliseconds.
+ *
+ * Create a pool for retaining connections between sessions.  Sessions use
+ * the pool once it is set with smtp_set_connpool().  By default parked
+ * connections are kept alive with NOOP after a minute of inactivity,
+ * see smtp_connpool_set_keepalive().
+ *
+ * Return: The pool or %NULL on failure.
+ */
+smtp_connpool_t
+smtp_connpool_create (int max_idle, long idle_timeout)
+{
+  smtp_connpool_t pool;
+
+  SMTPAPI_CHECK_ARGS (max_idle > 0 && idle_timeout > 0, NULL);
+
+  if ((pool = malloc (sizeof (struct smtp_connpool))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  memset (pool, 0, sizeof (struct smtp_connpool));
+#ifdef USE_PTHREADS
+  pthread_mutex_init (&pool->lock, NULL);
+#endif
+  pool->max_idle = max_idle;
+  pool->idle_timeout = idle_timeout;
+  pool->keepalive = 60 * 1000l;
+  return pool;
+}
+
+/**
+ * smtp_connpool_set_keepalive() - Set the keepalive interval.
+ * @pool: The pool.
+ * @interval: Milliseconds of inactivity before NOOP is sent, zero disables.
+ *
+ * Set how long a parked connection may be inactive before
+ * smtp_connpool_maintain() sends NOOP to the server.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_connpool_set_keepalive (smtp_connpool_t pool, long interval)
+{
+  SMTPAPI_CHECK_ARGS (pool != NULL && interval >= 0, 0);
+
+  POOL_LOCK (pool);
+  pool->keepalive = interval;
+  POOL_UNLOCK (pool);
+  return 1;
+}
+
+/**
+ * smtp_connpool_maintain() - Keep parked connections alive.
+ * @pool: The pool.
+ *
+ * Close parked connections which have exceeded the idle timeout or which
+ * the server has closed and send NOOP on those which have been inactive
+ * for longer than the keepalive interval.  Connections which do not
+ * respond to NOOP are closed.  This may block while waiting for servers
+ * to respond and should be called periodically, for example once every
+ * keepalive interval.
+ *
+ * Return: The number of connections remaining in the pool or -1 on failure.
+ */
+int
+smtp_connpool_maintain (smtp_connpool_t pool)
+{
+  struct parked_conn *pc, *next, *keep, *probe, *discard;
+  long long now;
+  int nconns;
+
+  SMTPAPI_CHECK_ARGS (pool != NULL, -1);
+
+  /* Sort the parked connections while holding the lock but perform
+     network I/O without it.  */
+  keep = probe = discard = NULL;
+  now = now_ms ();
+  POOL_LOCK (pool);
+  for (pc = pool->conns; pc != NULL; pc = next)
+    {
+      next = pc->next;
+      if (now - pc->parked >= pool->idle_timeout || !is_alive (pc))
+	{
+	  pc->next = discard;
+	  discard = pc;
+	  pool->nconns--;
+	}
+      else if (pool->keepalive > 0 && now - pc->active >= pool->keepalive)
+	{
+	  pc->next = probe;
+	  probe = pc;
+	  pool->nconns--;
+	}
+      else
+	{
+	  pc->next = keep;
+	  keep = pc;
+	}
+    }
+  pool->conns = keep;
+  POOL_UNLOCK (pool);
+
+  for (pc = discard; pc != NULL; pc = next)
+    {
+      next = pc->next;
+      close_parked (pc);
+    }
+
+  keep = NULL;
+  for (pc = probe; pc != NULL; pc = next)
+    {
+      next = pc->next;
+      sio_set_timeout (pc->conn, CONNPOOL_TIMEOUT);
+      sio_write (pc->conn, "NOOP\r\n", 6);
+      sio_flush (pc->conn);
+      if (read_status (pc->conn) != 2)
+	{
+	  sio_detach (pc->conn);
+	  close (pc->sd);
+	  free_parked (pc);
+	  continue;
+	}
+      pc->active = now_ms ();
+      pc->next = keep;
+      keep = pc;
+    }
+
+  POOL_LOCK (pool);
+  for (pc = keep; pc != NULL; pc = next)
+    {
+      next = pc->next;
+      pc->next = pool->conns;
+      pool->conns = pc;
+      pool->nconns++;
+    }
+  nconns = pool->nconns;
+  POOL_UNLOCK (pool);
+  return nconns;
+}
+
+/**
+ * smtp_connpool_destroy() - Destroy a connection pool.
+ * @pool: The pool.
+ *
+ * Close all parked connections and release the pool.  The pool must not
+ * be in use by any session.
+ */
+void
+smtp_connpool_destroy (smtp_connpool_t pool)
+{
+  struct parked_conn *pc, *next;
+
+  if (pool == NULL)
+    return;
+
+  for (pc = pool->conns; pc != NULL; pc = next)
+    {
+      next = pc->next;
+      close_parked (pc);
+    }
+#ifdef USE_PTHREADS
+  pthread_mutex_destroy (&pool->lock);
+#endif
+  free (pool);
+}
+
+/**
+ * smtp_set_connpool() - Use a connection pool for a session.
+ * @session: The session.
+ * @pool: The pool or %NULL to stop using a pool.
+ *
+ * Reuse a parked connection from the pool when smtp_start_session() is
+ * called and park the connection in the pool when the session completes.
+ * The pool must remain valid while the session uses it.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_connpool (smtp_session_t session, smtp_connpool_t pool)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  session->connpool = pool;
+  return 1;
+}
+
+/**
+ * smtp_set_connpool_identity() - Name the credentials for pooling.
+ * @session: The session.
+ * @identity: The credentials' identity or %NULL.
+ *
+ * Name the credentials supplied by the session's authentication context,
+ * for example the authentication ID, so that a connection authenticated
+ * by the session may be parked in the pool.  It is reused only by a
+ * later session which sets an authentication context and the same
+ * identity.  The identity must be unique to the credentials.  Unless it
+ * is set, connections of a session with an authentication context are
+ * not parked.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_connpool_identity (smtp_session_t session, const char *identity)
+{
+  char *copy;
+
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  copy = NULL;
+  if (identity != NULL && (copy = strdup (identity)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  if (session->connpool_identity != NULL)
+    free (session->connpool_identity);
+  session->connpool_identity = copy;
+  return 1;
+}
+
+/* Take a parked connection for the session's server and restore the
+   server state recorded when it was parked.  Connections found to be
+   closed or expired are discarded.  */
+struct siobuf *
+connpool_checkout (smtp_session_t session, int *sd)
+{
+  smtp_connpool_t pool = session->connpool;
+  struct parked_conn *pc, **prev, *discard;
+  struct siobuf *conn;
+  long long now;
+
+  if (session->host == NULL)
+    return NULL;
+#ifdef USE_ETRN
+  if (session->etrn_nodes != NULL)
+    return NULL;
+#endif
+
+  discard = NULL;
+  now = now_ms ();
+  POOL_LOCK (pool);
+  for (prev = &pool->conns; (pc = *prev) != NULL; )
+    {
+      if (!key_matches (pc, session))
+	{
+	  prev = &pc->next;
+	  continue;
+	}
+      *prev = pc->next;
+      pool->nconns--;
+      if (now - pc->parked < pool->idle_timeout && is_alive (pc))
+	break;
+      pc->next = discard;
+      discard = pc;
+    }
+  POOL_UNLOCK (pool);
+
+  while (discard != NULL)
+    {
+      struct parked_conn *next = discard->next;
+
+      close_parked (discard);
+      discard = next;
+    }
+  if (pc == NULL)
+    return NULL;
+
+  if (session->canon != NULL)
+    free (session->canon);
+  session->canon = pc->canon;
+  pc->canon = NULL;
+  session->extensions = pc->extensions;
+  session->size_limit = pc->size_limit;
+  session->rcpt_max = pc->rcpt_max;
+  session->mail_max = pc->mail_max;
+  session->rcptdomain_max = pc->rcptdomain_max;
+  session->mail_count = pc->mail_count;
+  session->authenticated = pc->authenticated;
+#ifdef USE_TLS
+  session->using_tls = pc->using_tls;
+  session->tls_handshake = 0;
+#endif
+  conn = pc->conn;
+  *sd = pc->sd;
+  free_parked (pc);
+  return conn;
+}
+
+/* Park the session's connection in the pool instead of closing it.  This
+   is done only if the session completed cleanly.  Returns non-zero if the
+   pool has taken ownership of the connection.  */
+int
+connpool_checkin (smtp_session_t session, struct siobuf *conn, int sd)
+{
+  smtp_connpool_t pool = session->connpool;
+  struct parked_conn *pc;
+  int len;
+
+  /* Don't park a connection after a failure, or with unread input, or
+     if a SASL security layer was negotiated, since it belongs to the
+     session's authentication context.  Nor if the server will accept
+     no more transactions on it, or if the application has not named
+     the credentials.  */
+  if (session->current_message != NULL || session->try_fallback_server
+      || session->nresp != 0 || session->host == NULL
+      || (session->mail_max > 0 && session->mail_count >= session->mail_max)
+      || (session->authenticated && session->auth_context == NULL)
+      || (session->auth_context != NULL && session->connpool_identity == NULL))
+    return 0;
+  sio_peek (conn, &len);
+  if (len > 0)
+    return 0;
+
+  if ((pc = malloc (sizeof (struct parked_conn))) == NULL)
+    return 0;
+  memset (pc, 0, sizeof (struct parked_conn));
+  pc->host = strdup (session->host);
+  pc->port = strdup (session->port);
+  if (session->canon != NULL)
+    pc->canon = strdup (session->canon);
+  if (session->auth_context != NULL)
+    pc->identity = strdup (session->connpool_identity);
+  if (pc->host == NULL || pc->port == NULL
+      || (session->auth_context != NULL && pc->identity == NULL))
+    {
+      free_parked (pc);
+      return 0;
+    }
+  pc->conn = conn;
+  pc->sd = sd;
+  pc->extensions = session->extensions;
+  pc->size_limit = session->size_limit;
+  pc->rcpt_max = session->rcpt_max;
+  pc->mail_max = session->mail_max;
+  pc->rcptdomain_max = session->rcptdomain_max;
+  pc->mail_count = session->mail_count;
+  pc->authenticated = session->authenticated;
+#ifdef USE_TLS
+  pc->starttls_enabled = session->starttls_enabled;
+  pc->using_tls = session->using_tls;
+#endif
+  pc->parked = pc->active = now_ms ();
+
+  /* The session's monitor must not see traffic on the parked connection */
+  sio_set_monitorcb (conn, NULL, NULL);
+
+  POOL_LOCK (pool);
+  if (pool->nconns >= pool->max_idle)
+    {
+      POOL_UNLOCK (pool);
+      if (session->monitor_cb != NULL)
+	sio_set_monitorcb (conn, session->monitor_cb, session->monitor_cb_arg);
+      free_parked (pc);
+      return 0;
+    }
+  pc->next = pool->conns;
+  pool->conns = pc;
+  pool->nconns++;
+  POOL_UNLOCK (pool);
+  return 1;
+}
@@ -0,0 +1,521 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#ifdef USE_PTHREADS
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#include "libesmtp-private.h"
+#include "api.h"
+
+/**
+ * DOC: Delivery Pool
+ *
+ * Delivery Pool
+ * -------------
+ *
+ * A delivery pool runs sessions on a fixed set of worker threads.  The
+ * application creates and populates sessions exactly as it would for
+ * smtp_start_session() then submits them to the pool, which starts each
+ * session on one of its workers.  The number of sessions connected to any
+ * one host concurrently may be capped; sessions for a host which is at its
+ * limit remain queued while sessions for other hosts proceed.
+ *
+ * Each worker has its own queue.  Submitted sessions are distributed over
+ * the queues and a worker with nothing to do takes work from the other
+ * workers' queues, so a few slow servers do not leave idle workers while
+ * work is pending elsewhere.
+ *
+ * A completion callback is notified on the worker thread when each session
+ * finishes.  smtp_errno() is maintained per thread so, in the callback, it
+ * reports the failure reason for that session.  A session must not be
+ * modified or destroyed by the application between smtp_pool_submit() and
+ * its completion callback.
+ */
+
+struct pool_item
+  {
+    struct pool_item *next;
+    struct pool_item *prev;
+    smtp_session_t session;
+    struct pool_host *host;		/* Found when submitted, or NULL */
+  };
+
+/* Per host and port connection count.  Entries persist for the lifetime
+   of the pool, the number of distinct hosts is expected to be modest.
+   The count is updated atomically so that workers claim and release
+   slots without taking the pool lock.  */
+struct pool_host
+  {
+    struct pool_host *next;
+    int active;				/* Sessions connected to host */
+    const char *port;			/* Follows name */
+    char name[1];
+  };
+
+struct pool_worker
+  {
+    struct smtp_pool *pool;		/* Back reference */
+    pthread_t thread;
+    pthread_mutex_t lock;		/* Protects the queue, never held
+					   with the pool lock */
+    struct pool_item *head;		/* Owner takes from the head */
+    struct pool_item *tail;		/* Thieves take from the tail */
+  };
+
+struct smtp_pool
+  {
+    pthread_mutex_t lock;		/* Protects everything below */
+    pthread_cond_t work;		/* Signalled when work may be runnable */
+    pthread_cond_t idle;		/* Signalled when pool becomes idle */
+    unsigned long generation;		/* Bumped when work may be runnable */
+    int pending;			/* Queued sessions */
+    int running;			/* Sessions in progress */
+    int shutdown;
+    int max_per_host;
+    struct pool_host *hosts;
+
+    smtp_pool_donecb_t done_cb;
+    void *done_cb_arg;
+
+    int next_worker;			/* Round robin for submission */
+    int nworkers;
+    struct pool_worker *workers;
+  };
+
+/* Find or create the connection count for the session's host and port.
+   Called with the pool lock held.  */
+static struct pool_host *
+pool_host (smtp_pool_t pool, smtp_session_t session)
+{
+  struct pool_host *host;
+  const char *name, *port;
+  size_t len;
+
+  name = session->host != NULL ? session->host : "";
+  port = session->port != NULL ? session->port : "";
+  for (host = pool->hosts; host != NULL; host = host->next)
+    if (strcasecmp (host->name, name) == 0 && strcmp (host->port, port) == 0)
+      return host;
+
+  len = strlen (name) + 1;
+  if ((host = malloc (sizeof (struct pool_host) + len + strlen (port))) == NULL)
+    return NULL;
+  host->active = 0;
+  memcpy (host->name, name, len);
+  host->port = strcpy (host->name + len, port);
+  host->next = pool->hosts;
+  pool->hosts = host;
+  return host;
+}
+
+/* Claim a connection slot for the item's host.  Called with only the
+   worker's queue lock held.  If the host could not be recorded when the
+   session was submitted, the session runs anyway rather than stalling the
+   queue.  */
+static int
+claim_host (smtp_pool_t pool, struct pool_item *item)
+{
+  struct pool_host *host;
+  int active;
+
+  if ((host = item->host) == NULL)
+    return 1;
+  active = __atomic_load_n (&host->active, __ATOMIC_RELAXED);
+  do
+    if (active >= pool->max_per_host)
+      return 0;
+  while (!__atomic_compare_exchange_n (&host->active, &active, active + 1, 1,
+				       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  return 1;
+}
+
+static void
+unlink_item (struct pool_worker *worker, struct pool_item *item)
+{
+  if (item->prev != NULL)
+    item->prev->next = item->next;
+  else
+    worker->head = item->next;
+  if (item->next != NULL)
+    item->next->prev = item->prev;
+  else
+    worker->tail = item->prev;
+}
+
+/* Take a runnable session from the worker's queue.  The owner scans from
+   the head so its own work runs in submission order, a thief scans from
+   the tail to minimise contention with the owner.  Sessions whose host is
+   at its connection limit are skipped.  The pool lock is not taken, so
+   workers scanning different queues do not serialise on it.  */
+static struct pool_item *
+take_item (struct pool_worker *worker, int steal)
+{
+  smtp_pool_t pool = worker->pool;
+  struct pool_item *item;
+
+  pthread_mutex_lock (&worker->lock);
+  for (item = steal ? worker->tail : worker->head;
+       item != NULL;
+       item = steal ? item->prev : item->next)
+    if (claim_host (pool, item))
+      {
+	unlink_item (worker, item);
+	break;
+      }
+  pthread_mutex_unlock (&worker->lock);
+  return item;
+}
+
+static struct pool_item *
+find_work (struct pool_worker *worker)
+{
+  smtp_pool_t pool = worker->pool;
+  struct pool_item *item;
+  int i, n;
+
+  if ((item = take_item (worker, 0)) != NULL)
+    return item;
+  n = worker - pool->workers;
+  for (i = 1; i < pool->nworkers; i++)
+    if ((item = take_item (&pool->workers[(n + i) % pool->nworkers], 1)) != NULL)
+      return item;
+  return NULL;
+}
+
+static void *
+pool_worker (void *arg)
+{
+  struct pool_worker *worker = arg;
+  smtp_pool_t pool = worker->pool;
+  struct pool_item *item;
+  unsigned long generation;
+  int status;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&pool->lock);
+      generation = pool->generation;
+      pthread_mutex_unlock (&pool->lock);
+
+      if ((item = find_work (worker)) != NULL)
+	{
+	  pthread_mutex_lock (&pool->lock);
+	  pool->pending--;
+	  pool->running++;
+	  pthread_mutex_unlock (&pool->lock);
+
+	  status = smtp_start_session (item->session);
+	  if (pool->done_cb != NULL)
+	    (*pool->done_cb) (item->session, status, pool->done_cb_arg);
+
+	  /* Release the host slot before bumping the generation so that a
+	     worker which found the host full sees the slot when it wakes.  */
+	  if (item->host != NULL)
+	    __atomic_sub_fetch (&item->host->active, 1, __ATOMIC_RELEASE);
+	  pthread_mutex_lock (&pool->lock);
+	  pool->running--;
+	  pool->generation++;
+	  pthread_cond_broadcast (&pool->work);
+	  if (pool->pending == 0 && pool->running == 0)
+	    pthread_cond_broadcast (&pool->idle);
+	  pthread_mutex_unlock (&pool->lock);
+	  free (item);
+	  continue;
+	}
+
+      /* Nothing runnable.  Sleep unless work arrived or a host slot was
+         released while the queues were being scanned.  */
+      pthread_mutex_lock (&pool->lock);
+      if (pool->shutdown && pool->pending == 0)
+	{
+	  pthread_mutex_unlock (&pool->lock);
+	  break;
+	}
+      while (pool->generation == generation)
+	pthread_cond_wait (&pool->work, &pool->lock);
+      pthread_mutex_unlock (&pool->lock);
+    }
+  return NULL;
+}
+
+/**
+ * smtp_pool_create() - Create a delivery pool.
+ * @nworkers: Number of worker threads.
+ * @max_per_host: Maximum concurrent sessions per host, zero for no limit.
+ *
+ * Create a delivery pool and start its worker threads.  Sessions are
+ * grouped by the host name and port set with smtp_set_server() for the
+ * purpose of the per host limit.
+ *
+ * Return: The pool or %NULL on failure.
+ */
+smtp_pool_t
+smtp_pool_create (int nworkers, int max_per_host)
+{
+  smtp_pool_t pool;
+  int i;
+
+  SMTPAPI_CHECK_ARGS (nworkers > 0 && max_per_host >= 0, NULL);
+
+  if ((pool = malloc (sizeof (struct smtp_pool))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  memset (pool, 0, sizeof (struct smtp_pool));
+  if ((pool->workers = calloc (nworkers, sizeof (struct pool_worker))) == NULL)
+    {
+      free (pool);
+      set_errno (ENOMEM);
+      return NULL;
+    }
+  pool->max_per_host = max_per_host;
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->work, NULL);
+  pthread_cond_init (&pool->idle, NULL);
+
+  /* Workers take the pool lock before they first look for work, so they
+     see the final number of workers.  */
+  pthread_mutex_lock (&pool->lock);
+  for (i = 0; i < nworkers; i++)
+    {
+      pool->workers[i].pool = pool;
+      pthread_mutex_init (&pool->workers[i].lock, NULL);
+      if (pthread_create (&pool->workers[i].thread, NULL,
+			  pool_worker, &pool->workers[i]) != 0)
+	{
+	  pthread_mutex_destroy (&pool->workers[i].lock);
+	  break;
+	}
+      pool->nworkers++;
+    }
+  pthread_mutex_unlock (&pool->lock);
+  if (pool->nworkers == 0)
+    {
+      smtp_pool_destroy (pool);
+      set_errno (EAGAIN);
+      return NULL;
+    }
+  return pool;
+}
+
+/**
+ * smtp_pool_set_donecb() - Set the session completion callback.
+ * @pool: The pool.
+ * @cb: Callback function.
+ * @arg: Argument (closure) passed to callback.
+ *
+ * Set a callback which is notified on the worker thread when a session
+ * submitted to the pool completes.  The callback receives the return
+ * value from smtp_start_session(); if this is zero, smtp_errno() describes
+ * the failure.  The callback may destroy the session.  This must be set
+ * before any sessions are submitted.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_pool_set_donecb (smtp_pool_t pool, smtp_pool_donecb_t cb, void *arg)
+{
+  SMTPAPI_CHECK_ARGS (pool != NULL, 0);
+
+  pthread_mutex_lock (&pool->lock);
+  pool->done_cb = cb;
+  pool->done_cb_arg = arg;
+  pthread_mutex_unlock (&pool->lock);
+  return 1;
+}
+
+/**
+ * smtp_pool_submit() - Queue a session for delivery.
+ * @pool: The pool.
+ * @session: The session.
+ *
+ * Queue the session to be started on one of the pool's workers.  The
+ * session must be fully configured.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_pool_submit (smtp_pool_t pool, smtp_session_t session)
+{
+  struct pool_worker *worker;
+  struct pool_item *item;
+
+  SMTPAPI_CHECK_ARGS (pool != NULL && session != NULL, 0);
+
+  if ((item = malloc (sizeof (struct pool_item))) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  item->session = session;
+  item->next = NULL;
+
+  pthread_mutex_lock (&pool->lock);
+  if (pool->shutdown)
+    {
+      pthread_mutex_unlock (&pool->lock);
+      free (item);
+      set_error (SMTP_ERR_INVAL);
+      return 0;
+    }
+  item->host = pool->max_per_host > 0 ? pool_host (pool, session) : NULL;
+  worker = &pool->workers[pool->next_worker];
+  pool->next_worker = (pool->next_worker + 1) % pool->nworkers;
+  pool->pending++;
+  pthread_mutex_unlock (&pool->lock);
+
+  pthread_mutex_lock (&worker->lock);
+  item->prev = worker->tail;
+  if (worker->tail != NULL)
+    worker->tail->next = item;
+  else
+    worker->head = item;
+  worker->tail = item;
+  pthread_mutex_unlock (&worker->lock);
+
+  pthread_mutex_lock (&pool->lock);
+  pool->generation++;
+  pthread_cond_broadcast (&pool->work);
+  pthread_mutex_unlock (&pool->lock);
+  return 1;
+}
+
+/**
+ * smtp_pool_wait() - Wait for the pool to become idle.
+ * @pool: The pool.
+ *
+ * Block until every session submitted to the pool has completed.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_pool_wait (smtp_pool_t pool)
+{
+  SMTPAPI_CHECK_ARGS (pool != NULL, 0);
+
+  pthread_mutex_lock (&pool->lock);
+  while (pool->pending > 0 || pool->running > 0)
+    pthread_cond_wait (&pool->idle, &pool->lock);
+  pthread_mutex_unlock (&pool->lock);
+  return 1;
+}
+
+/**
+ * smtp_pool_destroy() - Destroy a delivery pool.
+ * @pool: The pool.
+ *
+ * Wait for all queued sessions to complete, then stop the worker threads
+ * and release the pool.  Sessions are not destroyed.
+ */
+void
+smtp_pool_destroy (smtp_pool_t pool)
+{
+  struct pool_host *host, *next;
+  int i;
+
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->shutdown = 1;
+  pool->generation++;
+  pthread_cond_broadcast (&pool->work);
+  pthread_mutex_unlock (&pool->lock);
+
+  /* Other workers may still look at a queue after its owner exits.  */
+  for (i = 0; i < pool->nworkers; i++)
+    pthread_join (pool->workers[i].thread, NULL);
+  for (i = 0; i < pool->nworkers; i++)
+    pthread_mutex_destroy (&pool->workers[i].lock);
+
+  for (host = pool->hosts; host != NULL; host = next)
+    {
+      next = host->next;
+      free (host);
+    }
+  pthread_cond_destroy (&pool->idle);
+  pthread_cond_destroy (&pool->work);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool->workers);
+  free (pool);
+}
+
+#else
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "libesmtp-private.h"
+
+/* Without thread support a pool cannot be created; the remaining
+   functions fail or do nothing since no valid pool can exist.  */
+
+smtp_pool_t
+smtp_pool_create (int nworkers, int max_per_host)
+{
+  SMTPAPI_CHECK_ARGS (nworkers > 0 && max_per_host >= 0, NULL);
+
+  set_errno (ENOSYS);
+  return NULL;
+}
+
+int
+smtp_pool_set_donecb (smtp_pool_t pool,
+		      smtp_pool_donecb_t cb __attribute__ ((unused)),
+		      void *arg __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (pool != NULL, 0);
+
+  return 0;
+}
+
+int
+smtp_pool_submit (smtp_pool_t pool, smtp_session_t session)
+{
+  SMTPAPI_CHECK_ARGS (pool != NULL && session != NULL, 0);
+
+  return 0;
+}
+
+int
+smtp_pool_wait (smtp_pool_t pool)
+{
+  SMTPAPI_CHECK_ARGS (pool != NULL, 0);
+
+  return 0;
+}
+
+void
+smtp_pool_destroy (smtp_pool_t pool __attribute__ ((unused)))
+{
+}
+
+#endif
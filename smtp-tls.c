@@ -41,6 +41,7 @@
  * * smtp_starttls_set_password_cb()
  * * smtp_starttls_set_ctx()
  * * smtp_starttls_enable()
+ * * smtp_starttls_ctx_cache_enable()
  *
  * See also: `OpenSSL <https://www.openssl.org/>`_.
  */
@@ -52,6 +53,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <openssl/x509v3.h>
 #include <openssl/err.h>
 #include <missing.h> /* declarations for missing library functions */
@@ -241,9 +243,13 @@ smtp_starttls_set_password_cb (smtp_starttls_passwordcb_t cb, void *arg)
   return 1;
 }
 
+/* Returns 0 on failure.  Otherwise returns 1 if the SSL_CTX was
+   initialised as configured or 2 if the application accepted a problem
+   with the configuration; such a context is not shared.  */
 static int
 starttls_init_ctx (smtp_session_t session, SSL_CTX *ctx)
 {
+  int result = 1;
   char buf[2048];
   char buf2[2016];
   char *keyfile, *cafile, *capath;
@@ -288,6 +294,7 @@ starttls_init_ctx (smtp_session_t session, SSL_CTX *ctx)
 				  session->event_cb_arg, &ok);
 	  if (!ok)
 	    return 0;
+	  result = 2;
 	}
     }
   else if (status == FILE_PROBLEM)
@@ -329,6 +336,278 @@ starttls_init_ctx (smtp_session_t session, SSL_CTX *ctx)
   else
     SSL_CTX_set_default_verify_paths (ctx);
 
+  return result;
+}
+
+/* Shared SSL_CTX cache.  Contexts are shared by sessions which would
+   initialise them identically, that is which find the same certificate
+   files and use the same password callback.  Each session holds a
+   reference, as does the cache.  A context is replaced when any of the
+   files it was loaded from changes, including its permissions or owner
+   which decide whether the file is used.  The files are checked at most
+   once per CTX_CHECK_INTERVAL seconds.  */
+
+#define CTX_CHECK_INTERVAL	1
+#define CTX_NFILES		5
+
+struct file_sig
+  {
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    mode_t mode;		/* Checked by check_file() and check_directory() */
+    uid_t uid;
+  };
+
+struct ctx_cache
+  {
+    struct ctx_cache *next;
+    char *key;
+    SSL_CTX *ctx;
+    char *files[CTX_NFILES];		/* Files the CTX depends on */
+    struct file_sig sig[CTX_NFILES];
+    time_t checked;
+  };
+
+static int ctx_cache_enabled;
+static struct ctx_cache *ctx_cache;
+
+static void
+file_sig (struct file_sig *sig, const char *path)
+{
+  struct stat st;
+
+  memset (sig, 0, sizeof (struct file_sig));
+  if (path == NULL || stat (path, &st) < 0)
+    return;
+  sig->exists = 1;
+  sig->dev = st.st_dev;
+  sig->ino = st.st_ino;
+  sig->size = st.st_size;
+  sig->mtime = st.st_mtime;
+  sig->mode = st.st_mode;
+  sig->uid = st.st_uid;
+}
+
+/* Find the files from which starttls_init_ctx() initialises an SSL_CTX.
+   The system defaults are included since they are used if the user has
+   no CA list.  Returns the number of names set, or -1 if a name does not
+   fit.  */
+static int
+ctx_files (const char *files[], char buf[][2048])
+{
+  const char *env;
+  int n = 0;
+
+  if ((files[n] = user_pathname (buf[n], sizeof buf[n],
+				 "private/smtp-starttls.pem")) == NULL)
+    return -1;
+  n++;
+  if ((files[n] = user_pathname (buf[n], sizeof buf[n], "ca.pem")) == NULL)
+    return -1;
+  n++;
+  if ((files[n] = user_pathname (buf[n], sizeof buf[n], "ca")) == NULL)
+    return -1;
+  n++;
+  env = getenv (X509_get_default_cert_file_env ());
+  files[n++] = env != NULL ? env : X509_get_default_cert_file ();
+  env = getenv (X509_get_default_cert_dir_env ());
+  files[n++] = env != NULL ? env : X509_get_default_cert_dir ();
+  return n;
+}
+
+static void
+ctx_cache_free (struct ctx_cache *entry)
+{
+  int i;
+
+  SSL_CTX_free (entry->ctx);
+  free (entry->key);
+  for (i = 0; i < CTX_NFILES; i++)
+    free (entry->files[i]);
+  free (entry);
+}
+
+/* Check whether any of the files have changed.  */
+static int
+ctx_cache_stale (struct ctx_cache *entry, time_t now)
+{
+  struct file_sig sig;
+  int i;
+
+  if (now - entry->checked < CTX_CHECK_INTERVAL)
+    return 0;
+  entry->checked = now;
+  for (i = 0; i < CTX_NFILES; i++)
+    {
+      file_sig (&sig, entry->files[i]);
+      if (memcmp (&sig, &entry->sig[i], sizeof sig) != 0)
+	return 1;
+    }
+  return 0;
+}
+
+/* Look up the SSL_CTX matching the current configuration.  On success
+   the returned SSL_CTX has been up referenced for the caller.  On failure
+   the key is returned for use with ctx_cache_insert().  Called with the
+   mutex held.  */
+static SSL_CTX *
+ctx_cache_lookup (char **keyp)
+{
+  char buf[CTX_NFILES][2048];
+  const char *files[CTX_NFILES];
+  struct ctx_cache *entry, **prev;
+  size_t len;
+  char *key;
+  int i, n;
+
+  *keyp = NULL;
+  if ((n = ctx_files (files, buf)) < 0)
+    return NULL;
+
+  len = 64;
+  for (i = 0; i < n; i++)
+    len += strlen (files[i]) + 1;
+  if ((key = malloc (len)) == NULL)
+    return NULL;
+  snprintf (key, len, "%p:%p", (void *) ctx_password_cb, ctx_password_cb_arg);
+  for (i = 0; i < n; i++)
+    {
+      strcat (key, "\n");
+      strcat (key, files[i]);
+    }
+
+  for (prev = &ctx_cache; (entry = *prev) != NULL; prev = &entry->next)
+    if (strcmp (entry->key, key) == 0)
+      {
+	if (ctx_cache_stale (entry, time (NULL)))
+	  {
+	    /* Certificates verified against the old files must be
+	       checked again.  */
+	    *prev = entry->next;
+	    ctx_cache_free (entry);
+	    smtp_tls_verify_cache_flush ();
+	    break;
+	  }
+	free (key);
+	SSL_CTX_up_ref (entry->ctx);
+	return entry->ctx;
+      }
+  *keyp = key;
+  return NULL;
+}
+
+/* Add a newly initialised SSL_CTX to the cache, taking ownership of the
+   key.  Called with the mutex held.  */
+static void
+ctx_cache_insert (char *key, SSL_CTX *ctx)
+{
+  char buf[CTX_NFILES][2048];
+  const char *files[CTX_NFILES];
+  struct ctx_cache *entry, *other;
+  int i;
+
+  if ((entry = calloc (1, sizeof (struct ctx_cache))) == NULL)
+    {
+      free (key);
+      return;
+    }
+  entry->key = key;
+
+  /* Another session may have added the same configuration meanwhile.  */
+  for (other = ctx_cache; other != NULL; other = other->next)
+    if (strcmp (other->key, key) == 0)
+      {
+	ctx_cache_free (entry);
+	return;
+      }
+  if (ctx_files (files, buf) != CTX_NFILES)
+    {
+      ctx_cache_free (entry);
+      return;
+    }
+  for (i = 0; i < CTX_NFILES; i++)
+    {
+      if ((entry->files[i] = strdup (files[i])) == NULL)
+	{
+	  ctx_cache_free (entry);
+	  return;
+	}
+      file_sig (&entry->sig[i], files[i]);
+    }
+  entry->checked = time (NULL);
+  SSL_CTX_up_ref (ctx);
+  entry->ctx = ctx;
+  entry->next = ctx_cache;
+  ctx_cache = entry;
+}
+
+/* Compute a signature of the trusted CA files, including the system
+   defaults, as hex digits in buf.  Returns NULL if it cannot be
+   determined.  */
+static char *
+trust_signature (char *buf, size_t buflen)
+{
+  char names[CTX_NFILES][2048];
+  const char *files[CTX_NFILES];
+  struct file_sig sig[CTX_NFILES - 1];
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen, i;
+
+  if (ctx_files (files, names) != CTX_NFILES)
+    return NULL;
+  /* The first file is the client certificate.  */
+  for (i = 1; i < CTX_NFILES; i++)
+    file_sig (&sig[i - 1], files[i]);
+  if (!EVP_Digest (sig, sizeof sig, md, &mdlen, EVP_sha256 (), NULL)
+      || buflen < 2 * mdlen + 1)
+    return NULL;
+  for (i = 0; i < mdlen; i++)
+    snprintf (buf + 2 * i, 3, "%02x", md[i]);
+  return buf;
+}
+
+/**
+ * smtp_starttls_ctx_cache_enable() - Share SSL_CTX between sessions.
+ * @onoff: Non-zero to enable sharing, zero to disable it.
+ *
+ * Normally libESMTP creates and initialises a new SSL_CTX, including
+ * parsing the trusted CA list, for every session which uses STARTTLS.
+ * When this is enabled, sessions which would initialise the SSL_CTX
+ * identically share a single reference counted SSL_CTX instead.  A shared
+ * SSL_CTX is replaced by a new one when any of the certificate or CA files
+ * it was loaded from is modified; sessions already using it are
+ * unaffected.  Disabling the cache releases the cached contexts.
+ *
+ * An application which modifies the SSL_CTX returned by
+ * smtp_starttls_get_ctx() must not enable this, since the changes would
+ * affect other sessions.  Contexts set with smtp_starttls_set_ctx() are
+ * never shared.
+ *
+ * Returns: Zero on failure, non-zero on success.
+ */
+int
+smtp_starttls_ctx_cache_enable (int onoff)
+{
+  struct ctx_cache *entry, *next;
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&starttls_mutex);
+#endif
+  ctx_cache_enabled = onoff;
+  entry = onoff ? NULL : ctx_cache;
+  if (!onoff)
+    ctx_cache = NULL;
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&starttls_mutex);
+#endif
+  for (; entry != NULL; entry = next)
+    {
+      next = entry->next;
+      ctx_cache_free (entry);
+    }
   return 1;
 }
 
@@ -336,11 +615,23 @@ static SSL_CTX *
 starttls_create_ctx (smtp_session_t session)
 {
   SSL_CTX *ctx;
+  char *key = NULL;
+  char trust[2 * EVP_MAX_MD_SIZE + 1];
+  int status;
 
-  /* Previous versions attempted to cache the SSL_CTX, however properly caching
-     it is too complicated without a dedicated API.  Simple use cases leak the
-     SSL_CTX.  If an application needs a cached SSL_CTX it should create one of
-     its own and use smtp_starttls_set_ctx() each time it creates a session */
+#ifdef USE_PTHREADS
+  pthread_mutex_lock (&starttls_mutex);
+#endif
+  if (ctx_cache_enabled && (ctx = ctx_cache_lookup (&key)) != NULL)
+    {
+#ifdef USE_PTHREADS
+      pthread_mutex_unlock (&starttls_mutex);
+#endif
+      return ctx;
+    }
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock (&starttls_mutex);
+#endif
 
   /* The decision not to support SSL v2 and v3 but instead to use only
      TLSv1.X is deliberate.  This is in line with the intentions of RFC
@@ -351,14 +642,27 @@ starttls_create_ctx (smtp_session_t session)
   if (ctx != NULL)
     {
       SSL_CTX_set_min_proto_version (ctx, TLS1_VERSION);
+      tls_verify_cache_install (ctx, trust_signature (trust, sizeof trust));
 
-      if (!starttls_init_ctx (session, ctx))
+      if (!(status = starttls_init_ctx (session, ctx)))
         {
           SSL_CTX_free (ctx);
           ctx = NULL;
         }
+      else if (status == 1 && key != NULL)
+	{
+#ifdef USE_PTHREADS
+	  pthread_mutex_lock (&starttls_mutex);
+#endif
+	  ctx_cache_insert (key, ctx);
+	  key = NULL;
+#ifdef USE_PTHREADS
+	  pthread_mutex_unlock (&starttls_mutex);
+#endif
+	}
     }
 
+  free (key);
   return ctx;
 }
 
@@ -377,6 +681,18 @@ starttls_create_ssl (smtp_session_t session)
   ckf_t status;
 
   ssl = SSL_new (session->starttls_ctx);
+  if (ssl == NULL)
+    return NULL;
+
+#ifdef SSL_OP_ENABLE_KTLS
+  /* Let OpenSSL hand the record layer to the kernel after the handshake,
+     if the kernel and the negotiated cipher support it.  */
+  SSL_set_options (ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+  /* Offer a previous session with this server for resumption.  */
+  tls_session_cache_get (session, ssl);
+  tls_verify_cache_attach (session, ssl);
 
   /* Client certificate policy: if a host specific client certificate
      is found it is presented to the server if requested. */
@@ -489,13 +805,22 @@ smtp_starttls_get_ctx (smtp_session_t session)
  * %Starttls_REQUIRED the protocol will quit rather than transferring any
  * messages if the STARTTLS extension is not available.
  *
+ * If set to %Starttls_IMPLICIT the TLS handshake is performed immediately
+ * the connection is established, before the server's greeting, as described
+ * in RFC 8314.  This saves two round trips compared to STARTTLS but requires
+ * a server which expects it, usually on the ``submissions`` port, 465, which
+ * must be specified explicitly in smtp_set_server().  The server is verified
+ * exactly as for STARTTLS and the same events are reported.
+ *
  * Returns: Zero on failure, non-zero on success.
  */
-/* how == 0: disabled, 1: if possible, 2: required */
+/* how == 0: disabled, 1: if possible, 2: required, 3: implicit */
 int
 smtp_starttls_enable (smtp_session_t session, enum starttls_option how)
 {
-  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+  SMTPAPI_CHECK_ARGS (session != NULL
+		      && how >= Starttls_DISABLED && how <= Starttls_IMPLICIT,
+		      0);
 
   session->starttls_enabled = how;
   if (how == Starttls_REQUIRED)
@@ -505,6 +830,31 @@ smtp_starttls_enable (smtp_session_t session, enum starttls_option how)
   return 1;
 }
 
+/**
+ * smtp_set_tcp_fastopen() - Send the TLS ClientHello with the TCP SYN.
+ * @session: The session.
+ * @onoff: Non-zero to enable TCP Fast Open.
+ *
+ * With implicit TLS (see smtp_starttls_enable()) the client speaks first,
+ * so the TLS ClientHello may be carried in the TCP SYN using TCP Fast Open
+ * (RFC 7413), saving a further round trip on connections to a server which
+ * has been contacted before.  The SYN is not sent until the ClientHello is
+ * written, so connections are not raced in parallel as described for
+ * smtp_start_session(); the MTA's addresses are tried in turn.  This option
+ * has no effect without implicit TLS or if the system does not support
+ * TCP Fast Open for clients.
+ *
+ * Returns: Zero on failure, non-zero on success.
+ */
+int
+smtp_set_tcp_fastopen (smtp_session_t session, int onoff)
+{
+  SMTPAPI_CHECK_ARGS (session != NULL, 0);
+
+  session->tcp_fastopen = !!onoff;
+  return 1;
+}
+
 int
 select_starttls (smtp_session_t session)
 {
@@ -582,6 +932,12 @@ check_acceptable_security (smtp_session_t session, SSL *ssl)
 	(*session->event_cb) (session, SMTP_EV_NO_PEER_CERTIFICATE,
 			      session->event_cb_arg, &ok);
     }
+  else if (session->tls_verify_cached)
+    {
+      /* The name was checked when the certificate was cached.  */
+      ok = 1;
+      X509_free (cert);
+    }
   else
     {
       char buf[256] = { 0 };
@@ -651,7 +1007,9 @@ check_acceptable_security (smtp_session_t session, SSL *ssl)
 	    }
 	}
 
-      if (!ok && session->event_cb != NULL)
+      if (ok && vfy_result == X509_V_OK)
+	tls_verify_cache_put (session, ssl, cert);
+      else if (!ok && session->event_cb != NULL)
 	(*session->event_cb) (session, SMTP_EV_WRONG_PEER_CERTIFICATE,
 			      session->event_cb_arg, &ok, buf, ssl);
 
@@ -667,13 +1025,78 @@ cmd_starttls (siobuf_t conn, smtp_session_t session)
   session->cmd_state = -1;
 }
 
+/* The TLS handshake has completed, check the server is acceptable.
+   Returns zero if it is not.  */
+static int
+starttls_established (siobuf_t conn, smtp_session_t session, SSL *ssl)
+{
+  int offload;
+
+  X509 *cert;
+  char buf[256];
+
+  session->using_tls = 1;
+
+  /* Forget what we know about the server and reset protocol state.
+     With implicit TLS nothing has been heard from the server before the
+     handshake.  Any capabilities are those cached from an earlier
+     connection, also over TLS, which allow EHLO to be sent early.  */
+  if (session->starttls_enabled != Starttls_IMPLICIT)
+    {
+      session->extensions = 0;
+      destroy_auth_mechanisms (session);
+    }
+
+  if (!check_acceptable_security (session, ssl))
+    return 0;
+  else
+    {
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_STARTTLS_OK,
+			      session->event_cb_arg,
+			      ssl, SSL_get_cipher (ssl),
+			      SSL_get_cipher_bits (ssl, NULL),
+			      (int) session->tls_verify_cached);
+
+      /* Report whether the kernel encrypts and decrypts records.  */
+      offload = sio_tls_offload (conn);
+      if (session->event_cb != NULL)
+	(*session->event_cb) (session, SMTP_EV_TLS_OFFLOAD,
+			      session->event_cb_arg,
+			      (offload & SIO_WRITE) != 0,
+			      (offload & SIO_READ) != 0);
+      cert = SSL_get_certificate (ssl);
+      if (cert != NULL)
+	{
+	  /* Copy the common name [typically email address] from the
+	     client certificate and use it to prime the SASL EXTERNAL
+	     mechanism */
+	  X509_NAME_get_text_by_NID (X509_get_subject_name (cert),
+				     NID_commonName, buf, sizeof buf);
+	  X509_free (cert);
+	  if (session->auth_context != NULL)
+	    auth_set_external_id (session->auth_context, buf);
+	}
+    }
+  return 1;
+}
+
+/* Continue the protocol after the handshake.  The protocol restarts with
+   EHLO after STARTTLS.  With implicit TLS it continues with the greeting. */
+static void
+tls_established (siobuf_t conn, smtp_session_t session, SSL *ssl)
+{
+  if (!starttls_established (conn, session, ssl))
+    session->rsp_state = S_quit;
+  else if (session->starttls_enabled != Starttls_IMPLICIT)
+    session->rsp_state = S_ehlo;
+}
+
 void
 rsp_starttls (siobuf_t conn, smtp_session_t session)
 {
   int code;
   SSL *ssl;
-  X509 *cert;
-  char buf[256];
 
   code = read_smtp_response (conn, session, &session->mta_status, NULL);
   if (code < 0)
@@ -688,46 +1111,74 @@ rsp_starttls (siobuf_t conn, smtp_session_t session)
 	set_error (SMTP_ERR_INVALID_RESPONSE_STATUS);
       session->rsp_state = S_quit;
     }
-  else if (sio_set_tlsclient_ssl (conn, (ssl = starttls_create_ssl (session))))
+  else if (session->nonblocking
+           && (ssl = starttls_create_ssl (session)) != NULL)
     {
-      session->using_tls = 1;
-
-      /* Forget what we know about the server and reset protocol state.
-       */
-      session->extensions = 0;
-      destroy_auth_mechanisms (session);
+      /* The protocol engine calls handshake_starttls() until the
+         handshake completes. */
+      sio_start_tlsclient_ssl (conn, ssl);
+      session->tls_handshake = 1;
+    }
+  else if (!session->nonblocking
+           && sio_set_tlsclient_ssl (conn, (ssl = starttls_create_ssl (session))))
+    tls_established (conn, session, ssl);
+  else
+    {
+      set_error (SMTP_ERR_CLIENT_ERROR);
+      session->rsp_state = -1;
+    }
+}
 
-      if (!check_acceptable_security (session, ssl))
-	session->rsp_state = S_quit;
-      else
-	{
-	  if (session->event_cb != NULL)
-	    (*session->event_cb) (session, SMTP_EV_STARTTLS_OK,
-				  session->event_cb_arg,
-				  ssl, SSL_get_cipher (ssl),
-				  SSL_get_cipher_bits (ssl, NULL));
-	  cert = SSL_get_certificate (ssl);
-	  if (cert != NULL)
-	    {
-	      /* Copy the common name [typically email address] from the
-		 client certificate and use it to prime the SASL EXTERNAL
-		 mechanism */
-	      X509_NAME_get_text_by_NID (X509_get_subject_name (cert),
-					 NID_commonName, buf, sizeof buf);
-	      X509_free (cert);
-	      if (session->auth_context != NULL)
-		auth_set_external_id (session->auth_context, buf);
-	    }
+/* Continue a non-blocking TLS handshake.  Return zero if the handshake
+   must be resumed when the connection is ready. */
+int
+handshake_starttls (siobuf_t conn, smtp_session_t session)
+{
+  int ret;
 
-	  /* Next state is EHLO */
-	  session->rsp_state = S_ehlo;
-	}
-    }
+  if ((ret = sio_tls_handshake (conn)) == 0)
+    return 0;
+  session->tls_handshake = 0;
+  if (ret > 0)
+    tls_established (conn, session, sio_get_ssl (conn));
   else
     {
       set_error (SMTP_ERR_CLIENT_ERROR);
       session->rsp_state = -1;
     }
+  return 1;
+}
+
+/* Implicit TLS (RFC 8314).  Start the handshake immediately after the
+   connection is established, before the greeting.  In non-blocking mode
+   the protocol engine calls handshake_starttls() until it completes.
+   Returns zero if TLS could not be started.  */
+int
+start_implicit_tls (siobuf_t conn, smtp_session_t session)
+{
+  SSL *ssl;
+
+  if (session->starttls_ctx == NULL)
+    session->starttls_ctx = starttls_create_ctx (session);
+  if (session->starttls_ctx == NULL
+      || (ssl = starttls_create_ssl (session)) == NULL)
+    {
+      set_error (SMTP_ERR_CLIENT_ERROR);
+      return 0;
+    }
+  if (session->nonblocking)
+    {
+      sio_start_tlsclient_ssl (conn, ssl);
+      session->tls_handshake = 1;
+      return 1;
+    }
+  if (!sio_set_tlsclient_ssl (conn, ssl))
+    {
+      set_error (SMTP_ERR_CLIENT_ERROR);
+      return 0;
+    }
+  tls_established (conn, session, ssl);
+  return 1;
 }
 
 #else
@@ -767,4 +1218,19 @@ smtp_starttls_set_password_cb (smtp_starttls_passwordcb_t cb
   return 0;
 }
 
+int
+smtp_starttls_ctx_cache_enable (int onoff __attribute__ ((unused)))
+{
+  return 0;
+}
+
+int
+smtp_set_tcp_fastopen (smtp_session_t session,
+		       int onoff __attribute__ ((unused)))
+{
+  SMTPAPI_CHECK_ARGS (session != (smtp_session_t) 0, 0);
+
+  return 0;
+}
+
 #endif
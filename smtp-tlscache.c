@@ -0,0 +1,756 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  Copyright (C) 2001,2002  Brian Stafford  <brian@stafford.uklinux.net>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+/**
+ * DOC: TLS Session Cache
+ *
+ * TLS Session Cache
+ * -----------------
+ *
+ * Each STARTTLS normally performs a full TLS handshake, including
+ * verification of the server's certificate chain.  An application which
+ * submits many sessions to the same MTA may enable a process wide cache of
+ * TLS sessions with smtp_tls_session_cache_set_size().  Subsequent
+ * connections to the same host and port then offer the cached session to
+ * the server, saving a round trip and the certificate processing if the
+ * server agrees to resume it.  Both TLS 1.2 session IDs and TLS 1.3
+ * session tickets are supported.
+ *
+ * The cache is shared by all sessions and threads.  It may be saved to a
+ * file with smtp_tls_session_cache_save() and reloaded with
+ * smtp_tls_session_cache_load(), allowing short lived processes to resume
+ * sessions established by their predecessors.
+ *
+ * Resumed sessions are subject to the same checks as new ones; the
+ * certificate verification result and peer certificate recorded when the
+ * session was established are reported through the usual events.
+ *
+ * When a session cannot be resumed, the cost of verifying the server's
+ * certificate chain and checking its name may be avoided by enabling the
+ * certificate verification cache with smtp_tls_verify_cache_set_lifetime().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <missing.h> /* declarations for missing library functions */
+
+#ifdef USE_TLS
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "libesmtp-private.h"
+#include "htable.h"
+#include "api.h"
+
+struct cache_entry
+  {
+    SSL_SESSION *sess;
+  };
+
+static struct h_node **cache;
+static int cache_size;
+static int cache_count;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t tlscache_lock = PTHREAD_MUTEX_INITIALIZER;
+# define TLSCACHE_LOCK()	pthread_mutex_lock (&tlscache_lock)
+# define TLSCACHE_UNLOCK()	pthread_mutex_unlock (&tlscache_lock)
+#else
+# define TLSCACHE_LOCK()	((void) 0)
+# define TLSCACHE_UNLOCK()	((void) 0)
+#endif
+
+/* Sessions are cached per server and port.  */
+static char *
+cache_key (smtp_session_t session)
+{
+  const char *host;
+  char *key;
+  size_t len;
+
+  host = session->canon != NULL ? session->canon : session->host;
+  if (host == NULL)
+    host = "";
+  len = strlen (host) + strlen (session->port) + 2;
+  if ((key = malloc (len)) != NULL)
+    snprintf (key, len, "%s/%s", host, session->port);
+  return key;
+}
+
+static int
+expired (SSL_SESSION *sess, time_t now)
+{
+  return SSL_SESSION_get_time (sess) + SSL_SESSION_get_timeout (sess) <= now;
+}
+
+static void
+cache_entry_free (const char *name __attribute__ ((unused)), void *data,
+		  void *arg __attribute__ ((unused)))
+{
+  struct cache_entry *entry = data;
+
+  SSL_SESSION_free (entry->sess);
+}
+
+static void
+cache_remove (struct cache_entry *entry)
+{
+  SSL_SESSION_free (entry->sess);
+  h_remove (cache, entry);
+  cache_count--;
+}
+
+struct oldest
+  {
+    struct cache_entry *entry;
+    long time;
+  };
+
+static void
+find_oldest (const char *name __attribute__ ((unused)), void *data,
+	     void *arg)
+{
+  struct cache_entry *entry = data;
+  struct oldest *oldest = arg;
+  long time;
+
+  time = SSL_SESSION_get_time (entry->sess);
+  if (oldest->entry == NULL || time < oldest->time)
+    {
+      oldest->entry = entry;
+      oldest->time = time;
+    }
+}
+
+/* Add the session to the cache, replacing any session for the same key.
+   The oldest session is discarded if the cache is full.  A reference to
+   the session is taken.  Called with the lock held.  */
+static void
+cache_store (const char *key, SSL_SESSION *sess)
+{
+  struct cache_entry *entry;
+  struct oldest oldest;
+
+  if (cache_size <= 0)
+    return;
+  if (cache == NULL && (cache = h_create ()) == NULL)
+    return;
+  if ((entry = h_search (cache, key, -1)) != NULL)
+    {
+      if (entry->sess == sess)
+	return;
+      cache_remove (entry);
+    }
+  while (cache_count >= cache_size)
+    {
+      oldest.entry = NULL;
+      h_enumerate (cache, find_oldest, &oldest);
+      if (oldest.entry == NULL)
+	break;
+      cache_remove (oldest.entry);
+    }
+  if ((entry = h_insert (cache, key, -1, sizeof (struct cache_entry))) == NULL)
+    return;
+  SSL_SESSION_up_ref (sess);
+  entry->sess = sess;
+  cache_count++;
+}
+
+/* If a usable session is cached for the session's server, set it in the
+   SSL connection so that the handshake attempts to resume it.  */
+void
+tls_session_cache_get (smtp_session_t session, SSL *ssl)
+{
+  struct cache_entry *entry;
+  SSL_SESSION *sess;
+  char *key;
+
+  if (cache_size <= 0 || (key = cache_key (session)) == NULL)
+    return;
+
+  sess = NULL;
+  TLSCACHE_LOCK ();
+  if (cache != NULL && (entry = h_search (cache, key, -1)) != NULL)
+    {
+      if (expired (entry->sess, time (NULL)))
+	cache_remove (entry);
+      else
+	{
+	  sess = entry->sess;
+	  SSL_SESSION_up_ref (sess);
+	}
+    }
+  TLSCACHE_UNLOCK ();
+  free (key);
+
+  if (sess != NULL)
+    {
+      SSL_set_session (ssl, sess);
+      SSL_SESSION_free (sess);
+    }
+}
+
+/* Remember the connection's TLS session, if it may be resumed.  TLS 1.3
+   session tickets arrive after the handshake, so this is called once the
+   first response has been read over the secure connection.  */
+void
+tls_session_cache_put (smtp_session_t session, SSL *ssl)
+{
+  SSL_SESSION *sess;
+  char *key;
+
+  if (cache_size <= 0 || ssl == NULL)
+    return;
+  sess = SSL_get0_session (ssl);
+  if (sess == NULL || !SSL_SESSION_is_resumable (sess))
+    return;
+  if ((key = cache_key (session)) == NULL)
+    return;
+
+  TLSCACHE_LOCK ();
+  cache_store (key, sess);
+  TLSCACHE_UNLOCK ();
+  free (key);
+}
+
+/**
+ * smtp_tls_session_cache_set_size() - Enable the TLS session cache.
+ * @size: Maximum number of sessions cached, zero to disable.
+ *
+ * Set the maximum number of TLS sessions remembered for resumption.  One
+ * session is kept for each server host and port.  When the cache is full
+ * the oldest session is discarded.  Setting the size to zero disables the
+ * cache and discards its contents.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_tls_session_cache_set_size (int size)
+{
+  SMTPAPI_CHECK_ARGS (size >= 0, 0);
+
+  TLSCACHE_LOCK ();
+  cache_size = size;
+  if (cache != NULL && size > 0)
+    while (cache_count > cache_size)
+      {
+	struct oldest oldest;
+
+	oldest.entry = NULL;
+	h_enumerate (cache, find_oldest, &oldest);
+	if (oldest.entry == NULL)
+	  break;
+	cache_remove (oldest.entry);
+      }
+  TLSCACHE_UNLOCK ();
+  if (size == 0)
+    smtp_tls_session_cache_flush ();
+  return 1;
+}
+
+/**
+ * smtp_tls_session_cache_flush() - Discard cached TLS sessions.
+ *
+ * Empty the TLS session cache.  Subsequent connections perform a full
+ * handshake.
+ */
+void
+smtp_tls_session_cache_flush (void)
+{
+  struct h_node **table;
+
+  TLSCACHE_LOCK ();
+  table = cache;
+  cache = NULL;
+  cache_count = 0;
+  TLSCACHE_UNLOCK ();
+  if (table != NULL)
+    h_destroy (table, cache_entry_free, NULL);
+}
+
+struct save_state
+  {
+    FILE *fp;
+    time_t now;
+    int ok;
+  };
+
+static void
+save_entry (const char *name, void *data, void *arg)
+{
+  struct cache_entry *entry = data;
+  struct save_state *state = arg;
+
+  if (!state->ok || expired (entry->sess, state->now))
+    return;
+  if (fprintf (state->fp, "%s\n", name) < 0
+      || !PEM_write_SSL_SESSION (state->fp, entry->sess))
+    state->ok = 0;
+}
+
+/**
+ * smtp_tls_session_cache_save() - Save the TLS session cache to a file.
+ * @path: File name.
+ *
+ * Write the sessions in the cache which have not expired to @path, which
+ * is replaced atomically.  Since the file contains the secrets needed to
+ * resume the sessions, it is created readable only by its owner and should
+ * be stored in a private directory.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_tls_session_cache_save (const char *path)
+{
+  struct save_state state;
+  char *tmp;
+  size_t len;
+  int fd;
+
+  SMTPAPI_CHECK_ARGS (path != NULL, 0);
+
+  len = strlen (path) + 5;
+  if ((tmp = malloc (len)) == NULL)
+    {
+      set_errno (ENOMEM);
+      return 0;
+    }
+  snprintf (tmp, len, "%s.tmp", path);
+  if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    {
+      set_errno (errno);
+      free (tmp);
+      return 0;
+    }
+  if ((state.fp = fdopen (fd, "w")) == NULL)
+    {
+      set_errno (errno);
+      close (fd);
+      unlink (tmp);
+      free (tmp);
+      return 0;
+    }
+
+  state.now = time (NULL);
+  state.ok = 1;
+  TLSCACHE_LOCK ();
+  if (cache != NULL)
+    h_enumerate (cache, save_entry, &state);
+  TLSCACHE_UNLOCK ();
+
+  if (fclose (state.fp) != 0)
+    state.ok = 0;
+  if (state.ok && rename (tmp, path) < 0)
+    state.ok = 0;
+  if (!state.ok)
+    {
+      set_errno (errno != 0 ? errno : EIO);
+      unlink (tmp);
+    }
+  free (tmp);
+  return state.ok;
+}
+
+/**
+ * smtp_tls_session_cache_load() - Load the TLS session cache from a file.
+ * @path: File name.
+ *
+ * Add the sessions saved by smtp_tls_session_cache_save() to the cache.
+ * Sessions which have expired are skipped.  The cache must already be
+ * enabled with smtp_tls_session_cache_set_size(); sessions in excess of
+ * its size are discarded.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_tls_session_cache_load (const char *path)
+{
+  char key[1024];
+  SSL_SESSION *sess;
+  FILE *fp;
+  time_t now;
+  char *p;
+  int ok;
+
+  SMTPAPI_CHECK_ARGS (path != NULL, 0);
+
+  if ((fp = fopen (path, "r")) == NULL)
+    {
+      set_errno (errno);
+      return 0;
+    }
+
+  ok = 1;
+  now = time (NULL);
+  while (fgets (key, sizeof key, fp) != NULL)
+    {
+      if ((p = strchr (key, '\n')) == NULL)
+	{
+	  ok = 0;
+	  break;
+	}
+      *p = '\0';
+      if ((sess = PEM_read_SSL_SESSION (fp, NULL, NULL, NULL)) == NULL)
+	{
+	  ok = 0;
+	  break;
+	}
+      if (!expired (sess, now))
+	{
+	  TLSCACHE_LOCK ();
+	  cache_store (key, sess);
+	  TLSCACHE_UNLOCK ();
+	}
+      SSL_SESSION_free (sess);
+    }
+  fclose (fp);
+  if (!ok)
+    set_error (SMTP_ERR_INVAL);
+  return ok;
+}
+
+/* Certificate verification cache.  Successful verification of a server's
+   certificate chain and host name is remembered, keyed by the SHA-256
+   fingerprint of the server certificate, the host name and the trust
+   signature of the SSL_CTX, which identifies the trusted CA files it was
+   loaded from.  Since the handshake proves the server holds the
+   certificate's private key, a later connection presenting the same
+   certificate for the same host and trusting the same CAs need not repeat
+   the checks.  Entries expire after verify_lifetime seconds or when the
+   certificate does.  */
+
+#define VERIFY_CACHE_MAX	256
+
+struct verify_entry
+  {
+    time_t expires;
+  };
+
+static struct h_node **verify_cache;
+static int verify_count;
+static long verify_lifetime;
+static int verify_index = -1;	/* SSL ex_data index for the session */
+static int trust_index = -1;	/* SSL_CTX ex_data index for the trust */
+
+static void
+trust_free (void *parent __attribute__ ((unused)), void *ptr,
+	    CRYPTO_EX_DATA *ad __attribute__ ((unused)),
+	    int idx __attribute__ ((unused)),
+	    long argl __attribute__ ((unused)),
+	    void *argp __attribute__ ((unused)))
+{
+  free (ptr);
+}
+
+/* Results are not cached for an SSL_CTX without a trust signature.  */
+static char *
+verify_key (smtp_session_t session, SSL *ssl, X509 *cert)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen, i;
+  const char *host, *trust;
+  char *key, *p;
+  size_t len;
+
+  if (trust_index < 0
+      || (trust = SSL_CTX_get_ex_data (SSL_get_SSL_CTX (ssl),
+				       trust_index)) == NULL)
+    return NULL;
+  if (!X509_digest (cert, EVP_sha256 (), md, &mdlen))
+    return NULL;
+  host = session->canon != NULL ? session->canon : session->host;
+  if (host == NULL)
+    host = "";
+  len = 2 * mdlen + strlen (host) + strlen (trust) + 3;
+  if ((key = malloc (len)) == NULL)
+    return NULL;
+  for (p = key, i = 0; i < mdlen; i++, p += 2)
+    snprintf (p, 3, "%02x", md[i]);
+  snprintf (p, len - 2 * mdlen, "/%s/%s", host, trust);
+  return key;
+}
+
+struct oldest_verify
+  {
+    struct verify_entry *entry;
+  };
+
+static void
+find_oldest_verify (const char *name __attribute__ ((unused)), void *data,
+		    void *arg)
+{
+  struct verify_entry *entry = data;
+  struct oldest_verify *oldest = arg;
+
+  if (oldest->entry == NULL || entry->expires < oldest->entry->expires)
+    oldest->entry = entry;
+}
+
+/* Check whether the certificate has already been verified for the
+   session's host.  */
+static int
+verify_cache_lookup (smtp_session_t session, SSL *ssl, X509 *cert)
+{
+  struct verify_entry *entry;
+  char *key;
+  int hit;
+
+  if (verify_lifetime <= 0
+      || X509_cmp_current_time (X509_get0_notBefore (cert)) >= 0
+      || X509_cmp_current_time (X509_get0_notAfter (cert)) <= 0
+      || (key = verify_key (session, ssl, cert)) == NULL)
+    return 0;
+
+  hit = 0;
+  TLSCACHE_LOCK ();
+  if (verify_cache != NULL
+      && (entry = h_search (verify_cache, key, -1)) != NULL)
+    {
+      if (entry->expires > time (NULL))
+	hit = 1;
+      else
+	{
+	  h_remove (verify_cache, entry);
+	  verify_count--;
+	}
+    }
+  TLSCACHE_UNLOCK ();
+  free (key);
+  return hit;
+}
+
+/* Replaces X509_verify_cert() for contexts created by libESMTP.  If the
+   server certificate is in the verification cache, chain verification is
+   skipped and the result is X509_V_OK.  */
+static int
+verify_cb (X509_STORE_CTX *store, void *arg __attribute__ ((unused)))
+{
+  smtp_session_t session;
+  X509 *cert;
+  SSL *ssl;
+
+  ssl = X509_STORE_CTX_get_ex_data (store,
+				    SSL_get_ex_data_X509_STORE_CTX_idx ());
+  cert = X509_STORE_CTX_get0_cert (store);
+  if (ssl != NULL && cert != NULL && verify_index >= 0
+      && (session = SSL_get_ex_data (ssl, verify_index)) != NULL
+      && verify_cache_lookup (session, ssl, cert))
+    {
+      session->tls_verify_cached = 1;
+      X509_STORE_CTX_set_error (store, X509_V_OK);
+      return 1;
+    }
+  return X509_verify_cert (store);
+}
+
+/* Route certificate verification through the cache.  Trust is the
+   signature of the trusted CA files which the context is loaded from or
+   NULL if it cannot be determined.  */
+void
+tls_verify_cache_install (SSL_CTX *ctx, const char *trust)
+{
+  char *copy;
+
+  SSL_CTX_set_cert_verify_callback (ctx, verify_cb, NULL);
+  if (trust == NULL)
+    return;
+  TLSCACHE_LOCK ();
+  if (trust_index < 0)
+    trust_index = SSL_CTX_get_ex_new_index (0, NULL, NULL, NULL, trust_free);
+  TLSCACHE_UNLOCK ();
+  if (trust_index >= 0 && (copy = strdup (trust)) != NULL
+      && !SSL_CTX_set_ex_data (ctx, trust_index, copy))
+    free (copy);
+}
+
+/* Associate the SSL connection with the session so that the verification
+   callback can find the host name.  */
+void
+tls_verify_cache_attach (smtp_session_t session, SSL *ssl)
+{
+  session->tls_verify_cached = 0;
+  if (verify_lifetime <= 0)
+    return;
+  TLSCACHE_LOCK ();
+  if (verify_index < 0)
+    verify_index = SSL_get_ex_new_index (0, NULL, NULL, NULL, NULL);
+  TLSCACHE_UNLOCK ();
+  if (verify_index >= 0)
+    SSL_set_ex_data (ssl, verify_index, session);
+}
+
+/* Remember that the certificate was verified and matched the session's
+   host name.  */
+void
+tls_verify_cache_put (smtp_session_t session, SSL *ssl, X509 *cert)
+{
+  struct verify_entry *entry;
+  struct oldest_verify oldest;
+  char *key;
+
+  if (verify_lifetime <= 0 || session->tls_verify_cached
+      || (key = verify_key (session, ssl, cert)) == NULL)
+    return;
+
+  TLSCACHE_LOCK ();
+  if (verify_cache == NULL)
+    verify_cache = h_create ();
+  if (verify_cache != NULL)
+    {
+      if ((entry = h_search (verify_cache, key, -1)) == NULL)
+	{
+	  while (verify_count >= VERIFY_CACHE_MAX)
+	    {
+	      oldest.entry = NULL;
+	      h_enumerate (verify_cache, find_oldest_verify, &oldest);
+	      if (oldest.entry == NULL)
+		break;
+	      h_remove (verify_cache, oldest.entry);
+	      verify_count--;
+	    }
+	  entry = h_insert (verify_cache, key, -1,
+			    sizeof (struct verify_entry));
+	  if (entry != NULL)
+	    verify_count++;
+	}
+      if (entry != NULL)
+	entry->expires = time (NULL) + verify_lifetime;
+    }
+  TLSCACHE_UNLOCK ();
+  free (key);
+}
+
+/**
+ * smtp_tls_verify_cache_set_lifetime() - Cache certificate verification.
+ * @seconds: How long a result is remembered, zero to disable.
+ *
+ * Enable the process wide certificate verification cache.  When a server's
+ * certificate chain verifies and its name matches the host, the result is
+ * remembered for @seconds.  Later handshakes with a server presenting the
+ * same certificate for the same host skip chain verification and the name
+ * check.  A certificate is never accepted from the cache after it expires.
+ * Results are recorded against the trusted CA files and are not used once
+ * any of them is replaced or modified.  Changes within a hashed CA
+ * directory which do not add or remove a file are not detected, so the
+ * lifetime should be kept short; a few minutes is typical.  Setting the
+ * lifetime to zero disables the cache and discards its contents.
+ *
+ * Only SSL contexts created by libESMTP use the cache, not one supplied by
+ * smtp_starttls_set_ctx().  The verified chain (SSL_get0_verified_chain())
+ * is not available when the cache was used.
+ *
+ * Cache hits are reported by the %SMTP_EV_STARTTLS_OK event.  After the
+ * ``SSL *``, cipher name and cipher bits, an ``int`` argument is non-zero if
+ * the certificate was accepted from the cache.
+ *
+ * Return: Zero on failure, non-zero on success.
+ */
+int
+smtp_tls_verify_cache_set_lifetime (long seconds)
+{
+  SMTPAPI_CHECK_ARGS (seconds >= 0, 0);
+
+  TLSCACHE_LOCK ();
+  verify_lifetime = seconds;
+  TLSCACHE_UNLOCK ();
+  if (seconds == 0)
+    smtp_tls_verify_cache_flush ();
+  return 1;
+}
+
+/**
+ * smtp_tls_verify_cache_flush() - Discard cached verification results.
+ *
+ * Empty the certificate verification cache.  This should be called if the
+ * trusted CA list changes, so that subsequent connections verify the
+ * server certificate in full.
+ */
+void
+smtp_tls_verify_cache_flush (void)
+{
+  struct h_node **table;
+
+  TLSCACHE_LOCK ();
+  table = verify_cache;
+  verify_cache = NULL;
+  verify_count = 0;
+  TLSCACHE_UNLOCK ();
+  if (table != NULL)
+    h_destroy (table, NULL, NULL);
+}
+
+#else
+
+#include "libesmtp-private.h"
+#include "api.h"
+
+/* Fudge the declarations, as in smtp-tls.c, so all builds of the library
+   export the same API.  */
+
+int
+smtp_tls_session_cache_set_size (int size __attribute__ ((unused)))
+{
+  return 0;
+}
+
+void
+smtp_tls_session_cache_flush (void)
+{
+}
+
+int
+smtp_tls_session_cache_save (const char *path __attribute__ ((unused)))
+{
+  return 0;
+}
+
+int
+smtp_tls_session_cache_load (const char *path __attribute__ ((unused)))
+{
+  return 0;
+}
+
+int
+smtp_tls_verify_cache_set_lifetime (long seconds __attribute__ ((unused)))
+{
+  return 0;
+}
+
+void
+smtp_tls_verify_cache_flush (void)
+{
+}
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Regression test for CHUNKING with PIPELINING when the server defers a
+   recipient with 452.  BDAT LAST follows the RCPT commands before their
+   responses are read, so the client must not pipeline the next message's
+   MAIL command behind it: the deferred recipient belongs to a further
+   transaction of the current message.
+
+   A scripted server is forked which answers 452 to the second RCPT of
+   every transaction.  It holds its responses until the client stops
+   sending, so that the client always pipelines as far as it is able.
+   The server checks that each recipient is given with the reverse path
+   of its own message, i.e. both begin with the same letter.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libesmtp.h>
+
+/* Time the server waits for further pipelined commands before it sends
+   the responses held so far.  */
+#define HOLD_MS		100
+
+struct server
+  {
+    int fd;
+    char in[8192];
+    size_t inlen;
+    char out[8192];
+    size_t outlen;
+  };
+
+static void
+reply (struct server *srv, const char *text)
+{
+  size_t len = strlen (text);
+
+  if (srv->outlen + len <= sizeof srv->out)
+    {
+      memcpy (srv->out + srv->outlen, text, len);
+      srv->outlen += len;
+    }
+}
+
+static void
+flush_replies (struct server *srv)
+{
+  if (srv->outlen > 0 && write (srv->fd, srv->out, srv->outlen) < 0)
+    exit (2);
+  srv->outlen = 0;
+}
+
+/* Fill the input buffer.  Replies are held while the client continues to
+   send and are written once it waits for them.  */
+static void
+fill (struct server *srv)
+{
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = srv->fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, HOLD_MS) == 0)
+    flush_replies (srv);
+  if (srv->inlen >= sizeof srv->in)
+    exit (2);
+  n = read (srv->fd, srv->in + srv->inlen, sizeof srv->in - srv->inlen);
+  if (n <= 0)
+    exit (2);
+  srv->inlen += n;
+}
+
+static void
+consume (struct server *srv, size_t len)
+{
+  memmove (srv->in, srv->in + len, srv->inlen - len);
+  srv->inlen -= len;
+}
+
+static void
+read_line (struct server *srv, char *line, size_t size)
+{
+  char *eol;
+  size_t len;
+
+  while ((eol = memchr (srv->in, '\n', srv->inlen)) == NULL)
+    fill (srv);
+  len = eol - srv->in + 1;
+  if (len >= size)
+    exit (2);
+  memcpy (line, srv->in, len);
+  line[len] = '\0';
+  consume (srv, len);
+}
+
+static void
+read_chunk (struct server *srv, size_t len)
+{
+  size_t n;
+
+  while (len > 0)
+    {
+      if (srv->inlen == 0)
+	fill (srv);
+      n = len < srv->inlen ? len : srv->inlen;
+      consume (srv, n);
+      len -= n;
+    }
+}
+
+/* Returns the exit status for the test, the number of recipients given
+   with the wrong reverse path or accepted other than once.  */
+static int
+serve (int fd)
+{
+  struct server srv;
+  char line[512], sender;
+  int rcpts, accepted, errors;
+  unsigned long len;
+
+  memset (&srv, 0, sizeof srv);
+  srv.fd = fd;
+  sender = '\0';
+  rcpts = accepted = errors = 0;
+  reply (&srv, "220 test ESMTP\r\n");
+  for (;;)
+    {
+      read_line (&srv, line, sizeof line);
+      if (strncasecmp (line, "EHLO ", 5) == 0)
+	reply (&srv, "250-test\r\n250-PIPELINING\r\n250 CHUNKING\r\n");
+      else if (strncasecmp (line, "MAIL FROM:<", 11) == 0)
+	{
+	  sender = line[11];
+	  rcpts = 0;
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "RCPT TO:<", 9) == 0)
+	{
+	  if (++rcpts == 2)
+	    reply (&srv, "452 too many recipients\r\n");
+	  else
+	    {
+	      if (line[9] != sender)
+		{
+		  fprintf (stderr, "%c... sent with reverse path %c...\n",
+			   line[9], sender);
+		  errors++;
+		}
+	      accepted++;
+	      reply (&srv, "250 ok\r\n");
+	    }
+	}
+      else if (sscanf (line, "BDAT %lu", &len) == 1)
+	{
+	  read_chunk (&srv, len);
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "RSET", 4) == 0)
+	{
+	  sender = '\0';
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "QUIT", 4) == 0)
+	{
+	  reply (&srv, "221 bye\r\n");
+	  flush_replies (&srv);
+	  break;
+	}
+      else
+	reply (&srv, "500 unrecognised\r\n");
+    }
+  if (accepted != 4)
+    {
+      fprintf (stderr, "%d recipients accepted, expected 4\n", accepted);
+      errors++;
+    }
+  return errors;
+}
+
+static char body[] = "Subject: test\r\n\r\ntest\r\n";
+
+static void
+add_message (smtp_session_t session, const char *from,
+	     const char *rcpt1, const char *rcpt2)
+{
+  smtp_message_t message;
+
+  message = smtp_add_message (session);
+  smtp_set_reverse_path (message, from);
+  smtp_set_message_str (message, body);
+  smtp_add_recipient (message, rcpt1);
+  smtp_add_recipient (message, rcpt2);
+}
+
+static void
+check_recipient (smtp_recipient_t recipient, const char *mailbox, void *arg)
+{
+  const smtp_status_t *status = smtp_recipient_status (recipient);
+  int *errors = arg;
+
+  if (status->code != 250 || !smtp_recipient_check_complete (recipient))
+    {
+      fprintf (stderr, "%s: status %d\n", mailbox, status->code);
+      *errors += 1;
+    }
+}
+
+static void
+check_message (smtp_message_t message, void *arg)
+{
+  smtp_enumerate_recipients (message, check_recipient, arg);
+}
+
+int
+main (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  smtp_session_t session;
+  char server[64];
+  int sd, fd, status, errors;
+  pid_t pid;
+
+  signal (SIGPIPE, SIG_IGN);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addrlen = sizeof addr;
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+      || bind (sd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (sd, 1) < 0
+      || getsockname (sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      perror ("listen");
+      return 99;
+    }
+
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      return 99;
+    }
+  if (pid == 0)
+    {
+      alarm (10);
+      if ((fd = accept (sd, NULL, NULL)) < 0)
+	_exit (2);
+      _exit (serve (fd));
+    }
+  close (sd);
+
+  snprintf (server, sizeof server, "127.0.0.1:%d", ntohs (addr.sin_port));
+  session = smtp_create_session ();
+  smtp_set_server (session, server);
+  add_message (session, "a@example.org", "a1@example.org", "a2@example.org");
+  add_message (session, "b@example.org", "b1@example.org", "b2@example.org");
+
+  errors = 0;
+  if (!smtp_start_session (session))
+    {
+      fprintf (stderr, "smtp_start_session failed\n");
+      errors++;
+    }
+  smtp_enumerate_messages (session, check_message, &errors);
+  smtp_destroy_session (session);
+
+  if (waitpid (pid, &status, 0) != pid
+      || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    errors++;
+  return errors != 0;
+}
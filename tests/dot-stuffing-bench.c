@@ -0,0 +1,210 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Microbenchmark for dot stuffing the message body.  A body of about
+   80 octet lines is stuffed line by line with msg_gets(), as cmd_data2()
+   used to, and in spans with msg_getb_stuffed().  The output is buffered
+   and written to /dev/null much as siobuf.c would write it to the
+   server.
+
+   usage: dot-stuffing-bench [megabytes [chunk-size [dot-percent]]]
+
+   The defaults are a 64 MiB body supplied in 64 KiB chunks with 2% of
+   lines starting with a dot.  The best of five runs is reported.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "message-source.h"
+
+#define RUNS		5
+#define HIGHWATER	(64 * 1024)	/* As SIO_HIGHWATER */
+
+struct feed
+  {
+    const char *data;
+    size_t size;
+    size_t pos;
+    int chunk;
+  };
+
+static char outbuf[HIGHWATER];
+static int outlen;
+static int outfd;
+
+static const char *
+feed_cb (void **ctx __attribute__ ((unused)), int *len, void *arg)
+{
+  struct feed *feed = arg;
+  const char *p;
+  size_t n;
+
+  if (len == NULL)
+    {
+      feed->pos = 0;
+      return NULL;
+    }
+  n = feed->size - feed->pos;
+  if (n > (size_t) feed->chunk)
+    n = feed->chunk;
+  p = feed->data + feed->pos;
+  feed->pos += n;
+  *len = n;
+  return p;
+}
+
+static void
+output (const char *p, int len)
+{
+  if (outlen + len > (int) sizeof outbuf)
+    {
+      if (write (outfd, outbuf, outlen) < 0)
+	exit (99);
+      outlen = 0;
+    }
+  if (len >= (int) sizeof outbuf)
+    {
+      if (write (outfd, p, len) < 0)
+	exit (99);
+      return;
+    }
+  memcpy (outbuf + outlen, p, len);
+  outlen += len;
+}
+
+static void
+stuff_lines (msg_source_t source)
+{
+  const char *line;
+  int len;
+
+  while ((line = msg_gets (source, &len, 0)) != NULL)
+    {
+      if (line[0] == '.')
+	output (".", 1);
+      output (line, len);
+    }
+}
+
+static void
+stuff_spans (msg_source_t source)
+{
+  const char *span;
+  int len, stuff;
+
+  while ((span = msg_getb_stuffed (source, &len, HIGHWATER, &stuff)) != NULL)
+    {
+      if (stuff)
+	output (".", 1);
+      output (span, len);
+    }
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the best throughput in MB/s.  */
+static double
+measure (msg_source_t source, size_t size, void (*stuff) (msg_source_t))
+{
+  double start, elapsed, best;
+  int i;
+
+  best = 0;
+  for (i = 0; i < RUNS; i++)
+    {
+      msg_rewind (source);
+      outlen = 0;
+      start = now ();
+      (*stuff) (source);
+      elapsed = now () - start;
+      if (best == 0 || elapsed < best)
+	best = elapsed;
+    }
+  return size / best / 1e6;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct feed feed;
+  msg_source_t source;
+  char *body;
+  size_t size, n;
+  unsigned int seed;
+  int dots, len;
+
+  size = (argc > 1 ? atol (argv[1]) : 64) * 1024 * 1024;
+  feed.chunk = argc > 2 ? atoi (argv[2]) : 64 * 1024;
+  dots = argc > 3 ? atoi (argv[3]) : 2;
+  if (size == 0 || feed.chunk <= 0)
+    {
+      fprintf (stderr, "usage: %s [megabytes [chunk-size [dot-percent]]]\n",
+	       argv[0]);
+      return 2;
+    }
+
+  if ((body = malloc (size)) == NULL)
+    return 99;
+  seed = 1;
+  for (n = 0; n < size; n += len)
+    {
+      seed = seed * 1103515245 + 12345;
+      len = 60 + (seed >> 16) % 40;
+      if (n + len > size)
+	len = size - n;
+      memset (body + n, 'x', len);
+      if ((int) ((seed >> 8) % 100) < dots)
+	body[n] = '.';
+      if (len >= 2)
+	memcpy (body + n + len - 2, "\r\n", 2);
+    }
+  feed.data = body;
+  feed.size = size;
+
+  if ((outfd = open ("/dev/null", O_WRONLY)) < 0
+      || (source = msg_source_create ()) == NULL)
+    return 99;
+  msg_source_set_cb (source, feed_cb, &feed);
+
+  printf ("%zu MiB, %d octet chunks, %d%% dot lines\n",
+	  size / (1024 * 1024), feed.chunk, dots);
+  printf ("msg_gets          %8.0f MB/s\n",
+	  measure (source, size, stuff_lines));
+  printf ("msg_getb_stuffed  %8.0f MB/s\n",
+	  measure (source, size, stuff_spans));
+
+  msg_source_destroy (source);
+  close (outfd);
+  free (body);
+  return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Compare msg_getb_stuffed() with dot stuffing line by line using
+   msg_gets(), as cmd_data2() used to do, over random message bodies.
+   The bodies are made mostly of \r, \n and dots and are supplied by the
+   callback in random sized pieces, so that lines starting with a dot
+   fall on every position relative to the callback's buffers, the span
+   limit and the vector width of find_dot_line().
+
+   The test is built once for each implementation of find_dot_line().
+   The argument names the variant, "avx2" is skipped if the processor
+   does not support it.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "message-source.h"
+
+#define ITERATIONS	200000
+#define MAXBODY		1024
+
+struct feed
+  {
+    const char *data;
+    int size;
+    int pos;
+    int maxchunk;
+    unsigned int seed;
+  };
+
+struct output
+  {
+    char buf[3 * MAXBODY + 2];
+    int len;
+  };
+
+static unsigned int
+next_random (unsigned int *seed)
+{
+  /* xorshift32 */
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+static const char *
+feed_cb (void **ctx __attribute__ ((unused)), int *len, void *arg)
+{
+  struct feed *feed = arg;
+  const char *p;
+  int n;
+
+  if (len == NULL)
+    {
+      feed->pos = 0;
+      return NULL;
+    }
+  n = feed->size - feed->pos;
+  if (n > 0)
+    n = 1 + next_random (&feed->seed) % (n < feed->maxchunk ? n : feed->maxchunk);
+  p = feed->data + feed->pos;
+  feed->pos += n;
+  *len = n;
+  return p;
+}
+
+static void
+append (struct output *out, const char *p, int len)
+{
+  if (out->len + len > (int) sizeof out->buf)
+    {
+      fprintf (stderr, "output overflow\n");
+      exit (1);
+    }
+  memcpy (out->buf + out->len, p, len);
+  out->len += len;
+}
+
+/* Reference implementation.  */
+static void
+stuff_lines (msg_source_t source, struct output *out)
+{
+  const char *line;
+  int len;
+
+  out->len = 0;
+  msg_rewind (source);
+  while ((line = msg_gets (source, &len, 0)) != NULL)
+    {
+      if (line[0] == '.')
+	append (out, ".", 1);
+      append (out, line, len);
+    }
+}
+
+static int
+stuff_spans (msg_source_t source, struct output *out, int maxlen)
+{
+  const char *span;
+  int len, stuff;
+
+  out->len = 0;
+  msg_rewind (source);
+  while ((span = msg_getb_stuffed (source, &len, maxlen, &stuff)) != NULL)
+    {
+      if (len <= 0 || len > maxlen)
+	{
+	  fprintf (stderr, "span of %d octets, limit %d\n", len, maxlen);
+	  return 0;
+	}
+      if (stuff)
+	append (out, ".", 1);
+      append (out, span, len);
+    }
+  return 1;
+}
+
+static void
+print_escaped (const char *label, const char *p, int len)
+{
+  fprintf (stderr, "%s (%d): \"", label, len);
+  for (; len > 0; p++, len--)
+    if (*p == '\r')
+      fputs ("\\r", stderr);
+    else if (*p == '\n')
+      fputs ("\\n", stderr);
+    else
+      fputc (*p, stderr);
+  fputs ("\"\n", stderr);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const char alphabet[] = "\r\n.\r\n.xy";
+  static struct output expected, actual;
+  char body[MAXBODY];
+  struct feed feed;
+  msg_source_t source;
+  unsigned int seed;
+  int i, j, size, maxlen;
+
+#if defined (__x86_64__) || defined (__i386__)
+  if (argc > 1 && strcmp (argv[1], "avx2") == 0
+      && !__builtin_cpu_supports ("avx2"))
+    return 77;
+#else
+  (void) argc;
+  (void) argv;
+#endif
+
+  if ((source = msg_source_create ()) == NULL)
+    return 99;
+  msg_source_set_cb (source, feed_cb, &feed);
+  feed.data = body;
+
+  seed = 0x2f6b1d37;
+  for (i = 0; i < ITERATIONS; i++)
+    {
+      /* Mostly short bodies, some long enough for several vector
+	 strides between line breaks.  */
+      size = next_random (&seed) % (i % 16 == 0 ? MAXBODY : 96);
+      for (j = 0; j < size; j++)
+	if (i % 4 == 0)
+	  body[j] = alphabet[next_random (&seed) % (sizeof alphabet - 1)];
+	else
+	  body[j] = next_random (&seed) % 8 == 0
+		    ? alphabet[next_random (&seed) % 6] : 'x';
+      feed.size = size;
+      feed.maxchunk = 1 + next_random (&seed) % (i % 2 ? 8 : MAXBODY);
+      maxlen = 2 + next_random (&seed) % (i % 3 ? 40 : MAXBODY);
+
+      feed.seed = next_random (&seed) | 1;
+      stuff_lines (source, &expected);
+      feed.seed = next_random (&seed) | 1;
+      if (!stuff_spans (source, &actual, maxlen)
+	  || actual.len != expected.len
+	  || memcmp (actual.buf, expected.buf, expected.len) != 0)
+	{
+	  fprintf (stderr, "iteration %d, chunks <= %d, spans <= %d\n",
+		   i, feed.maxchunk, maxlen);
+	  print_escaped ("body", body, size);
+	  print_escaped ("expected", expected.buf, expected.len);
+	  print_escaped ("actual", actual.buf, actual.len);
+	  return 1;
+	}
+    }
+  msg_source_destroy (source);
+  return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Regression test for the capability cache with implicit TLS.  The
+   capabilities seen on the first connection must let the second send
+   EHLO as soon as the handshake completes, without waiting for the
+   greeting.
+
+   A scripted server is forked which accepts two connections with a
+   freshly generated self-signed certificate.  After each handshake it
+   waits briefly before sending its greeting and records whether the
+   client spoke first.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#include <libesmtp.h>
+
+/* Time the server waits for the client before sending its greeting.  */
+#define HOLD_MS		200
+
+struct server
+  {
+    SSL *ssl;
+    char in[4096];
+    size_t inlen;
+  };
+
+/* Create a key and a self-signed certificate for the server.  */
+static int
+make_certificate (EVP_PKEY **pkeyp, X509 **certp)
+{
+  EVP_PKEY_CTX *pctx;
+  EVP_PKEY *pkey = NULL;
+  X509_NAME *name;
+  X509 *cert;
+
+  if ((pctx = EVP_PKEY_CTX_new_id (EVP_PKEY_EC, NULL)) == NULL)
+    return 0;
+  if (EVP_PKEY_keygen_init (pctx) <= 0
+      || EVP_PKEY_CTX_set_ec_paramgen_curve_nid (pctx,
+						 NID_X9_62_prime256v1) <= 0
+      || EVP_PKEY_keygen (pctx, &pkey) <= 0)
+    {
+      EVP_PKEY_CTX_free (pctx);
+      return 0;
+    }
+  EVP_PKEY_CTX_free (pctx);
+
+  if ((cert = X509_new ()) == NULL)
+    {
+      EVP_PKEY_free (pkey);
+      return 0;
+    }
+  X509_set_version (cert, 2);
+  ASN1_INTEGER_set (X509_get_serialNumber (cert), 1);
+  X509_gmtime_adj (X509_getm_notBefore (cert), -60);
+  X509_gmtime_adj (X509_getm_notAfter (cert), 3600);
+  X509_set_pubkey (cert, pkey);
+  name = X509_get_subject_name (cert);
+  X509_NAME_add_entry_by_txt (name, "CN", MBSTRING_ASC,
+			      (const unsigned char *) "localhost", -1, -1, 0);
+  X509_set_issuer_name (cert, name);
+  if (!X509_sign (cert, pkey, EVP_sha256 ()))
+    {
+      X509_free (cert);
+      EVP_PKEY_free (pkey);
+      return 0;
+    }
+  *pkeyp = pkey;
+  *certp = cert;
+  return 1;
+}
+
+static void
+reply (struct server *srv, const char *text)
+{
+  if (SSL_write (srv->ssl, text, strlen (text)) <= 0)
+    exit (2);
+}
+
+static void
+read_line (struct server *srv, char *line, size_t size)
+{
+  char *eol;
+  size_t len;
+  int n;
+
+  while ((eol = memchr (srv->in, '\n', srv->inlen)) == NULL)
+    {
+      if (srv->inlen >= sizeof srv->in)
+	exit (2);
+      n = SSL_read (srv->ssl, srv->in + srv->inlen,
+		    sizeof srv->in - srv->inlen);
+      if (n <= 0)
+	exit (2);
+      srv->inlen += n;
+    }
+  len = eol - srv->in + 1;
+  if (len >= size)
+    exit (2);
+  memcpy (line, srv->in, len);
+  line[len] = '\0';
+  memmove (srv->in, srv->in + len, srv->inlen - len);
+  srv->inlen -= len;
+}
+
+/* Serve one connection.  Returns non-zero if the client sent something
+   before the greeting.  */
+static int
+serve (SSL_CTX *ctx, int fd)
+{
+  struct server srv;
+  struct pollfd pfd;
+  char line[512];
+  int early, data;
+
+  memset (&srv, 0, sizeof srv);
+  if ((srv.ssl = SSL_new (ctx)) == NULL
+      || !SSL_set_fd (srv.ssl, fd)
+      || SSL_accept (srv.ssl) <= 0)
+    exit (2);
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  early = SSL_pending (srv.ssl) > 0 || poll (&pfd, 1, HOLD_MS) > 0;
+  reply (&srv, "220 test ESMTP\r\n");
+
+  data = 0;
+  for (;;)
+    {
+      read_line (&srv, line, sizeof line);
+      if (data)
+	{
+	  if (strcmp (line, ".\r\n") == 0)
+	    {
+	      data = 0;
+	      reply (&srv, "250 queued\r\n");
+	    }
+	}
+      else if (strncasecmp (line, "EHLO ", 5) == 0)
+	reply (&srv, "250-test\r\n250-PIPELINING\r\n250 PIPECONNECT\r\n");
+      else if (strncasecmp (line, "MAIL FROM:", 10) == 0
+	       || strncasecmp (line, "RCPT TO:", 8) == 0
+	       || strncasecmp (line, "RSET", 4) == 0)
+	reply (&srv, "250 ok\r\n");
+      else if (strncasecmp (line, "DATA", 4) == 0)
+	{
+	  data = 1;
+	  reply (&srv, "354 go ahead\r\n");
+	}
+      else if (strncasecmp (line, "QUIT", 4) == 0)
+	{
+	  reply (&srv, "221 bye\r\n");
+	  break;
+	}
+      else
+	reply (&srv, "500 unrecognised\r\n");
+    }
+  SSL_shutdown (srv.ssl);
+  SSL_free (srv.ssl);
+  close (fd);
+  return early;
+}
+
+/* Returns the exit status for the test.  */
+static int
+run_server (int sd, EVP_PKEY *pkey, X509 *cert)
+{
+  SSL_CTX *ctx;
+  int fd, first, second;
+
+  if ((ctx = SSL_CTX_new (TLS_server_method ())) == NULL
+      || !SSL_CTX_use_certificate (ctx, cert)
+      || !SSL_CTX_use_PrivateKey (ctx, pkey))
+    return 2;
+
+  if ((fd = accept (sd, NULL, NULL)) < 0)
+    return 2;
+  first = serve (ctx, fd);
+  if ((fd = accept (sd, NULL, NULL)) < 0)
+    return 2;
+  second = serve (ctx, fd);
+  SSL_CTX_free (ctx);
+
+  if (first)
+    fprintf (stderr, "EHLO sent early without cached capabilities\n");
+  if (!second)
+    fprintf (stderr, "EHLO not sent early with cached capabilities\n");
+  return first || !second;
+}
+
+/* The certificate is self-signed and issued for localhost.  */
+static void
+event_cb (smtp_session_t session __attribute__ ((unused)), int event,
+	  void *arg __attribute__ ((unused)), ...)
+{
+  va_list ap;
+  int *ok;
+
+  va_start (ap, arg);
+  switch (event)
+    {
+    case SMTP_EV_INVALID_PEER_CERTIFICATE:
+      (void) va_arg (ap, long);
+      ok = va_arg (ap, int *);
+      *ok = 1;
+      break;
+    case SMTP_EV_WRONG_PEER_CERTIFICATE:
+      ok = va_arg (ap, int *);
+      *ok = 1;
+      break;
+    }
+  va_end (ap);
+}
+
+static char body[] = "Subject: test\r\n\r\ntest\r\n";
+
+static int
+send_message (const char *server)
+{
+  smtp_session_t session;
+  smtp_message_t message;
+  const smtp_status_t *status;
+  int ok;
+
+  session = smtp_create_session ();
+  smtp_set_server (session, server);
+  smtp_starttls_enable (session, Starttls_IMPLICIT);
+  smtp_set_eventcb (session, event_cb, NULL);
+  message = smtp_add_message (session);
+  smtp_set_reverse_path (message, "a@example.org");
+  smtp_set_message_str (message, body);
+  smtp_add_recipient (message, "b@example.org");
+
+  ok = smtp_start_session (session);
+  status = smtp_message_transfer_status (message);
+  if (!ok || status->code != 250)
+    {
+      fprintf (stderr, "message status %d\n", status->code);
+      ok = 0;
+    }
+  smtp_destroy_session (session);
+  return ok;
+}
+
+int
+main (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  char server[64];
+  EVP_PKEY *pkey;
+  X509 *cert;
+  int sd, status, errors;
+  pid_t pid;
+
+  signal (SIGPIPE, SIG_IGN);
+  /* Use no trusted CA files or client certificates.  */
+  setenv ("HOME", "/nonexistent", 1);
+  unsetenv ("XDG_CONFIG_HOME");
+
+  if (!make_certificate (&pkey, &cert))
+    {
+      fprintf (stderr, "cannot create certificate\n");
+      return 99;
+    }
+
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addrlen = sizeof addr;
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+      || bind (sd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (sd, 2) < 0
+      || getsockname (sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      perror ("listen");
+      return 99;
+    }
+
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      return 99;
+    }
+  if (pid == 0)
+    {
+      alarm (10);
+      _exit (run_server (sd, pkey, cert));
+    }
+  close (sd);
+
+  snprintf (server, sizeof server, "127.0.0.1:%d", ntohs (addr.sin_port));
+  smtp_capability_cache_set_size (4);
+
+  errors = 0;
+  if (!send_message (server))
+    errors++;
+  if (!send_message (server))
+    errors++;
+
+  if (waitpid (pid, &status, 0) != pid
+      || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    errors++;
+  X509_free (cert);
+  EVP_PKEY_free (pkey);
+  return errors != 0;
+}
@@ -0,0 +1,454 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Test splitting of transactions at the server's RFC 9422 LIMITS.
+
+   A scripted server is forked which advertises PIPELINING and
+   LIMITS RCPTMAX=3 MAILMAX=2 RCPTDOMAINMAX=2, and CHUNKING if the first
+   argument is "bdat".  It checks that no transaction exceeds RCPTMAX or
+   RCPTDOMAINMAX, that no connection exceeds MAILMAX, that the client
+   reconnects only when MAILMAX is reached and that every recipient is
+   given exactly once with the reverse path of its own message, i.e. both
+   begin with the same letter.
+
+   The server normally holds its responses until the client stops
+   sending, so that the client pipelines as far as it is able.  With the
+   DATA command the next MAIL must then follow the end of the data before
+   its response is read.  If the second argument is "flush", each response
+   is sent as soon as its command is read instead, so that responses to
+   the RCPT commands can arrive while BDAT is being sent.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libesmtp.h>
+
+/* Time the server waits for further pipelined commands before it sends
+   the responses held so far.  */
+#define HOLD_MS		100
+
+#define RCPTMAX		3
+#define MAILMAX		2
+#define RCPTDOMAINMAX	2
+#define MAXRCPTS	32
+
+static const char *const messages[][8] =
+  {
+    { "a@example.org",
+      "a1@x.example", "a2@y.example", "a3@z.example", "a4@x.example",
+      "a5@y.example", "a6@z.example", "a7@x.example", },
+    { "b@example.org",
+      "b1@x.example", "b2@x.example", },
+    { "c@example.org",
+      "c1@y.example", "c2@y.example", "c3@y.example", "c4@y.example",
+      "c5@z.example", },
+  };
+#define NMESSAGES	((int) (sizeof messages / sizeof messages[0]))
+
+static int chunking;		/* Server offers CHUNKING */
+static int flush_each;		/* Server does not hold responses */
+
+struct server
+  {
+    int fd;
+    char in[8192];
+    size_t inlen;
+    char out[8192];
+    size_t outlen;
+    int flushes;
+  };
+
+static void
+reply (struct server *srv, const char *text)
+{
+  size_t len = strlen (text);
+
+  if (srv->outlen + len <= sizeof srv->out)
+    {
+      memcpy (srv->out + srv->outlen, text, len);
+      srv->outlen += len;
+    }
+}
+
+static void
+flush_replies (struct server *srv)
+{
+  if (srv->outlen > 0)
+    {
+      if (write (srv->fd, srv->out, srv->outlen) < 0)
+	exit (2);
+      srv->flushes++;
+    }
+  srv->outlen = 0;
+}
+
+/* Fill the input buffer.  Replies are held while the client continues to
+   send and are written once it waits for them.  */
+static void
+fill (struct server *srv)
+{
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = srv->fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, HOLD_MS) == 0)
+    flush_replies (srv);
+  if (srv->inlen >= sizeof srv->in)
+    exit (2);
+  n = read (srv->fd, srv->in + srv->inlen, sizeof srv->in - srv->inlen);
+  if (n <= 0)
+    exit (2);
+  srv->inlen += n;
+}
+
+static void
+consume (struct server *srv, size_t len)
+{
+  memmove (srv->in, srv->in + len, srv->inlen - len);
+  srv->inlen -= len;
+}
+
+static void
+read_line (struct server *srv, char *line, size_t size)
+{
+  char *eol;
+  size_t len;
+
+  if (flush_each)
+    flush_replies (srv);
+  while ((eol = memchr (srv->in, '\n', srv->inlen)) == NULL)
+    fill (srv);
+  len = eol - srv->in + 1;
+  if (len >= size)
+    exit (2);
+  memcpy (line, srv->in, len);
+  line[len] = '\0';
+  consume (srv, len);
+}
+
+static void
+read_chunk (struct server *srv, size_t len)
+{
+  size_t n;
+
+  while (len > 0)
+    {
+      if (srv->inlen == 0)
+	fill (srv);
+      n = len < srv->inlen ? len : srv->inlen;
+      consume (srv, n);
+      len -= n;
+    }
+}
+
+/* State kept over all connections.  */
+struct transcript
+  {
+    char accepted[MAXRCPTS][32];
+    int naccepted;
+    int transactions;
+    int connections;
+    int pipelined_mail;		/* MAIL sent before the data was accepted */
+    int errors;
+  };
+
+/* State of the current transaction.  */
+struct transaction
+  {
+    char sender;
+    int rcpts;
+    char domains[RCPTDOMAINMAX + 1][32];
+    int ndomains;
+  };
+
+static void
+add_recipient (struct transcript *log, struct transaction *txn,
+	       const char *line)
+{
+  char mailbox[32];
+  const char *domain;
+  int i;
+
+  if (sscanf (line, "RCPT TO:<%31[^>]>", mailbox) != 1)
+    {
+      log->errors++;
+      return;
+    }
+  if (mailbox[0] != txn->sender)
+    {
+      fprintf (stderr, "%s sent with reverse path %c...\n",
+	       mailbox, txn->sender);
+      log->errors++;
+    }
+  if (++txn->rcpts > RCPTMAX)
+    {
+      fprintf (stderr, "%s: more than RCPTMAX recipients\n", mailbox);
+      log->errors++;
+    }
+
+  domain = strchr (mailbox, '@') + 1;
+  for (i = 0; i < txn->ndomains; i++)
+    if (strcmp (txn->domains[i], domain) == 0)
+      break;
+  if (i == txn->ndomains)
+    {
+      if (txn->ndomains == RCPTDOMAINMAX)
+	{
+	  fprintf (stderr, "%s: more than RCPTDOMAINMAX domains\n", mailbox);
+	  log->errors++;
+	}
+      else
+	strcpy (txn->domains[txn->ndomains++], domain);
+    }
+
+  for (i = 0; i < log->naccepted; i++)
+    if (strcmp (log->accepted[i], mailbox) == 0)
+      {
+	fprintf (stderr, "%s: accepted twice\n", mailbox);
+	log->errors++;
+	return;
+      }
+  if (log->naccepted < MAXRCPTS)
+    strcpy (log->accepted[log->naccepted++], mailbox);
+}
+
+/* Serve one connection.  */
+static void
+serve (int fd, struct transcript *log)
+{
+  struct server srv;
+  struct transaction txn;
+  char line[512];
+  unsigned long len;
+  int mails, data_end;
+
+  memset (&srv, 0, sizeof srv);
+  memset (&txn, 0, sizeof txn);
+  srv.fd = fd;
+  mails = 0;
+  data_end = -1;
+  log->connections++;
+  reply (&srv, "220 test ESMTP\r\n");
+  for (;;)
+    {
+      read_line (&srv, line, sizeof line);
+      if (strncasecmp (line, "EHLO ", 5) == 0)
+	{
+	  reply (&srv, "250-test\r\n250-PIPELINING\r\n");
+	  if (chunking)
+	    reply (&srv, "250-CHUNKING\r\n");
+	  reply (&srv, "250 LIMITS RCPTMAX=3 MAILMAX=2 RCPTDOMAINMAX=2\r\n");
+	}
+      else if (strncasecmp (line, "MAIL FROM:<", 11) == 0)
+	{
+	  if (++mails > MAILMAX)
+	    {
+	      fprintf (stderr, "more than MAILMAX transactions\n");
+	      log->errors++;
+	    }
+	  if (data_end == srv.flushes)
+	    log->pipelined_mail++;
+	  memset (&txn, 0, sizeof txn);
+	  txn.sender = line[11];
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "RCPT TO:<", 8) == 0)
+	{
+	  add_recipient (log, &txn, line);
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "DATA", 4) == 0)
+	{
+	  reply (&srv, "354 go ahead\r\n");
+	  do
+	    read_line (&srv, line, sizeof line);
+	  while (strcmp (line, ".\r\n") != 0);
+	  log->transactions++;
+	  data_end = srv.flushes;
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (sscanf (line, "BDAT %lu", &len) == 1)
+	{
+	  read_chunk (&srv, len);
+	  if (strstr (line, "LAST") != NULL)
+	    {
+	      log->transactions++;
+	      data_end = srv.flushes;
+	    }
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "RSET", 4) == 0)
+	reply (&srv, "250 ok\r\n");
+      else if (strncasecmp (line, "QUIT", 4) == 0)
+	{
+	  reply (&srv, "221 bye\r\n");
+	  flush_replies (&srv);
+	  break;
+	}
+      else
+	reply (&srv, "500 unrecognised\r\n");
+    }
+  close (fd);
+}
+
+/* Accept connections until every recipient has been given.  Returns the
+   exit status for the test, the number of errors.  */
+static int
+run_server (int sd, int nrcpts)
+{
+  struct transcript log;
+  int fd;
+
+  memset (&log, 0, sizeof log);
+  while (log.naccepted < nrcpts)
+    {
+      if ((fd = accept (sd, NULL, NULL)) < 0)
+	return 2;
+      serve (fd, &log);
+    }
+
+  /* The client reconnects only when MAILMAX is reached.  */
+  if (log.connections != (log.transactions + MAILMAX - 1) / MAILMAX)
+    {
+      fprintf (stderr, "%d transactions on %d connections\n",
+	       log.transactions, log.connections);
+      log.errors++;
+    }
+  if (!chunking && !flush_each && log.pipelined_mail == 0)
+    {
+      fprintf (stderr, "MAIL never pipelined behind the data\n");
+      log.errors++;
+    }
+  return log.errors;
+}
+
+static char body[] = "Subject: test\r\n\r\ntest\r\n";
+
+static void
+check_recipient (smtp_recipient_t recipient, const char *mailbox, void *arg)
+{
+  const smtp_status_t *status = smtp_recipient_status (recipient);
+  int *errors = arg;
+
+  if (status->code != 250 || !smtp_recipient_check_complete (recipient))
+    {
+      fprintf (stderr, "%s: status %d\n", mailbox, status->code);
+      *errors += 1;
+    }
+}
+
+static void
+check_message (smtp_message_t message, void *arg)
+{
+  const smtp_status_t *status = smtp_message_transfer_status (message);
+  int *errors = arg;
+
+  if (status->code != 250)
+    {
+      fprintf (stderr, "message: status %d\n", status->code);
+      *errors += 1;
+    }
+  smtp_enumerate_recipients (message, check_recipient, arg);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  smtp_session_t session;
+  smtp_message_t message;
+  char server[64];
+  int sd, status, errors, nrcpts, i, j;
+  pid_t pid;
+
+  chunking = argc > 1 && strcmp (argv[1], "bdat") == 0;
+  flush_each = argc > 2 && strcmp (argv[2], "flush") == 0;
+
+  signal (SIGPIPE, SIG_IGN);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addrlen = sizeof addr;
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+      || bind (sd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (sd, 1) < 0
+      || getsockname (sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      perror ("listen");
+      return 99;
+    }
+
+  nrcpts = 0;
+  for (i = 0; i < NMESSAGES; i++)
+    for (j = 1; j < 8 && messages[i][j] != NULL; j++)
+      nrcpts++;
+
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      return 99;
+    }
+  if (pid == 0)
+    {
+      alarm (10);
+      _exit (run_server (sd, nrcpts));
+    }
+  close (sd);
+
+  snprintf (server, sizeof server, "127.0.0.1:%d", ntohs (addr.sin_port));
+  session = smtp_create_session ();
+  smtp_set_server (session, server);
+  for (i = 0; i < NMESSAGES; i++)
+    {
+      message = smtp_add_message (session);
+      smtp_set_reverse_path (message, messages[i][0]);
+      smtp_set_message_str (message, body);
+      for (j = 1; j < 8 && messages[i][j] != NULL; j++)
+	smtp_add_recipient (message, messages[i][j]);
+    }
+
+  errors = 0;
+  if (!smtp_start_session (session))
+    {
+      fprintf (stderr, "smtp_start_session failed\n");
+      errors++;
+    }
+  smtp_enumerate_messages (session, check_message, &errors);
+  smtp_destroy_session (session);
+
+  if (waitpid (pid, &status, 0) != pid
+      || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    errors++;
+  return errors != 0;
+}
@@ -0,0 +1,466 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Test the non-blocking protocol engine.  A session is driven with
+   smtp_session_step() from a poll() loop through the greeting, EHLO, a
+   pipelined envelope and a message body many times larger than the
+   output queue limit (SIO_HIGHWATER, 32 KiB).
+
+   A scripted server is forked which holds its responses until the client
+   stops sending and checks that the recipients and DATA arrive before
+   any of their responses are sent.  After the 354 response the server
+   stops reading for a while.  The socket buffers are small, so the client
+   must suspend the body transfer and wait for the socket to become
+   writable.  No call to smtp_session_step() may wait for the server
+   meanwhile.  The server checks the body after removing the dot
+   stuffing.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libesmtp.h>
+
+/* Time the server waits for further pipelined commands before it sends
+   the responses held so far.  */
+#define HOLD_MS		100
+
+/* Time the server stops reading after the 354 response, and the longest
+   a call to smtp_session_step() may take.  */
+#define STALL_MS	500
+#define STEP_MS		(STALL_MS / 2)
+
+#define BODY_SIZE	(1024 * 1024)
+#define SOCKBUF		8192
+#define RCPTS		3
+
+static const char headers[] = "Subject: test\r\n\r\n";
+static char *message;		/* headers followed by the body */
+static size_t message_len;
+
+struct server
+  {
+    int fd;
+    char in[8192];
+    size_t inlen;
+    char out[8192];
+    size_t outlen;
+    int flushes;
+  };
+
+static void
+reply (struct server *srv, const char *text)
+{
+  size_t len = strlen (text);
+
+  if (srv->outlen + len <= sizeof srv->out)
+    {
+      memcpy (srv->out + srv->outlen, text, len);
+      srv->outlen += len;
+    }
+}
+
+static void
+flush_replies (struct server *srv)
+{
+  if (srv->outlen > 0)
+    {
+      if (write (srv->fd, srv->out, srv->outlen) < 0)
+	exit (2);
+      srv->flushes++;
+    }
+  srv->outlen = 0;
+}
+
+/* Fill the input buffer.  Replies are held while the client continues to
+   send and are written once it waits for them.  */
+static void
+fill (struct server *srv)
+{
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = srv->fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, HOLD_MS) == 0)
+    flush_replies (srv);
+  if (srv->inlen >= sizeof srv->in)
+    exit (2);
+  n = read (srv->fd, srv->in + srv->inlen, sizeof srv->in - srv->inlen);
+  if (n <= 0)
+    exit (2);
+  srv->inlen += n;
+}
+
+static void
+consume (struct server *srv, size_t len)
+{
+  memmove (srv->in, srv->in + len, srv->inlen - len);
+  srv->inlen -= len;
+}
+
+static size_t
+read_line (struct server *srv, char *line, size_t size)
+{
+  char *eol;
+  size_t len;
+
+  while ((eol = memchr (srv->in, '\n', srv->inlen)) == NULL)
+    fill (srv);
+  len = eol - srv->in + 1;
+  if (len >= size)
+    exit (2);
+  memcpy (line, srv->in, len);
+  line[len] = '\0';
+  consume (srv, len);
+  return len;
+}
+
+/* Read the message up to the terminating dot, removing dot stuffing, and
+   compare it with the message sent.  The client adds headers of its own
+   so only the body is compared.  Returns the number of errors.  */
+static int
+read_message (struct server *srv)
+{
+  char line[512];
+  const char *body, *p;
+  size_t len, offset, body_len;
+  int in_headers;
+
+  body = message + sizeof headers - 1;
+  body_len = message_len - (sizeof headers - 1);
+  offset = 0;
+  in_headers = 1;
+  for (;;)
+    {
+      len = read_line (srv, line, sizeof line);
+      if (strcmp (line, ".\r\n") == 0)
+	break;
+      p = line;
+      if (*p == '.')
+	{
+	  p++;
+	  len--;
+	}
+      if (in_headers)
+	{
+	  if (strcmp (p, "\r\n") == 0)
+	    in_headers = 0;
+	  continue;
+	}
+      if (offset + len > body_len || memcmp (body + offset, p, len) != 0)
+	{
+	  fprintf (stderr, "body differs at offset %zu\n", offset);
+	  return 1;
+	}
+      offset += len;
+    }
+  if (offset != body_len)
+    {
+      fprintf (stderr, "%zu octets of body received, expected %zu\n",
+	       offset, body_len);
+      return 1;
+    }
+  return 0;
+}
+
+/* Returns the exit status for the test, the number of errors found.  */
+static int
+serve (int fd)
+{
+  struct server srv;
+  struct timespec ts;
+  char line[512];
+  int rcpts, rcpt_flushes, errors;
+
+  memset (&srv, 0, sizeof srv);
+  srv.fd = fd;
+  rcpts = rcpt_flushes = errors = 0;
+  reply (&srv, "220 test ESMTP\r\n");
+  for (;;)
+    {
+      read_line (&srv, line, sizeof line);
+      if (strncasecmp (line, "EHLO ", 5) == 0)
+	reply (&srv, "250-test\r\n250 PIPELINING\r\n");
+      else if (strncasecmp (line, "MAIL FROM:<", 11) == 0)
+	{
+	  rcpts = 0;
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "RCPT TO:<", 9) == 0)
+	{
+	  if (rcpts++ == 0)
+	    rcpt_flushes = srv.flushes;
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "DATA", 4) == 0)
+	{
+	  if (rcpts != RCPTS)
+	    {
+	      fprintf (stderr, "%d recipients, expected %d\n", rcpts, RCPTS);
+	      errors++;
+	    }
+	  if (srv.flushes != rcpt_flushes || srv.outlen == 0)
+	    {
+	      fprintf (stderr, "envelope not pipelined\n");
+	      errors++;
+	    }
+	  reply (&srv, "354 go ahead\r\n");
+	  flush_replies (&srv);
+
+	  ts.tv_sec = STALL_MS / 1000;
+	  ts.tv_nsec = STALL_MS % 1000 * 1000000L;
+	  nanosleep (&ts, NULL);
+
+	  errors += read_message (&srv);
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "QUIT", 4) == 0)
+	{
+	  reply (&srv, "221 bye\r\n");
+	  flush_replies (&srv);
+	  break;
+	}
+      else
+	reply (&srv, "500 unrecognised\r\n");
+    }
+  return errors;
+}
+
+/* Make a body of lines of 60 to 99 octets, some of which start with a
+   dot or are a lone dot.  */
+static void
+make_message (void)
+{
+  unsigned int seed;
+  size_t n;
+  int len;
+
+  if ((message = malloc (sizeof headers + BODY_SIZE)) == NULL)
+    exit (99);
+  memcpy (message, headers, sizeof headers - 1);
+  n = sizeof headers - 1;
+  seed = 1;
+  while (n + 102 < sizeof headers + BODY_SIZE)
+    {
+      seed = seed * 1103515245 + 12345;
+      len = 60 + (seed >> 16) % 40;
+      if ((seed >> 8) % 50 == 0)
+	len = 1;
+      memset (message + n, 'x', len);
+      if ((seed >> 8) % 20 == 0)
+	message[n] = '.';
+      memcpy (message + n + len, "\r\n", 2);
+      n += len + 2;
+    }
+  message[n] = '\0';
+  message_len = n;
+}
+
+struct progress
+  {
+    int in_body;		/* the body transfer has started */
+    int write_waits;		/* steps suspended during the transfer */
+  };
+
+static void
+event_cb (smtp_session_t session __attribute__ ((unused)), int event_no,
+	  void *arg, ...)
+{
+  struct progress *progress = arg;
+
+  if (event_no == SMTP_EV_MESSAGEDATA)
+    progress->in_body = 1;
+  else if (event_no == SMTP_EV_MESSAGESENT)
+    progress->in_body = 0;
+}
+
+static long
+elapsed_ms (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000
+	 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void
+check_recipient (smtp_recipient_t recipient, const char *mailbox, void *arg)
+{
+  const smtp_status_t *status = smtp_recipient_status (recipient);
+  int *errors = arg;
+
+  if (status->code != 250 || !smtp_recipient_check_complete (recipient))
+    {
+      fprintf (stderr, "%s: status %d\n", mailbox, status->code);
+      *errors += 1;
+    }
+}
+
+static void
+check_message (smtp_message_t msg, void *arg)
+{
+  const smtp_status_t *status = smtp_message_transfer_status (msg);
+  int *errors = arg;
+
+  if (status->code != 250)
+    {
+      fprintf (stderr, "message: status %d\n", status->code);
+      *errors += 1;
+    }
+  smtp_enumerate_recipients (msg, check_recipient, arg);
+}
+
+int
+main (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  smtp_session_t session;
+  smtp_message_t msg;
+  struct progress progress;
+  struct pollfd pfd;
+  struct timespec start;
+  char server[64], rcpt[32];
+  int sd, fd, status, errors, events, step, size, i;
+  long ms;
+  pid_t pid;
+
+  signal (SIGPIPE, SIG_IGN);
+  make_message ();
+
+  /* Accepted sockets inherit the small receive buffer, which also stops
+     the kernel growing it automatically.  */
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addrlen = sizeof addr;
+  size = SOCKBUF;
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+      || setsockopt (sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) < 0
+      || bind (sd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (sd, 1) < 0
+      || getsockname (sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      perror ("listen");
+      return 99;
+    }
+
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      return 99;
+    }
+  if (pid == 0)
+    {
+      alarm (10);
+      if ((fd = accept (sd, NULL, NULL)) < 0)
+	_exit (2);
+      _exit (serve (fd));
+    }
+  close (sd);
+
+  snprintf (server, sizeof server, "127.0.0.1:%d", ntohs (addr.sin_port));
+  session = smtp_create_session ();
+  smtp_set_server (session, server);
+  smtp_set_socket_options (session, SOCKBUF, 0, 0);
+  memset (&progress, 0, sizeof progress);
+  smtp_set_eventcb (session, event_cb, &progress);
+  msg = smtp_add_message (session);
+  smtp_set_reverse_path (msg, "a@example.org");
+  smtp_set_message_str (msg, message);
+  for (i = 0; i < RCPTS; i++)
+    {
+      snprintf (rcpt, sizeof rcpt, "b%d@example.org", i);
+      smtp_add_recipient (msg, rcpt);
+    }
+
+  errors = 0;
+  if (!smtp_session_begin (session))
+    {
+      fprintf (stderr, "smtp_session_begin failed\n");
+      return 99;
+    }
+  events = 0;
+  for (;;)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      step = smtp_session_step (session, events);
+      if ((ms = elapsed_ms (&start)) > STEP_MS)
+	{
+	  fprintf (stderr, "smtp_session_step took %ld ms\n", ms);
+	  errors++;
+	}
+      if (step != Step_WANT_IO)
+	break;
+
+      pfd.fd = smtp_session_get_fd (session);
+      pfd.events = 0;
+      if (smtp_session_get_events (session) & SMTP_IO_READ)
+	pfd.events |= POLLIN;
+      if (smtp_session_get_events (session) & SMTP_IO_WRITE)
+	{
+	  pfd.events |= POLLOUT;
+	  if (progress.in_body)
+	    progress.write_waits++;
+	}
+      if (poll (&pfd, 1, smtp_session_get_timeout (session)) < 0)
+	{
+	  perror ("poll");
+	  return 99;
+	}
+      events = 0;
+      if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+	events |= SMTP_IO_READ;
+      if (pfd.revents & (POLLOUT | POLLHUP | POLLERR))
+	events |= SMTP_IO_WRITE;
+    }
+  if (step != Step_DONE)
+    {
+      fprintf (stderr, "session failed, error %d\n", smtp_errno ());
+      errors++;
+    }
+  if (progress.write_waits == 0)
+    {
+      fprintf (stderr, "body transfer was never suspended\n");
+      errors++;
+    }
+  smtp_enumerate_messages (session, check_message, &errors);
+  smtp_destroy_session (session);
+
+  if (waitpid (pid, &status, 0) != pid
+      || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    errors++;
+  free (message);
+  return errors != 0;
+}
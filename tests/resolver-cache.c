@@ -0,0 +1,233 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Test the resolver cache and smtp_resolver_load_hosts().
+
+   This program defines getaddrinfo() and freeaddrinfo(), which take the
+   place of the system resolver for libESMTP.  Lookups of names are
+   counted so that the test can tell whether a session's lookup was
+   answered from the cache.  Every name resolves to the loopback address
+   and a port on which nothing listens, so sessions fail as soon as they
+   have resolved the server.  Names starting with "missing" do not
+   exist.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <libesmtp.h>
+
+static int lookups;		/* getaddrinfo() calls for names */
+static int numeric;		/* getaddrinfo() calls for addresses */
+static unsigned short refused_port;
+
+int
+getaddrinfo (const char *node, const char *service __attribute__ ((unused)),
+	     const struct addrinfo *hints, struct addrinfo **res)
+{
+  struct addrinfo *ai;
+  struct sockaddr_in *sin;
+
+  if (hints != NULL && (hints->ai_flags & AI_NUMERICHOST))
+    numeric++;
+  else
+    {
+      lookups++;
+      if (node != NULL && strncmp (node, "missing", 7) == 0)
+	return EAI_NONAME;
+    }
+
+  if ((ai = calloc (1, sizeof (struct addrinfo)
+			+ sizeof (struct sockaddr_in))) == NULL)
+    return EAI_MEMORY;
+  sin = (struct sockaddr_in *) (ai + 1);
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons (refused_port);
+  sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  ai->ai_family = AF_INET;
+  ai->ai_socktype = SOCK_STREAM;
+  ai->ai_addrlen = sizeof (struct sockaddr_in);
+  ai->ai_addr = (struct sockaddr *) sin;
+  *res = ai;
+  return 0;
+}
+
+void
+freeaddrinfo (struct addrinfo *ai)
+{
+  free (ai);
+}
+
+static char body[] = "Subject: test\r\n\r\ntest\r\n";
+
+/* Run a session for host and port.  It cannot succeed, so return the
+   reason for its failure.  */
+static int
+run_session (const char *host, const char *port)
+{
+  smtp_session_t session;
+  smtp_message_t message;
+  char server[256];
+  int err;
+
+  snprintf (server, sizeof server, "%s:%s", host, port);
+  session = smtp_create_session ();
+  smtp_set_server (session, server);
+  message = smtp_add_message (session);
+  smtp_set_reverse_path (message, "a@example.org");
+  smtp_set_message_str (message, body);
+  smtp_add_recipient (message, "b@example.org");
+  err = smtp_start_session (session) ? 0 : smtp_errno ();
+  smtp_destroy_session (session);
+  return err;
+}
+
+static int errors;
+
+static void
+expect (const char *what, int lookups_wanted, int got)
+{
+  if (got != lookups_wanted)
+    {
+      fprintf (stderr, "%s: %d lookups, expected %d\n",
+	       what, got, lookups_wanted);
+      errors++;
+    }
+}
+
+int
+main (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  char path[] = "/tmp/resolver-cache-XXXXXX", host[32];
+  struct timespec ts;
+  FILE *fp;
+  int sd, fd, err, i, n;
+
+  /* A port on which connections are refused.  The socket is bound for the
+     duration of the test but never listens.  */
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addrlen = sizeof addr;
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+      || bind (sd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || getsockname (sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      perror ("bind");
+      return 99;
+    }
+  refused_port = ntohs (addr.sin_port);
+
+  /* Without the cache every session looks up its server.  */
+  n = lookups;
+  run_session ("relay.test", "25");
+  run_session ("relay.test", "25");
+  expect ("uncached", n + 2, lookups);
+
+  if (!smtp_resolver_set_ttl (200, 200))
+    return 99;
+
+  /* A positive result is reused until it expires.  */
+  n = lookups;
+  err = run_session ("relay.test", "25");
+  if (err == SMTP_ERR_EAI_NONAME)
+    {
+      fprintf (stderr, "relay.test not resolved\n");
+      errors++;
+    }
+  run_session ("relay.test", "25");
+  expect ("positive", n + 1, lookups);
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = 300 * 1000000L;
+  nanosleep (&ts, NULL);
+  n = lookups;
+  run_session ("relay.test", "25");
+  expect ("positive expired", n + 1, lookups);
+
+  /* Non-existent names are cached as such.  */
+  n = lookups;
+  for (i = 0; i < 2; i++)
+    if ((err = run_session ("missing.test", "25")) != SMTP_ERR_EAI_NONAME)
+      {
+	fprintf (stderr, "missing.test: error %d\n", err);
+	errors++;
+      }
+  expect ("negative", n + 1, lookups);
+
+  nanosleep (&ts, NULL);
+  n = lookups;
+  run_session ("missing.test", "25");
+  expect ("negative expired", n + 1, lookups);
+
+  /* A cached server must not answer for another whose name and port
+     are a prefix of its own.  */
+  n = lookups;
+  for (i = 0; i < 512; i++)
+    {
+      snprintf (host, sizeof host, "host%d.test", i);
+      run_session (host, "25");
+      run_session (host, "2");
+    }
+  expect ("prefix", n + 2 * 512, lookups);
+
+  /* Names in the hosts file bypass the resolver and the cache.  */
+  if ((fd = mkstemp (path)) < 0 || (fp = fdopen (fd, "w")) == NULL)
+    {
+      perror (path);
+      return 99;
+    }
+  fprintf (fp, "# test\n127.0.0.1\tlisted.test listed\n");
+  fclose (fp);
+  if (!smtp_resolver_load_hosts (path))
+    {
+      unlink (path);
+      return 99;
+    }
+  unlink (path);
+
+  n = lookups;
+  i = numeric;
+  run_session ("listed.test", "25");
+  run_session ("listed", "25");
+  run_session ("listed.test.example", "25");
+  expect ("hosts file", n + 1, lookups);
+  expect ("hosts file addresses", i + 2, numeric);
+
+  smtp_resolver_load_hosts (NULL);
+  n = lookups;
+  run_session ("listed.test", "25");
+  expect ("hosts file unloaded", n + 1, lookups);
+
+  smtp_resolver_set_ttl (0, 0);
+  close (sd);
+  return errors != 0;
+}
@@ -0,0 +1,329 @@
+/*
+ *  This file is part of libESMTP, a library for submission of RFC 2822
+ *  formatted electronic mail messages using the SMTP protocol described
+ *  in RFC 2821.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Check that memory use stays flat while recipients are streamed from
+   smtp_set_recipientcb() into a session using an arena.  Every other
+   mailbox is too long to be stored inline in the recipient and some
+   recipients are given application data when their status is reported.
+   smtp_get_memory_usage() must not grow once the window of RCPT commands
+   awaiting a response is full.
+
+   A scripted server is forked which accepts every recipient and holds
+   its responses until the client stops sending, so that the client
+   pipelines as far as it is able.  */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libesmtp.h>
+
+/* Time the server waits for further pipelined commands before it sends
+   the responses held so far.  */
+#define HOLD_MS		10
+
+#define RCPTS		20000
+#define SAMPLE		4096	/* Well beyond the window of RCPT commands */
+
+struct server
+  {
+    int fd;
+    char in[8192];
+    size_t inlen;
+    char out[8192];
+    size_t outlen;
+  };
+
+static void
+flush_replies (struct server *srv)
+{
+  if (srv->outlen > 0 && write (srv->fd, srv->out, srv->outlen) < 0)
+    exit (2);
+  srv->outlen = 0;
+}
+
+static void
+reply (struct server *srv, const char *text)
+{
+  size_t len = strlen (text);
+
+  if (srv->outlen + len > sizeof srv->out)
+    flush_replies (srv);
+  memcpy (srv->out + srv->outlen, text, len);
+  srv->outlen += len;
+}
+
+/* Fill the input buffer.  Replies are held while the client continues to
+   send and are written once it waits for them.  */
+static void
+fill (struct server *srv)
+{
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = srv->fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, HOLD_MS) == 0)
+    flush_replies (srv);
+  if (srv->inlen >= sizeof srv->in)
+    exit (2);
+  n = read (srv->fd, srv->in + srv->inlen, sizeof srv->in - srv->inlen);
+  if (n <= 0)
+    exit (2);
+  srv->inlen += n;
+}
+
+static void
+read_line (struct server *srv, char *line, size_t size)
+{
+  char *eol;
+  size_t len;
+
+  while ((eol = memchr (srv->in, '\n', srv->inlen)) == NULL)
+    fill (srv);
+  len = eol - srv->in + 1;
+  if (len >= size)
+    exit (2);
+  memcpy (line, srv->in, len);
+  line[len] = '\0';
+  memmove (srv->in, srv->in + len, srv->inlen - len);
+  srv->inlen -= len;
+}
+
+/* Returns the exit status for the test, non-zero if the wrong number of
+   recipients arrived.  */
+static int
+serve (int fd)
+{
+  struct server srv;
+  char line[512];
+  int rcpts, in_data;
+
+  memset (&srv, 0, sizeof srv);
+  srv.fd = fd;
+  rcpts = in_data = 0;
+  reply (&srv, "220 test ESMTP\r\n");
+  for (;;)
+    {
+      read_line (&srv, line, sizeof line);
+      if (in_data)
+	{
+	  if (strcmp (line, ".\r\n") == 0)
+	    {
+	      in_data = 0;
+	      reply (&srv, "250 ok\r\n");
+	    }
+	}
+      else if (strncasecmp (line, "EHLO ", 5) == 0)
+	reply (&srv, "250-test\r\n250 PIPELINING\r\n");
+      else if (strncasecmp (line, "MAIL FROM:<", 11) == 0)
+	reply (&srv, "250 ok\r\n");
+      else if (strncasecmp (line, "RCPT TO:<", 9) == 0)
+	{
+	  rcpts++;
+	  reply (&srv, "250 ok\r\n");
+	}
+      else if (strncasecmp (line, "DATA", 4) == 0)
+	{
+	  in_data = 1;
+	  reply (&srv, "354 go ahead\r\n");
+	}
+      else if (strncasecmp (line, "QUIT", 4) == 0)
+	{
+	  reply (&srv, "221 bye\r\n");
+	  flush_replies (&srv);
+	  break;
+	}
+      else
+	reply (&srv, "500 unrecognised\r\n");
+    }
+  if (rcpts != RCPTS)
+    {
+      fprintf (stderr, "server: %d recipients, expected %d\n", rcpts, RCPTS);
+      return 1;
+    }
+  return 0;
+}
+
+static char body[] = "Subject: test\r\n\r\ntest\r\n";
+
+struct progress
+  {
+    int supplied;		/* recipients returned by rcpt_cb */
+    int accepted;		/* recipients reported with status 250 */
+    int data_set;		/* recipients given application data */
+    int data_released;
+    size_t sample;		/* memory in use after SAMPLE recipients */
+    size_t peak;		/* largest memory in use after the sample */
+  };
+
+static struct progress progress;
+
+static const char *
+rcpt_cb (smtp_message_t message __attribute__ ((unused)),
+	 void *arg __attribute__ ((unused)))
+{
+  static char mailbox[256];
+  static const char long_part[] =
+    "a-mailbox-longer-than-can-be-stored-inline-in-the-recipient-record";
+
+  if (progress.supplied >= RCPTS)
+    return NULL;
+  snprintf (mailbox, sizeof mailbox, "%s%d@example.org",
+	    progress.supplied % 2 ? long_part : "r", progress.supplied);
+  progress.supplied++;
+  return mailbox;
+}
+
+static void
+release_data (void *data)
+{
+  progress.data_released++;
+  free (data);
+}
+
+static void
+event_cb (smtp_session_t session, int event_no, void *arg, ...)
+{
+  smtp_recipient_t recipient;
+  const smtp_status_t *status;
+  size_t usage;
+  va_list ap;
+  int n;
+
+  if (event_no != SMTP_EV_RCPTSTATUS)
+    return;
+
+  va_start (ap, arg);
+  (void) va_arg (ap, const char *);
+  recipient = va_arg (ap, smtp_recipient_t);
+  va_end (ap);
+
+  status = smtp_recipient_status (recipient);
+  if (status->code == 250)
+    progress.accepted++;
+  n = progress.accepted;
+  if (n % 3 == 0)
+    {
+      smtp_recipient_set_application_data_release (recipient, malloc (16),
+						   release_data);
+      progress.data_set++;
+    }
+
+  usage = smtp_get_memory_usage (session);
+  if (n == SAMPLE)
+    progress.sample = usage;
+  else if (n > SAMPLE && usage > progress.peak)
+    progress.peak = usage;
+}
+
+int
+main (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  smtp_session_t session;
+  smtp_message_t message;
+  char server[64];
+  int sd, fd, status, errors;
+  pid_t pid;
+
+  signal (SIGPIPE, SIG_IGN);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addrlen = sizeof addr;
+  if ((sd = socket (AF_INET, SOCK_STREAM, 0)) < 0
+      || bind (sd, (struct sockaddr *) &addr, sizeof addr) < 0
+      || listen (sd, 1) < 0
+      || getsockname (sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+      perror ("listen");
+      return 99;
+    }
+
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      return 99;
+    }
+  if (pid == 0)
+    {
+      alarm (20);
+      if ((fd = accept (sd, NULL, NULL)) < 0)
+	_exit (2);
+      _exit (serve (fd));
+    }
+  close (sd);
+
+  snprintf (server, sizeof server, "127.0.0.1:%d", ntohs (addr.sin_port));
+  session = smtp_create_session ();
+  if (!smtp_set_arena (session, 0))
+    return 99;
+  smtp_set_server (session, server);
+  smtp_set_eventcb (session, event_cb, NULL);
+  message = smtp_add_message (session);
+  smtp_set_reverse_path (message, "a@example.org");
+  smtp_set_message_str (message, body);
+  smtp_set_recipientcb (message, rcpt_cb, NULL);
+
+  errors = 0;
+  if (!smtp_start_session (session))
+    {
+      fprintf (stderr, "smtp_start_session failed\n");
+      errors++;
+    }
+  if (progress.accepted != RCPTS)
+    {
+      fprintf (stderr, "%d recipients accepted, expected %d\n",
+	       progress.accepted, RCPTS);
+      errors++;
+    }
+  if (progress.peak > progress.sample)
+    {
+      fprintf (stderr, "memory grew from %zu to %zu octets\n",
+	       progress.sample, progress.peak);
+      errors++;
+    }
+  smtp_destroy_session (session);
+  if (progress.data_released != progress.data_set)
+    {
+      fprintf (stderr, "%d of %d application data released\n",
+	       progress.data_released, progress.data_set);
+      errors++;
+    }
+
+  if (waitpid (pid, &status, 0) != pid
+      || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    errors++;
+  return errors != 0;
+}
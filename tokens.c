@@ -22,6 +22,7 @@
 
 #include <config.h>
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -97,6 +98,32 @@ read_atom (const char *s, const char **es, char buf[], int len)
   return t - buf;
 }
 
+/* Return a pointer to the first character after the atom at s, that is,
+   s itself if it does not point to an atom.  */
+const char *
+skipatom (const char *s)
+{
+  initatom ();
+  while (is_atom (*s))
+    s++;
+  return s;
+}
+
+/* Case insensitive hash of the len characters at s, used by the perfect
+   hash tables which mkkeywords.py generates from keywords.in.  Folding
+   with 0x20 is only case insensitive for letters, the tables are
+   checked with strncasecmp().  This must agree with mkkeywords.py.  */
+unsigned int
+keyword_hash (unsigned int seed, const char *s, int len)
+{
+  const unsigned char *p = (const unsigned char *) s;
+  uint32_t h = seed;
+
+  while (len-- > 0)
+    h = (h ^ (*p++ | 0x20)) * 16777619u;
+  return h ^ (h >> 15);
+}
+
 static char xdigits[] = "0123456789ABCDEF";
 
 /* Return a pointer to an xtext encoded string.
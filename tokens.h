@@ -24,6 +24,8 @@
 
 int read_atom (const char *s, const char **es, char buf[], int len);
 const char *skipblank (const char *s);
+const char *skipatom (const char *s);
+unsigned int keyword_hash (unsigned int seed, const char *s, int len);
 char *encode_xtext (char buf[], int len, const char *string);
 
 #endif